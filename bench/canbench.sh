@@ -0,0 +1,276 @@
+#!/bin/bash
+#
+# canutils/bench/canbench.sh - throughput and latency benchmarks
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the version 2 of the GNU General Public License
+# as published by the Free Software Foundation
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# Runs the tools against vcan and vxcan interfaces in a private network
+# namespace, so it needs root and the vcan and vxcan kernel modules, but
+# leaves the host's interfaces alone. The results are printed as one
+# JSON object per line with a fixed key order, to be diffed between
+# versions:
+#
+#   cansend_tx		cansend --loop, frames/s
+#   candump_capture	cansequence -> candump -o, frames/s and lost frames
+#   canecho_forward	cansequence -> vxcan -> canecho -> vcan -> cansequence -r
+#   cansequence_rtt	cansequence -L -> vxcan -> canecho -> vxcan -> cansequence -r,
+#			paced with --gap, latency percentiles in usecs
+#
+# Every benchmark is run for each I/O backend in $BACKENDS. The "sim"
+# backend's simulated buses need neither root nor the kernel modules,
+# "-b sim" runs anywhere.
+#
+
+usage() {
+	cat >&2 <<EOF
+Usage: $0 [Options]
+Options:
+ -d DIR		directory of the tools (default: installed ones in \$PATH)
+ -n FRAMES	frames per throughput benchmark (default: $FRAMES)
+ -l FRAMES	frames per latency benchmark (default: $LAT_FRAMES)
+ -g USEC	gap between frames of the latency benchmark (default: $LAT_GAP)
+ -b BACKENDS	I/O backends to benchmark (default: "$BACKENDS")
+ -o FILE	append the results to FILE instead of printing them
+ -h		this help
+EOF
+}
+
+FRAMES=200000
+LAT_FRAMES=10000
+LAT_GAP=100
+BACKENDS="rw mmsg mmap uring"
+BINDIR=
+OUTPUT=
+
+while getopts "d:n:l:g:b:o:h" opt; do
+	case $opt in
+	d) BINDIR=$(cd "$OPTARG" && pwd) || exit 1 ;;
+	n) FRAMES=$OPTARG ;;
+	l) LAT_FRAMES=$OPTARG ;;
+	g) LAT_GAP=$OPTARG ;;
+	b) BACKENDS=$OPTARG ;;
+	o) OUTPUT=$OPTARG ;;
+	h) usage; exit 0 ;;
+	*) usage; exit 1 ;;
+	esac
+done
+
+NETNS=
+for io in $BACKENDS; do
+	[ "$io" != sim ] && NETNS=1
+done
+
+# re-exec in a new network namespace, the interfaces vanish with it
+if [ -n "$NETNS" ] && [ -z "$CANBENCH_NETNS" ]; then
+	if [ "$(id -u)" != 0 ]; then
+		echo "$0: must be run as root" >&2
+		exit 1
+	fi
+	exec env CANBENCH_NETNS=1 unshare --net -- "$BASH" "$0" "$@"
+fi
+
+tool() {
+	if [ -n "$BINDIR" ]; then
+		echo "$BINDIR/$1"
+	else
+		echo "$1"
+	fi
+}
+
+CANSEND=$(tool cansend)
+CANDUMP=$(tool candump)
+CANECHO=$(tool canecho)
+CANSEQUENCE=$(tool cansequence)
+
+TMP=$(mktemp -d /tmp/canbench.XXXXXX) || exit 1
+PIDS=
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+setup() {
+	modprobe -q vcan 2>/dev/null
+	modprobe -q vxcan 2>/dev/null
+
+	ip link add vcan0 type vcan &&
+	ip link add vcan1 type vcan &&
+	ip link add vxcan0 type vxcan peer name vxcan1 || {
+		echo "$0: can't create vcan/vxcan interfaces" >&2
+		exit 1
+	}
+
+	for i in vcan0 vcan1 vxcan0 vxcan1; do
+		ip link set $i txqueuelen 1000 up || exit 1
+	done
+}
+
+# a simulated bus has no vxcan pairs, both ends are the same bus
+vxcan() {
+	if [ "$1" = sim ]; then
+		echo vxcan
+	else
+		echo vxcan$2
+	fi
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# start a tool in the background, give it time to bind its socket
+start() {
+	"$@" &
+	PIDS="$PIDS $!"
+	sleep 0.3
+}
+
+stop() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait $PIDS 2>/dev/null
+	PIDS=
+}
+
+# wait up to 5s for a file to stop growing
+settle() {
+	local size=-1 i
+
+	for i in $(seq 50); do
+		[ "$(stat -c %s "$1")" = "$size" ] && return
+		size=$(stat -c %s "$1")
+		sleep 0.1
+	done
+}
+
+emit() {
+	if [ -n "$OUTPUT" ]; then
+		echo "$1" >> "$OUTPUT"
+	else
+		echo "$1"
+	fi
+}
+
+error() {
+	emit "{\"bench\": \"$1\", \"io\": \"$2\", \"error\": \"$3\"}"
+}
+
+# "received: N frames, B bytes in S s, R frames/s, ..." of cansequence -r
+rx_frames() {
+	sed -n 's/^received: \([0-9]*\) frames.*/\1/p' "$1"
+}
+
+rx_rate() {
+	sed -n 's/^received: .*, \([0-9.]*\) frames\/s.*/\1/p' "$1"
+}
+
+rx_lost() {
+	sed -n 's/^stream .*, lost: \([0-9]*\),.*/\1/p' "$1"
+}
+
+# "latency [us]: samples: N, min: A, mean: B, p50: C, p99: D, p99.9: E, max: F"
+rx_latency() {
+	sed -n 's/^latency \[us\]: samples: \([0-9]*\), min: \([0-9.]*\), mean: \([0-9.]*\), p50: \([0-9.]*\), p99: \([0-9.]*\), p99.9: \([0-9.]*\), max: \([0-9.]*\)$/"samples": \1, "min_us": \2, "mean_us": \3, "p50_us": \4, "p99_us": \5, "p999_us": \6, "max_us": \7/p' "$1"
+}
+
+bench_cansend() {
+	local io=$1 t0 t1
+
+	t0=$(now_ns)
+	"$CANSEND" vcan0 --io=$io -p --loop=$FRAMES -i 0x100 \
+		11 22 33 44 55 66 77 88 > /dev/null || {
+		error cansend_tx $io "cansend failed"
+		return
+	}
+	t1=$(now_ns)
+
+	emit "$(awk -v io=$io -v n=$FRAMES -v ns=$((t1 - t0)) 'BEGIN {
+		printf("{\"bench\": \"cansend_tx\", \"io\": \"%s\", \"frames\": %d, " \
+		       "\"seconds\": %.3f, \"rate\": %.0f}", io, n, ns / 1e9, n / (ns / 1e9))
+	}')"
+}
+
+bench_candump() {
+	local io=$1 t0 t1 captured
+
+	start "$CANDUMP" vcan0 --io=$io -o "$TMP/dump" > /dev/null
+	t0=$(now_ns)
+	"$CANSEQUENCE" vcan0 --io=$io -p --loop=$FRAMES -i 0x100 > /dev/null
+	t1=$(now_ns)
+	touch "$TMP/dump"
+	settle "$TMP/dump"
+	stop
+
+	captured=$(wc -l < "$TMP/dump")
+	rm -f "$TMP/dump"
+	if [ "$captured" = 0 ]; then
+		error candump_capture $io "nothing captured"
+		return
+	fi
+
+	emit "$(awk -v io=$io -v n=$FRAMES -v c=$captured -v ns=$((t1 - t0)) 'BEGIN {
+		printf("{\"bench\": \"candump_capture\", \"io\": \"%s\", \"frames\": %d, " \
+		       "\"seconds\": %.3f, \"rate\": %.0f, \"lost\": %d}",
+		       io, n, ns / 1e9, c / (ns / 1e9), n - c)
+	}')"
+}
+
+bench_canecho() {
+	local io=$1 frames rate lost
+
+	start "$CANECHO" --io=$io $(vxcan $io 1) vcan1 > /dev/null
+	start timeout 60 "$CANSEQUENCE" vcan1 -r --io=$io -i 0x101 \
+		--loop=$FRAMES > "$TMP/rx"
+	"$CANSEQUENCE" $(vxcan $io 0) --io=$io -p --loop=$FRAMES -i 0x100 > /dev/null
+	sleep 1
+	stop
+
+	frames=$(rx_frames "$TMP/rx")
+	rate=$(rx_rate "$TMP/rx")
+	lost=$(rx_lost "$TMP/rx")
+	if [ -z "$frames" ]; then
+		error canecho_forward $io "nothing forwarded"
+		return
+	fi
+
+	emit "{\"bench\": \"canecho_forward\", \"io\": \"$io\", \"frames\": $frames, \"rate\": ${rate:-0}, \"lost\": ${lost:-0}}"
+}
+
+bench_rtt() {
+	local io=$1 lat
+
+	start "$CANECHO" --io=$io $(vxcan $io 1) > /dev/null
+	start timeout 60 "$CANSEQUENCE" $(vxcan $io 0) -r -L --io=$io -i 0x101 \
+		--loop=$LAT_FRAMES > "$TMP/rx"
+	"$CANSEQUENCE" $(vxcan $io 0) -L --io=$io -p --gap=$LAT_GAP \
+		--loop=$LAT_FRAMES -i 0x100 > /dev/null
+	sleep 1
+	stop
+
+	lat=$(rx_latency "$TMP/rx")
+	if [ -z "$lat" ]; then
+		error cansequence_rtt $io "no latency samples"
+		return
+	fi
+
+	emit "{\"bench\": \"cansequence_rtt\", \"io\": \"$io\", \"gap_us\": $LAT_GAP, $lat}"
+}
+
+[ -n "$NETNS" ] && setup
+
+emit "{\"bench\": \"info\", \"version\": \"$("$CANDUMP" --version | sed 's/^candump //')\", \"kernel\": \"$(uname -r)\", \"cpus\": $(nproc), \"frames\": $FRAMES, \"latency_frames\": $LAT_FRAMES}"
+
+for io in $BACKENDS; do
+	bench_cansend $io
+	bench_candump $io
+	bench_canecho $io
+	bench_rtt $io
+done
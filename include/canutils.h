@@ -0,0 +1,659 @@
+/*
+ * canutils/canutils.h - frame I/O and formatting shared by the canutils
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef CANUTILS_H
+#define CANUTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include <linux/can.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CANFD_FDF
+#define CANFD_FDF	0x04
+#endif
+
+/*
+ * Frame I/O
+ *
+ * Frames are always passed as struct canfd_frame. Received CAN-FD frames
+ * have CANFD_FDF set in "flags", classic frames have "flags" cleared.
+ * When sending on a socket opened with "fd_frames", frames with CANFD_FDF
+ * set or a "len" above 8 are sent as CAN-FD frames.
+ */
+enum can_io_backend {
+	CAN_IO_DEFAULT,		/* $CANUTILS_IO, or CAN_IO_MMSG */
+	CAN_IO_RW,		/* one read(2)/write(2) per frame */
+	CAN_IO_MMSG,		/* recvmmsg(2)/sendmmsg(2) */
+	CAN_IO_MMAP,		/* PF_PACKET rx ring, sendmmsg(2) */
+	CAN_IO_URING,		/* io_uring, multishot receive */
+	CAN_IO_SIM,		/* simulated bus, no kernel module needed */
+	CAN_IO_SHM,		/* receive from a ring of can_shm_create() */
+};
+
+#define CAN_IO_BATCH_DEFAULT	32
+
+struct can_io_opts {
+	enum can_io_backend backend;
+	int fd_frames;		/* enable CAN-FD frames */
+	int batch;		/* max. frames per syscall, 0: default */
+	int wait;		/* poll(2) for buffer space instead of ENOBUFS */
+	int nonblock;		/* recv returns EAGAIN instead of blocking */
+	int timestamp;		/* provide rx timestamps */
+};
+
+struct can_io;
+
+/*
+ * Open a CAN_RAW socket bound to "ifname" ("any" for all interfaces).
+ * With CAN_IO_SIM "ifname" names a simulated bus shared by all processes
+ * opening it. With CAN_IO_SHM "ifname" names a ring published by another
+ * process, see can_shm_create(), frames can't be sent. "opts" may be NULL
+ * for the defaults. Returns NULL on error with errno set.
+ */
+struct can_io *can_io_open(const char *ifname, const struct can_io_opts *opts);
+void can_io_close(struct can_io *io);
+
+/*
+ * the file descriptor to poll(2) for POLLIN, not with CAN_IO_SHM: the
+ * ring is a regular file, which poll(2) always reports readable
+ */
+int can_io_fd(const struct can_io *io);
+
+enum can_io_backend can_io_backend(const struct can_io *io);
+
+/*
+ * Receive up to "n" frames, blocks until at least one is available.
+ * "ts" may be NULL, otherwise it receives the frames' timestamps if
+ * the socket was opened with "timestamp". Returns the number of frames
+ * or -1 with errno set, EINTR and EAGAIN included.
+ */
+int can_io_recv(struct can_io *io, struct canfd_frame *frames,
+		struct timespec *ts, int n);
+
+/*
+ * Send "n" frames. Returns the number of frames sent, which is less
+ * than "n" only if an error occurred after some were sent, or -1 with
+ * errno set.
+ */
+int can_io_send(struct can_io *io, const struct canfd_frame *frames, int n);
+
+/*
+ * Write "len" bytes of "buf" to "fd", e.g. a log file. With the uring
+ * backend the data is copied and written asynchronously through the
+ * same ring as the frames, in order. can_io_flush() waits until all
+ * data is written. Errors of earlier writes are reported by later
+ * calls. Returns 0 or -1 with errno set.
+ */
+int can_io_write(struct can_io *io, int fd, const void *buf, size_t len);
+int can_io_flush(struct can_io *io);
+
+/* like CAN_RAW_FILTER and CAN_RAW_ERR_FILTER, for all backends */
+int can_io_set_filter(struct can_io *io, const struct can_filter *filter,
+		      int count);
+int can_io_set_err_mask(struct can_io *io, can_err_mask_t err_mask);
+
+/*
+ * "rw", "mmsg", "mmap", "uring", "sim" or "shm", returns -1 for an
+ * unknown name
+ */
+int can_io_backend_parse(const char *name);
+const char *can_io_backend_name(enum can_io_backend backend);
+
+/*
+ * On-wire length of a frame, stuff bits, CRC delimiter, ACK, EOF and
+ * the interframe space included; 0 for error frames, which aren't
+ * frames on the bus. "dbits" is set to the part sent at the data
+ * bitrate, for CAN-FD frames with BRS, it's not included in the result.
+ */
+unsigned int can_frame_bits(const struct canfd_frame *frame,
+			    unsigned int *dbits);
+
+/* its duration, with "dbitrate" 0 the data phase is sent at "bitrate" */
+uint64_t can_frame_ns(const struct canfd_frame *frame, unsigned long bitrate,
+		      unsigned long dbitrate);
+
+/*
+ * Parsing and formatting
+ */
+
+/*
+ * candump's format, i.e. "<0x123> [2] 11 22 ", extended ids have 8
+ * digits, error frames CAN_ERR_FLAG and their class, "<0x20000088>"
+ */
+#define CAN_FRAME_FORMAT_SIZE	256
+
+/* returns the length of the string in "buf", like snprintf(3) */
+int can_frame_format(char *buf, size_t size, const struct canfd_frame *frame);
+
+/* the reverse of can_frame_format(), returns 0 or -1 on syntax errors */
+int can_frame_parse(const char *s, struct canfd_frame *frame);
+
+/*
+ * Parse "id:mask[:id:mask]..." into a newly allocated array, returns
+ * the number of filters or -1 on errors.
+ */
+int can_filter_parse(const char *s, struct can_filter **filter);
+
+/* like CAN_RAW, CAN_INV_FILTER included, returns 1 if the frame passes */
+int can_filter_match(const struct can_filter *filter,
+		     const struct canfd_frame *frame);
+
+/*
+ * Metrics
+ *
+ * The frame I/O counts frames, bytes, system calls and drops, per filter
+ * hits and the frames returned per receive call. Tools add their own
+ * values, e.g. the processing time per frame. The counters are kept per
+ * thread, updating them takes no lock or atomic read-modify-write.
+ * Nothing is counted until can_metrics_enable() or can_metrics_serve()
+ * is called, which must happen before can_io_open().
+ */
+enum can_metric {
+	CAN_METRIC_RX_FRAMES,
+	CAN_METRIC_RX_BYTES,
+	CAN_METRIC_RX_SYSCALLS,
+	CAN_METRIC_RX_DROPS,	/* invalid frames, overflows seen by the backend */
+	CAN_METRIC_TX_FRAMES,
+	CAN_METRIC_TX_BYTES,
+	CAN_METRIC_TX_SYSCALLS,
+	CAN_METRIC_TX_DROPS,	/* frames not sent due to errors */
+	CAN_METRIC_OUT_BYTES,	/* output of the tool, e.g. the log */
+	CAN_METRIC_MAX,
+};
+
+enum can_metric_hist {
+	CAN_HIST_RX_BATCH,	/* frames per receive call */
+	CAN_HIST_FRAME_NS,	/* processing time per frame, in nsecs */
+	CAN_HIST_MAX,
+};
+
+void can_metrics_enable(void);
+int can_metrics_enabled(void);
+
+void can_metric_add(enum can_metric metric, uint64_t v);
+
+/* add "count" observations of the value "v" */
+void can_metric_observe(enum can_metric_hist hist, uint64_t v, uint64_t count);
+
+/* in the Prometheus text format, returns 0 or -1 on write errors */
+int can_metrics_print(FILE *f);
+
+/*
+ * Serve the metrics on a unix stream socket at "path", from a thread
+ * of its own. Plain clients get the text, HTTP clients a response.
+ * Returns 0 or -1 with errno set.
+ */
+int can_metrics_serve(const char *path);
+
+/*
+ * Capture index
+ *
+ * A sidecar of a candump log, appended while capturing: one block entry
+ * per CAN_INDEX_BLOCK_FRAMES lines, with the block's place in the log,
+ * its time range and a bitmap of the hashed ids of its frames. A query
+ * reads the entries and only the blocks that can match. The log may
+ * have unindexed parts, e.g. appended without an index, or the last
+ * block of a capture that was killed; these have to be scanned. The
+ * index is in host byte order.
+ */
+#define CAN_INDEX_MAGIC		"CANIDX01"
+#define CAN_INDEX_BLOCK_FRAMES	4096
+#define CAN_INDEX_ID_BITS	2048
+
+struct can_index_header {
+	char magic[8];
+	uint32_t block_frames;
+	uint32_t id_bits;
+};
+
+struct can_index_block {
+	uint64_t offset;	/* of the first line in the log */
+	uint64_t length;	/* of all lines, in bytes */
+	int64_t first_ns;	/* earliest and latest timestamp */
+	int64_t last_ns;
+	uint32_t frames;
+	uint32_t reserved;
+	uint64_t ids[CAN_INDEX_ID_BITS / 64];
+};
+
+struct can_index;
+
+/*
+ * Append to the index at "path", created if it doesn't exist. "offset"
+ * is the size of the log, where the next line will be written. Returns
+ * NULL on error with errno set, EINVAL if "path" isn't an index.
+ */
+struct can_index *can_index_open(const char *path, uint64_t offset);
+
+/* a line of "len" bytes, newline included, was written for "frame" */
+int can_index_add(struct can_index *idx, const struct canfd_frame *frame,
+		  const struct timespec *ts, size_t len);
+
+/* writes the last, partial block, returns 0 or -1 with errno set */
+int can_index_close(struct can_index *idx);
+
+/* the bit of "can_id" in a block's "ids", 2^11 = CAN_INDEX_ID_BITS */
+static inline unsigned int can_index_id_bit(canid_t can_id)
+{
+	can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+	return (can_id * 0x9e3779b1u) >> (32 - 11);
+}
+
+/*
+ * Compressed capture
+ *
+ * A stream of independent blocks after an 8 byte magic. A block holds up
+ * to CAN_LOG_BLOCK_SIZE bytes of encoded frames, at most a second of
+ * them, deflated if built with zlib. Within a block timestamps are
+ * deltas to the previous frame, ids are indices into a dictionary of the
+ * block's ids, payloads are repeats or XORs of the id's previous one.
+ * A block header has a CRC, the frame count and the time range, a
+ * truncated or damaged log can be read up to the damage. All integers
+ * are little endian.
+ */
+#define CAN_LOG_MAGIC		"CANLOG01"
+#define CAN_LOG_BLOCK_SIZE	65536
+
+struct can_log;
+
+/* writes the magic if "fd" is at its start */
+struct can_log *can_log_open(int fd);
+
+int can_log_add(struct can_log *log, const struct canfd_frame *frame,
+		const struct timespec *ts);
+
+/* writes the current block, returns 0 or -1 with errno set */
+int can_log_flush(struct can_log *log);
+
+/*
+ * Writes the current block if it's a second old at "now", for an idle
+ * bus, where no frame comes along to close it.
+ */
+int can_log_expire(struct can_log *log, const struct timespec *now);
+
+/* flushes, doesn't close "fd" */
+int can_log_close(struct can_log *log);
+
+struct can_log_reader;
+
+/* "f" must be at the start of a log, returns NULL with errno EINVAL if not */
+struct can_log_reader *can_log_reader_open(FILE *f);
+
+/* reads the blocks in "buf", which starts at a block, not the magic */
+struct can_log_reader *can_log_reader_open_mem(const void *buf, size_t size);
+void can_log_reader_close(struct can_log_reader *r);
+
+/* blocks entirely outside of [from_ns, to_ns) are skipped undecoded */
+void can_log_reader_window(struct can_log_reader *r, int64_t from_ns,
+			   int64_t to_ns);
+
+/*
+ * Returns 1 for a frame, 0 at the end of the log, which may be
+ * truncated, or -1 with errno EBADMSG at a damaged block, ENOTSUP at a
+ * deflated one without zlib.
+ */
+int can_log_read(struct can_log_reader *r, struct canfd_frame *frame,
+		 struct timespec *ts);
+
+/*
+ * The size of the block at "buf", header included, to split a log
+ * without decoding it. Returns 0 if "size" is too short for the block,
+ * -1 if "buf" isn't at a block.
+ */
+ssize_t can_log_block_size(const void *buf, size_t size);
+
+/*
+ * Signal decoding with DBC files
+ *
+ * The messages and signals of a DBC file are compiled into extractors
+ * when it's loaded, decoding a frame is a lookup by id and a load, shift
+ * and mask per signal.
+ */
+struct can_dbc;
+
+/*
+ * Returns NULL with errno set on error, with "line" set to the line
+ * of a syntax error or 0 for other errors.
+ */
+struct can_dbc *can_dbc_load(const char *path, int *line);
+void can_dbc_free(struct can_dbc *dbc);
+
+/*
+ * Writes " Message: Signal=value unit ..." for a known message, nothing
+ * for other frames. Returns the length written, at most "size" - 1.
+ */
+int can_dbc_format(const struct can_dbc *dbc, char *buf, size_t size,
+		   const struct canfd_frame *frame);
+
+/*
+ * J1939
+ *
+ * A J1939 frame has a 29 bit id of the priority, the parameter group
+ * number (PGN) and the source address. PGNs of PDU1 format, with a PF
+ * byte below 240, carry a destination address in place of their low
+ * byte. Messages of up to 1785 bytes are sent with the transport
+ * protocol: announced by a TP.CM frame, broadcast (BAM) or to a
+ * destination (RTS/CTS), and sent in TP.DT frames of 7 bytes.
+ */
+#define CAN_J1939_NO_ADDR	0xff		/* global destination */
+#define CAN_J1939_PGN_ANY	0xffffffffu
+#define CAN_J1939_PGN_TP_CM	0x0ec00
+#define CAN_J1939_PGN_TP_DT	0x0eb00
+#define CAN_J1939_MAX_TP_SIZE	1785
+
+static inline unsigned int can_j1939_prio(canid_t can_id)
+{
+	return (can_id >> 26) & 0x7;
+}
+
+static inline unsigned int can_j1939_sa(canid_t can_id)
+{
+	return can_id & 0xff;
+}
+
+static inline unsigned int can_j1939_pgn(canid_t can_id)
+{
+	unsigned int pgn = (can_id >> 8) & 0x3ffff;
+
+	return (pgn & 0xff00) < 0xf000 ? pgn & 0x3ff00 : pgn;
+}
+
+static inline unsigned int can_j1939_da(canid_t can_id)
+{
+	return (can_id & 0xff0000) < 0xf00000 ?
+		(can_id >> 8) & 0xff : CAN_J1939_NO_ADDR;
+}
+
+/* the acronym of well known PGNs, e.g. "EEC1" for 0xf004, or NULL */
+const char *can_j1939_pgn_name(unsigned int pgn);
+
+/*
+ * Matches frames by PGN, source address and priority. A frame matches
+ * if each of these with a list has its value in the list.
+ */
+struct can_j1939_filter;
+
+struct can_j1939_filter *can_j1939_filter_new(void);
+void can_j1939_filter_free(struct can_j1939_filter *f);
+
+/*
+ * Adds the comma separated "list" to the values of "field": "pgn", by
+ * number or name, "sa" or "prio". Returns -1 with errno EINVAL if the
+ * list is invalid.
+ */
+int can_j1939_filter_add(struct can_j1939_filter *f, const char *field,
+			 const char *list);
+
+/* with "pgn" CAN_J1939_PGN_ANY, e.g. for TP frames, matches the address only */
+int can_j1939_filter_match(const struct can_j1939_filter *f, unsigned int pgn,
+			   unsigned int sa, unsigned int prio);
+
+/*
+ * CAN_RAW filters for the kernel passing the matching frames and the
+ * TP.CM and TP.DT frames of the matching source addresses. If that takes
+ * more than "max" filters, a filter passing all extended frames. Returns
+ * the count, or -1 with errno set.
+ */
+int can_j1939_filter_compile(const struct can_j1939_filter *f, int max,
+			     struct can_filter **filter);
+
+/*
+ * Reassembly of the transport protocol, listening only. Sessions are
+ * taken from a pool allocated up front, a session idle for 750 ms (T1)
+ * is dropped; with all sessions busy, the one idle the longest is.
+ */
+struct can_j1939_msg {
+	unsigned int pgn;
+	unsigned int sa, da;
+	unsigned int prio;	/* of the TP.CM frame */
+	size_t len;
+	const unsigned char *data;
+};
+
+struct can_j1939_tp;
+
+struct can_j1939_tp *can_j1939_tp_new(int sessions);
+void can_j1939_tp_free(struct can_j1939_tp *tp);
+
+/*
+ * Feeds a frame received at "ns", ignored unless it's a TP.CM or TP.DT
+ * frame. Returns 1 if it completed a message, "msg" points into the
+ * pool until the next call, else 0.
+ */
+int can_j1939_tp_add(struct can_j1939_tp *tp, const struct canfd_frame *frame,
+		     int64_t ns, struct can_j1939_msg *msg);
+
+/*
+ * ISO-TP (ISO 15765-2) reassembly, listening only
+ *
+ * PDUs of up to 4095 bytes are sent in a first frame and consecutive
+ * frames, paced by flow control frames of the receiver on the other id
+ * of the pair, or in a single frame. Normal addressing only: the PCI is
+ * the first byte. Reassembly takes sessions of a pool allocated up
+ * front, a session gets no flow control or consecutive frame for 1 s
+ * (N_Bs, N_Cr) times out.
+ */
+#define CAN_ISOTP_MAX_SIZE	4095
+#define CAN_ISOTP_MAX_EVENTS	2	/* per can_isotp_add() */
+
+enum can_isotp_event_type {
+	CAN_ISOTP_PDU,
+	CAN_ISOTP_SEQUENCE,	/* a consecutive frame out of sequence */
+	CAN_ISOTP_TIMEOUT,
+	CAN_ISOTP_ABORT,	/* by a flow control overflow or a new PDU */
+	CAN_ISOTP_BUSY,		/* a PDU found no free session */
+};
+
+struct can_isotp_event {
+	enum can_isotp_event_type type;
+	canid_t id;		/* of the data */
+	size_t len;		/* of the PDU, as announced for errors */
+	size_t received;
+	unsigned int expected_sn, sn;	/* CAN_ISOTP_SEQUENCE */
+	const unsigned char *data;	/* CAN_ISOTP_PDU, until the next call */
+};
+
+struct can_isotp;
+
+struct can_isotp *can_isotp_new(int sessions);
+void can_isotp_free(struct can_isotp *tp);
+
+/*
+ * Data on "id" with flow control on "fc_id", and the other way round.
+ * Without pairs, the ids of ISO 15765-4 are used: 0x7df and 0x7e0-0x7e7
+ * paired with 0x7e8-0x7ef, extended 0x18da<ta><sa> with 0x18da<sa><ta>
+ * and 0x18db<ta><sa>.
+ */
+int can_isotp_add_pair(struct can_isotp *tp, canid_t id, canid_t fc_id);
+
+/* 1 if frames with "can_id" are ISO-TP frames */
+int can_isotp_match(const struct can_isotp *tp, canid_t can_id);
+
+/*
+ * Feeds a frame received at "ns". Returns the number of events written
+ * to "ev", at most CAN_ISOTP_MAX_EVENTS.
+ */
+int can_isotp_add(struct can_isotp *tp, const struct canfd_frame *frame,
+		  int64_t ns, struct can_isotp_event *ev);
+
+/* times out the sessions idle at "ns", returns up to "max" events */
+int can_isotp_expire(struct can_isotp *tp, int64_t ns,
+		     struct can_isotp_event *ev, int max);
+
+/*
+ * Error frames
+ *
+ * The error classes are the CAN_ERR_* bits of an error frame's id,
+ * class n is bit n: CAN_ERR_TX_TIMEOUT is 0, CAN_ERR_CNT 9. The frame
+ * I/O counts them per interface in the metrics.
+ */
+#define CAN_ERROR_CLASSES	10
+
+/* e.g. "ack" for class 5, CAN_ERR_ACK, or NULL */
+const char *can_error_class_name(int class);
+
+/*
+ * Writes " error: class(detail,...) ..." for an error frame, with the
+ * controller, protocol and transceiver details of its data, nothing for
+ * other frames. Returns the length written, at most "size" - 1.
+ */
+int can_error_format(char *buf, size_t size, const struct canfd_frame *frame);
+
+/*
+ * Error rates per class over the last second, with alarms raised when
+ * a rate goes above its limit and cleared when it's back at or below.
+ */
+struct can_error_alarm {
+	int class;
+	int raised;		/* 0 if cleared */
+	unsigned int rate;	/* errors in the last second */
+	unsigned int limit;
+};
+
+struct can_error_rate;
+
+struct can_error_rate *can_error_rate_new(void);
+void can_error_rate_free(struct can_error_rate *r);
+
+/*
+ * "class:limit[,class:limit]...", limits in errors per second. Returns
+ * -1 with errno EINVAL if invalid.
+ */
+int can_error_rate_set_alarms(struct can_error_rate *r, const char *spec);
+
+/*
+ * Counts "frame" received at "ns" if it's an error frame, "frame" may be
+ * NULL to let time pass. Returns the number of alarms raised or cleared,
+ * written to "alarms", up to CAN_ERROR_CLASSES.
+ */
+int can_error_rate_add(struct can_error_rate *r,
+		       const struct canfd_frame *frame, int64_t ns,
+		       struct can_error_alarm *alarms);
+
+/*
+ * Shared memory rings
+ *
+ * A capture process publishes the frames it receives into a ring in
+ * /dev/shm/canutils-shm-NAME, any number of local readers consume them
+ * without locks, each at its own position. A reader that falls more
+ * than the ring behind loses frames and is told how many. Readers may
+ * also attach with can_io_open() and CAN_IO_SHM, which counts the lost
+ * frames as CAN_METRIC_RX_DROPS.
+ */
+#define CAN_SHM_SLOTS_DEFAULT	65536
+
+struct can_shm;
+
+/*
+ * Create the ring "name" of "slots" frames, a power of 2, 0 for the
+ * default, or take over an existing one of that size, continuing its
+ * stream. There's one writer at a time, EBUSY for another one. Returns
+ * NULL on error with errno set.
+ */
+struct can_shm *can_shm_create(const char *name, unsigned int slots);
+
+/*
+ * Attach to the ring "name" as a reader, from its current end on. The
+ * ring is mapped read-only. ENODATA if no writer has created it yet.
+ */
+struct can_shm *can_shm_attach(const char *name);
+void can_shm_close(struct can_shm *shm);
+
+/* the ring's file, not for poll(2), it's always readable */
+int can_shm_fd(const struct can_shm *shm);
+
+/* append "n" frames, "ts" may be NULL, and wake up the readers */
+int can_shm_publish(struct can_shm *shm, const struct canfd_frame *frames,
+		    const struct timespec *ts, int n);
+
+/*
+ * Read up to "n" frames, blocks until at least one is published unless
+ * "nonblock". "ts" may be NULL, stamps the writer didn't have are 0.
+ * "lost" is set to the number of frames skipped because the writer
+ * overtook the reader, 0 frames may be returned then. Returns the number
+ * of frames or -1 with errno set, EINTR and EAGAIN included.
+ */
+int can_shm_read(struct can_shm *shm, struct canfd_frame *frames,
+		 struct timespec *ts, int n, int nonblock, uint64_t *lost);
+
+/*
+ * Flight recorder
+ *
+ * Keeps the frames of the last seconds, or the last frames, in a ring
+ * allocated up front and releases them only when a trigger fires,
+ * followed by the frames of a window after it. A trigger during that
+ * window extends it.
+ */
+
+/* a ring for seconds has room for this many frames per second */
+#define CAN_RECORDER_RATE	20000
+#define CAN_RECORDER_MAX_FRAMES	(1 << 26)
+
+struct can_recorder;
+
+/*
+ * "pre[:post]", the windows before and after a trigger, each as frames,
+ * e.g. "10000", or time, e.g. "5s" or "500ms"; "post" defaults to "pre".
+ * Up to "batch" frames are added at a time. Returns NULL with errno set,
+ * EINVAL if "spec" is invalid.
+ */
+struct can_recorder *can_recorder_new(const char *spec, int batch);
+void can_recorder_free(struct can_recorder *rec);
+
+/*
+ * "trigger[,trigger]...": "error" for any error frame, "bus-off", or
+ * "id[:data]" for a frame with that id whose payload starts with the
+ * hex bytes "data", "xx" matching any byte. Ids above 0x7ff are
+ * extended. Returns -1 with errno EINVAL if invalid.
+ */
+int can_recorder_add_triggers(struct can_recorder *rec, const char *spec);
+
+/* the error classes the triggers need to receive */
+can_err_mask_t can_recorder_err_mask(const struct can_recorder *rec);
+
+/* fire at "ts", without a frame, e.g. on a signal */
+void can_recorder_trigger(struct can_recorder *rec, const struct timespec *ts);
+
+/*
+ * Add "n" frames received at "ts", at most "batch". Returns the number
+ * of triggers that fired. All frames released must have been taken
+ * before, see can_recorder_pending().
+ */
+int can_recorder_add(struct can_recorder *rec,
+		     const struct canfd_frame *frames,
+		     const struct timespec *ts, int n);
+
+/* 1 if there are released frames to take */
+int can_recorder_pending(const struct can_recorder *rec);
+
+/* up to "n" released frames, oldest first, returns their number */
+int can_recorder_take(struct can_recorder *rec, struct canfd_frame *frames,
+		      struct timespec *ts, int n);
+
+/* released frames overwritten before they were taken */
+uint64_t can_recorder_lost(const struct can_recorder *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CANUTILS_H */
@@ -0,0 +1,160 @@
+/*
+ * canutils/bittiming.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can/netlink.h>
+
+#include "bittiming.h"
+
+/*
+ * Constants as in the mainline drivers, clock as found on common boards.
+ * Another clock can be given on the command line.
+ */
+const struct bt_preset bt_presets[] = {
+	{ "sja1000",	{ "sja1000",   1,  16, 1,   8,   4, 1,   64, 1 },   8000000 },
+	{ "mcp251x",	{ "mcp251x",   3,  16, 2,   8,   4, 1,   64, 1 },   8000000 },
+	{ "mcp251xfd",	{ "mcp251xfd", 2, 256, 1, 128, 128, 1,  256, 1 },  40000000 },
+	{ "flexcan",	{ "flexcan",   4,  16, 2,   8,   4, 1,  256, 1 },  24000000 },
+	{ "at91",	{ "at91",      4,  16, 2,   8,   4, 2,  128, 1 }, 100000000 },
+	{ "c_can",	{ "c_can",     2,  16, 1,   8,   4, 1, 1024, 1 },  24000000 },
+	{ "ti_hecc",	{ "ti_hecc",   1,  16, 1,   8,   4, 1,  256, 1 },  13000000 },
+	{ "mscan",	{ "mscan",     4,  16, 2,   8,   4, 1,   64, 1 },  33000000 },
+	{ "m_can",	{ "m_can",     2, 256, 2, 128, 128, 1,  512, 1 },  40000000 },
+	{ NULL },
+};
+
+const struct bt_preset *bt_preset_find(const char *name)
+{
+	const struct bt_preset *p;
+
+	for (p = bt_presets; p->name; p++)
+		if (!strcmp(p->name, name))
+			return p;
+
+	return NULL;
+}
+
+__u32 bt_default_sample_point(__u32 bitrate)
+{
+	if (bitrate > 800000)
+		return 750;
+	if (bitrate > 500000)
+		return 800;
+
+	return 875;
+}
+
+static __u32 diff(__u32 a, __u32 b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/* returns < 0 if "a" is better than "b" */
+static int candidate_cmp(const struct bt_candidate *a,
+			 const struct bt_candidate *b)
+{
+	__u32 ntq_a, ntq_b;
+
+	if (a->bitrate_error != b->bitrate_error)
+		return a->bitrate_error < b->bitrate_error ? -1 : 1;
+	if (a->sample_point_error != b->sample_point_error)
+		return a->sample_point_error < b->sample_point_error ? -1 : 1;
+
+	/* more tq per bit allow for a finer resynchronization */
+	ntq_a = 1 + a->bt.prop_seg + a->bt.phase_seg1 + a->bt.phase_seg2;
+	ntq_b = 1 + b->bt.prop_seg + b->bt.phase_seg1 + b->bt.phase_seg2;
+	if (ntq_a != ntq_b)
+		return ntq_a > ntq_b ? -1 : 1;
+
+	return 0;
+}
+
+/* insert into the sorted list "best" of "*count" out of "n" entries */
+static void candidate_add(struct bt_candidate *best, int n, int *count,
+			  const struct bt_candidate *c)
+{
+	int i;
+
+	if (*count == n && candidate_cmp(c, &best[n - 1]) >= 0)
+		return;
+
+	i = *count < n ? (*count)++ : n - 1;
+	for (; i > 0 && candidate_cmp(c, &best[i - 1]) < 0; i--)
+		best[i] = best[i - 1];
+	best[i] = *c;
+}
+
+/*
+ * For each brp only the two tq counts per bit closest to the requested
+ * bitrate are worth looking at, all splits of those into tseg1 and
+ * tseg2 are considered. This keeps the search linear in the brp range,
+ * even for controllers with huge tseg ranges.
+ */
+int bt_solve(const struct can_bittiming_const *btc, __u32 clock,
+	     __u32 bitrate, __u32 sample_point, __u32 sjw,
+	     struct bt_candidate *best, int n)
+{
+	struct bt_candidate c;
+	unsigned long long rate;
+	__u32 brp, ntq, ntq_min, ntq_max, tseg1, tseg2;
+	int count = 0, i;
+
+	if (!bitrate || !clock || n < 1 || !btc->brp_inc)
+		return 0;
+
+	ntq_min = 1 + btc->tseg1_min + btc->tseg2_min;
+	ntq_max = 1 + btc->tseg1_max + btc->tseg2_max;
+
+	for (brp = btc->brp_min; brp <= btc->brp_max; brp += btc->brp_inc) {
+		rate = (unsigned long long)brp * bitrate;
+		ntq = clock / rate;
+
+		for (i = 0; i < 2; i++, ntq++) {
+			if (ntq < ntq_min || ntq > ntq_max)
+				continue;
+
+			memset(&c, 0, sizeof(c));
+			c.bt.brp = brp;
+			c.bt.bitrate = clock / ((unsigned long long)brp * ntq);
+			c.bt.tq = ((unsigned long long)brp * 1000000000 + clock / 2) / clock;
+			c.bitrate_error = diff(c.bt.bitrate, bitrate);
+
+			for (tseg2 = btc->tseg2_min; tseg2 <= btc->tseg2_max; tseg2++) {
+				if (ntq < 1 + tseg2 + btc->tseg1_min)
+					break;
+
+				tseg1 = ntq - 1 - tseg2;
+				if (tseg1 > btc->tseg1_max)
+					continue;
+
+				c.bt.prop_seg = tseg1 / 2;
+				c.bt.phase_seg1 = tseg1 - c.bt.prop_seg;
+				c.bt.phase_seg2 = tseg2;
+				c.bt.sjw = sjw ? sjw : tseg2;
+				if (c.bt.sjw > btc->sjw_max)
+					c.bt.sjw = btc->sjw_max;
+				if (c.bt.sjw > tseg2)
+					c.bt.sjw = tseg2;
+				c.bt.sample_point = 1000 * (ntq - tseg2) / ntq;
+				c.sample_point_error = diff(c.bt.sample_point,
+							    sample_point);
+
+				candidate_add(best, n, &count, &c);
+			}
+		}
+	}
+
+	return count;
+}
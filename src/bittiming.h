@@ -0,0 +1,53 @@
+/*
+ * canutils/bittiming.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef BITTIMING_H
+#define BITTIMING_H
+
+/*
+ * Like canlink.h this needs the CAN netlink structures, include
+ * <libsocketcan.h> or <linux/can/netlink.h> first.
+ */
+
+struct bt_preset {
+	const char *name;
+	struct can_bittiming_const btc;
+	__u32 clock;		/* default clock in Hz */
+};
+
+struct bt_candidate {
+	struct can_bittiming bt;	/* incl. brp, bitrate and sample_point */
+	__u32 bitrate_error;		/* in Hz */
+	__u32 sample_point_error;	/* in tenth of a percent */
+};
+
+/* NULL terminated table of known controllers */
+extern const struct bt_preset bt_presets[];
+
+const struct bt_preset *bt_preset_find(const char *name);
+
+/* the CiA recommended sample point for "bitrate", in tenth of a percent */
+__u32 bt_default_sample_point(__u32 bitrate);
+
+/*
+ * Find the "n" best bit timings for "bitrate" and "sample_point" (in
+ * tenth of a percent) on a controller described by "btc" running at
+ * "clock" Hz, ranked by bitrate error, then sample point error. "sjw"
+ * of 0 selects the largest possible value. Returns the number of
+ * candidates stored in "best".
+ */
+int bt_solve(const struct can_bittiming_const *btc, __u32 clock,
+	     __u32 bitrate, __u32 sample_point, __u32 sjw,
+	     struct bt_candidate *best, int n);
+
+#endif /* BITTIMING_H */
@@ -0,0 +1,630 @@
+#include <can_config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/can.h>
+
+#include <canutils.h>
+
+extern int optind, opterr, optopt;
+
+/*
+ * The logs are split into chunks, text logs at line boundaries and
+ * compressed ones at block boundaries. Worker threads take the next
+ * chunk and collect per id statistics of it, which share nothing and
+ * are merged in log order afterwards. The period and a DLC change
+ * across the boundary of two chunks are taken from the last frame of
+ * the earlier and the first frame of the later chunk, the result
+ * doesn't depend on the chunking.
+ */
+#define CHUNK_SIZE	(16 << 20)
+
+/* compressed, about as many frames as a text chunk */
+#define CHUNK_SIZE_BINARY	(1 << 20)
+
+/* a line without "(seconds.usecs) " */
+#define NO_TS		INT64_MIN
+
+struct id_stats {
+	canid_t id;
+	int used;
+	uint64_t frames;
+	int64_t first_ns, last_ns;
+	unsigned char first_len, last_len, min_len, max_len;
+	uint64_t dlc_changes;
+
+	/* the periods, with Welford's running mean and variance */
+	uint64_t periods;
+	double mean, m2;
+	int64_t min_period, max_period;
+};
+
+struct table {
+	struct id_stats *s;
+	size_t size;		/* a power of two */
+	size_t count;
+};
+
+struct log {
+	const char *name;
+	const char *map;
+	size_t size;
+	int binary;
+	int first_chunk, chunks;
+};
+
+struct chunk {
+	const struct log *log;
+	const char *start;
+	size_t len;
+	struct table table;
+	uint64_t frames, errors, bad;
+	int err;		/* errno of a damaged block */
+};
+
+static struct chunk *chunks;
+static int chunk_count;
+static int next_chunk;
+
+enum {
+	VERSION_OPTION = CHAR_MAX + 1,
+};
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr,
+		"Usage: %s [Options] <logfile>...\n"
+		"Per id statistics of candump logs, text or compressed:\n"
+		"frames, rate, period, its jitter (standard deviation),\n"
+		"min. and max., DLCs and error frames\n"
+		"Options:\n"
+		" -j, --jobs=N		threads (default: number of CPUs)\n"
+		" -v, --verbose		print the time taken\n"
+		" -h, --help		this help\n"
+		"     --version		print version information and exit\n",
+		prg);
+}
+
+static struct id_stats *table_get(struct table *t, canid_t id)
+{
+	struct id_stats *old = t->s;
+	size_t i, size = t->size;
+
+	if (2 * (t->count + 1) > t->size) {
+		t->size = size ? 2 * size : 64;
+		t->s = calloc(t->size, sizeof(*t->s));
+		if (!t->s) {
+			perror("calloc");
+			exit(1);
+		}
+		t->count = 0;
+		for (i = 0; i < size; i++)
+			if (old[i].used)
+				*table_get(t, old[i].id) = old[i];
+		free(old);
+	}
+
+	i = (id * 0x9e3779b1u) & (t->size - 1);
+	while (t->s[i].used && t->s[i].id != id)
+		i = (i + 1) & (t->size - 1);
+
+	if (!t->s[i].used) {
+		t->s[i].used = 1;
+		t->s[i].id = id;
+		t->count++;
+	}
+
+	return &t->s[i];
+}
+
+static void observe(struct id_stats *s, int64_t period)
+{
+	double delta = period - s->mean;
+
+	if (!s->periods || period < s->min_period)
+		s->min_period = period;
+	if (!s->periods || period > s->max_period)
+		s->max_period = period;
+
+	s->periods++;
+	s->mean += delta / s->periods;
+	s->m2 += delta * (period - s->mean);
+}
+
+static void update(struct chunk *c, canid_t id, unsigned int len, int64_t ns)
+{
+	struct id_stats *s = table_get(&c->table, id);
+
+	c->frames++;
+	if (id & CAN_ERR_FLAG)
+		c->errors++;
+
+	if (!s->frames) {
+		s->first_ns = ns;
+		s->first_len = s->min_len = s->max_len = len;
+	} else {
+		if (len != s->last_len)
+			s->dlc_changes++;
+		if (ns != NO_TS && s->last_ns != NO_TS)
+			observe(s, ns - s->last_ns);
+		if (len < s->min_len)
+			s->min_len = len;
+		if (len > s->max_len)
+			s->max_len = len;
+	}
+
+	s->last_ns = ns;
+	s->last_len = len;
+	s->frames++;
+}
+
+/* "b" follows "a" in the log */
+static void merge(struct id_stats *a, const struct id_stats *b)
+{
+	uint64_t n;
+	double delta;
+
+	if (!a->frames) {
+		*a = *b;
+		return;
+	}
+
+	if (b->first_len != a->last_len)
+		a->dlc_changes++;
+	if (b->first_ns != NO_TS && a->last_ns != NO_TS)
+		observe(a, b->first_ns - a->last_ns);
+
+	/* Chan et al.'s combination of the means and variances */
+	if (b->periods) {
+		n = a->periods + b->periods;
+		delta = b->mean - a->mean;
+		a->mean += delta * b->periods / n;
+		a->m2 += b->m2 + delta * delta * a->periods * b->periods / n;
+		if (!a->periods || b->min_period < a->min_period)
+			a->min_period = b->min_period;
+		if (!a->periods || b->max_period > a->max_period)
+			a->max_period = b->max_period;
+		a->periods = n;
+	}
+
+	a->frames += b->frames;
+	a->dlc_changes += b->dlc_changes;
+	a->last_ns = b->last_ns;
+	a->last_len = b->last_len;
+	if (b->min_len < a->min_len)
+		a->min_len = b->min_len;
+	if (b->max_len > a->max_len)
+		a->max_len = b->max_len;
+}
+
+/* the lines aren't terminated, don't parse beyond "e" */
+static int parse_num(const char **p, const char *e, int base,
+		     unsigned long long *v, int *digits)
+{
+	const char *s = *p;
+	int d;
+
+	*v = 0;
+	for (; *p < e; (*p)++) {
+		if (**p >= '0' && **p <= '9')
+			d = **p - '0';
+		else if (base == 16 && **p >= 'a' && **p <= 'f')
+			d = **p - 'a' + 10;
+		else if (base == 16 && **p >= 'A' && **p <= 'F')
+			d = **p - 'A' + 10;
+		else
+			break;
+		*v = *v * base + d;
+	}
+	*digits = *p - s;
+
+	return *digits ? 0 : -1;
+}
+
+static int expect(const char **p, const char *e, const char *s)
+{
+	size_t len = strlen(s);
+
+	if ((size_t)(e - *p) < len || memcmp(*p, s, len))
+		return -1;
+	*p += len;
+
+	return 0;
+}
+
+/* "[(seconds.usecs) ]<0xid> [len] ...", like can_frame_parse() */
+static int parse_line(const char *p, const char *e, canid_t *id,
+		      unsigned int *len, int64_t *ns)
+{
+	unsigned long long sec, usec, v;
+	int digits;
+
+	*ns = NO_TS;
+	if (p < e && *p == '(') {
+		p++;
+		if (parse_num(&p, e, 10, &sec, &digits) || expect(&p, e, ".") ||
+		    parse_num(&p, e, 10, &usec, &digits) || expect(&p, e, ") "))
+			return -1;
+		*ns = sec * 1000000000LL + usec * 1000;
+	}
+
+	if (expect(&p, e, "<0x") || parse_num(&p, e, 16, &v, &digits) ||
+	    expect(&p, e, "> ["))
+		return -1;
+	if (v & CAN_ERR_FLAG)
+		*id = v & (CAN_ERR_FLAG | CAN_ERR_MASK);
+	else if (digits > 3 || v > CAN_SFF_MASK)
+		*id = (v & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	else
+		*id = v;
+
+	if (parse_num(&p, e, 10, &v, &digits) || v > CANFD_MAX_DLEN ||
+	    expect(&p, e, "]"))
+		return -1;
+	*len = v;
+
+	return 0;
+}
+
+static void analyze_text(struct chunk *c)
+{
+	const char *p = c->start, *e = c->start + c->len, *nl;
+	unsigned int len;
+	int64_t ns;
+	canid_t id;
+
+	while (p < e) {
+		nl = memchr(p, '\n', e - p);
+		if (!nl)
+			nl = e;
+		if (!parse_line(p, nl, &id, &len, &ns))
+			update(c, id, len, ns);
+		else if (nl != p)
+			c->bad++;
+		p = nl + 1;
+	}
+}
+
+static void analyze_binary(struct chunk *c)
+{
+	struct can_log_reader *r;
+	struct canfd_frame frame;
+	struct timespec ts;
+	int ret;
+
+	r = can_log_reader_open_mem(c->start, c->len);
+	if (!r) {
+		c->err = errno;
+		return;
+	}
+
+	while ((ret = can_log_read(r, &frame, &ts)) > 0)
+		update(c, frame.can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG |
+					  CAN_EFF_MASK),
+		       frame.len, ts.tv_sec * 1000000000LL + ts.tv_nsec);
+	if (ret < 0)
+		c->err = errno;
+
+	can_log_reader_close(r);
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) <
+	       chunk_count) {
+		if (chunks[i].log->binary)
+			analyze_binary(&chunks[i]);
+		else
+			analyze_text(&chunks[i]);
+	}
+
+	return NULL;
+}
+
+static void add_chunk(struct log *log, const char *start, size_t len)
+{
+	struct chunk *tmp;
+
+	tmp = realloc(chunks, sizeof(*chunks) * (chunk_count + 1));
+	if (!tmp) {
+		perror("realloc");
+		exit(1);
+	}
+	chunks = tmp;
+
+	memset(&chunks[chunk_count], 0, sizeof(*chunks));
+	chunks[chunk_count].start = start;
+	chunks[chunk_count].len = len;
+	chunk_count++;
+	log->chunks++;
+}
+
+static void split_text(struct log *log)
+{
+	size_t off = 0, end;
+	const char *nl;
+
+	while (off < log->size) {
+		end = log->size - off > CHUNK_SIZE ? off + CHUNK_SIZE : log->size;
+		if (end < log->size) {
+			nl = memchr(log->map + end, '\n', log->size - end);
+			end = nl ? (size_t)(nl - log->map) + 1 : log->size;
+		}
+		add_chunk(log, log->map + off, end - off);
+		off = end;
+	}
+}
+
+static void split_binary(struct log *log)
+{
+	size_t off = sizeof(CAN_LOG_MAGIC) - 1, start = off;
+	ssize_t size;
+
+	while (off < log->size) {
+		size = can_log_block_size(log->map + off, log->size - off);
+		if (size < 0)
+			fprintf(stderr, "%s: damaged block at %zu\n",
+				log->name, off);
+		if (size <= 0)
+			break;
+		off += size;
+		if (off - start >= CHUNK_SIZE_BINARY) {
+			add_chunk(log, log->map + start, off - start);
+			start = off;
+		}
+	}
+	if (off > start)
+		add_chunk(log, log->map + start, off - start);
+}
+
+static int open_log(struct log *log, const char *name)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(log, 0, sizeof(*log));
+	log->name = name;
+	log->first_chunk = chunk_count;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(name);
+		return -1;
+	}
+
+	log->size = st.st_size;
+	if (log->size) {
+		p = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			perror(name);
+			close(fd);
+			return -1;
+		}
+		madvise(p, log->size, MADV_SEQUENTIAL);
+		log->map = p;
+	}
+	close(fd);
+
+	log->binary = log->size >= sizeof(CAN_LOG_MAGIC) - 1 &&
+		!memcmp(log->map, CAN_LOG_MAGIC, sizeof(CAN_LOG_MAGIC) - 1);
+	if (log->binary)
+		split_binary(log);
+	else
+		split_text(log);
+
+	return 0;
+}
+
+static int cmp_stats(const void *a, const void *b)
+{
+	const struct id_stats *x = a, *y = b;
+	unsigned int cx, cy;
+
+	/* standard, extended, then error frames */
+	cx = x->id & CAN_ERR_FLAG ? 2 : x->id & CAN_EFF_FLAG ? 1 : 0;
+	cy = y->id & CAN_ERR_FLAG ? 2 : y->id & CAN_EFF_FLAG ? 1 : 0;
+	if (cx != cy)
+		return cx < cy ? -1 : 1;
+
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static void print_log(const struct log *log)
+{
+	struct table t = { 0 };
+	struct id_stats *s, *sorted;
+	const struct chunk *c;
+	uint64_t frames = 0, errors = 0, bad = 0;
+	char id[16], dlc[8];
+	size_t i, n = 0;
+	int err = 0;
+
+	for (c = &chunks[log->first_chunk];
+	     c < &chunks[log->first_chunk + log->chunks]; c++) {
+		for (i = 0; i < c->table.size; i++)
+			if (c->table.s[i].used)
+				merge(table_get(&t, c->table.s[i].id),
+				      &c->table.s[i]);
+		frames += c->frames;
+		errors += c->errors;
+		bad += c->bad;
+		if (c->err && !err)
+			err = c->err;
+	}
+
+	sorted = malloc(sizeof(*sorted) * (t.count + 1));
+	if (!sorted) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < t.size; i++)
+		if (t.s[i].used)
+			sorted[n++] = t.s[i];
+	qsort(sorted, n, sizeof(*sorted), cmp_stats);
+
+	printf("%s: %llu frames, %llu error frames, %zu ids",
+	       log->name, (unsigned long long)frames,
+	       (unsigned long long)errors, n);
+	if (bad)
+		printf(", %llu unparsable lines", (unsigned long long)bad);
+	printf("\n");
+	if (err)
+		fprintf(stderr, "%s: %s, the statistics are incomplete\n",
+			log->name, strerror(err));
+
+	printf("%-12s %12s %10s %11s %11s %11s %11s %6s %11s\n",
+	       "id", "frames", "rate[1/s]", "period[ms]", "jitter[ms]",
+	       "min[ms]", "max[ms]", "dlc", "dlc-changes");
+	for (s = sorted; s < sorted + n; s++) {
+		if (s->id & CAN_ERR_FLAG)
+			sprintf(id, "err:0x%03x", s->id & CAN_ERR_MASK);
+		else if (s->id & CAN_EFF_FLAG)
+			sprintf(id, "0x%08x", s->id & CAN_EFF_MASK);
+		else
+			sprintf(id, "0x%03x", s->id);
+
+		if (s->min_len == s->max_len)
+			sprintf(dlc, "%d", s->min_len);
+		else
+			sprintf(dlc, "%d-%d", s->min_len, s->max_len);
+
+		printf("%-12s %12llu", id, (unsigned long long)s->frames);
+		if (s->periods && s->mean > 0)
+			printf(" %10.2f %11.3f %11.3f %11.3f %11.3f",
+			       1e9 / s->mean, s->mean / 1e6,
+			       sqrt(s->m2 / s->periods) / 1e6,
+			       s->min_period / 1e6, s->max_period / 1e6);
+		else
+			printf(" %10s %11s %11s %11s %11s",
+			       "-", "-", "-", "-", "-");
+		printf(" %6s %11llu\n", dlc,
+		       (unsigned long long)s->dlc_changes);
+	}
+
+	free(sorted);
+	free(t.s);
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec t0, t1;
+	struct log *logs;
+	pthread_t *threads;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, verbose = 0, count, i, l;
+	size_t bytes = 0;
+
+	struct option long_options[] = {
+		{ "help",	no_argument,		0, 'h' },
+		{ "jobs",	required_argument,	0, 'j' },
+		{ "verbose",	no_argument,		0, 'v' },
+		{ "version",	no_argument,		0, VERSION_OPTION },
+		{ 0,		0,			0, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "hj:v", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(basename(argv[0]));
+			exit(0);
+
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			if (jobs < 1) {
+				fprintf(stderr, "jobs must be at least 1\n");
+				exit(1);
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case VERSION_OPTION:
+			printf("cananalyze %s\n", VERSION);
+			exit(0);
+
+		default:
+			print_usage(basename(argv[0]));
+			exit(1);
+		}
+	}
+
+	if (optind == argc) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	count = argc - optind;
+	logs = calloc(count, sizeof(*logs));
+	if (!logs) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		if (open_log(&logs[i], argv[optind + i]))
+			exit(1);
+		bytes += logs[i].size;
+	}
+	for (i = 0; i < chunk_count; i++) {
+		for (l = 0; l < count; l++)
+			if (i >= logs[l].first_chunk &&
+			    i < logs[l].first_chunk + logs[l].chunks)
+				chunks[i].log = &logs[l];
+	}
+
+	if (jobs > chunk_count)
+		jobs = chunk_count ? chunk_count : 1;
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 1; i < jobs; i++) {
+		errno = pthread_create(&threads[i], NULL, worker, NULL);
+		if (errno) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	worker(NULL);
+	for (i = 1; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < count; i++)
+		print_log(&logs[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (verbose)
+		fprintf(stderr, "%zu bytes in %d chunks, %d threads, %.3f s\n",
+			bytes, chunk_count, jobs,
+			(t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+	if (fflush(stdout)) {
+		perror("write");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * canutils/canbits.c - on-wire length of frames, stuff bits included
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+#ifndef CANFD_BRS
+#define CANFD_BRS	0x01
+#endif
+
+/*
+ * The frame is fed to a bit stuffer, bit by bit, as the controller sends
+ * it: after five equal bits a stuff bit of the other value follows, and
+ * starts the next run. Classic frames are stuffed up to the end of the
+ * CRC, which is calculated on the way. CAN-FD frames are stuffed up to
+ * the end of the data, their CRC field has fixed stuff bits, one ahead
+ * of every four bits, so its value doesn't matter.
+ */
+struct stuffer {
+	unsigned int bits;	/* sent, stuff bits included */
+	int last, run;
+	unsigned int crc;	/* CRC-15 of classic frames */
+};
+
+#define CRC15_POLY	0x4599
+
+static void put(struct stuffer *s, unsigned int v, int n, int crc)
+{
+	int bit;
+
+	while (n--) {
+		bit = v >> n & 1;
+		if (crc) {
+			s->crc <<= 1;
+			if (bit ^ (s->crc >> 15 & 1))
+				s->crc ^= CRC15_POLY;
+			s->crc &= 0x7fff;
+		}
+
+		s->bits++;
+		if (bit == s->last) {
+			s->run++;
+		} else {
+			s->last = bit;
+			s->run = 1;
+		}
+		if (s->run == 5) {
+			s->bits++;
+			s->last = !bit;
+			s->run = 1;
+		}
+	}
+}
+
+static const unsigned char len2dlc[CANFD_MAX_DLEN + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8,			/* 0 - 8 */
+	9, 9, 9, 9,					/* 9 - 12 */
+	10, 10, 10, 10,					/* 13 - 16 */
+	11, 11, 11, 11,					/* 17 - 20 */
+	12, 12, 12, 12,					/* 21 - 24 */
+	13, 13, 13, 13, 13, 13, 13, 13,			/* 25 - 32 */
+	14, 14, 14, 14, 14, 14, 14, 14,			/* 33 - 40 */
+	14, 14, 14, 14, 14, 14, 14, 14,			/* 41 - 48 */
+	15, 15, 15, 15, 15, 15, 15, 15,			/* 49 - 56 */
+	15, 15, 15, 15, 15, 15, 15, 15,			/* 57 - 64 */
+};
+
+static const unsigned char dlc2len[16] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64,
+};
+
+/* the id and the bits in front of the DLC */
+static void put_id(struct stuffer *s, canid_t id, int fd, int crc)
+{
+	int rtr = !fd && id & CAN_RTR_FLAG;
+
+	put(s, 0, 1, crc);					/* SOF */
+	if (id & CAN_EFF_FLAG) {
+		put(s, id >> 18 & 0x7ff, 11, crc);
+		put(s, 3, 2, crc);				/* SRR, IDE */
+		put(s, id & 0x3ffff, 18, crc);
+		put(s, rtr, 1, crc);				/* RTR, RRS */
+		put(s, fd ? 2 : 0, 2, crc);			/* r1, r0 / FDF, res */
+	} else {
+		put(s, id & 0x7ff, 11, crc);
+		put(s, rtr, 1, crc);				/* RTR, RRS */
+		put(s, fd ? 2 : 0, fd ? 3 : 2, crc);		/* IDE, r0 / FDF, res */
+	}
+}
+
+unsigned int can_frame_bits(const struct canfd_frame *frame,
+			    unsigned int *dbits)
+{
+	struct stuffer s;
+	unsigned int len = frame->len, data, i;
+
+	*dbits = 0;
+	if (frame->can_id & CAN_ERR_FLAG)
+		return 0;
+	memset(&s, 0, sizeof(s));
+	s.last = -1;
+
+	if (!(frame->flags & CANFD_FDF)) {
+		if (len > CAN_MAX_DLEN)
+			len = CAN_MAX_DLEN;
+		put_id(&s, frame->can_id, 0, 1);
+		put(&s, len, 4, 1);
+		if (!(frame->can_id & CAN_RTR_FLAG))
+			for (i = 0; i < len; i++)
+				put(&s, frame->data[i], 8, 1);
+		put(&s, s.crc, 15, 0);
+
+		/* CRC delimiter, ACK slot and delimiter, EOF, IFS */
+		return s.bits + 1 + 2 + 7 + 3;
+	}
+
+	if (len > CANFD_MAX_DLEN)
+		len = CANFD_MAX_DLEN;
+	put_id(&s, frame->can_id, 1, 0);
+	put(&s, frame->flags & CANFD_BRS ? 1 : 0, 1, 0);	/* BRS */
+
+	/* from ESI to the CRC delimiter at the data bitrate with BRS */
+	data = s.bits;
+	put(&s, 0, 1, 0);					/* ESI */
+	put(&s, len2dlc[len], 4, 0);
+	for (i = 0; i < dlc2len[len2dlc[len]]; i++)
+		put(&s, i < len ? frame->data[i] : 0, 8, 0);
+
+	/* stuff count, CRC-17 or CRC-21, the fixed stuff bits and delimiter */
+	s.bits += dlc2len[len2dlc[len]] > 16 ? 4 + 21 + 7 : 4 + 17 + 6;
+	s.bits += 1;
+	data = s.bits - data;
+
+	if (!(frame->flags & CANFD_BRS))
+		return s.bits + 2 + 7 + 3;
+
+	*dbits = data;
+	return s.bits - data + 2 + 7 + 3;
+}
+
+uint64_t can_frame_ns(const struct canfd_frame *frame, unsigned long bitrate,
+		      unsigned long dbitrate)
+{
+	unsigned int nbits, dbits;
+	uint64_t ns;
+
+	nbits = can_frame_bits(frame, &dbits);
+	if (!dbitrate) {
+		nbits += dbits;
+		dbits = 0;
+	}
+
+	ns = nbits * 1000000000ULL / bitrate;
+	if (dbits)
+		ns += dbits * 1000000000ULL / dbitrate;
+
+	return ns;
+}
@@ -0,0 +1,525 @@
+/*
+ * canutils/canbusload.c - bus load of CAN interfaces
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libsocketcan.h>
+#include <can_config.h>
+
+#include <canutils.h>
+
+#include "canlink.h"
+
+extern int optind, opterr, optopt;
+
+static volatile sig_atomic_t running = 1;
+static int wake_pipe[2];
+
+enum {
+	VERSION_OPTION = CHAR_MAX + 1,
+	IO_OPTION,
+};
+
+#define BATCH		(64)
+#define TOP_DEFAULT	(5)
+
+/*
+ * The bus time of the frames is summed up in slots of 10 ms, by their
+ * receive time, for the last 10 s. The loads over 100 ms, 1 s and 10 s
+ * are the sums of the last complete slots, the current one is still
+ * filling. The bus time per id is only kept for the report interval.
+ */
+#define SLOT_NS		(10000000LL)
+#define SLOTS		(1000)
+
+static const struct {
+	const char *name;
+	int slots;
+} windows[] = {
+	{ "100ms", 10 },
+	{ "1s", 100 },
+	{ "10s", 1000 },
+};
+
+#define WINDOWS		(sizeof(windows) / sizeof(windows[0]))
+
+struct id_load {
+	canid_t id;
+	int used;
+	uint64_t frames;
+	uint64_t ns;
+};
+
+/*
+ * One receiving thread per interface, the report takes the lock once
+ * per interval, the receiver once per batch.
+ */
+struct bus {
+	const char *name;
+	struct can_io *io;
+	pthread_t thread;
+	unsigned long bitrate, dbitrate;
+
+	pthread_mutex_t lock;
+	int64_t first, now;		/* slots, in SLOT_NS since the epoch */
+	uint64_t slot_ns[SLOTS];
+	uint64_t frames;		/* in the report interval */
+
+	struct id_load *ids;		/* hashed by id, at most half full */
+	unsigned int size, count;
+};
+
+static struct bus *buses;
+static int bus_count;
+static struct id_load *best;
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr, "Usage: %s [Options] <can-interface>...\n"
+		"\n"
+		"canbusload reports the bus load of CAN interfaces, from the on-wire length\n"
+		"of every frame received, stuff bits included.\n"
+		"\n"
+		"Options:\n"
+		" -b, --bitrate=BPS[:DBPS]	bitrate and CAN-FD data bitrate of the interfaces\n"
+		"				(default: as configured, needed with --io=sim and shm)\n"
+		" -i, --interval=MSEC	report every MSEC milliseconds (default 1000)\n"
+		" -t, --top=COUNT		the COUNT ids with the most bus time (default %d)\n"
+		"     --io=BACKEND	frame I/O: rw, mmsg, mmap, uring, sim or shm (default $CANUTILS_IO or mmsg)\n"
+		" -h, --help		this help\n"
+		"     --version		print version information and exit\n",
+		prg, TOP_DEFAULT);
+}
+
+static void sigterm(int signo)
+{
+	running = 0;
+}
+
+/* no SA_RESTART, a blocking receive returns with EINTR */
+static void set_signal(int signo, void (*handler)(int))
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signo, &sa, NULL);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int get_link(const struct can_link *link, void *priv)
+{
+	memcpy(priv, link, sizeof(*link));
+
+	return 1;
+}
+
+/* like canconfig's "show bitrate" and "show dbitrate" */
+static int get_bitrate(struct bus *b)
+{
+	struct can_bittiming bt;
+	struct can_link link;
+
+	if (can_get_bittiming(b->name, &bt) < 0 || !bt.bitrate)
+		return -1;
+	b->bitrate = bt.bitrate;
+
+	memset(&link, 0, sizeof(link));
+	if (can_link_dump(b->name, get_link, &link) == 0 &&
+	    link.valid & CAN_LINK_DATA_BITTIMING)
+		b->dbitrate = link.dbt.bitrate;
+
+	return 0;
+}
+
+static unsigned int hash_id(canid_t id, unsigned int size)
+{
+	return (id * 0x9e3779b1u) & (size - 1);
+}
+
+static struct id_load *find_id(struct bus *b, canid_t id)
+{
+	struct id_load *ids;
+	unsigned int size, h, i;
+
+	if (2 * (b->count + 1) > b->size) {
+		size = b->size ? 2 * b->size : 256;
+		ids = calloc(size, sizeof(*ids));
+		if (!ids)
+			return NULL;
+		for (i = 0; i < b->size; i++) {
+			if (!b->ids[i].used)
+				continue;
+			h = hash_id(b->ids[i].id, size);
+			while (ids[h].used)
+				h = (h + 1) & (size - 1);
+			ids[h] = b->ids[i];
+		}
+		free(b->ids);
+		b->ids = ids;
+		b->size = size;
+	}
+
+	h = hash_id(id, b->size);
+	while (b->ids[h].used && b->ids[h].id != id)
+		h = (h + 1) & (b->size - 1);
+	if (!b->ids[h].used) {
+		b->ids[h].used = 1;
+		b->ids[h].id = id;
+		b->count++;
+	}
+
+	return &b->ids[h];
+}
+
+/* clears the slots that "slot" moves past */
+static void advance(struct bus *b, int64_t slot)
+{
+	int64_t k;
+
+	if (slot <= b->now)
+		return;
+
+	for (k = b->now + 1; k <= slot && k <= b->now + SLOTS; k++)
+		b->slot_ns[k % SLOTS] = 0;
+	b->now = slot;
+}
+
+static void add_frames(struct bus *b, const struct canfd_frame *frames,
+		       const struct timespec *ts, int n)
+{
+	struct id_load *id;
+	int64_t ns, slot;
+	uint64_t t;
+	int i;
+
+	pthread_mutex_lock(&b->lock);
+	for (i = 0; i < n; i++) {
+		ns = ts[i].tv_sec * 1000000000LL + ts[i].tv_nsec;
+		if (!ns)
+			ns = now_ns();
+		slot = ns / SLOT_NS;
+		advance(b, slot);
+
+		t = can_frame_ns(&frames[i], b->bitrate, b->dbitrate);
+		/* a little late, e.g. received in the same batch */
+		if (slot > b->now - SLOTS)
+			b->slot_ns[slot % SLOTS] += t;
+		b->frames++;
+
+		id = find_id(b, frames[i].can_id &
+			     (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_EFF_MASK));
+		if (id) {
+			id->frames++;
+			id->ns += t;
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * The receive doesn't block, a signal could come just before it. The
+ * receivers poll(2) their interface and the wake pipe, which is written
+ * on shutdown. Frames of the uring and shm backends don't wake up
+ * poll(2), these are looked for once per slot.
+ */
+static void *receiver(void *arg)
+{
+	struct canfd_frame frames[BATCH];
+	struct timespec ts[BATCH];
+	struct pollfd fds[2];
+	struct bus *b = arg;
+	int nfds = 1, timeout = -1;
+	int n;
+
+	fds[0].fd = wake_pipe[0];
+	fds[0].events = POLLIN;
+	if (can_io_backend(b->io) == CAN_IO_URING ||
+	    can_io_backend(b->io) == CAN_IO_SHM) {
+		timeout = SLOT_NS / 1000000;
+	} else {
+		fds[1].fd = can_io_fd(b->io);
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	while (running) {
+		n = can_io_recv(b->io, frames, ts, BATCH);
+		if (n < 0 && errno == EAGAIN) {
+			if (poll(fds, nfds, timeout) >= 0 || errno == EINTR)
+				continue;
+			n = -1;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(b->name);
+			running = 0;
+			kill(getpid(), SIGTERM);
+			break;
+		}
+		add_frames(b, frames, ts, n);
+	}
+
+	return NULL;
+}
+
+static void format_id(char *buf, canid_t id)
+{
+	if (id & CAN_EFF_FLAG)
+		sprintf(buf, "0x%08x", id & CAN_EFF_MASK);
+	else
+		sprintf(buf, "0x%03x", id & CAN_SFF_MASK);
+	if (id & CAN_RTR_FLAG)
+		strcat(buf, "r");
+}
+
+static void report(struct bus *b, int64_t ns, int64_t interval_ns, int top)
+{
+	struct id_load *id;
+	uint64_t sum, frames;
+	int64_t slot;
+	unsigned int w;
+	char name[16];
+	int i, j, n = 0, count;
+
+	pthread_mutex_lock(&b->lock);
+	advance(b, ns / SLOT_NS);
+
+	printf("%s:", b->name);
+	for (w = 0; w < WINDOWS; w++) {
+		/* complete slots since the start, at most the window */
+		count = windows[w].slots;
+		if (b->now - b->first < count)
+			count = b->now - b->first;
+		if (count < 0)
+			count = 0;
+
+		sum = 0;
+		for (slot = b->now - count; slot < b->now; slot++)
+			sum += b->slot_ns[slot % SLOTS];
+		if (count)
+			printf(" %s %5.1f%%", windows[w].name,
+			       100.0 * sum / (count * SLOT_NS));
+		else
+			printf(" %s     -", windows[w].name);
+	}
+
+	/* the ids with the most bus time, insertion sorted */
+	for (id = b->ids; id < b->ids + b->size; id++) {
+		if (!id->used)
+			continue;
+		for (i = n; i > 0 && best[i - 1].ns < id->ns; i--)
+			if (i < top)
+				best[i] = best[i - 1];
+		if (i < top) {
+			best[i] = *id;
+			if (n < top)
+				n++;
+		}
+	}
+	frames = b->frames;
+	b->frames = 0;
+	if (b->ids)
+		memset(b->ids, 0, b->size * sizeof(*b->ids));
+	b->count = 0;
+	pthread_mutex_unlock(&b->lock);
+
+	printf(", %.0f frames/s", frames * 1e9 / interval_ns);
+	for (j = 0; j < n; j++) {
+		format_id(name, best[j].id);
+		printf("%s %s %.1f%%", j ? "" : ", top", name,
+		       100.0 * best[j].ns / interval_ns);
+		if (j < n - 1)
+			putchar(',');
+	}
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	struct can_io_opts io_opts = {
+		.batch = BATCH,
+		.nonblock = 1,
+		.timestamp = 1,
+	};
+	unsigned long bitrate = 0, dbitrate = 0;
+	long interval_ms = 1000;
+	int64_t interval_ns, next;
+	struct timespec ts;
+	int top = TOP_DEFAULT;
+	int backend, opt, i;
+	char *end;
+
+	struct option long_options[] = {
+		{ "help", no_argument, 0, 'h' },
+		{ "bitrate", required_argument, 0, 'b' },
+		{ "interval", required_argument, 0, 'i' },
+		{ "top", required_argument, 0, 't' },
+		{ "io", required_argument, 0, IO_OPTION },
+		{ "version", no_argument, 0, VERSION_OPTION },
+		{ 0, 0, 0, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "b:i:t:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(basename(argv[0]));
+			exit(0);
+
+		case 'b':
+			bitrate = strtoul(optarg, &end, 0);
+			if (*end == ':')
+				dbitrate = strtoul(end + 1, &end, 0);
+			if (!bitrate || *end) {
+				fprintf(stderr, "the bitrate must be given as BPS[:DBPS]\n");
+				exit(1);
+			}
+			break;
+
+		case 'i':
+			interval_ms = strtol(optarg, NULL, 0);
+			if (interval_ms < 10 || interval_ms % (SLOT_NS / 1000000)) {
+				fprintf(stderr, "the interval must be a multiple of 10 ms\n");
+				exit(1);
+			}
+			break;
+
+		case 't':
+			top = strtol(optarg, NULL, 0);
+			if (top < 0 || top > 1000) {
+				fprintf(stderr, "the top count must be 0 to 1000\n");
+				exit(1);
+			}
+			break;
+
+		case IO_OPTION:
+			backend = can_io_backend_parse(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "unknown I/O backend %s\n", optarg);
+				exit(1);
+			}
+			io_opts.backend = backend;
+			break;
+
+		case VERSION_OPTION:
+			printf("canbusload %s\n", VERSION);
+			exit(0);
+
+		default:
+			fprintf(stderr, "Unknown option %c\n", opt);
+			break;
+		}
+	}
+
+	bus_count = argc - optind;
+	if (!bus_count) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+
+	buses = calloc(bus_count, sizeof(*buses));
+	best = calloc(top + 1, sizeof(*best));
+	if (!buses || !best) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < bus_count; i++) {
+		buses[i].name = argv[optind + i];
+		buses[i].bitrate = bitrate;
+		buses[i].dbitrate = dbitrate;
+		if (!bitrate && get_bitrate(&buses[i])) {
+			fprintf(stderr, "%s: failed to get bitrate, give it with --bitrate\n",
+				buses[i].name);
+			exit(1);
+		}
+		pthread_mutex_init(&buses[i].lock, NULL);
+		/* the current slot is only partly seen */
+		buses[i].now = now_ns() / SLOT_NS;
+		buses[i].first = buses[i].now + 1;
+
+		buses[i].io = can_io_open(buses[i].name, &io_opts);
+		if (!buses[i].io) {
+			perror(buses[i].name);
+			exit(1);
+		}
+	}
+
+	set_signal(SIGTERM, sigterm);
+	set_signal(SIGHUP, sigterm);
+
+	if (pipe(wake_pipe)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	for (i = 0; i < bus_count; i++) {
+		errno = pthread_create(&buses[i].thread, NULL, receiver, &buses[i]);
+		if (errno) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	/*
+	 * the interval is a multiple of the slots, on its boundaries every
+	 * slot is complete
+	 */
+	interval_ns = interval_ms * 1000000LL;
+	next = (now_ns() / interval_ns + 1) * interval_ns;
+	while (running) {
+		ts.tv_sec = next / 1000000000LL;
+		ts.tv_nsec = next % 1000000000LL;
+		if (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL))
+			continue;
+
+		for (i = 0; i < bus_count; i++)
+			report(&buses[i], next, interval_ns, top);
+		fflush(stdout);
+		next += interval_ns;
+	}
+
+	/* wake up the receivers, the pipe stays readable for all of them */
+	if (write(wake_pipe[1], "", 1) < 0)
+		perror("write");
+	for (i = 0; i < bus_count; i++) {
+		pthread_join(buses[i].thread, NULL);
+		can_io_close(buses[i].io);
+		free(buses[i].ids);
+	}
+	free(buses);
+	free(best);
+
+	return 0;
+}
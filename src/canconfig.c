@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/socket.h>
@@ -34,10 +35,24 @@
 #include <libsocketcan.h>
 #include <can_config.h>
 
+#include "bittiming.h"
+#include "canlink.h"
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/* older libsocketcan headers don't know about CAN-FD */
+#ifndef CAN_CTRLMODE_FD
+#define CAN_CTRLMODE_FD			0x20
+#endif
+#ifndef CAN_CTRLMODE_PRESUME_ACK
+#define CAN_CTRLMODE_PRESUME_ACK	0x40
+#endif
+#ifndef CAN_CTRLMODE_FD_NON_ISO
+#define CAN_CTRLMODE_FD_NON_ISO		0x80
+#endif
+
 const char *can_states[CAN_STATE_MAX] = {
 	"ERROR-ACTIVE",
 	"ERROR-WARNING",
@@ -50,7 +65,13 @@ const char *can_states[CAN_STATE_MAX] = {
 const char *config_keywords[] = {
 		"baudrate", "bitrate", "bittiming", "ctrlmode", "restart",
 		"start", "stop", "restart-ms", "state", "clockfreq",
-		"bittiming-const", "berr-counter"};
+		"bittiming-const", "berr-counter", "solve", "dbittiming",
+		"data-bittiming-constants"};
+
+#define APPLY_LINE_MAX		1024
+
+#define SOLVE_TOP_DEFAULT	5
+#define SOLVE_TOP_MAX		64
 
 /* this is shamelessly stolen from iproute and slightly modified */
 #define NEXT_ARG() \
@@ -80,9 +101,11 @@ static inline int find_str(const char** haystack, unsigned int stack_size,
 static void help(void)
 {
 	fprintf(stderr, "usage:\n\t"
-		"canconfig <dev> bitrate { BR } [sample-point { SP }]\n\t\t"
+		"canconfig <dev> bitrate { BR } [sample-point { SP }] [dbitrate { DBR } [dsample-point { DSP }]]\n\t\t"
 		"BR := <bitrate in Hz>\n\t\t"
-		"SP := <sample-point {0...0.999}> (optional)\n\t"
+		"SP := <sample-point {0...0.999}> (optional)\n\t\t"
+		"DBR := <CAN-FD data bitrate in Hz>, implies ctrlmode fd on (optional)\n\t\t"
+		"DSP := <data sample-point {0...0.999}> (optional)\n\t"
 		"canconfig <dev> bittiming [ VALs ]\n\t\t"
 		"VALs := <tq | prop-seg | phase-seg1 | phase-seg2 | sjw>\n\t\t"
 		"tq <time quantum in ns>\n\t\t"
@@ -90,20 +113,143 @@ static void help(void)
 		"phase-seg1 <no. in tq>\n\t\t"
 		"phase-seg2 <no. in tq\n\t\t"
 		"sjw <no. in tq> (optional)\n\t"
+		"canconfig <dev> dbittiming [ VALs ]\n\t"
 		"canconfig <dev> restart-ms { RESTART-MS }\n\t\t"
 		"RESTART-MS := <autorestart interval in ms>\n\t"
 		"canconfig <dev> ctrlmode { CTRLMODE }\n\t\t"
-		"CTRLMODE := <[loopback | listen-only | triple-sampling | berr-reporting] [on|off]>\n\t"
+		"CTRLMODE := <[loopback | listen-only | triple-sampling | one-shot | berr-reporting |\n\t\t"
+		"              fd | fd-non-iso | presume-ack] [on|off]>\n\t"
 		"canconfig <dev> {ACTION}\n\t\t"
 		"ACTION := <[start|stop|restart]>\n\t"
 		"canconfig <dev> clockfreq\n\t"
 		"canconfig <dev> bittiming-constants\n\t"
-		"canconfig <dev> berr-counter\n"
+		"canconfig <dev> data-bittiming-constants\n\t"
+		"canconfig <dev> berr-counter\n\t"
+		"canconfig <dev> solve bitrate { BR } [ OPTs ] [apply]\n\t"
+		"canconfig solve controller { NAME } [clock { HZ }] bitrate { BR } [ OPTs ]\n\t\t"
+		"OPTs := <sample-point { SP } | sjw { SJW } | top { N }>\n\t\t"
+		"NAME := <sja1000 | mcp251x | mcp251xfd | flexcan | at91 | c_can | ti_hecc | mscan | m_can>\n\t"
+		"canconfig show [<dev>...]\n\t"
+		"canconfig monitor [<dev>...]\n\t"
+		"canconfig stats [<dev>...] [--interval { SEC }]\n\t"
+		"canconfig apply { FILE } [dry-run]\n\t\t"
+		"FILE := lines of <dev> [bitrate { BR } [sample-point { SP }]] [dbitrate { DBR } [dsample-point { DSP }]]\n\t\t"
+		"         [restart-ms { RESTART-MS }]\n\t\t"
+		"         [ctrlmode { CTRLMODE }...] [up | down]\n"
 		);
 
 	exit(EXIT_FAILURE);
 }
 
+static int get_link(const struct can_link *link, void *priv)
+{
+	memcpy(priv, link, sizeof(*link));
+
+	return 1;
+}
+
+static void do_get_link(const char *name, struct can_link *link)
+{
+	memset(link, 0, sizeof(*link));
+	if (can_link_dump(name, get_link, link) < 0) {
+		fprintf(stderr, "%s: failed to get interface attributes: %s\n",
+			name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * libsocketcan doesn't know about the CAN-FD data phase, which is set
+ * with a RTM_NEWLINK request of our own.
+ */
+static int do_set_link(const char *name, struct can_link_config *cfg)
+{
+	int ret;
+
+	cfg->name = name;
+	cfg->up = -1;
+	cfg->ifindex = if_nametoindex(name);
+	if (!cfg->ifindex)
+		return -1;
+
+	ret = can_link_apply(cfg, 1);
+	if (ret > 0)
+		errno = -cfg->err;
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * The kernel takes the data phase only along with the nominal one and
+ * ctrlmode FD, in the same request. A phase that isn't to be changed is
+ * sent again as it is, as segments, or as bitrate if the controller has
+ * fixed bitrates only.
+ */
+static void keep_bittiming(struct can_bittiming *bt,
+			   const struct can_bittiming *cur, int segments)
+{
+	memset(bt, 0, sizeof(*bt));
+	if (segments) {
+		bt->tq = cur->tq;
+		bt->prop_seg = cur->prop_seg;
+		bt->phase_seg1 = cur->phase_seg1;
+		bt->phase_seg2 = cur->phase_seg2;
+		bt->sjw = cur->sjw;
+	} else {
+		bt->bitrate = cur->bitrate;
+	}
+}
+
+static int bittiming_kept(const struct can_bittiming *bt,
+			  const struct can_bittiming *cur)
+{
+	return bt->tq ||
+		(bt->bitrate == cur->bitrate && !bt->sample_point);
+}
+
+static void set_fd_config(struct can_link_config *cfg,
+			  const struct can_link *cur)
+{
+	if (!(cfg->set & CAN_LINK_BITTIMING)) {
+		keep_bittiming(&cfg->bt, &cur->bt,
+			       cur->valid & CAN_LINK_BITTIMING_CONST);
+		cfg->set |= CAN_LINK_BITTIMING;
+	}
+	if (!(cfg->set & CAN_LINK_DATA_BITTIMING)) {
+		keep_bittiming(&cfg->dbt, &cur->dbt,
+			       cur->valid & CAN_LINK_DATA_BITTIMING_CONST);
+		cfg->set |= CAN_LINK_DATA_BITTIMING;
+	}
+	cfg->set |= CAN_LINK_CTRLMODE;
+	cfg->ctrlmode.mask |= CAN_CTRLMODE_FD;
+	cfg->ctrlmode.flags |= CAN_CTRLMODE_FD;
+}
+
+static void print_bitrate(const char *name, const struct can_bittiming *bt)
+{
+	fprintf(stdout,
+		"%s bitrate: %u, sample-point: %0.3f\n",
+		name, bt->bitrate,
+		(float)((float)bt->sample_point / 1000));
+}
+
+static void print_data_bitrate(const char *name, const struct can_bittiming *dbt)
+{
+	fprintf(stdout,
+		"%s dbitrate: %u, dsample-point: %0.3f\n",
+		name, dbt->bitrate,
+		(float)((float)dbt->sample_point / 1000));
+}
+
+static void do_show_data_bitrate(const char *name)
+{
+	struct can_link link;
+
+	do_get_link(name, &link);
+	if (link.valid & CAN_LINK_DATA_BITTIMING)
+		print_data_bitrate(name, &link.dbt);
+}
+
 static void do_show_bitrate(const char *name)
 {
 	struct can_bittiming bt;
@@ -112,16 +258,17 @@ static void do_show_bitrate(const char *name)
 		fprintf(stderr, "%s: failed to get bitrate\n", name);
 		exit(EXIT_FAILURE);
 	} else
-		fprintf(stdout,
-			"%s bitrate: %u, sample-point: %0.3f\n",
-			name, bt.bitrate,
-			(float)((float)bt.sample_point / 1000));
+		print_bitrate(name, &bt);
 }
 
 static void do_set_bitrate(int argc, char *argv[], const char *name)
 {
+	struct can_link_config cfg;
+	struct can_link link;
 	__u32 bitrate = 0;
 	__u32 sample_point = 0;
+	__u32 dbitrate = 0;
+	__u32 dsample_point = 0;
 	int err;
 
 	while (argc > 0) {
@@ -131,10 +278,46 @@ static void do_set_bitrate(int argc, char *argv[], const char *name)
 		} else if (!strcmp(*argv, "sample-point")) {
 			NEXT_ARG();
 			sample_point = (__u32)(strtod(*argv, NULL) * 1000);
+		} else if (!strcmp(*argv, "dbitrate")) {
+			NEXT_ARG();
+			dbitrate =  (__u32)strtoul(*argv, NULL, 0);
+		} else if (!strcmp(*argv, "dsample-point")) {
+			NEXT_ARG();
+			dsample_point = (__u32)(strtod(*argv, NULL) * 1000);
 		}
 		argc--, argv++;
 	}
 
+	/* both phases and FD mode are set with a single request */
+	if (dbitrate) {
+		memset(&cfg, 0, sizeof(cfg));
+		if (bitrate) {
+			cfg.set |= CAN_LINK_BITTIMING;
+			cfg.bt.bitrate = bitrate;
+			cfg.bt.sample_point = sample_point;
+		}
+		cfg.set |= CAN_LINK_DATA_BITTIMING;
+		cfg.dbt.bitrate = dbitrate;
+		cfg.dbt.sample_point = dsample_point;
+
+		/* without a bitrate, the nominal phase stays as it is */
+		do_get_link(name, &link);
+		if (!bitrate && !(link.valid & CAN_LINK_BITTIMING &&
+				  link.bt.bitrate)) {
+			fprintf(stderr, "%s: no bitrate set, give one along "
+				"with the data bitrate\n", name);
+			exit(EXIT_FAILURE);
+		}
+		set_fd_config(&cfg, &link);
+
+		if (do_set_link(name, &cfg) < 0) {
+			fprintf(stderr, "failed to set data bitrate of %s to %u: %s\n",
+				name, dbitrate, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
 	if (sample_point)
 		err = can_set_bitrate_samplepoint(name, bitrate, sample_point);
 	else
@@ -160,9 +343,11 @@ static void cmd_bitrate(int argc, char *argv[], const char *name)
 		do_set_bitrate(argc, argv, name);
 
 	do_show_bitrate(name);
+	do_show_data_bitrate(name);
 }
 
-static void do_set_bittiming(int argc, char *argv[], const char *name)
+static void parse_bittiming(int argc, char *argv[], const char *name,
+			    struct can_bittiming *bt_out)
 {
 	struct can_bittiming bt;
 	int bt_par_count = 0;
@@ -211,12 +396,30 @@ static void do_set_bittiming(int argc, char *argv[], const char *name)
 				name);
 		exit(1);
 	}
+
+	*bt_out = bt;
+}
+
+static void do_set_bittiming(int argc, char *argv[], const char *name)
+{
+	struct can_bittiming bt;
+
+	parse_bittiming(argc, argv, name, &bt);
 	if (can_set_bittiming(name, &bt) < 0) {
 		fprintf(stderr, "%s: unable to set bittiming\n", name);
 		exit(EXIT_FAILURE);
 	}
 }
 
+static void print_bittiming(const char *name, const struct can_bittiming *bt)
+{
+	fprintf(stdout, "%s bittiming:\n\t"
+		"tq: %u, prop-seq: %u phase-seq1: %u phase-seq2: %u "
+		"sjw: %u, brp: %u\n",
+		name, bt->tq, bt->prop_seg, bt->phase_seg1, bt->phase_seg2,
+		bt->sjw, bt->brp);
+}
+
 static void do_show_bittiming(const char *name)
 {
 	struct can_bittiming bt;
@@ -225,11 +428,7 @@ static void do_show_bittiming(const char *name)
 		fprintf(stderr, "%s: failed to get bittiming\n", name);
 		exit(EXIT_FAILURE);
 	} else
-		fprintf(stdout, "%s bittiming:\n\t"
-			"tq: %u, prop-seq: %u phase-seq1: %u phase-seq2: %u "
-			"sjw: %u, brp: %u\n",
-			name, bt.tq, bt.prop_seg, bt.phase_seg1, bt.phase_seg2,
-			bt.sjw, bt.brp);
+		print_bittiming(name, &bt);
 }
 
 static void cmd_bittiming(int argc, char *argv[], const char *name)
@@ -248,6 +447,68 @@ static void cmd_bittiming(int argc, char *argv[], const char *name)
 	do_show_bitrate(name);
 }
 
+static void print_data_bittiming(const char *name,
+				 const struct can_bittiming *dbt)
+{
+	fprintf(stdout, "%s data bittiming:\n\t"
+		"tq: %u, prop-seq: %u phase-seq1: %u phase-seq2: %u "
+		"sjw: %u, brp: %u\n",
+		name, dbt->tq, dbt->prop_seg, dbt->phase_seg1, dbt->phase_seg2,
+		dbt->sjw, dbt->brp);
+}
+
+static void cmd_data_bittiming(int argc, char *argv[], const char *name)
+{
+	struct can_link_config cfg;
+	struct can_link link;
+	int show_only = 1;
+
+	if (argc > 0)
+		show_only = find_str(config_keywords,
+				sizeof(config_keywords) / sizeof(char*),
+				argv[1]);
+
+	if (! show_only) {
+		memset(&cfg, 0, sizeof(cfg));
+		parse_bittiming(argc, argv, name, &cfg.dbt);
+		cfg.set = CAN_LINK_DATA_BITTIMING;
+
+		do_get_link(name, &link);
+		if (!(link.valid & CAN_LINK_BITTIMING && link.bt.bitrate)) {
+			fprintf(stderr, "%s: no bitrate set, set the nominal "
+				"bit timing first\n", name);
+			exit(EXIT_FAILURE);
+		}
+		set_fd_config(&cfg, &link);
+
+		if (do_set_link(name, &cfg) < 0) {
+			fprintf(stderr, "%s: unable to set data bittiming: %s\n",
+				name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	do_get_link(name, &link);
+	if (!(link.valid & CAN_LINK_DATA_BITTIMING)) {
+		fprintf(stderr, "%s: failed to get data bittiming\n", name);
+		exit(EXIT_FAILURE);
+	}
+	print_data_bittiming(name, &link.dbt);
+	print_data_bitrate(name, &link.dbt);
+}
+
+static void print_bittiming_const(const char *name,
+				  const struct can_bittiming_const *btc)
+{
+	fprintf(stdout, "%s bittiming-constants: name %s,\n\t"
+		"tseg1-min: %u, tseg1-max: %u, "
+		"tseg2-min: %u, tseg2-max: %u,\n\t"
+		"sjw-max %u, brp-min: %u, brp-max: %u, brp-inc: %u,\n",
+		name, btc->name, btc->tseg1_min, btc->tseg1_max,
+		btc->tseg2_min, btc->tseg2_max, btc->sjw_max,
+		btc->brp_min, btc->brp_max, btc->brp_inc);
+}
+
 static void do_show_bittiming_const(const char *name)
 {
 	struct can_bittiming_const btc;
@@ -256,13 +517,7 @@ static void do_show_bittiming_const(const char *name)
 		fprintf(stderr, "%s: failed to get bittiming_const\n", name);
 		exit(EXIT_FAILURE);
 	} else
-		fprintf(stdout, "%s bittiming-constants: name %s,\n\t"
-			"tseg1-min: %u, tseg1-max: %u, "
-			"tseg2-min: %u, tseg2-max: %u,\n\t"
-			"sjw-max %u, brp-min: %u, brp-max: %u, brp-inc: %u,\n",
-			name, btc.name, btc.tseg1_min, btc.tseg1_max,
-			btc.tseg2_min, btc.tseg2_max, btc.sjw_max,
-			btc.brp_min, btc.brp_max, btc.brp_inc);
+		print_bittiming_const(name, &btc);
 }
 
 static void cmd_bittiming_const(int argc, char *argv[], const char *name)
@@ -270,26 +525,61 @@ static void cmd_bittiming_const(int argc, char *argv[], const char *name)
 	do_show_bittiming_const(name);
 }
 
-static void do_show_state(const char *name)
+static void print_data_bittiming_const(const char *name,
+				       const struct can_bittiming_const *dbtc)
 {
-	int state;
+	fprintf(stdout, "%s data bittiming-constants: name %s,\n\t"
+		"tseg1-min: %u, tseg1-max: %u, "
+		"tseg2-min: %u, tseg2-max: %u,\n\t"
+		"sjw-max %u, brp-min: %u, brp-max: %u, brp-inc: %u,\n",
+		name, dbtc->name, dbtc->tseg1_min, dbtc->tseg1_max,
+		dbtc->tseg2_min, dbtc->tseg2_max, dbtc->sjw_max,
+		dbtc->brp_min, dbtc->brp_max, dbtc->brp_inc);
+}
 
-	if (can_get_state(name, &state) < 0) {
-		fprintf(stderr, "%s: failed to get state \n", name);
+static void cmd_data_bittiming_const(int argc, char *argv[], const char *name)
+{
+	struct can_link link;
+
+	do_get_link(name, &link);
+	if (!(link.valid & CAN_LINK_DATA_BITTIMING_CONST)) {
+		fprintf(stderr, "%s: failed to get data bittiming_const\n",
+			name);
 		exit(EXIT_FAILURE);
 	}
+	print_data_bittiming_const(name, &link.dbtc);
+}
 
+static void print_state(const char *name, int state)
+{
 	if (state >= 0 && state < CAN_STATE_MAX)
 		fprintf(stdout, "%s state: %s\n", name, can_states[state]);
 	else
 		fprintf(stderr, "%s: unknown state\n", name);
 }
 
+static void do_show_state(const char *name)
+{
+	int state;
+
+	if (can_get_state(name, &state) < 0) {
+		fprintf(stderr, "%s: failed to get state \n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	print_state(name, state);
+}
+
 static void cmd_state(int argc, char *argv[], const char *name)
 {
 	do_show_state(name);
 }
 
+static void print_clockfreq(const char *name, const struct can_clock *clock)
+{
+	fprintf(stdout, "%s clock freq: %u\n", name, clock->freq);
+}
+
 static void do_show_clockfreq(const char *name)
 {
 	struct can_clock clock;
@@ -301,7 +591,7 @@ static void do_show_clockfreq(const char *name)
 		exit(EXIT_FAILURE);
 	}
 
-	fprintf(stdout, "%s clock freq: %u\n", name, clock.freq);
+	print_clockfreq(name, &clock);
 }
 
 static void cmd_clockfreq(int argc, char *argv[], const char *name)
@@ -357,12 +647,16 @@ static void cmd_stop(int argc, char *argv[], const char *name)
 static inline void print_ctrlmode(__u32 cm_flags)
 {
 	fprintf(stdout,
-		"loopback[%s], listen-only[%s], tripple-sampling[%s], one-shot[%s], berr-reporting[%s]\n",
+		"loopback[%s], listen-only[%s], tripple-sampling[%s], one-shot[%s], berr-reporting[%s], "
+		"fd[%s], fd-non-iso[%s], presume-ack[%s]\n",
 		(cm_flags & CAN_CTRLMODE_LOOPBACK) ? "ON" : "OFF",
 		(cm_flags & CAN_CTRLMODE_LISTENONLY) ? "ON" : "OFF",
 		(cm_flags & CAN_CTRLMODE_3_SAMPLES) ? "ON" : "OFF",
 		(cm_flags & CAN_CTRLMODE_ONE_SHOT) ? "ON" : "OFF",
-		(cm_flags & CAN_CTRLMODE_BERR_REPORTING) ? "ON" : "OFF");
+		(cm_flags & CAN_CTRLMODE_BERR_REPORTING) ? "ON" : "OFF",
+		(cm_flags & CAN_CTRLMODE_FD) ? "ON" : "OFF",
+		(cm_flags & CAN_CTRLMODE_FD_NON_ISO) ? "ON" : "OFF",
+		(cm_flags & CAN_CTRLMODE_PRESUME_ACK) ? "ON" : "OFF");
 }
 
 static void do_show_ctrlmode(const char *name)
@@ -379,7 +673,7 @@ static void do_show_ctrlmode(const char *name)
 }
 
 /* this is shamelessly stolen from iproute and slightly modified */
-static inline void set_ctrlmode(char* name, char *arg,
+static inline void set_ctrlmode(const char *name, const char *arg,
 			 struct can_ctrlmode *cm, __u32 flags)
 {
 	if (strcmp(arg, "on") == 0) {
@@ -393,38 +687,76 @@ static inline void set_ctrlmode(char* name, char *arg,
 	cm->mask |= flags;
 }
 
+static const struct {
+	const char *name;
+	__u32 flag;
+} ctrlmodes[] = {
+	{ "loopback",		CAN_CTRLMODE_LOOPBACK },
+	{ "listen-only",	CAN_CTRLMODE_LISTENONLY },
+	{ "triple-sampling",	CAN_CTRLMODE_3_SAMPLES },
+	{ "one-shot",		CAN_CTRLMODE_ONE_SHOT },
+	{ "berr-reporting",	CAN_CTRLMODE_BERR_REPORTING },
+	{ "fd",			CAN_CTRLMODE_FD },
+	{ "fd-non-iso",		CAN_CTRLMODE_FD_NON_ISO },
+	{ "presume-ack",	CAN_CTRLMODE_PRESUME_ACK },
+};
+
+/* returns 0 if "name" is no ctrlmode */
+static __u32 find_ctrlmode(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(ctrlmodes) / sizeof(ctrlmodes[0]); i++)
+		if (!strcmp(name, ctrlmodes[i].name))
+			return ctrlmodes[i].flag;
+
+	return 0;
+}
+
 static void do_set_ctrlmode(int argc, char* argv[], const char *name)
 {
+	struct can_link_config cfg;
+	struct can_link link;
 	struct can_ctrlmode cm;
+	const char *mode;
+	__u32 flag;
 
 	memset(&cm, 0, sizeof(cm));
 
 	while (argc > 0) {
-		if (!strcmp(*argv, "loopback")) {
-			NEXT_ARG();
-			set_ctrlmode("loopback", *argv, &cm,
-				     CAN_CTRLMODE_LOOPBACK);
-		} else if (!strcmp(*argv, "listen-only")) {
-			NEXT_ARG();
-			set_ctrlmode("listen-only", *argv, &cm,
-				     CAN_CTRLMODE_LISTENONLY);
-		} else if (!strcmp(*argv, "triple-sampling")) {
-			NEXT_ARG();
-			set_ctrlmode("triple-sampling", *argv, &cm,
-				     CAN_CTRLMODE_3_SAMPLES);
-		} else if (!strcmp(*argv, "one-shot")) {
-			NEXT_ARG();
-			set_ctrlmode("one-shot", *argv, &cm,
-				     CAN_CTRLMODE_ONE_SHOT);
-		} else if (!strcmp(*argv, "berr-reporting")) {
+		flag = find_ctrlmode(*argv);
+		if (flag) {
+			mode = *argv;
 			NEXT_ARG();
-			set_ctrlmode("berr-reporting", *argv, &cm,
-				     CAN_CTRLMODE_BERR_REPORTING);
+			set_ctrlmode(mode, *argv, &cm, flag);
 		}
 
 		argc--, argv++;
 	}
 
+	/* FD goes along with both bit timings, see set_fd_config() */
+	if (cm.flags & CAN_CTRLMODE_FD) {
+		do_get_link(name, &link);
+		if (!(link.valid & CAN_LINK_BITTIMING && link.bt.bitrate) ||
+		    !(link.valid & CAN_LINK_DATA_BITTIMING && link.dbt.bitrate)) {
+			fprintf(stderr, "%s: ctrlmode fd needs both bit timings, "
+				"set them with \"bitrate ... dbitrate ...\"\n",
+				name);
+			exit(EXIT_FAILURE);
+		}
+
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.set = CAN_LINK_CTRLMODE;
+		cfg.ctrlmode = cm;
+		set_fd_config(&cfg, &link);
+		if (do_set_link(name, &cfg) < 0) {
+			fprintf(stderr, "%s: failed to set ctrlmode: %s\n",
+				name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
 	if (can_set_ctrlmode(name, &cm) < 0) {
 		fprintf(stderr, "%s: failed to set ctrlmode\n", name);
 		exit(EXIT_FAILURE);
@@ -446,6 +778,12 @@ static void cmd_ctrlmode(int argc, char *argv[], const char *name)
 	do_show_ctrlmode(name);
 }
 
+static void print_restart_ms(const char *name, __u32 restart_ms)
+{
+	fprintf(stdout,
+		"%s restart-ms: %u\n", name, restart_ms);
+}
+
 static void do_show_restart_ms(const char *name)
 {
 	__u32 restart_ms;
@@ -454,8 +792,7 @@ static void do_show_restart_ms(const char *name)
 		fprintf(stderr, "%s: failed to get restart_ms\n", name);
 		exit(EXIT_FAILURE);
 	} else
-		fprintf(stdout,
-			"%s restart-ms: %u\n", name, restart_ms);
+		print_restart_ms(name, restart_ms);
 }
 
 static void do_set_restart_ms(int argc, char* argv[], const char *name)
@@ -483,6 +820,13 @@ static void cmd_restart_ms(int argc, char *argv[], const char *name)
 	do_show_restart_ms(name);
 }
 
+static void print_berr_counter(const char *name,
+			       const struct can_berr_counter *bc)
+{
+	fprintf(stdout, "%s txerr: %u rxerr: %u\n",
+		name, bc->txerr, bc->rxerr);
+}
+
 static void do_show_berr_counter(const char *name)
 {
 	struct can_berr_counter bc;
@@ -495,8 +839,7 @@ static void do_show_berr_counter(const char *name)
 		exit(EXIT_FAILURE);
 	}
 
-	fprintf(stdout, "%s txerr: %u rxerr: %u\n",
-		name, bc.txerr, bc.rxerr);
+	print_berr_counter(name, &bc);
 }
 
 static void cmd_berr_counter(int argc, char *argv[], const char *name)
@@ -512,20 +855,893 @@ static void cmd_baudrate(int argc, char *argv[], const char *name)
 	exit(EXIT_FAILURE);
 }
 
+static int show_link(const struct can_link *link, void *priv)
+{
+	const char *name = link->name;
+
+	if (!(link->valid & ~CAN_LINK_STATS64)) {
+		fprintf(stdout, "%s: no CAN device attributes (%s)\n",
+			name, link->kind[0] ? link->kind : "unknown");
+		return 0;
+	}
+
+	if (link->valid & CAN_LINK_BITTIMING) {
+		print_bitrate(name, &link->bt);
+		print_bittiming(name, &link->bt);
+	}
+	if (link->valid & CAN_LINK_DATA_BITTIMING) {
+		print_data_bitrate(name, &link->dbt);
+		print_data_bittiming(name, &link->dbt);
+	}
+	if (link->valid & CAN_LINK_STATE)
+		print_state(name, link->state);
+	if (link->valid & CAN_LINK_RESTART_MS)
+		print_restart_ms(name, link->restart_ms);
+	if (link->valid & CAN_LINK_CTRLMODE) {
+		fprintf(stdout, "%s ctrlmode: ", name);
+		print_ctrlmode(link->ctrlmode.flags);
+	}
+	if (link->valid & CAN_LINK_CLOCK)
+		print_clockfreq(name, &link->clock);
+	if (link->valid & CAN_LINK_BITTIMING_CONST)
+		print_bittiming_const(name, &link->btc);
+	if (link->valid & CAN_LINK_DATA_BITTIMING_CONST)
+		print_data_bittiming_const(name, &link->dbtc);
+	if (link->valid & CAN_LINK_BERR_COUNTER)
+		print_berr_counter(name, &link->berr);
+
+	return 0;
+}
+
+/*
+ * Get all attributes with a single RTM_GETLINK request instead of
+ * one libsocketcan call (and netlink request) per attribute.
+ */
 static void cmd_show_interface(const char *name)
 {
-	do_show_bitrate(name);
+	if (can_link_dump(name, show_link, NULL) < 0) {
+		fprintf(stderr, "%s: failed to get interface attributes: %s\n",
+			name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* without arguments all CAN interfaces are shown with a single dump */
+static void cmd_show(int argc, char *argv[])
+{
+	int i;
+
+	if (argc == 0) {
+		if (can_link_dump(NULL, show_link, NULL) < 0) {
+			fprintf(stderr, "failed to dump CAN interfaces: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (can_link_dump(argv[i], show_link, NULL) < 0) {
+			fprintf(stderr, "%s: failed to get interface attributes: %s\n",
+				argv[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct solve {
+	__u32 bitrate;
+	__u32 sample_point;
+	__u32 sjw;
+	__u32 clock;
+	int top;
+	int apply;
+	const char *controller;
+};
+
+static void parse_solve(int argc, char *argv[], struct solve *sv)
+{
+	memset(sv, 0, sizeof(*sv));
+	sv->top = SOLVE_TOP_DEFAULT;
+
+	while (argc > 0) {
+		if (!strcmp(*argv, "bitrate")) {
+			NEXT_ARG();
+			sv->bitrate = (__u32)strtoul(*argv, NULL, 0);
+		} else if (!strcmp(*argv, "sample-point")) {
+			NEXT_ARG();
+			sv->sample_point = (__u32)(strtod(*argv, NULL) * 1000);
+		} else if (!strcmp(*argv, "sjw")) {
+			NEXT_ARG();
+			sv->sjw = (__u32)strtoul(*argv, NULL, 0);
+		} else if (!strcmp(*argv, "clock")) {
+			NEXT_ARG();
+			sv->clock = (__u32)strtoul(*argv, NULL, 0);
+		} else if (!strcmp(*argv, "controller")) {
+			NEXT_ARG();
+			sv->controller = *argv;
+		} else if (!strcmp(*argv, "top")) {
+			NEXT_ARG();
+			sv->top = strtoul(*argv, NULL, 0);
+			if (sv->top < 1 || sv->top > SOLVE_TOP_MAX) {
+				fprintf(stderr, "top must be within 1...%d\n",
+					SOLVE_TOP_MAX);
+				exit(EXIT_FAILURE);
+			}
+		} else if (!strcmp(*argv, "apply")) {
+			sv->apply = 1;
+		}
+		argc--, argv++;
+	}
+
+	if (!sv->bitrate) {
+		fprintf(stderr, "solve: missing bitrate\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!sv->sample_point)
+		sv->sample_point = bt_default_sample_point(sv->bitrate);
+}
+
+static void do_solve(const char *name, const struct can_bittiming_const *btc,
+		     __u32 clock, const struct solve *sv)
+{
+	struct bt_candidate best[SOLVE_TOP_MAX];
+	struct can_bittiming bt;
+	int i, count;
+
+	count = bt_solve(btc, clock, sv->bitrate, sv->sample_point, sv->sjw,
+			 best, sv->top);
+	if (!count) {
+		fprintf(stderr, "%s: no valid bittiming for %u bps\n",
+			name, sv->bitrate);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout, "%s bittiming candidates for bitrate: %u, "
+		"sample-point: %0.3f (%s, clock %u):\n\t"
+		" brp     tq prop-seg phase-seg1 phase-seg2 sjw  bitrate   error sample-point\n",
+		name, sv->bitrate, (float)sv->sample_point / 1000,
+		btc->name, clock);
+
+	for (i = 0; i < count; i++)
+		fprintf(stdout, "\t%4u %6u %8u %10u %10u %3u %8u %6.2f%% %12.3f\n",
+			best[i].bt.brp, best[i].bt.tq, best[i].bt.prop_seg,
+			best[i].bt.phase_seg1, best[i].bt.phase_seg2,
+			best[i].bt.sjw, best[i].bt.bitrate,
+			100.0 * best[i].bitrate_error / sv->bitrate,
+			(float)best[i].bt.sample_point / 1000);
+
+	if (!sv->apply)
+		return;
+
+	/* like do_set_bittiming(), the kernel calculates brp from tq */
+	memset(&bt, 0, sizeof(bt));
+	bt.tq = best[0].bt.tq;
+	bt.prop_seg = best[0].bt.prop_seg;
+	bt.phase_seg1 = best[0].bt.phase_seg1;
+	bt.phase_seg2 = best[0].bt.phase_seg2;
+	bt.sjw = best[0].bt.sjw;
+
+	if (can_set_bittiming(name, &bt) < 0) {
+		fprintf(stderr, "%s: unable to set bittiming\n", name);
+		exit(EXIT_FAILURE);
+	}
+
 	do_show_bittiming(name);
-	do_show_state(name);
-	do_show_restart_ms(name);
-	do_show_ctrlmode(name);
-	do_show_clockfreq(name);
-	do_show_bittiming_const(name);
-	do_show_berr_counter(name);
+	do_show_bitrate(name);
+}
+
+static void cmd_solve(int argc, char *argv[], const char *name)
+{
+	struct can_link link;
+	struct solve sv;
+
+	parse_solve(argc, argv, &sv);
+
+	do_get_link(name, &link);
+
+	if (!(link.valid & CAN_LINK_BITTIMING_CONST) ||
+	    !(link.valid & CAN_LINK_CLOCK)) {
+		fprintf(stderr, "%s: no bittiming constants, "
+			"use \"canconfig solve controller\" instead\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	do_solve(name, &link.btc, sv.clock ? sv.clock : link.clock.freq, &sv);
+
+	exit(EXIT_SUCCESS);
+}
+
+/* without an interface, the constants come from the preset table */
+static void cmd_solve_offline(int argc, char *argv[])
+{
+	const struct bt_preset *p;
+	struct solve sv;
+
+	parse_solve(argc, argv, &sv);
+
+	if (sv.apply) {
+		fprintf(stderr, "solve: apply needs an interface\n");
+		exit(EXIT_FAILURE);
+	}
+
+	p = sv.controller ? bt_preset_find(sv.controller) : NULL;
+	if (!p) {
+		fprintf(stderr, "solve: unknown controller, known are:");
+		for (p = bt_presets; p->name; p++)
+			fprintf(stderr, " %s", p->name);
+		fprintf(stderr, "\n");
+		exit(EXIT_FAILURE);
+	}
+
+	do_solve(p->name, &p->btc, sv.clock ? sv.clock : p->clock, &sv);
+
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * The last seen state of the interfaces given on the command line, or
+ * of all CAN interfaces if none is given.
+ */
+struct link_table {
+	int argc;
+	char **argv;
+	struct can_link *links;
+	int count;
+};
+
+static int link_table_match(const struct link_table *t, const char *name)
+{
+	return !t->argc || find_str((const char **)t->argv, t->argc, name);
+}
+
+/* returns the entry of "link", a new one is initialized with "link" */
+static struct can_link *link_table_get(struct link_table *t,
+				       const struct can_link *link, int *new)
+{
+	int i;
+
+	for (i = 0; i < t->count; i++)
+		if (t->links[i].ifindex == link->ifindex) {
+			*new = 0;
+			return &t->links[i];
+		}
+
+	t->links = realloc(t->links, (t->count + 1) * sizeof(*t->links));
+	if (!t->links) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	t->links[t->count] = *link;
+	*new = 1;
+
+	return &t->links[t->count++];
+}
+
+static const char *state_name(__u32 state)
+{
+	return state < CAN_STATE_MAX ? can_states[state] : "UNKNOWN";
+}
+
+static void print_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(stdout, "[%ld.%06ld] ", (long)ts.tv_sec, ts.tv_nsec / 1000);
+}
+
+static void print_xstats_delta(const char *name, const char *what,
+			       __u32 old, __u32 new)
+{
+	if (old == new)
+		return;
+
+	print_timestamp();
+	fprintf(stdout, "%s %s: %u (+%u)\n", name, what, new, new - old);
+}
+
+/*
+ * Print what changed since the last notification. The xstats counters
+ * also reveal transitions that were too short to be seen in the state.
+ */
+static int monitor_link(const struct can_link *link, void *priv)
+{
+	struct link_table *t = priv;
+	struct can_link *old;
+	const char *name = link->name;
+	int new;
+
+	if (!link_table_match(t, name))
+		return 0;
+
+	old = link_table_get(t, link, &new);
+	if (new) {
+		print_timestamp();
+		fprintf(stdout, "%s %s, state: %s, txerr: %u rxerr: %u\n",
+			name, link->flags & IFF_UP ? "up" : "down",
+			link->valid & CAN_LINK_STATE ?
+			state_name(link->state) : "n/a",
+			link->berr.txerr, link->berr.rxerr);
+		fflush(stdout);
+
+		return 0;
+	}
+
+	if ((old->flags ^ link->flags) & IFF_UP) {
+		print_timestamp();
+		fprintf(stdout, "%s %s\n", name,
+			link->flags & IFF_UP ? "up" : "down");
+	}
+
+	if ((old->flags ^ link->flags) & IFF_RUNNING) {
+		print_timestamp();
+		fprintf(stdout, "%s carrier %s\n", name,
+			link->flags & IFF_RUNNING ? "on" : "off");
+	}
+
+	if (old->state != link->state) {
+		print_timestamp();
+		fprintf(stdout, "%s state: %s -> %s\n", name,
+			state_name(old->state), state_name(link->state));
+	}
+
+	if (old->berr.txerr != link->berr.txerr ||
+	    old->berr.rxerr != link->berr.rxerr) {
+		print_timestamp();
+		fprintf(stdout, "%s txerr: %u -> %u rxerr: %u -> %u\n", name,
+			old->berr.txerr, link->berr.txerr,
+			old->berr.rxerr, link->berr.rxerr);
+	}
+
+	print_xstats_delta(name, "error-warning",
+			   old->xstats.error_warning, link->xstats.error_warning);
+	print_xstats_delta(name, "error-passive",
+			   old->xstats.error_passive, link->xstats.error_passive);
+	print_xstats_delta(name, "bus-off",
+			   old->xstats.bus_off, link->xstats.bus_off);
+	print_xstats_delta(name, "restarts",
+			   old->xstats.restarts, link->xstats.restarts);
+
+	*old = *link;
+	fflush(stdout);
+
+	return 0;
+}
+
+static void cmd_monitor(int argc, char *argv[])
+{
+	struct link_table t = {
+		.argc = argc,
+		.argv = argv,
+	};
+
+	if (can_link_monitor(monitor_link, &t) < 0) {
+		fprintf(stderr, "failed to monitor CAN interfaces: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
 	exit(EXIT_SUCCESS);
 }
 
+struct stats {
+	struct link_table t;
+	double elapsed;		/* since the last dump, in seconds */
+};
+
+static void print_stats(const struct can_link *link)
+{
+	const struct rtnl_link_stats64 *st = &link->stats64;
+	const struct can_device_stats *xs = &link->xstats;
+	const char *name = link->name;
+
+	fprintf(stdout, "%s rx: packets %llu bytes %llu errors %llu "
+		"dropped %llu overrun %llu\n", name,
+		(unsigned long long)st->rx_packets,
+		(unsigned long long)st->rx_bytes,
+		(unsigned long long)st->rx_errors,
+		(unsigned long long)st->rx_dropped,
+		(unsigned long long)st->rx_over_errors);
+	fprintf(stdout, "%s tx: packets %llu bytes %llu errors %llu "
+		"dropped %llu\n", name,
+		(unsigned long long)st->tx_packets,
+		(unsigned long long)st->tx_bytes,
+		(unsigned long long)st->tx_errors,
+		(unsigned long long)st->tx_dropped);
+
+	if (link->valid & CAN_LINK_XSTATS)
+		fprintf(stdout, "%s bus-error: %u error-warning: %u "
+			"error-passive: %u bus-off: %u arbitration-lost: %u "
+			"restarts: %u\n", name, xs->bus_error,
+			xs->error_warning, xs->error_passive, xs->bus_off,
+			xs->arbitration_lost, xs->restarts);
+}
+
+static void print_stats_delta(const struct can_link *old,
+			      const struct can_link *link, double elapsed)
+{
+	const struct rtnl_link_stats64 *o = &old->stats64, *n = &link->stats64;
+	const struct can_device_stats *ox = &old->xstats, *nx = &link->xstats;
+
+	print_timestamp();
+	fprintf(stdout, "%s rx: %.0f frames/s %.0f bytes/s +%llu errors "
+		"+%llu dropped, tx: %.0f frames/s %.0f bytes/s +%llu errors "
+		"+%llu dropped", link->name,
+		(n->rx_packets - o->rx_packets) / elapsed,
+		(n->rx_bytes - o->rx_bytes) / elapsed,
+		(unsigned long long)(n->rx_errors - o->rx_errors),
+		(unsigned long long)(n->rx_dropped - o->rx_dropped),
+		(n->tx_packets - o->tx_packets) / elapsed,
+		(n->tx_bytes - o->tx_bytes) / elapsed,
+		(unsigned long long)(n->tx_errors - o->tx_errors),
+		(unsigned long long)(n->tx_dropped - o->tx_dropped));
+
+	if (link->valid & CAN_LINK_XSTATS)
+		fprintf(stdout, ", bus-error: +%u error-warning: +%u "
+			"error-passive: +%u bus-off: +%u arbitration-lost: +%u "
+			"restarts: +%u",
+			nx->bus_error - ox->bus_error,
+			nx->error_warning - ox->error_warning,
+			nx->error_passive - ox->error_passive,
+			nx->bus_off - ox->bus_off,
+			nx->arbitration_lost - ox->arbitration_lost,
+			nx->restarts - ox->restarts);
+
+	fprintf(stdout, "\n");
+}
+
+static int stats_link(const struct can_link *link, void *priv)
+{
+	struct stats *sc = priv;
+	struct can_link *old;
+	int new;
+
+	if (!link_table_match(&sc->t, link->name))
+		return 0;
+
+	old = link_table_get(&sc->t, link, &new);
+	if (new)
+		print_stats(link);
+	else
+		print_stats_delta(old, link, sc->elapsed);
+
+	*old = *link;
+
+	return 0;
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+ * All interfaces are read with a single dump per interval, the first one
+ * prints the totals, the following ones rates and deltas.
+ */
+static void cmd_stats(int argc, char *argv[])
+{
+	struct stats sc;
+	struct timespec next, now, last;
+	unsigned long interval = 0;
+	char **devs = argv;
+	int i, ndevs = 0;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--interval") || !strcmp(argv[i], "interval")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing parameter for %s\n",
+					argv[i - 1]);
+				exit(EXIT_FAILURE);
+			}
+			interval = strtoul(argv[i], NULL, 0);
+		} else if (!strncmp(argv[i], "--interval=", 11)) {
+			interval = strtoul(argv[i] + 11, NULL, 0);
+		} else {
+			devs[ndevs++] = argv[i];
+		}
+	}
+
+	memset(&sc, 0, sizeof(sc));
+	sc.t.argc = ndevs;
+	sc.t.argv = devs;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	last = next;
+
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sc.elapsed = timespec_diff(&now, &last);
+		last = now;
+
+		if (can_link_dump(NULL, stats_link, &sc) < 0) {
+			fprintf(stderr, "failed to dump CAN interfaces: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fflush(stdout);
+
+		if (!interval)
+			break;
+
+		next.tv_sec += interval;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR)
+			;
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* desired state of an interface, as read from the file */
+struct apply {
+	char name[IFNAMSIZ];
+	int line;
+	unsigned int set;		/* CAN_LINK_* */
+	__u32 bitrate;
+	__u32 sample_point;
+	__u32 dbitrate;
+	__u32 dsample_point;
+	struct can_ctrlmode ctrlmode;
+	__u32 restart_ms;
+	int up;				/* -1: as is */
+};
+
+static int apply_parse_line(char *line, struct apply *a)
+{
+	char *tok, *save, *mode;
+	__u32 flag;
+
+	tok = strtok_r(line, " \t\n", &save);
+	if (!tok || tok[0] == '#')
+		return 0;
+
+	memset(a, 0, sizeof(*a));
+	strncpy(a->name, tok, sizeof(a->name) - 1);
+	a->up = -1;
+
+#define NEXT_TOK() \
+	do { \
+		tok = strtok_r(NULL, " \t\n", &save); \
+		if (!tok) \
+			return -1; \
+	} while (0)
+
+	while ((tok = strtok_r(NULL, " \t\n", &save))) {
+		if (tok[0] == '#')
+			break;
+
+		if (!strcmp(tok, "bitrate")) {
+			NEXT_TOK();
+			a->bitrate = (__u32)strtoul(tok, NULL, 0);
+			a->set |= CAN_LINK_BITTIMING;
+		} else if (!strcmp(tok, "sample-point")) {
+			NEXT_TOK();
+			a->sample_point = (__u32)(strtod(tok, NULL) * 1000);
+		} else if (!strcmp(tok, "dbitrate")) {
+			NEXT_TOK();
+			a->dbitrate = (__u32)strtoul(tok, NULL, 0);
+			a->set |= CAN_LINK_DATA_BITTIMING;
+		} else if (!strcmp(tok, "dsample-point")) {
+			NEXT_TOK();
+			a->dsample_point = (__u32)(strtod(tok, NULL) * 1000);
+		} else if (!strcmp(tok, "restart-ms")) {
+			NEXT_TOK();
+			a->restart_ms = (__u32)strtoul(tok, NULL, 0);
+			a->set |= CAN_LINK_RESTART_MS;
+		} else if (!strcmp(tok, "ctrlmode")) {
+			NEXT_TOK();
+			mode = tok;
+			flag = find_ctrlmode(mode);
+			if (!flag)
+				return -1;
+			NEXT_TOK();
+			set_ctrlmode(mode, tok, &a->ctrlmode, flag);
+			a->set |= CAN_LINK_CTRLMODE;
+		} else if (!strcmp(tok, "up")) {
+			a->up = 1;
+		} else if (!strcmp(tok, "down")) {
+			a->up = 0;
+		} else {
+			return -1;
+		}
+	}
+
+#undef NEXT_TOK
+
+	if (a->sample_point && !(a->set & CAN_LINK_BITTIMING))
+		return -1;
+	if (a->dsample_point && !(a->set & CAN_LINK_DATA_BITTIMING))
+		return -1;
+	if (a->set & CAN_LINK_DATA_BITTIMING &&
+	    a->ctrlmode.mask & ~a->ctrlmode.flags & CAN_CTRLMODE_FD)
+		return -1;
+
+	/* a data bitrate implies FD mode, unless explicitly given */
+	if (a->set & CAN_LINK_DATA_BITTIMING &&
+	    !(a->ctrlmode.mask & CAN_CTRLMODE_FD)) {
+		a->ctrlmode.mask |= CAN_CTRLMODE_FD;
+		a->ctrlmode.flags |= CAN_CTRLMODE_FD;
+		a->set |= CAN_LINK_CTRLMODE;
+	}
+
+	return 1;
+}
+
+/*
+ * The kernel calculates the bit timing for a bitrate and sample point,
+ * which the controller often can't hit exactly, e.g. 87.0% for 87.5%.
+ * The current timing counts as requested if it's no further off than
+ * the best one bt_solve() finds for the controller, give or take
+ * APPLY_SP_SLACK for the sample point, which the kernel may split into
+ * segments a bit differently. Without constants, the bitrate has to be
+ * exact.
+ */
+#define APPLY_SP_SLACK		10	/* in tenth of a percent */
+
+static __u32 abs_diff(__u32 a, __u32 b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int apply_bt_match(const struct can_bittiming *cur,
+			  const struct can_bittiming_const *btc, __u32 clock,
+			  __u32 bitrate, __u32 sample_point)
+{
+	struct bt_candidate best;
+	__u32 bitrate_error = 0, sp_error = APPLY_SP_SLACK;
+
+	if (btc && clock &&
+	    bt_solve(btc, clock, bitrate, sample_point ? sample_point :
+		     bt_default_sample_point(bitrate), 0, &best, 1) == 1) {
+		bitrate_error = best.bitrate_error;
+		sp_error += best.sample_point_error;
+	}
+
+	if (abs_diff(cur->bitrate, bitrate) > bitrate_error)
+		return 0;
+
+	return !sample_point ||
+		abs_diff(cur->sample_point, sample_point) <= sp_error;
+}
+
+/* fill in "cfg" with the minimal changes from "cur" to "a" */
+static void apply_diff(const struct apply *a, const struct can_link *cur,
+		       struct can_link_config *cfg)
+{
+	int is_up = !!(cur->flags & IFF_UP);
+	__u32 clock = cur->valid & CAN_LINK_CLOCK ? cur->clock.freq : 0;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->ifindex = cur->ifindex;
+	cfg->name = a->name;
+	cfg->up = -1;
+
+	if (a->set & CAN_LINK_BITTIMING &&
+	    !apply_bt_match(&cur->bt, cur->valid & CAN_LINK_BITTIMING_CONST ?
+			    &cur->btc : NULL, clock,
+			    a->bitrate, a->sample_point)) {
+		cfg->set |= CAN_LINK_BITTIMING;
+		cfg->bt.bitrate = a->bitrate;
+		cfg->bt.sample_point = a->sample_point;
+	}
+
+	if (a->set & CAN_LINK_DATA_BITTIMING &&
+	    !apply_bt_match(&cur->dbt, cur->valid & CAN_LINK_DATA_BITTIMING_CONST ?
+			    &cur->dbtc : NULL, clock,
+			    a->dbitrate, a->dsample_point)) {
+		cfg->set |= CAN_LINK_DATA_BITTIMING;
+		cfg->dbt.bitrate = a->dbitrate;
+		cfg->dbt.sample_point = a->dsample_point;
+	}
+
+	if (a->set & CAN_LINK_CTRLMODE &&
+	    (cur->ctrlmode.flags & a->ctrlmode.mask) != a->ctrlmode.flags) {
+		cfg->set |= CAN_LINK_CTRLMODE;
+		cfg->ctrlmode = a->ctrlmode;
+	}
+
+	/*
+	 * FD goes along with both timings. If it's on already, it's only sent
+	 * again for a new data phase.
+	 */
+	if (cfg->set & CAN_LINK_CTRLMODE &&
+	    !(cfg->set & CAN_LINK_DATA_BITTIMING) &&
+	    cur->ctrlmode.flags & cfg->ctrlmode.flags & CAN_CTRLMODE_FD) {
+		cfg->ctrlmode.mask &= ~CAN_CTRLMODE_FD;
+		cfg->ctrlmode.flags &= ~CAN_CTRLMODE_FD;
+		if (!cfg->ctrlmode.mask)
+			cfg->set &= ~CAN_LINK_CTRLMODE;
+	}
+	if (cfg->set & CAN_LINK_DATA_BITTIMING ||
+	    (cfg->set & CAN_LINK_CTRLMODE &&
+	     cfg->ctrlmode.flags & CAN_CTRLMODE_FD)) {
+		if (a->set & CAN_LINK_DATA_BITTIMING &&
+		    !(cfg->set & CAN_LINK_DATA_BITTIMING)) {
+			cfg->set |= CAN_LINK_DATA_BITTIMING;
+			cfg->dbt.bitrate = a->dbitrate;
+			cfg->dbt.sample_point = a->dsample_point;
+		}
+		set_fd_config(cfg, cur);
+	}
+
+	if (a->set & CAN_LINK_RESTART_MS && cur->restart_ms != a->restart_ms) {
+		cfg->set |= CAN_LINK_RESTART_MS;
+		cfg->restart_ms = a->restart_ms;
+	}
+
+	/* bit timing and ctrlmode can only be changed while down */
+	if (cfg->set & (CAN_LINK_BITTIMING | CAN_LINK_DATA_BITTIMING |
+			CAN_LINK_CTRLMODE) && is_up) {
+		cfg->down_first = 1;
+		cfg->up = a->up < 0 ? 1 : a->up;
+	} else if (a->up >= 0 && a->up != is_up) {
+		cfg->up = a->up;
+	}
+}
+
+static void print_apply(const struct can_link_config *cfg,
+			const struct can_link *cur)
+{
+	const char *sep = " ";
+
+	fprintf(stdout, "%s:", cfg->name);
+
+	if (!cfg->set && cfg->up < 0) {
+		fprintf(stdout, " unchanged\n");
+		return;
+	}
+
+	if (cfg->down_first) {
+		fprintf(stdout, "%sdown", sep);
+		sep = ", ";
+	}
+	if (cfg->set & CAN_LINK_BITTIMING &&
+	    !bittiming_kept(&cfg->bt, &cur->bt)) {
+		fprintf(stdout, "%sbitrate %u -> %u", sep, cur->bt.bitrate,
+			cfg->bt.bitrate);
+		sep = ", ";
+	}
+	if (cfg->set & CAN_LINK_DATA_BITTIMING &&
+	    !bittiming_kept(&cfg->dbt, &cur->dbt)) {
+		fprintf(stdout, "%sdbitrate %u -> %u", sep, cur->dbt.bitrate,
+			cfg->dbt.bitrate);
+		sep = ", ";
+	}
+	if (cfg->set & CAN_LINK_CTRLMODE) {
+		fprintf(stdout, "%sctrlmode 0x%x -> 0x%x", sep,
+			cur->ctrlmode.flags,
+			(cur->ctrlmode.flags & ~cfg->ctrlmode.mask) |
+			cfg->ctrlmode.flags);
+		sep = ", ";
+	}
+	if (cfg->set & CAN_LINK_RESTART_MS) {
+		fprintf(stdout, "%srestart-ms %u -> %u", sep, cur->restart_ms,
+			cfg->restart_ms);
+		sep = ", ";
+	}
+	if (cfg->up >= 0)
+		fprintf(stdout, "%s%s", sep, cfg->up ? "up" : "down");
+
+	fprintf(stdout, "\n");
+}
+
+static int apply_find_link(const struct can_link *link, void *priv)
+{
+	struct link_table *t = priv;
+	int new;
+
+	if (link_table_match(t, link->name))
+		link_table_get(t, link, &new);
+
+	return 0;
+}
+
+/*
+ * Read the desired state of all interfaces, get the current one with a
+ * single dump and apply only the differences with a single batch of
+ * netlink requests.
+ */
+static void cmd_apply(int argc, char *argv[])
+{
+	struct link_table t;
+	struct apply *apply = NULL;
+	struct can_link_config *cfg;
+	struct can_link *cur;
+	char line[APPLY_LINE_MAX];
+	char **names;
+	FILE *f;
+	int i, j, n = 0, lineno = 0, dry_run = 0, ret;
+
+	if (argc < 1)
+		help();
+	if (argc > 1 && !strcmp(argv[1], "dry-run"))
+		dry_run = 1;
+
+	f = strcmp(argv[0], "-") ? fopen(argv[0], "r") : stdin;
+	if (!f) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		apply = realloc(apply, (n + 1) * sizeof(*apply));
+		if (!apply) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		ret = apply_parse_line(line, &apply[n]);
+		if (ret < 0) {
+			fprintf(stderr, "%s:%d: syntax error\n", argv[0], lineno);
+			exit(EXIT_FAILURE);
+		}
+		if (ret) {
+			apply[n].line = lineno;
+			n++;
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+
+	names = calloc(n + 1, sizeof(*names));
+	cfg = calloc(n + 1, sizeof(*cfg));
+	if (!names || !cfg) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++)
+		names[i] = apply[i].name;
+
+	memset(&t, 0, sizeof(t));
+	t.argc = n;
+	t.argv = names;
+	if (n && can_link_dump(NULL, apply_find_link, &t) < 0) {
+		fprintf(stderr, "failed to dump CAN interfaces: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0, cur = NULL; j < t.count; j++)
+			if (!strcmp(t.links[j].name, apply[i].name))
+				cur = &t.links[j];
+
+		if (!cur) {
+			fprintf(stderr, "%s:%d: %s: no such CAN interface\n",
+				argv[0], apply[i].line, apply[i].name);
+			exit(EXIT_FAILURE);
+		}
+
+		apply_diff(&apply[i], cur, &cfg[i]);
+		print_apply(&cfg[i], cur);
+	}
+
+	if (dry_run)
+		exit(EXIT_SUCCESS);
+
+	ret = can_link_apply(cfg, n);
+	if (ret < 0) {
+		fprintf(stderr, "failed to apply configuration: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++)
+		if (cfg[i].err)
+			fprintf(stderr, "%s: failed to apply configuration: %s\n",
+				cfg[i].name, strerror(-cfg[i].err));
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 int main(int argc, char *argv[])
 {
 	const char* name = argv[1];
@@ -538,6 +1754,21 @@ int main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 
+	if (!strcmp(argv[1], "show"))
+		cmd_show(argc - 2, argv + 2);
+
+	if (!strcmp(argv[1], "monitor"))
+		cmd_monitor(argc - 2, argv + 2);
+
+	if (!strcmp(argv[1], "solve"))
+		cmd_solve_offline(argc - 2, argv + 2);
+
+	if (!strcmp(argv[1], "stats"))
+		cmd_stats(argc - 2, argv + 2);
+
+	if (!strcmp(argv[1], "apply"))
+		cmd_apply(argc - 2, argv + 2);
+
 	if (argc < 3)
 		cmd_show_interface(name);
 
@@ -548,6 +1779,8 @@ int main(int argc, char *argv[])
 			cmd_bitrate(argc, argv, name);
 		if (!strcmp(argv[0], "bittiming"))
 			cmd_bittiming(argc, argv, name);
+		if (!strcmp(argv[0], "dbittiming"))
+			cmd_data_bittiming(argc, argv, name);
 		if (!strcmp(argv[0], "ctrlmode"))
 			cmd_ctrlmode(argc, argv, name);
 		if (!strcmp(argv[0], "restart"))
@@ -564,8 +1797,12 @@ int main(int argc, char *argv[])
 			cmd_clockfreq(argc, argv, name);
 		if (!strcmp(argv[0], "bittiming-constants"))
 			cmd_bittiming_const(argc, argv, name);
+		if (!strcmp(argv[0], "data-bittiming-constants"))
+			cmd_data_bittiming_const(argc, argv, name);
 		if (!strcmp(argv[0], "berr-counter"))
 			cmd_berr_counter(argc, argv, name);
+		if (!strcmp(argv[0], "solve"))
+			cmd_solve(argc, argv, name);
 		argv++;
 	}
 
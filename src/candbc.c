@@ -0,0 +1,640 @@
+/*
+ * canutils/candbc.c - signal decoding with DBC files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* getline */
+#endif
+
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+/*
+ * Only what's needed to decode is read: messages (BO_), signals (SG_),
+ * including simple multiplexing, value descriptions (VAL_) and float
+ * signals (SIG_VALTYPE_), everything else is skipped.
+ *
+ * Every signal is compiled into an extractor when the file is loaded:
+ * a signal that fits into 64 bits loaded from its first byte is one
+ * unaligned load, a shift and a mask, in the byte order of the signal.
+ * Only signals spanning 9 bytes are extracted bit by bit. The messages
+ * are found by id in a hash table.
+ */
+enum {
+	EXTRACT_LE,		/* Intel */
+	EXTRACT_BE,		/* Motorola */
+	EXTRACT_BITS,
+};
+
+enum {
+	VALUE_INT,
+	VALUE_FLOAT,
+	VALUE_DOUBLE,
+};
+
+struct dbc_val {
+	int64_t value;
+	char *desc;
+};
+
+struct dbc_sig {
+	char *name;
+	char *unit;
+	int extract;
+	unsigned int byte;	/* of the load */
+	unsigned int shift;	/* of the loaded 64 bits */
+	unsigned int bit;	/* of EXTRACT_BITS, DBC numbering */
+	unsigned int len;
+	int big_endian;
+	uint64_t mask;
+	unsigned int need;	/* frame length the signal needs */
+	int is_signed;
+	int type;
+	int identity;		/* factor 1, offset 0 */
+	double factor, offset;
+	int decimals;
+	int mux;		/* -1, or the multiplexor value */
+	struct dbc_val *vals;
+	int val_count;
+};
+
+struct dbc_msg {
+	canid_t id;
+	char *name;
+	struct dbc_sig *sigs;
+	int sig_count;
+	int mux;		/* index of the multiplexor or -1 */
+};
+
+struct can_dbc {
+	struct dbc_msg *msgs;
+	int msg_count;
+	int *hash;		/* message index + 1, 0 if empty */
+	unsigned int hash_size;
+};
+
+static unsigned int hash_id(canid_t id, unsigned int size)
+{
+	return (id * 0x9e3779b1u) & (size - 1);
+}
+
+static struct dbc_msg *find_msg(const struct can_dbc *dbc, canid_t id)
+{
+	unsigned int h;
+	int k;
+
+	if (!dbc->hash_size)
+		return NULL;
+
+	h = hash_id(id, dbc->hash_size);
+	while ((k = dbc->hash[h]) != 0) {
+		if (dbc->msgs[k - 1].id == id)
+			return &dbc->msgs[k - 1];
+		h = (h + 1) & (dbc->hash_size - 1);
+	}
+
+	return NULL;
+}
+
+/* DBC ids have bit 31 set for extended ids */
+static canid_t dbc_id(unsigned long v)
+{
+	if (v & 0x80000000)
+		return (v & CAN_EFF_MASK) | CAN_EFF_FLAG;
+
+	return v & CAN_SFF_MASK;
+}
+
+static struct dbc_sig *find_sig(struct dbc_msg *msg, const char *name)
+{
+	int i;
+
+	for (i = 0; i < msg->sig_count; i++)
+		if (!strcmp(msg->sigs[i].name, name))
+			return &msg->sigs[i];
+
+	return NULL;
+}
+
+/* digits needed to show the resolution of "v", e.g. 3 for 0.125 */
+static int decimals(double v)
+{
+	double r;
+	int d;
+
+	for (d = 0; d < 9; d++, v *= 10) {
+		r = v - (double)(int64_t)(v < 0 ? v - 0.5 : v + 0.5);
+		if (r < 1e-6 && r > -1e-6)
+			break;
+	}
+
+	return d;
+}
+
+static void compile(struct dbc_sig *sig)
+{
+	unsigned int pos, last;
+
+	sig->mask = sig->len == 64 ? ~0ULL : (1ULL << sig->len) - 1;
+	sig->identity = sig->factor == 1.0 && sig->offset == 0.0;
+	sig->decimals = decimals(sig->factor);
+	if (decimals(sig->offset) > sig->decimals)
+		sig->decimals = decimals(sig->offset);
+
+	if (!sig->big_endian) {
+		sig->byte = sig->bit / 8;
+		sig->shift = sig->bit % 8;
+		sig->need = (sig->bit + sig->len - 1) / 8 + 1;
+		sig->extract = sig->shift + sig->len <= 64 ?
+			EXTRACT_LE : EXTRACT_BITS;
+		return;
+	}
+
+	/* the start bit is the MSB, numbered like in the little endian case */
+	pos = sig->bit / 8 * 8 + 7 - sig->bit % 8;
+	last = pos + sig->len - 1;
+	sig->byte = pos / 8;
+	sig->need = last / 8 + 1;
+	if (pos % 8 + sig->len <= 64) {
+		sig->shift = 64 - pos % 8 - sig->len;
+		sig->extract = EXTRACT_BE;
+	} else {
+		sig->extract = EXTRACT_BITS;
+	}
+}
+
+static char *skip_space(char *p)
+{
+	while (isspace((unsigned char)*p))
+		p++;
+
+	return p;
+}
+
+/* the next word, terminated in place */
+static char *word(char **p)
+{
+	char *s = skip_space(*p), *e = s;
+
+	while (*e && !isspace((unsigned char)*e) && *e != ':')
+		e++;
+	if (e == s)
+		return NULL;
+	*p = e;
+	if (*e) {
+		*e = '\0';
+		*p = e + 1;
+	}
+
+	return s;
+}
+
+/* a quoted string, terminated in place */
+static char *quoted(char **p)
+{
+	char *s = skip_space(*p), *e;
+
+	if (*s != '"')
+		return NULL;
+	e = strchr(s + 1, '"');
+	if (!e)
+		return NULL;
+	*e = '\0';
+	*p = e + 1;
+
+	return s + 1;
+}
+
+static int parse_bo(struct can_dbc *dbc, char *p)
+{
+	struct dbc_msg *msg, *tmp;
+	unsigned long id;
+	char *s, *end;
+
+	s = word(&p);
+	if (!s)
+		return -1;
+	id = strtoul(s, &end, 10);
+	if (*end)
+		return -1;
+	s = word(&p);
+	if (!s)
+		return -1;
+
+	tmp = realloc(dbc->msgs, sizeof(*msg) * (dbc->msg_count + 1));
+	if (!tmp)
+		return -1;
+	dbc->msgs = tmp;
+	msg = &dbc->msgs[dbc->msg_count++];
+	memset(msg, 0, sizeof(*msg));
+	msg->id = dbc_id(id);
+	msg->mux = -1;
+	msg->name = strdup(s);
+
+	return msg->name ? 0 : -1;
+}
+
+static int parse_sg(struct can_dbc *dbc, char *p)
+{
+	struct dbc_msg *msg;
+	struct dbc_sig *sig, *tmp;
+	char *name, *mux = NULL, *unit, *s;
+	char order, sign;
+	double min, max;
+	int n;
+
+	if (!dbc->msg_count)
+		return -1;
+	msg = &dbc->msgs[dbc->msg_count - 1];
+
+	name = word(&p);
+	if (!name)
+		return -1;
+	p = skip_space(p);
+	if (*p != ':') {
+		mux = word(&p);
+		p = skip_space(p);
+	}
+	if (*p++ != ':')
+		return -1;
+
+	tmp = realloc(msg->sigs, sizeof(*sig) * (msg->sig_count + 1));
+	if (!tmp)
+		return -1;
+	msg->sigs = tmp;
+	sig = &msg->sigs[msg->sig_count];
+	memset(sig, 0, sizeof(*sig));
+	sig->mux = -1;
+
+	if (sscanf(p, " %u|%u@%c%c (%lf,%lf) [%lf|%lf]%n", &sig->bit,
+		   &sig->len, &order, &sign, &sig->factor, &sig->offset,
+		   &min, &max, &n) != 8 ||
+	    !sig->len || sig->len > 64 ||
+	    (order != '0' && order != '1') || (sign != '+' && sign != '-'))
+		return -1;
+	p += n;
+
+	unit = quoted(&p);
+	if (!unit)
+		return -1;
+
+	sig->big_endian = order == '0';
+	sig->is_signed = sign == '-';
+	if (sig->bit >= CANFD_MAX_DLEN * 8)
+		return -1;
+
+	if (mux && !strcmp(mux, "M")) {
+		msg->mux = msg->sig_count;
+	} else if (mux && mux[0] == 'm') {
+		sig->mux = strtoul(mux + 1, &s, 10);
+		/* "m1M", a multiplexed multiplexor, is taken as "m1" */
+		if (s == mux + 1)
+			return -1;
+	}
+
+	sig->name = strdup(name);
+	sig->unit = strdup(unit);
+	if (!sig->name || !sig->unit) {
+		free(sig->name);
+		free(sig->unit);
+		return -1;
+	}
+	compile(sig);
+	msg->sig_count++;
+
+	return 0;
+}
+
+/* VAL_ <id> <signal> <value> "<desc>" ... ; */
+static int parse_val(struct can_dbc *dbc, char *p)
+{
+	struct dbc_msg *msg;
+	struct dbc_sig *sig;
+	struct dbc_val *tmp;
+	char *s, *end, *desc;
+	unsigned long id;
+	long long v;
+
+	s = word(&p);
+	if (!s)
+		return -1;
+	id = strtoul(s, &end, 10);
+	if (*end)
+		return -1;
+
+	/* value tables of environment variables have no id */
+	msg = find_msg(dbc, dbc_id(id));
+	s = word(&p);
+	if (!msg || !s)
+		return 0;
+	sig = find_sig(msg, s);
+	if (!sig)
+		return 0;
+
+	while (1) {
+		p = skip_space(p);
+		if (*p == ';' || !*p)
+			return 0;
+		v = strtoll(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		desc = quoted(&p);
+		if (!desc)
+			return -1;
+
+		tmp = realloc(sig->vals, sizeof(*tmp) * (sig->val_count + 1));
+		if (!tmp)
+			return -1;
+		sig->vals = tmp;
+		tmp[sig->val_count].value = v;
+		tmp[sig->val_count].desc = strdup(desc);
+		if (!tmp[sig->val_count].desc)
+			return -1;
+		sig->val_count++;
+	}
+}
+
+/* SIG_VALTYPE_ <id> <signal> : <1: float, 2: double> ; */
+static int parse_valtype(struct can_dbc *dbc, char *p)
+{
+	struct dbc_msg *msg;
+	struct dbc_sig *sig;
+	char *s, *end;
+	unsigned long id;
+	int type;
+
+	s = word(&p);
+	if (!s)
+		return -1;
+	id = strtoul(s, &end, 10);
+	if (*end)
+		return -1;
+	msg = find_msg(dbc, dbc_id(id));
+	s = word(&p);
+	if (!msg || !s || !(sig = find_sig(msg, s)))
+		return 0;
+
+	p = skip_space(p);
+	if (*p == ':')
+		p++;
+	type = strtol(p, &end, 10);
+	if (end == p)
+		return -1;
+
+	if ((type == 1 && sig->len == 32) || (type == 2 && sig->len == 64))
+		sig->type = type == 1 ? VALUE_FLOAT : VALUE_DOUBLE;
+
+	return 0;
+}
+
+static int build_hash(struct can_dbc *dbc)
+{
+	unsigned int h;
+	int i;
+
+	for (dbc->hash_size = 16; dbc->hash_size < 2u * dbc->msg_count;)
+		dbc->hash_size *= 2;
+	free(dbc->hash);
+	dbc->hash = calloc(dbc->hash_size, sizeof(*dbc->hash));
+	if (!dbc->hash)
+		return -1;
+
+	/* a later definition of an id replaces an earlier one */
+	for (i = 0; i < dbc->msg_count; i++) {
+		h = hash_id(dbc->msgs[i].id, dbc->hash_size);
+		while (dbc->hash[h] && dbc->msgs[dbc->hash[h] - 1].id != dbc->msgs[i].id)
+			h = (h + 1) & (dbc->hash_size - 1);
+		dbc->hash[h] = i + 1;
+	}
+
+	return 0;
+}
+
+struct can_dbc *can_dbc_load(const char *path, int *line)
+{
+	struct can_dbc *dbc;
+	char *buf = NULL, *p, *kw;
+	size_t size = 0;
+	int hashed = 0, ret = 0, err;
+	FILE *f;
+
+	*line = 0;
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	dbc = calloc(1, sizeof(*dbc));
+	if (!dbc)
+		goto err;
+
+	while (getline(&buf, &size, f) > 0) {
+		(*line)++;
+		p = buf;
+		kw = word(&p);
+		if (!kw)
+			continue;
+
+		if (!strcmp(kw, "BO_")) {
+			ret = parse_bo(dbc, p);
+			hashed = 0;
+		} else if (!strcmp(kw, "SG_")) {
+			ret = parse_sg(dbc, p);
+		} else if (!strcmp(kw, "VAL_") || !strcmp(kw, "SIG_VALTYPE_")) {
+			/* these follow all messages */
+			if (!hashed && build_hash(dbc))
+				goto err;
+			hashed = 1;
+			ret = !strcmp(kw, "VAL_") ?
+				parse_val(dbc, p) : parse_valtype(dbc, p);
+		}
+
+		if (ret) {
+			errno = EINVAL;
+			goto err;
+		}
+	}
+
+	if (ferror(f) || build_hash(dbc))
+		goto err;
+
+	*line = 0;
+	free(buf);
+	fclose(f);
+
+	return dbc;
+
+ err:
+	err = errno;
+	can_dbc_free(dbc);
+	free(buf);
+	fclose(f);
+	errno = err;
+
+	return NULL;
+}
+
+void can_dbc_free(struct can_dbc *dbc)
+{
+	struct dbc_msg *msg;
+	struct dbc_sig *sig;
+	int i;
+
+	if (!dbc)
+		return;
+
+	for (msg = dbc->msgs; msg < dbc->msgs + dbc->msg_count; msg++) {
+		for (sig = msg->sigs; sig < msg->sigs + msg->sig_count; sig++) {
+			for (i = 0; i < sig->val_count; i++)
+				free(sig->vals[i].desc);
+			free(sig->vals);
+			free(sig->name);
+			free(sig->unit);
+		}
+		free(msg->sigs);
+		free(msg->name);
+	}
+	free(dbc->msgs);
+	free(dbc->hash);
+	free(dbc);
+}
+
+/* "data" is padded, loads beyond the frame read zeros */
+static uint64_t extract(const struct dbc_sig *sig, const unsigned char *data)
+{
+	uint64_t v = 0;
+	unsigned int i, bit;
+
+	switch (sig->extract) {
+	case EXTRACT_LE:
+		memcpy(&v, data + sig->byte, sizeof(v));
+		return (le64toh(v) >> sig->shift) & sig->mask;
+
+	case EXTRACT_BE:
+		memcpy(&v, data + sig->byte, sizeof(v));
+		return (be64toh(v) >> sig->shift) & sig->mask;
+	}
+
+	for (i = 0; i < sig->len; i++) {
+		if (sig->big_endian) {
+			/* from the MSB on, in the big endian numbering */
+			bit = sig->byte * 8 + (7 - sig->bit % 8) + i;
+			v = v << 1 | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+		} else {
+			bit = sig->bit + i;
+			v |= (uint64_t)((data[bit / 8] >> (bit % 8)) & 1) << i;
+		}
+	}
+
+	return v;
+}
+
+static int64_t sign_extend(const struct dbc_sig *sig, uint64_t raw)
+{
+	if (!sig->is_signed || sig->len == 64)
+		return raw;
+
+	return (int64_t)(raw << (64 - sig->len)) >> (64 - sig->len);
+}
+
+static const char *find_desc(const struct dbc_sig *sig, int64_t v)
+{
+	int i;
+
+	for (i = 0; i < sig->val_count; i++)
+		if (sig->vals[i].value == v)
+			return sig->vals[i].desc;
+
+	return NULL;
+}
+
+static int format_sig(char *buf, size_t size, const struct dbc_sig *sig,
+		      uint64_t raw)
+{
+	const char *desc;
+	int64_t v = sign_extend(sig, raw);
+	uint32_t u32;
+	double d;
+	float f;
+
+	if (sig->type == VALUE_FLOAT) {
+		u32 = raw;
+		memcpy(&f, &u32, sizeof(f));
+		d = f * sig->factor + sig->offset;
+	} else if (sig->type == VALUE_DOUBLE) {
+		memcpy(&d, &raw, sizeof(d));
+		d = d * sig->factor + sig->offset;
+	} else if (sig->val_count && (desc = find_desc(sig, v))) {
+		return snprintf(buf, size, " %s=%s", sig->name, desc);
+	} else if (sig->identity && !sig->is_signed) {
+		return snprintf(buf, size, " %s=%llu%s%s", sig->name,
+				(unsigned long long)raw,
+				*sig->unit ? " " : "", sig->unit);
+	} else if (sig->identity) {
+		return snprintf(buf, size, " %s=%lld%s%s", sig->name,
+				(long long)v, *sig->unit ? " " : "", sig->unit);
+	} else {
+		d = (sig->is_signed ? (double)v : (double)raw) * sig->factor +
+			sig->offset;
+	}
+
+	if (sig->type != VALUE_INT)
+		return snprintf(buf, size, " %s=%g%s%s", sig->name, d,
+				*sig->unit ? " " : "", sig->unit);
+
+	return snprintf(buf, size, " %s=%.*f%s%s", sig->name, sig->decimals,
+			d, *sig->unit ? " " : "", sig->unit);
+}
+
+int can_dbc_format(const struct can_dbc *dbc, char *buf, size_t size,
+		   const struct canfd_frame *frame)
+{
+	unsigned char data[CANFD_MAX_DLEN + 8];
+	const struct dbc_msg *msg;
+	const struct dbc_sig *sig;
+	int64_t mux = -1;
+	size_t len;
+	int n;
+
+	if (!size || frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return 0;
+	msg = find_msg(dbc, frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+	if (!msg)
+		return 0;
+
+	len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+	memcpy(data, frame->data, len);
+	memset(data + len, 0, sizeof(data) - len);
+
+	if (msg->mux >= 0 && msg->sigs[msg->mux].need <= len)
+		mux = extract(&msg->sigs[msg->mux], data);
+
+	n = snprintf(buf, size, " %s:", msg->name);
+	for (sig = msg->sigs; sig < msg->sigs + msg->sig_count; sig++) {
+		if ((size_t)n >= size)
+			break;
+		if (sig->need > len || (sig->mux >= 0 && sig->mux != mux))
+			continue;
+		n += format_sig(buf + n, size - n, sig, extract(sig, data));
+	}
+
+	return (size_t)n < size ? n : (int)size - 1;
+}
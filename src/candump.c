@@ -7,29 +7,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdint.h>
 
 #include <net/if.h>
 
-#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <linux/can/error.h>
 
+#include <canutils.h>
+
 extern int optind, opterr, optopt;
 
-static int	s = -1;
 static int	running = 1;
+static volatile sig_atomic_t dump_metrics;
+static volatile sig_atomic_t record_signal;
+static volatile sig_atomic_t log_tick;
 
 enum {
 	VERSION_OPTION = CHAR_MAX + 1,
 	FILTER_OPTION,
+	IO_OPTION,
+	METRICS_OPTION,
+	TIMESTAMP_OPTION,
+	INDEX_OPTION,
+	COMPRESS_OPTION,
+	DBC_OPTION,
+	J1939_OPTION,
+	PGN_OPTION,
+	SA_OPTION,
+	PRIO_OPTION,
+	ISOTP_OPTION,
+	ALARM_OPTION,
+	PUBLISH_OPTION,
+	RECORDER_OPTION,
+	TRIGGER_OPTION,
 };
 
 static void print_usage(char *prg)
@@ -41,10 +61,31 @@ static void print_usage(char *prg)
 		" -p, --protocol=PROTO\t"	"CAN protocol (default CAN_RAW = %d)\n"
 		"     --filter=id:mask[:id:mask]...\n"
 		"\t\t\t"			"apply filter\n"
-		" -e, --error\t\t"		"dump error frames along with data frames\n"
+		" -e, --error\t\t"		"dump error frames along with data frames, decoded\n"
+		"     --alarm=CLASS:LIMIT[,CLASS:LIMIT]...\n"
+		"\t\t\t"			"alarm when errors of CLASS exceed LIMIT per second, implies -e\n"
+		"     --io=BACKEND\t"		"frame I/O: rw, mmsg, mmap, uring, sim or shm (default $CANUTILS_IO or mmsg)\n"
 		" -h, --help\t\t"		"this help\n"
 		" -o <filename>\t\t"		"output into filename\n"
+		"     --timestamp\t"		"prefix the frames with their receive time\n"
+		"     --index\t\t"		"write a time and id index to <filename>.idx, implies --timestamp\n"
+		"     --compress\t\t"		"write a compressed log to <filename>, read it with canquery\n"
+		"     --dbc=FILE\t"		"decode the signals of the messages in the DBC file FILE\n"
+		"     --j1939\t\t"		"decode J1939 ids and reassemble transport protocol messages\n"
+		"     --pgn=PGN[,PGN]...\t"	"J1939 frames of these PGNs, by number or name, implies --j1939\n"
+		"     --sa=ADDR[,ADDR]...\t"	"J1939 frames from these source addresses, implies --j1939\n"
+		"     --prio=PRIO[,PRIO]...\t"	"J1939 frames of these priorities, implies --j1939\n"
+		"     --isotp[=ID:FCID[,ID:FCID]...]\n"
+		"\t\t\t"			"print reassembled ISO-TP PDUs instead of the frames of these\n"
+		"\t\t\t"			"id pairs (default: the diagnostic ids of ISO 15765-4)\n"
+		"     --publish[=NAME]\t"	"publish the frames to local readers in the ring NAME\n"
+		"\t\t\t"			"(default: the interface), only print them with -o\n"
+		"     --recorder=PRE[:POST]\t"	"flight recorder: keep the last PRE frames (or seconds, e.g. 5s)\n"
+		"\t\t\t"			"and only write them and the POST after a trigger or SIGUSR2\n"
+		"     --trigger=TRIGGER[,TRIGGER]...\n"
+		"\t\t\t"			"error, bus-off or id[:hexdata], for --recorder\n"
 		" -d\t\t\t"			"daemonize\n"
+		"     --metrics=PATH\t"		"serve metrics on the unix socket PATH, SIGUSR1 prints them\n"
 		"     --version\t\t"		"print version information and exit\n",
 		prg, PF_CAN, SOCK_RAW, CAN_RAW);
 }
@@ -54,41 +95,370 @@ static void sigterm(int signo)
 	running = 0;
 }
 
+static void sigusr1(int signo)
+{
+	dump_metrics = 1;
+}
+
+static void sigusr2(int signo)
+{
+	record_signal = 1;
+}
+
+static void sigalrm(int signo)
+{
+	log_tick = 1;
+}
+
+static long elapsed_ns(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1000000000L +
+		t1.tv_nsec - t0->tv_nsec;
+}
+
+static void set_signal(int signo, void (*handler)(int))
+{
+	struct sigaction sa;
+
+	/* no SA_RESTART, a blocking receive returns with EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signo, &sa, NULL);
+}
+
 static struct can_filter *filter = NULL;
 static int filter_count = 0;
+static struct can_dbc *dbc = NULL;
+static struct can_j1939_filter *jfilter = NULL;
+static struct can_j1939_tp *jtp = NULL;
+static int j1939 = 0;
+static struct can_isotp *isotp = NULL;
+static int64_t isotp_sweep_ns;
+static struct can_error_rate *erate = NULL;
+static const char *ifname;
+static FILE *alarm_copy;
+static int opttimestamp = 0;
+static struct can_shm *shm = NULL;
+static struct can_recorder *rec = NULL;
+static uint64_t rec_lost;
+
+/* kernel filters for --pgn, --sa and --prio, beyond that they're hashed */
+#define J1939_FILTERS	(64)
+#define J1939_SESSIONS	(32)
+
+/* ISO-TP reassemblies at a time, idle ones are timed out every 100ms */
+#define ISOTP_SESSIONS	(256)
+#define ISOTP_SWEEP_NS	(100000000LL)
+#define ISOTP_EXPIRED	(16)
+
+#define BATCH	(64)
+
+/* a frame, "(seconds.usecs) ", its decoded signals or error and the newline */
+#define DBC_SIZE	(1024)
+#define ERROR_SIZE	(256)
+#define FRAME_SIZE	(CAN_FRAME_FORMAT_SIZE + 96 + DBC_SIZE + ERROR_SIZE)
+
+/* then the alarms raised or cleared */
+#define ALARM_SIZE	(CAN_ERROR_CLASSES * 128)
+
+/* followed by a reassembled J1939 message */
+#define J1939_SIZE	(CAN_J1939_MAX_TP_SIZE * 3 + 128)
+
+/* or the timed out ISO-TP sessions and the events of an ISO-TP frame */
+#define ISOTP_SIZE	(ISOTP_EXPIRED * 128 + \
+			 CAN_ISOTP_MAX_EVENTS * (CAN_ISOTP_MAX_SIZE * 3 + 128))
+#define LINE_SIZE	(FRAME_SIZE + ALARM_SIZE + \
+			 (J1939_SIZE > ISOTP_SIZE ? J1939_SIZE : ISOTP_SIZE))
+
+/* the formatted batch, for writes through the io_uring backend */
+static char obuf[BATCH * LINE_SIZE];
+
+static int format_j1939(char *buf, unsigned int prio, unsigned int pgn,
+			unsigned int sa, unsigned int da)
+{
+	const char *name = can_j1939_pgn_name(pgn);
+
+	return sprintf(buf, "j1939: prio=%u pgn=0x%05x%s%s sa=0x%02x da=0x%02x",
+		       prio, pgn, name ? " " : "", name ? name : "", sa, da);
+}
+
+static int is_j1939(const struct canfd_frame *frame)
+{
+	return (frame->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) ==
+		CAN_EFF_FLAG;
+}
+
+/* error frames pass, other frames have to be J1939 frames that match */
+static int j1939_match(const struct canfd_frame *frame)
+{
+	canid_t id = frame->can_id;
+
+	if (id & CAN_ERR_FLAG)
+		return 1;
+
+	return is_j1939(frame) &&
+		can_j1939_filter_match(jfilter, can_j1939_pgn(id),
+				       can_j1939_sa(id), can_j1939_prio(id));
+}
+
+/* in the compressed log, with the TP frames of the source addresses */
+static int j1939_keep(const struct canfd_frame *frame)
+{
+	unsigned int pgn = can_j1939_pgn(frame->can_id);
+
+	if (is_j1939(frame) &&
+	    (pgn == CAN_J1939_PGN_TP_CM || pgn == CAN_J1939_PGN_TP_DT))
+		return can_j1939_filter_match(jfilter, CAN_J1939_PGN_ANY,
+					      can_j1939_sa(frame->can_id), 0);
+
+	return j1939_match(frame);
+}
+
+/* returns the length of the line, newline included, not terminated */
+static size_t format_frame(char *buf, const struct canfd_frame *frame,
+			   const struct timespec *ts)
+{
+	canid_t id = frame->can_id;
+	size_t len = 0;
+
+	if (ts && opttimestamp)
+		len = sprintf(buf, "(%lld.%06ld) ", (long long)ts->tv_sec,
+			      ts->tv_nsec / 1000);
+	len += can_frame_format(buf + len, CAN_FRAME_FORMAT_SIZE, frame);
+	if (j1939 && is_j1939(frame)) {
+		buf[len++] = ' ';
+		len += format_j1939(buf + len, can_j1939_prio(id),
+				    can_j1939_pgn(id), can_j1939_sa(id),
+				    can_j1939_da(id));
+	}
+	if (dbc)
+		len += can_dbc_format(dbc, buf + len, DBC_SIZE, frame);
+	if (id & CAN_ERR_FLAG)
+		len += can_error_format(buf + len, ERROR_SIZE, frame);
+	buf[len++] = '\n';
+
+	return len;
+}
+
+/* "[(seconds.usecs) ]j1939: ... [len] data", not a frame for can_frame_parse() */
+static size_t format_msg(char *buf, const struct can_j1939_msg *msg,
+			 const struct timespec *ts)
+{
+	size_t len = 0, i;
+
+	if (opttimestamp)
+		len = sprintf(buf, "(%lld.%06ld) ", (long long)ts->tv_sec,
+			      ts->tv_nsec / 1000);
+	len += format_j1939(buf + len, msg->prio, msg->pgn, msg->sa, msg->da);
+	len += sprintf(buf + len, " [%zu]", msg->len);
+	for (i = 0; i < msg->len; i++)
+		len += sprintf(buf + len, " %02x", msg->data[i]);
+	buf[len++] = '\n';
+
+	return len;
+}
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* "[(seconds.usecs) ]isotp: 0xid ...", not a frame for can_frame_parse() */
+static size_t format_isotp(char *buf, const struct can_isotp_event *ev,
+			   const struct timespec *ts)
+{
+	size_t len = 0, i;
+
+	if (opttimestamp)
+		len = sprintf(buf, "(%lld.%06ld) ", (long long)ts->tv_sec,
+			      ts->tv_nsec / 1000);
+	len += sprintf(buf + len, "isotp: 0x%0*x",
+		       ev->id & CAN_EFF_FLAG ? 8 : 3, ev->id & CAN_EFF_MASK);
+
+	switch (ev->type) {
+	case CAN_ISOTP_PDU:
+		len += sprintf(buf + len, " [%zu]", ev->len);
+		for (i = 0; i < ev->len; i++)
+			len += sprintf(buf + len, " %02x", ev->data[i]);
+		break;
+	case CAN_ISOTP_SEQUENCE:
+		len += sprintf(buf + len, " sequence error, expected %u got %u,",
+			       ev->expected_sn, ev->sn);
+		break;
+	case CAN_ISOTP_TIMEOUT:
+		len += sprintf(buf + len, " timeout,");
+		break;
+	case CAN_ISOTP_ABORT:
+		len += sprintf(buf + len, " aborted,");
+		break;
+	case CAN_ISOTP_BUSY:
+		len += sprintf(buf + len, " no free session,");
+		break;
+	}
+	if (ev->type != CAN_ISOTP_PDU)
+		len += sprintf(buf + len, " %zu of %zu bytes", ev->received,
+			       ev->len);
+	buf[len++] = '\n';
+
+	return len;
+}
+
+/* the events of an ISO-TP frame, after the sessions that timed out */
+static size_t format_isotp_frame(char *buf, const struct canfd_frame *frame,
+				 const struct timespec *ts)
+{
+	struct can_isotp_event ev[ISOTP_EXPIRED];
+	int64_t ns = ts_ns(ts);
+	size_t len = 0;
+	int i, n;
+
+	if (ns >= isotp_sweep_ns) {
+		isotp_sweep_ns = ns + ISOTP_SWEEP_NS;
+		n = can_isotp_expire(isotp, ns, ev, ISOTP_EXPIRED);
+		for (i = 0; i < n; i++)
+			len += format_isotp(buf + len, &ev[i], ts);
+	}
+
+	if (!can_isotp_match(isotp, frame->can_id))
+		return len;
+
+	n = can_isotp_add(isotp, frame, ns, ev);
+	for (i = 0; i < n; i++)
+		len += format_isotp(buf + len, &ev[i], ts);
+
+	return len;
+}
+
+/* "[(seconds.usecs) ]alarm: ...", also to stderr when writing to a file */
+static size_t format_alarms(char *buf, const struct canfd_frame *frame,
+			    const struct timespec *ts)
+{
+	struct can_error_alarm alarms[CAN_ERROR_CLASSES];
+	size_t len = 0, start;
+	int i, n;
+
+	n = can_error_rate_add(erate, frame, ts_ns(ts), alarms);
+	for (i = 0; i < n; i++) {
+		start = len;
+		if (opttimestamp)
+			len += sprintf(buf + len, "(%lld.%06ld) ",
+				       (long long)ts->tv_sec, ts->tv_nsec / 1000);
+		/* the frames don't tell their interface, "any" sums them up */
+		len += sprintf(buf + len, "alarm%s: %s %s errors %u/s, limit %u/s%s\n",
+			       alarms[i].raised ? "" : " cleared", ifname,
+			       can_error_class_name(alarms[i].class),
+			       alarms[i].rate, alarms[i].limit,
+			       strcmp(ifname, "any") ? "" : ", all interfaces");
+		if (alarm_copy)
+			fwrite(buf + start, 1, len - start, alarm_copy);
+	}
+
+	return len;
+}
 
-int add_filter(u_int32_t id, u_int32_t mask)
+/*
+ * The frame's line, unless --pgn, --sa or --prio filter it out, and the
+ * line of the J1939 message it completes. Returns their length, 0 if
+ * there's nothing to write.
+ */
+static size_t format_line(char *buf, const struct canfd_frame *frame,
+			  const struct timespec *ts)
 {
-	filter = realloc(filter, sizeof(struct can_filter) * (filter_count + 1));
-	if(!filter)
-		return -1;
+	struct can_j1939_msg msg;
+	size_t len = 0;
+
+	/* with --j1939, --isotp and --alarm there are always timestamps */
+	if (isotp)
+		len = format_isotp_frame(buf, frame, ts);
+
+	if (!isotp || !can_isotp_match(isotp, frame->can_id)) {
+		if (!jfilter || j1939_match(frame))
+			len += format_frame(buf + len, frame, ts);
 
-	filter[filter_count].can_id = id;
-	filter[filter_count].can_mask = mask;
-	filter_count++;
+		if (jtp && can_j1939_tp_add(jtp, frame, ts_ns(ts), &msg) &&
+		    (!jfilter || can_j1939_filter_match(jfilter, msg.pgn,
+							msg.sa, msg.prio)))
+			len += format_msg(buf + len, &msg, ts);
+	}
+
+	/* every frame moves the rates on, alarms clear without errors */
+	if (erate)
+		len += format_alarms(buf + len, frame, ts);
 
-	printf("id: 0x%08x mask: 0x%08x\n",id,mask);
-	return 0;
+	return len;
 }
 
-#define BUF_SIZ	(255)
+/* "id:fcid[,id:fcid]...", ids above 0x7ff are extended */
+static int isotp_parse(struct can_isotp *tp, const char *s)
+{
+	unsigned long id[2];
+	const char *p = s;
+	char *end;
+	int i;
+
+	while (1) {
+		id[0] = strtoul(p, &end, 0);
+		if (end == p || *end != ':')
+			return -1;
+		p = end + 1;
+		id[1] = strtoul(p, &end, 0);
+		if (end == p || (*end != ',' && *end != '\0'))
+			return -1;
+
+		for (i = 0; i < 2; i++) {
+			if (id[i] > CAN_EFF_MASK)
+				return -1;
+			if (id[i] > CAN_SFF_MASK)
+				id[i] |= CAN_EFF_FLAG;
+		}
+		if (can_isotp_add_pair(tp, id[0], id[1]))
+			return -1;
+
+		if (!*end)
+			return 0;
+		p = end + 1;
+	}
+}
 
 int main(int argc, char **argv)
 {
-	struct can_frame frame;
-	struct ifreq ifr;
-	struct sockaddr_can addr;
+	struct canfd_frame frames[BATCH];
+	struct timespec stamps[BATCH], *ts = NULL;
+	struct can_io *io;
+	struct can_index *idx = NULL;
+	struct can_log *clog = NULL;
+	struct stat st;
+	struct can_io_opts io_opts = {
+		.batch = BATCH,
+	};
 	FILE *out = stdout;
 	char *interface = "can0";
 	char *optout = NULL;
-	char *ptr;
-	char buf[BUF_SIZ];
+	char *optmetrics = NULL;
+	char *optpublish = NULL;
+	char *opttrigger = NULL;
+	struct timespec now;
+	struct timespec t0;
+	struct itimerval log_timer = {
+		.it_interval = { 0, 250000 },
+		.it_value = { 0, 250000 },
+	};
+	char buf[LINE_SIZE];
+	char *idxname;
 	int family = PF_CAN, type = SOCK_RAW, proto = CAN_RAW;
-	int n = 0, err;
+	int err;
 	int nbytes, i;
-	int opt, optdaemon = 0;
-	uint32_t id, mask;
+	int uring;
+	size_t len, n;
+	int opt, optdaemon = 0, optpublish_set = 0;
+	int optindex = 0, optcompress = 0;
+	int dbc_line;
 	int error = 0;
+	int backend;
 	can_err_mask_t err_mask = (CAN_ERR_TX_TIMEOUT | CAN_ERR_LOSTARB |
 					CAN_ERR_CRTL | CAN_ERR_PROT |
 					CAN_ERR_TRX | CAN_ERR_ACK | CAN_ERR_BUSOFF |
@@ -103,6 +473,21 @@ int main(int argc, char **argv)
 		{ "type", required_argument, 0, 't' },
 		{ "filter", required_argument, 0, FILTER_OPTION },
 		{ "error", no_argument, 0, 'e' },
+		{ "io", required_argument, 0, IO_OPTION },
+		{ "metrics", required_argument, 0, METRICS_OPTION },
+		{ "timestamp", no_argument, 0, TIMESTAMP_OPTION },
+		{ "index", no_argument, 0, INDEX_OPTION },
+		{ "compress", no_argument, 0, COMPRESS_OPTION },
+		{ "dbc", required_argument, 0, DBC_OPTION },
+		{ "j1939", no_argument, 0, J1939_OPTION },
+		{ "pgn", required_argument, 0, PGN_OPTION },
+		{ "sa", required_argument, 0, SA_OPTION },
+		{ "prio", required_argument, 0, PRIO_OPTION },
+		{ "isotp", optional_argument, 0, ISOTP_OPTION },
+		{ "alarm", required_argument, 0, ALARM_OPTION },
+		{ "publish", optional_argument, 0, PUBLISH_OPTION },
+		{ "recorder", required_argument, 0, RECORDER_OPTION },
+		{ "trigger", required_argument, 0, TRIGGER_OPTION },
 		{ "version", no_argument, 0, VERSION_OPTION},
 		{ 0, 0, 0, 0},
 	};
@@ -138,22 +523,131 @@ int main(int argc, char **argv)
 			break;
 
 		case FILTER_OPTION:
-			ptr = optarg;
-			while(1) {
-				id = strtoul(ptr, NULL, 0);
-				ptr = strchr(ptr, ':');
-				if(!ptr) {
-					fprintf(stderr, "filter must be applied in the form id:mask[:id:mask]...\n");
-					exit(1);
-				}
-				ptr++;
-				mask = strtoul(ptr, NULL, 0);
-				ptr = strchr(ptr, ':');
-				add_filter(id,mask);
-				if(!ptr)
-					break;
-				ptr++;
+			free(filter);
+			filter_count = can_filter_parse(optarg, &filter);
+			if (filter_count < 0) {
+				fprintf(stderr, "filter must be applied in the form id:mask[:id:mask]...\n");
+				exit(1);
+			}
+			for (i = 0; i < filter_count; i++)
+				printf("id: 0x%08x mask: 0x%08x\n",
+				       filter[i].can_id, filter[i].can_mask);
+			break;
+
+		case IO_OPTION:
+			backend = can_io_backend_parse(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "unknown I/O backend %s\n", optarg);
+				exit(1);
 			}
+			io_opts.backend = backend;
+			break;
+
+		case METRICS_OPTION:
+			optmetrics = optarg;
+			break;
+
+		case TIMESTAMP_OPTION:
+			opttimestamp = 1;
+			break;
+
+		case INDEX_OPTION:
+			optindex = 1;
+			opttimestamp = 1;
+			break;
+
+		case COMPRESS_OPTION:
+			optcompress = 1;
+			opttimestamp = 1;
+			break;
+
+		case DBC_OPTION:
+			can_dbc_free(dbc);
+			dbc = can_dbc_load(optarg, &dbc_line);
+			if (!dbc && dbc_line) {
+				fprintf(stderr, "%s:%d: invalid DBC\n", optarg, dbc_line);
+				exit(1);
+			} else if (!dbc) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+
+		case J1939_OPTION:
+			j1939 = 1;
+			break;
+
+		case PGN_OPTION:
+		case SA_OPTION:
+		case PRIO_OPTION:
+			j1939 = 1;
+			if (!jfilter)
+				jfilter = can_j1939_filter_new();
+			if (!jfilter) {
+				perror("j1939");
+				exit(1);
+			}
+			if (can_j1939_filter_add(jfilter, opt == PGN_OPTION ? "pgn" :
+						 opt == SA_OPTION ? "sa" : "prio",
+						 optarg)) {
+				fprintf(stderr, "invalid J1939 %s list: %s\n",
+					opt == PGN_OPTION ? "PGN" :
+					opt == SA_OPTION ? "address" : "priority",
+					optarg);
+				exit(1);
+			}
+			break;
+
+		case ISOTP_OPTION:
+			if (!isotp)
+				isotp = can_isotp_new(ISOTP_SESSIONS);
+			if (!isotp) {
+				perror("isotp");
+				exit(1);
+			}
+			if (optarg && isotp_parse(isotp, optarg)) {
+				fprintf(stderr, "ISO-TP pairs must be given in the form id:fcid[,id:fcid]...\n");
+				exit(1);
+			}
+			break;
+
+		case ALARM_OPTION:
+			error = 1;
+			if (!erate)
+				erate = can_error_rate_new();
+			if (!erate) {
+				perror("alarm");
+				exit(1);
+			}
+			if (can_error_rate_set_alarms(erate, optarg)) {
+				fprintf(stderr, "alarms must be given in the form class:limit[,class:limit]...\n"
+					"classes:");
+				for (i = 0; i < CAN_ERROR_CLASSES; i++)
+					fprintf(stderr, " %s", can_error_class_name(i));
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			break;
+
+		case PUBLISH_OPTION:
+			optpublish_set = 1;
+			optpublish = optarg;
+			break;
+
+		case RECORDER_OPTION:
+			can_recorder_free(rec);
+			rec = can_recorder_new(optarg, BATCH);
+			if (!rec && errno == EINVAL) {
+				fprintf(stderr, "the recorder's windows must be given in the form pre[:post], as frames or seconds\n");
+				exit(1);
+			} else if (!rec) {
+				perror("recorder");
+				exit(1);
+			}
+			break;
+
+		case TRIGGER_OPTION:
+			opttrigger = optarg;
 			break;
 
 		case VERSION_OPTION:
@@ -172,45 +666,144 @@ int main(int argc, char **argv)
 	printf("interface = %s, family = %d, type = %d, proto = %d\n",
 	       interface, family, type, proto);
 
-	if ((s = socket(family, type, proto)) < 0) {
-		perror("socket");
+	/* frame I/O is done by libcanutils, which only knows about CAN_RAW */
+	if (family != PF_CAN || type != SOCK_RAW || proto != CAN_RAW) {
+		fprintf(stderr, "-f, -t and -p: only PF_CAN, SOCK_RAW, CAN_RAW is supported\n");
+		return 1;
+	}
+
+	if ((optindex || optcompress) && !optout) {
+		fprintf(stderr, "--index and --compress need an output file (-o)\n");
+		return 1;
+	}
+
+	/* the index refers to lines of the text log */
+	if (optindex && optcompress) {
+		fprintf(stderr, "--index can't be used with --compress\n");
 		return 1;
 	}
 
-	addr.can_family = family;
-	strncpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
-	if (ioctl(s, SIOCGIFINDEX, &ifr)) {
-		perror("ioctl");
+	/* the compressed log stores frames, decode them when reading it */
+	if (dbc && optcompress) {
+		fprintf(stderr, "--dbc can't be used with --compress\n");
 		return 1;
 	}
-	addr.can_ifindex = ifr.ifr_ifindex;
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
+	/* both set the kernel filters */
+	if (filter && jfilter) {
+		fprintf(stderr, "--filter can't be used with --pgn, --sa or --prio\n");
 		return 1;
 	}
 
+	/* the compressed log keeps the TP frames, not the messages */
+	if (j1939 && !optcompress) {
+		jtp = can_j1939_tp_new(J1939_SESSIONS);
+		if (!jtp) {
+			perror("j1939");
+			return 1;
+		}
+	}
+
+	/* PDUs are lines of text */
+	if (isotp && optcompress) {
+		fprintf(stderr, "--isotp can't be used with --compress\n");
+		return 1;
+	}
+
+	/* alarms are lines of text too */
+	if (erate && optcompress) {
+		fprintf(stderr, "--alarm can't be used with --compress\n");
+		return 1;
+	}
+	ifname = interface;
+	if (optout)
+		alarm_copy = stderr;
+
+	if (opttrigger && !rec) {
+		fprintf(stderr, "--trigger needs --recorder\n");
+		return 1;
+	}
+	if (opttrigger && can_recorder_add_triggers(rec, opttrigger)) {
+		fprintf(stderr, "triggers must be given in the form error, bus-off or id[:hexdata], separated by commas\n");
+		return 1;
+	}
+	if (rec && can_recorder_err_mask(rec))
+		error = 1;
+
+	/* readers of the ring would see their own frames again */
+	if (optpublish_set && !optpublish)
+		optpublish = interface;
+	if (optpublish && io_opts.backend == CAN_IO_SHM &&
+	    !strcmp(optpublish, interface)) {
+		fprintf(stderr, "can't publish to the ring %s read from\n", optpublish);
+		return 1;
+	}
+
+	/*
+	 * The transport protocols time out idle sessions, rates need times,
+	 * the readers of the ring get the frames with their stamps.
+	 */
+	if (opttimestamp || jtp || isotp || erate || optpublish || rec) {
+		io_opts.timestamp = 1;
+		ts = stamps;
+	}
+
+	/* served below, the socket is registered for its filter hits now */
+	if (optmetrics)
+		can_metrics_enable();
+
+	io = can_io_open(interface, &io_opts);
+	if (!io) {
+		perror(interface);
+		return 1;
+	}
+
+	if (optpublish) {
+		shm = can_shm_create(optpublish, 0);
+		if (!shm) {
+			perror(optpublish);
+			return 1;
+		}
+	}
+
+	if (jfilter) {
+		filter_count = can_j1939_filter_compile(jfilter, J1939_FILTERS,
+							&filter);
+		if (filter_count < 0) {
+			perror("j1939");
+			exit(1);
+		}
+	}
+
 	if (filter) {
-		if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
-			       filter_count * sizeof(struct can_filter)) != 0) {
+		if (can_io_set_filter(io, filter, filter_count) != 0) {
 			perror("setsockopt");
 			exit(1);
 		}
 	}
 
 	if (error) {
-		if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask,
-			       sizeof(err_mask)) != 0) {
+		if (can_io_set_err_mask(io, err_mask) != 0) {
 			perror("setsockopt");
 			exit(1);
 		}
 	}
 
+	/* the open block of --compress is written on the way out */
 	if (optdaemon)
 		daemon(1, 0);
-	else {
-		signal(SIGTERM, sigterm);
-		signal(SIGHUP, sigterm);
+	else
+		set_signal(SIGHUP, sigterm);
+	set_signal(SIGTERM, sigterm);
+	set_signal(SIGINT, sigterm);
+	set_signal(SIGUSR1, sigusr1);
+	if (rec)
+		set_signal(SIGUSR2, sigusr2);
+
+	/* after daemon(), its thread wouldn't survive the fork */
+	if (optmetrics && can_metrics_serve(optmetrics)) {
+		perror(optmetrics);
+		return 1;
 	}
 
 	if (optout) {
@@ -221,25 +814,166 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* the index refers to offsets in the log, a FIFO has none */
+	if (optindex) {
+		if (fstat(fileno(out), &st) || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "%s: --index needs a regular file\n", optout);
+			exit (EXIT_FAILURE);
+		}
+		idxname = malloc(strlen(optout) + sizeof(".idx"));
+		if (!idxname)
+			exit (EXIT_FAILURE);
+		sprintf(idxname, "%s.idx", optout);
+		idx = can_index_open(idxname, st.st_size);
+		if (!idx) {
+			perror(idxname);
+			exit (EXIT_FAILURE);
+		}
+		free(idxname);
+	}
+
+	if (optcompress) {
+		clog = can_log_open(fileno(out));
+		if (!clog) {
+			perror(optout);
+			exit (EXIT_FAILURE);
+		}
+
+		/* interrupts the receive to close blocks on an idle bus */
+		set_signal(SIGALRM, sigalrm);
+		setitimer(ITIMER_REAL, &log_timer, NULL);
+	}
+
+	/* with io_uring the log is written through the ring, not stdio */
+	uring = can_io_backend(io) == CAN_IO_URING;
+	if (uring)
+		fflush(out);
+
 	while (running) {
-		if ((nbytes = read(s, &frame, sizeof(struct can_frame))) < 0) {
-			perror("read");
-			return 1;
-		} else {
-			if (frame.can_id & CAN_EFF_FLAG)
-				n = snprintf(buf, BUF_SIZ, "<0x%08x> ", frame.can_id & CAN_EFF_MASK);
-			else
-				n = snprintf(buf, BUF_SIZ, "<0x%03x> ", frame.can_id & CAN_SFF_MASK);
-
-			n += snprintf(buf + n, BUF_SIZ - n, "[%d] ", frame.can_dlc);
-			for (i = 0; i < frame.can_dlc; i++) {
-				n += snprintf(buf + n, BUF_SIZ - n, "%02x ", frame.data[i]);
+		if (dump_metrics) {
+			dump_metrics = 0;
+			can_metrics_print(stderr);
+		}
+
+		/* a reader gone from the FIFO is noticed by the next block */
+		if (log_tick) {
+			log_tick = 0;
+			clock_gettime(CLOCK_REALTIME, &now);
+			if (can_log_expire(clog, &now) && errno != EPIPE) {
+				perror("write");
+				return 1;
+			}
+		}
+
+		/* what a trigger released is written before receiving more */
+		nbytes = 0;
+		if (!rec || !can_recorder_pending(rec))
+			nbytes = can_io_recv(io, frames, ts, BATCH);
+		if (nbytes < 0) {
+			if (errno != EINTR) {
+				perror("read");
+				return 1;
+			}
+			if (!record_signal)
+				continue;
+			nbytes = 0;
+		}
+
+		/* only pay for the clock when someone is looking */
+		if ((nbytes || rec) && can_metrics_enabled())
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		/* not every backend has kernel timestamps */
+		if (ts)
+			for (i = 0; i < nbytes; i++)
+				if (!ts[i].tv_sec && !ts[i].tv_nsec)
+					clock_gettime(CLOCK_REALTIME, &ts[i]);
+
+		/* once per batch, after the filters, before any formatting */
+		if (shm && nbytes)
+			can_shm_publish(shm, frames, ts, nbytes);
+
+		/* the flight recorder passes on what a trigger released */
+		if (rec) {
+			if (record_signal) {
+				record_signal = 0;
+				clock_gettime(CLOCK_REALTIME, &now);
+				can_recorder_trigger(rec, &now);
+			}
+			can_recorder_add(rec, frames, ts, nbytes);
+			nbytes = can_recorder_take(rec, frames, ts, BATCH);
+
+			/* released frames overwritten before they were written */
+			if (can_recorder_lost(rec) != rec_lost) {
+				can_metric_add(CAN_METRIC_RX_DROPS,
+					       can_recorder_lost(rec) - rec_lost);
+				rec_lost = can_recorder_lost(rec);
 			}
-			if (frame.can_id & CAN_RTR_FLAG)
-				n += snprintf(buf + n, BUF_SIZ - n, "remote request");
+		}
 
-			fprintf(out, "%s\n", buf);
+		if (shm && !optout) {
+			/* nothing to print */
+		} else if (clog) {
+			for (i = 0; i < nbytes; i++) {
+				if (jfilter && !j1939_keep(&frames[i]))
+					continue;
+				if (!can_log_add(clog, &frames[i], &ts[i]))
+					continue;
+				if (errno != EPIPE) {
+					perror("write");
+					return 1;
+				}
 
+				/* a new reader of the FIFO needs a new log */
+				can_log_close(clog);
+				fclose(out);
+				out = fopen(optout, "a");
+				if (!out)
+					exit (EXIT_FAILURE);
+				clog = can_log_open(fileno(out));
+				if (!clog)
+					exit (EXIT_FAILURE);
+			}
+		} else if (uring) {
+			len = 0;
+			for (i = 0; i < nbytes; i++) {
+				n = format_line(obuf + len, &frames[i],
+						ts ? &ts[i] : NULL);
+				if (!n)
+					continue;
+				if (idx && can_index_add(idx, &frames[i], &ts[i], n)) {
+					perror("index");
+					return 1;
+				}
+				len += n;
+			}
+
+			while (can_io_write(io, fileno(out), obuf, len)) {
+				if (errno != EPIPE) {
+					perror("write");
+					return 1;
+				}
+				fclose(out);
+				out = fopen(optout, "a");
+				if (!out)
+					exit (EXIT_FAILURE);
+			}
+		} else {
+			len = 0;
+			for (i = 0; i < nbytes; i++) {
+				n = format_line(buf, &frames[i], ts ? &ts[i] : NULL);
+				if (!n)
+					continue;
+				if (idx && can_index_add(idx, &frames[i], &ts[i], n)) {
+					perror("index");
+					return 1;
+				}
+				fwrite(buf, 1, n, out);
+				len += n;
+			}
+			can_metric_add(CAN_METRIC_OUT_BYTES, len);
+
+			/* one flush per batch */
 			do {
 				err = fflush(out);
 				if (err == -1 && errno == EPIPE) {
@@ -250,10 +984,29 @@ int main(int argc, char **argv)
 						exit (EXIT_FAILURE);
 				}
 			} while (err == -EPIPE);
-
-			n = 0;
 		}
+
+		if (nbytes && can_metrics_enabled())
+			can_metric_observe(CAN_HIST_FRAME_NS,
+					   elapsed_ns(&t0) / nbytes, nbytes);
 	}
 
+	if (uring && can_io_flush(io))
+		perror("write");
+	if (clog && can_log_close(clog))
+		perror("write");
+	if (idx && can_index_close(idx))
+		perror("index");
+	can_dbc_free(dbc);
+	can_j1939_tp_free(jtp);
+	can_j1939_filter_free(jfilter);
+	can_isotp_free(isotp);
+	can_error_rate_free(erate);
+	can_shm_close(shm);
+	if (rec_lost)
+		fprintf(stderr, "recorder: %llu frames lost before they were "
+			"written\n", (unsigned long long)rec_lost);
+	can_recorder_free(rec);
+	can_io_close(io);
 	exit (EXIT_SUCCESS);
 }
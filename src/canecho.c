@@ -8,22 +8,93 @@
 #include <libgen.h>
 #include <getopt.h>
 #include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <netdb.h>
+#include <endian.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/uio.h>
-#include <sys/ioctl.h>
-#include <net/if.h>
+#include <netinet/in.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
+#include <canutils.h>
+
 extern int optind, opterr, optopt;
 
 static int running = 1;
+static volatile sig_atomic_t dump_metrics;
 
 enum {
 	VERSION_OPTION = CHAR_MAX + 1,
+	UDP_OPTION,
+	LISTEN_OPTION,
+	BATCH_OPTION,
+	FLUSH_OPTION,
+	IO_OPTION,
+	METRICS_OPTION,
+};
+
+/*
+ * CAN-over-UDP bridge
+ *
+ * Frames are packed into datagrams of the following layout, all fields
+ * in network byte order:
+ *
+ *   header: u16 magic, u8 version, u8 count, u32 sequence, u64 timestamp
+ *   frame:  u32 can_id, u32 timestamp delta, u8 dlc, u8 data[dlc]
+ *
+ * Timestamps are CLOCK_REALTIME in usecs, the per frame delta is relative
+ * to the header's timestamp. A datagram is sent when it holds --batch
+ * frames, when the next frame wouldn't fit or when its first frame has
+ * been waiting for --flush usecs.
+ */
+#define BRIDGE_MAGIC		0xca4e
+#define BRIDGE_VERSION		1
+#define BRIDGE_HDR_SIZE		16
+#define BRIDGE_FRAME_HDR_SIZE	9
+#define BRIDGE_DGRAM_SIZE	1472	/* fits into an ethernet MTU */
+#define BRIDGE_BATCH_MAX	((BRIDGE_DGRAM_SIZE - BRIDGE_HDR_SIZE) / \
+				 (BRIDGE_FRAME_HDR_SIZE + 8))
+#define BRIDGE_FLUSH_DEFAULT	1000
+
+/*
+ * Datagrams up to this far behind the expected one are late or
+ * duplicates. Further behind, or a sequence number 0 that isn't
+ * expected, the peer has started over.
+ */
+#define BRIDGE_REORDER_WINDOW	64
+
+struct bridge {
+	struct can_io *can_in;
+	struct can_io *can_out;
+	int udp;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	int batch;
+	int flush_us;
+	int verbose;
+
+	/* datagram being filled */
+	unsigned char buf[BRIDGE_DGRAM_SIZE];
+	size_t len;
+	int count;
+	uint64_t first_us;
+	uint32_t tx_seq;
+
+	uint32_t rx_seq;
+	int rx_seq_valid;
+	uint64_t rx_seen;		/* bit n: rx_seq - 1 - n was received */
+
+	unsigned long long tx_dgrams, tx_frames, tx_dropped;
+	unsigned long long rx_dgrams, rx_frames;
+	unsigned long long rx_lost, rx_reordered, rx_duplicates;
+	unsigned long long rx_restarts, rx_invalid;
 };
 
 void print_usage(char *prg)
@@ -38,9 +109,17 @@ void print_usage(char *prg)
 		" -t, --type=TYPE       Socket type, see man 2 socket (default SOCK_RAW = %d)\n"
 		" -p, --protocol=PROTO  CAN protocol (default CAN_RAW = %d)\n"
 		" -v, --verbose         be verbose\n"
+		"     --udp=HOST:PORT   bridge mode, tunnel frames to and from HOST:PORT\n"
+		"     --listen=[ADDR:]PORT\n"
+		"                       local UDP address (default: port of --udp)\n"
+		"     --batch=COUNT     frames per datagram (default = max = %d)\n"
+		"     --flush=USEC      max. time a frame is delayed (default = %d)\n"
+		"     --io=BACKEND      frame I/O: rw, mmsg, mmap, uring or sim (default $CANUTILS_IO or mmsg)\n"
+		"     --metrics=PATH    serve metrics on the unix socket PATH, SIGUSR1 prints them\n"
 		" -h, --help            this help\n"
 		"     --version         print version information and exit\n",
-		prg, PF_CAN, SOCK_RAW, CAN_RAW);
+		prg, PF_CAN, SOCK_RAW, CAN_RAW,
+		BRIDGE_BATCH_MAX, BRIDGE_FLUSH_DEFAULT);
 }
 
 void sigterm(int signo)
@@ -48,21 +127,439 @@ void sigterm(int signo)
 	running = 0;
 }
 
+void sigusr1(int signo)
+{
+	dump_metrics = 1;
+}
+
+static void set_signal(int signo, void (*handler)(int))
+{
+	struct sigaction sa;
+
+	/* no SA_RESTART, a blocking receive returns with EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signo, &sa, NULL);
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long elapsed_ns(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1000000000L +
+		t1.tv_nsec - t0->tv_nsec;
+}
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get_be16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return be16toh(v);
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return be32toh(v);
+}
+
+/* split "[host:]port", host may be a bracketed IPv6 address */
+static int parse_hostport(char *arg, char **host, char **port)
+{
+	char *colon = strrchr(arg, ':');
+
+	if (!colon) {
+		*host = NULL;
+		*port = arg;
+		return 0;
+	}
+
+	*colon = '\0';
+	*host = arg;
+	*port = colon + 1;
+	if (**host == '[') {
+		(*host)++;
+		colon = strchr(*host, ']');
+		if (!colon)
+			return -1;
+		*colon = '\0';
+	}
+	if (!**host)
+		*host = NULL;
+
+	return **port ? 0 : -1;
+}
+
+static int bridge_open(struct bridge *b, char *peer, char *local)
+{
+	struct addrinfo hints, *res;
+	char *host, *port;
+	int err;
+
+	if (parse_hostport(peer, &host, &port) || !host) {
+		fprintf(stderr, "--udp must be given as HOST:PORT\n");
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+	memcpy(&b->peer, res->ai_addr, res->ai_addrlen);
+	b->peer_len = res->ai_addrlen;
+	hints.ai_family = res->ai_family;
+	freeaddrinfo(res);
+
+	if (local) {
+		if (parse_hostport(local, &host, &port)) {
+			fprintf(stderr, "--listen must be given as [ADDR:]PORT\n");
+			return -1;
+		}
+	} else {
+		host = NULL;
+	}
+
+	hints.ai_flags = AI_PASSIVE;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", host ? host : port, gai_strerror(err));
+		return -1;
+	}
+
+	b->udp = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (b->udp < 0) {
+		perror("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (bind(b->udp, res->ai_addr, res->ai_addrlen) < 0) {
+		perror("bind");
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	fcntl(b->udp, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+static int bridge_flush(struct bridge *b)
+{
+	ssize_t len;
+
+	if (!b->count)
+		return 0;
+
+	put_be16(b->buf, BRIDGE_MAGIC);
+	b->buf[2] = BRIDGE_VERSION;
+	b->buf[3] = b->count;
+	put_be32(b->buf + 4, b->tx_seq++);
+	put_be64(b->buf + 8, b->first_us);
+
+	do {
+		len = sendto(b->udp, b->buf, b->len, 0,
+			     (struct sockaddr *)&b->peer, b->peer_len);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0 && errno != EAGAIN && errno != ENOBUFS &&
+	    errno != ECONNREFUSED) {
+		perror("sendto");
+		return -1;
+	}
+
+	/* the receiving side sees a lost datagram, count it here as well */
+	if (len < 0) {
+		b->tx_dropped += b->count;
+		can_metric_add(CAN_METRIC_TX_DROPS, b->count);
+	} else {
+		b->tx_dgrams++;
+		b->tx_frames += b->count;
+	}
+	b->count = 0;
+	b->len = BRIDGE_HDR_SIZE;
+
+	return 0;
+}
+
+static int bridge_add(struct bridge *b, const struct canfd_frame *frame,
+		      uint64_t ts)
+{
+	unsigned char *p;
+
+	if (b->count == b->batch ||
+	    b->len + BRIDGE_FRAME_HDR_SIZE + frame->len > sizeof(b->buf))
+		if (bridge_flush(b))
+			return -1;
+
+	if (!b->count)
+		b->first_us = ts;
+
+	p = b->buf + b->len;
+	put_be32(p, frame->can_id);
+	put_be32(p + 4, ts - b->first_us);
+	p[8] = frame->len;
+	memcpy(p + BRIDGE_FRAME_HDR_SIZE, frame->data, frame->len);
+
+	b->len += BRIDGE_FRAME_HDR_SIZE + frame->len;
+	b->count++;
+
+	if (b->count == b->batch)
+		return bridge_flush(b);
+
+	return 0;
+}
+
+/* the can_io is opened with "wait", i.e. this blocks for buffer space */
+static int can_write(struct can_io *io, const struct canfd_frame *frames,
+		     int n)
+{
+	int sent = 0, ret;
+
+	while (sent < n) {
+		ret = can_io_send(io, frames + sent, n - sent);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		sent += ret;
+	}
+
+	return 0;
+}
+
+static int bridge_inject(struct bridge *b, const unsigned char *buf, size_t len)
+{
+	struct canfd_frame frames[BRIDGE_BATCH_MAX];
+	struct canfd_frame *frame;
+	const unsigned char *p, *end = buf + len;
+	uint32_t seq;
+	int32_t diff;
+	int count, i;
+
+	if (len < BRIDGE_HDR_SIZE || get_be16(buf) != BRIDGE_MAGIC ||
+	    buf[2] != BRIDGE_VERSION) {
+		b->rx_invalid++;
+		return 0;
+	}
+
+	count = buf[3];
+	seq = get_be32(buf + 4);
+
+	diff = (int32_t)(seq - b->rx_seq);
+	if (b->rx_seq_valid && diff < 0 &&
+	    (diff < -BRIDGE_REORDER_WINDOW || !seq)) {
+		b->rx_restarts++;
+		if (b->verbose)
+			printf("peer started over. expected: %u, got: %u\n",
+			       b->rx_seq, seq);
+		b->rx_seq_valid = 0;
+	}
+	if (!b->rx_seq_valid) {
+		b->rx_seq = seq;
+		b->rx_seq_valid = 1;
+		b->rx_seen = 0;
+		diff = 0;
+	}
+
+	if (diff > 0) {
+		b->rx_lost += diff;
+		if (b->verbose)
+			printf("lost %d datagram(s). expected: %u, got: %u\n",
+			       diff, b->rx_seq, seq);
+	} else if (diff < 0 && b->rx_seen & 1ULL << (-diff - 1)) {
+		b->rx_duplicates++;
+		if (b->verbose)
+			printf("duplicate datagram. expected: %u, got: %u\n",
+			       b->rx_seq, seq);
+		return 0;
+	} else if (diff < 0) {
+		/* a late datagram was counted as lost before */
+		b->rx_reordered++;
+		if (b->rx_lost)
+			b->rx_lost--;
+		b->rx_seen |= 1ULL << (-diff - 1);
+		if (b->verbose)
+			printf("reordered datagram. expected: %u, got: %u\n",
+			       b->rx_seq, seq);
+	}
+	if (diff >= 0) {
+		b->rx_seen = diff + 1 < 64 ? b->rx_seen << (diff + 1) : 0;
+		b->rx_seen |= 1;
+		b->rx_seq = seq + 1;
+	}
+
+	b->rx_dgrams++;
+
+	/* the datagram's frames are sent with a single can_io_send() */
+	p = buf + BRIDGE_HDR_SIZE;
+	for (i = 0; i < count && i < BRIDGE_BATCH_MAX; i++) {
+		if (p + BRIDGE_FRAME_HDR_SIZE > end ||
+		    p[8] > 8 || p + BRIDGE_FRAME_HDR_SIZE + p[8] > end) {
+			b->rx_invalid++;
+			break;
+		}
+
+		frame = &frames[i];
+		memset(frame, 0, sizeof(*frame));
+		frame->can_id = get_be32(p);
+		frame->len = p[8];
+		memcpy(frame->data, p + BRIDGE_FRAME_HDR_SIZE, frame->len);
+		p += BRIDGE_FRAME_HDR_SIZE + frame->len;
+	}
+
+	if (can_write(b->can_out, frames, i))
+		return -1;
+	b->rx_frames += i;
+
+	return 0;
+}
+
+static int bridge_loop(struct bridge *b)
+{
+	unsigned char buf[BRIDGE_DGRAM_SIZE];
+	struct canfd_frame frames[BRIDGE_BATCH_MAX];
+	struct pollfd fds[2];
+	int timeout, i, n;
+	ssize_t len;
+	int64_t left;
+
+	b->len = BRIDGE_HDR_SIZE;
+
+	fds[0].fd = can_io_fd(b->can_in);
+	fds[0].events = POLLIN;
+	fds[1].fd = b->udp;
+	fds[1].events = POLLIN;
+
+	while (running) {
+		if (dump_metrics) {
+			dump_metrics = 0;
+			can_metrics_print(stderr);
+		}
+
+		timeout = -1;
+		if (b->count) {
+			left = b->first_us + b->flush_us - now_us();
+			if (left <= 0) {
+				if (bridge_flush(b))
+					return 1;
+				continue;
+			}
+			timeout = (left + 999) / 1000;
+		}
+
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		/* drain at most one batch, then give the other direction a turn */
+		if (fds[0].revents) {
+			n = can_io_recv(b->can_in, frames, NULL, b->batch);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("read");
+				return 1;
+			}
+			for (i = 0; i < n; i++)
+				if (bridge_add(b, &frames[i], now_us()))
+					return 1;
+		}
+
+		while (fds[1].revents) {
+			len = recv(b->udp, buf, sizeof(buf), 0);
+			if (len < 0) {
+				if (errno == EAGAIN || errno == EINTR ||
+				    errno == ECONNREFUSED)
+					break;
+				perror("recv");
+				return 1;
+			}
+			if (bridge_inject(b, buf, len))
+				return 1;
+		}
+	}
+
+	bridge_flush(b);
+
+	printf("tx: %llu frames in %llu datagrams, dropped: %llu frames, "
+	       "rx: %llu frames in %llu datagrams, "
+	       "lost: %llu, reordered: %llu, duplicates: %llu, "
+	       "restarts: %llu, invalid: %llu\n",
+	       b->tx_frames, b->tx_dgrams, b->tx_dropped,
+	       b->rx_frames, b->rx_dgrams, b->rx_lost, b->rx_reordered,
+	       b->rx_duplicates, b->rx_restarts, b->rx_invalid);
+
+	return 0;
+}
+
+#define ECHO_BATCH	32
+
 int main(int argc, char **argv)
 {
-	struct can_frame frame;
-	struct ifreq ifr[2];
-	struct sockaddr_can addr[2];
+	struct canfd_frame frames[ECHO_BATCH];
+	struct can_io *io[2];
+	struct can_io_opts io_opts = {
+		.batch = ECHO_BATCH,
+		.wait = 1,
+	};
+	char buf[CAN_FRAME_FORMAT_SIZE];
 	char *intf_name[2];
 	int family = PF_CAN, type = SOCK_RAW, proto = CAN_RAW;
 	int nbytes, i, out;
-	int opt;
-	int s[2];
+	int opt, backend;
 	int verbose = 0;
+	char *udp = NULL, *local = NULL;
+	char *metrics = NULL;
+	struct timespec t0;
+	struct bridge bridge = {
+		.batch = BRIDGE_BATCH_MAX,
+		.flush_us = BRIDGE_FLUSH_DEFAULT,
+	};
 
-	signal(SIGTERM, sigterm);
-	signal(SIGHUP, sigterm);
-	signal(SIGINT, sigterm);
+	set_signal(SIGTERM, sigterm);
+	set_signal(SIGHUP, sigterm);
+	set_signal(SIGINT, sigterm);
+	set_signal(SIGUSR1, sigusr1);
 
 	struct option long_options[] = {
 		{ "help", no_argument, 0, 'h' },
@@ -71,6 +568,12 @@ int main(int argc, char **argv)
 		{ "type", required_argument, 0, 't' },
 		{ "version", no_argument, 0, VERSION_OPTION},
 		{ "verbose", no_argument, 0, 'v'},
+		{ "udp", required_argument, 0, UDP_OPTION },
+		{ "listen", required_argument, 0, LISTEN_OPTION },
+		{ "batch", required_argument, 0, BATCH_OPTION },
+		{ "flush", required_argument, 0, FLUSH_OPTION },
+		{ "io", required_argument, 0, IO_OPTION },
+		{ "metrics", required_argument, 0, METRICS_OPTION },
 		{ 0, 0, 0, 0},
 	};
 
@@ -96,6 +599,40 @@ int main(int argc, char **argv)
 			print_usage(basename(argv[0]));
 			exit(0);
 
+		case UDP_OPTION:
+			udp = optarg;
+			break;
+
+		case LISTEN_OPTION:
+			local = optarg;
+			break;
+
+		case BATCH_OPTION:
+			bridge.batch = strtoul(optarg, NULL, 0);
+			if (bridge.batch < 1 || bridge.batch > BRIDGE_BATCH_MAX) {
+				fprintf(stderr, "batch must be within 1...%d\n",
+					BRIDGE_BATCH_MAX);
+				exit(1);
+			}
+			break;
+
+		case FLUSH_OPTION:
+			bridge.flush_us = strtoul(optarg, NULL, 0);
+			break;
+
+		case IO_OPTION:
+			backend = can_io_backend_parse(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "unknown I/O backend %s\n", optarg);
+				exit(1);
+			}
+			io_opts.backend = backend;
+			break;
+
+		case METRICS_OPTION:
+			metrics = optarg;
+			break;
+
 		case VERSION_OPTION:
 			printf("canecho %s\n",VERSION);
 			exit(0);
@@ -125,42 +662,81 @@ int main(int argc, char **argv)
 	else
 		out = 1;
 
+	/* frame I/O is done by libcanutils, which only knows about CAN_RAW */
+	if (family != PF_CAN || type != SOCK_RAW || proto != CAN_RAW) {
+		fprintf(stderr, "-f, -t and -p: only PF_CAN, SOCK_RAW, CAN_RAW is supported\n");
+		return 1;
+	}
+
+	/* the bridge polls the CAN and the UDP socket */
+	if (udp)
+		io_opts.nonblock = 1;
+
+	if (metrics && can_metrics_serve(metrics)) {
+		perror(metrics);
+		return 1;
+	}
+
 	for (i = 0; i <= out; i++) {
-		if ((s[i] = socket(family, type, proto)) < 0) {
-			perror("socket");
+		io[i] = can_io_open(intf_name[i], &io_opts);
+		if (!io[i]) {
+			perror(intf_name[i]);
 			return 1;
 		}
+	}
 
-		addr[i].can_family = family;
-		strcpy(ifr[i].ifr_name, intf_name[i]);
-		ioctl(s[i], SIOCGIFINDEX, &ifr[i]);
-		addr[i].can_ifindex = ifr[i].ifr_ifindex;
-
-		if (bind(s[i], (struct sockaddr *)&addr[i], sizeof(addr)) < 0) {
-			perror("bind");
+	if (udp) {
+		/*
+		 * frames queued by the ring don't wake up poll(2), the fd of a
+		 * shm ring is a regular file, which always does
+		 */
+		if (can_io_backend(io[0]) == CAN_IO_URING ||
+		    can_io_backend(io[0]) == CAN_IO_SHM) {
+			fprintf(stderr, "--udp doesn't support the %s backend\n",
+				can_io_backend(io[0]) == CAN_IO_URING ?
+				"uring" : "shm");
 			return 1;
 		}
+
+		bridge.can_in = io[0];
+		bridge.can_out = io[out];
+		bridge.verbose = verbose;
+		if (bridge_open(&bridge, udp, local))
+			return 1;
+
+		return bridge_loop(&bridge);
 	}
 
 	while (running) {
-		if ((nbytes = read(s[0], &frame, sizeof(frame))) < 0) {
+		if (dump_metrics) {
+			dump_metrics = 0;
+			can_metrics_print(stderr);
+		}
+
+		if ((nbytes = can_io_recv(io[0], frames, NULL, ECHO_BATCH)) < 0) {
+			if (errno == EINTR)
+				continue;
 			perror("read");
 			return 1;
 		}
-		if (verbose) {
-			printf("%04x: ", frame.can_id);
-			if (frame.can_id & CAN_RTR_FLAG) {
-				printf("remote request");
-			} else {
-				printf("[%d]", frame.can_dlc);
-				for (i = 0; i < frame.can_dlc; i++) {
-					printf(" %02x", frame.data[i]);
-				}
+
+		/* only pay for the clock when someone is looking */
+		if (nbytes && can_metrics_enabled())
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		for (i = 0; i < nbytes; i++) {
+			if (verbose) {
+				can_frame_format(buf, sizeof(buf), &frames[i]);
+				printf("%s\n", buf);
 			}
-			printf("\n");
+			frames[i].can_id++;
 		}
-		frame.can_id++;
-		write(s[out], &frame, sizeof(frame));
+		if (can_write(io[out], frames, nbytes))
+			return 1;
+
+		if (nbytes && can_metrics_enabled())
+			can_metric_observe(CAN_HIST_FRAME_NS,
+					   elapsed_ns(&t0) / nbytes, nbytes);
 	}
 
 	return 0;
@@ -0,0 +1,313 @@
+/*
+ * canutils/canerror.c - decoding and rates of error frames
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+#include "canutils.h"
+
+#ifndef CAN_ERR_CNT
+#define CAN_ERR_CNT	0x00000200U	/* error counters in data[6..7] */
+#endif
+
+/* indexed by the bit of the class in the id */
+static const char *class_names[CAN_ERROR_CLASSES] = {
+	"tx-timeout",
+	"lost-arbitration",
+	"controller",
+	"protocol",
+	"transceiver",
+	"ack",
+	"bus-off",
+	"bus-error",
+	"restarted",
+	"counters",
+};
+
+/* data[1], by bit */
+static const char *crtl_names[] = {
+	"rx-overflow", "tx-overflow", "rx-warning", "tx-warning",
+	"rx-passive", "tx-passive", "active",
+};
+
+/* data[2], by bit */
+static const char *prot_names[] = {
+	"bit", "form", "stuff", "bit0", "bit1", "overload", "active", "tx",
+};
+
+/* data[3] */
+static const struct {
+	unsigned char loc;
+	const char *name;
+} prot_locs[] = {
+	{ CAN_ERR_PROT_LOC_SOF, "sof" },
+	{ CAN_ERR_PROT_LOC_ID28_21, "id28-21" },
+	{ CAN_ERR_PROT_LOC_ID20_18, "id20-18" },
+	{ CAN_ERR_PROT_LOC_SRTR, "srtr" },
+	{ CAN_ERR_PROT_LOC_IDE, "ide" },
+	{ CAN_ERR_PROT_LOC_ID17_13, "id17-13" },
+	{ CAN_ERR_PROT_LOC_ID12_05, "id12-05" },
+	{ CAN_ERR_PROT_LOC_ID04_00, "id04-00" },
+	{ CAN_ERR_PROT_LOC_RTR, "rtr" },
+	{ CAN_ERR_PROT_LOC_RES1, "res1" },
+	{ CAN_ERR_PROT_LOC_RES0, "res0" },
+	{ CAN_ERR_PROT_LOC_DLC, "dlc" },
+	{ CAN_ERR_PROT_LOC_DATA, "data" },
+	{ CAN_ERR_PROT_LOC_CRC_SEQ, "crc-seq" },
+	{ CAN_ERR_PROT_LOC_CRC_DEL, "crc-del" },
+	{ CAN_ERR_PROT_LOC_ACK, "ack" },
+	{ CAN_ERR_PROT_LOC_ACK_DEL, "ack-del" },
+	{ CAN_ERR_PROT_LOC_EOF, "eof" },
+	{ CAN_ERR_PROT_LOC_INTERM, "intermission" },
+};
+
+/* data[4], CANH in the low, CANL in the high nibble */
+static const char *trx_names[] = {
+	[0x4] = "no-wire",
+	[0x5] = "short-to-bat",
+	[0x6] = "short-to-vcc",
+	[0x7] = "short-to-gnd",
+	[0x8] = "short-to-canh",	/* CANL only */
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+const char *can_error_class_name(int class)
+{
+	if (class < 0 || class >= CAN_ERROR_CLASSES)
+		return NULL;
+
+	return class_names[class];
+}
+
+struct out {
+	char *buf;
+	size_t size, len;
+};
+
+static void put(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (o->len >= o->size)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		o->len += n;
+	if (o->len >= o->size)
+		o->len = o->size - 1;
+}
+
+/* the set bits of "v" named by "names", "(a,b)" */
+static void put_bits(struct out *o, unsigned int v, const char **names,
+		     size_t count)
+{
+	const char *sep = "(";
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!(v & (1u << i)))
+			continue;
+		put(o, "%s%s", sep, names[i]);
+		sep = ",";
+	}
+	if (*sep == ',')
+		put(o, ")");
+}
+
+static void put_trx(struct out *o, const char *wire, unsigned int v)
+{
+	if (v < ARRAY_SIZE(trx_names) && trx_names[v])
+		put(o, "%s%s", wire, trx_names[v]);
+	else
+		put(o, "%s0x%x", wire, v);
+}
+
+int can_error_format(char *buf, size_t size, const struct canfd_frame *frame)
+{
+	struct out o = { buf, size, 0 };
+	const unsigned char *d = frame->data;
+	canid_t id = frame->can_id;
+	int class;
+	size_t i;
+
+	if (!size || !(id & CAN_ERR_FLAG))
+		return 0;
+	buf[0] = '\0';
+
+	put(&o, " error:");
+	for (class = 0; class < CAN_ERROR_CLASSES; class++) {
+		if (!(id & (1u << class)))
+			continue;
+		put(&o, " %s", class_names[class]);
+
+		switch (1u << class) {
+		case CAN_ERR_LOSTARB:
+			if (d[0])
+				put(&o, "(bit %u)", d[0]);
+			break;
+
+		case CAN_ERR_CRTL:
+			put_bits(&o, d[1], crtl_names, ARRAY_SIZE(crtl_names));
+			break;
+
+		case CAN_ERR_PROT:
+			put_bits(&o, d[2], prot_names, ARRAY_SIZE(prot_names));
+			for (i = 0; i < ARRAY_SIZE(prot_locs); i++)
+				if (d[3] && prot_locs[i].loc == d[3])
+					put(&o, "@%s", prot_locs[i].name);
+			break;
+
+		case CAN_ERR_TRX:
+			if (d[4] & 0x0f)
+				put_trx(&o, "(canh-", d[4] & 0x0f);
+			if (d[4] & 0xf0)
+				put_trx(&o, d[4] & 0x0f ? ",canl-" : "(canl-",
+					d[4] >> 4);
+			if (d[4])
+				put(&o, ")");
+			break;
+
+		case CAN_ERR_CNT:
+			put(&o, "(tx=%u,rx=%u)", d[6], d[7]);
+			break;
+		}
+	}
+
+	return o.len;
+}
+
+/*
+ * The errors of each class are counted in 10 slots of 100 ms, the rate
+ * is their sum over the last second, updated as the slots move on.
+ */
+#define SLOTS		10
+#define SLOT_NS		100000000LL
+
+struct class_rate {
+	unsigned int slot[SLOTS];
+	unsigned int sum;
+	unsigned int limit;
+	int alarm;		/* has a limit */
+	int raised;
+};
+
+struct can_error_rate {
+	int64_t now;		/* the current slot, in SLOT_NS since the epoch */
+	struct class_rate c[CAN_ERROR_CLASSES];
+};
+
+struct can_error_rate *can_error_rate_new(void)
+{
+	return calloc(1, sizeof(struct can_error_rate));
+}
+
+void can_error_rate_free(struct can_error_rate *r)
+{
+	free(r);
+}
+
+int can_error_rate_set_alarms(struct can_error_rate *r, const char *spec)
+{
+	const char *p = spec, *colon;
+	unsigned long limit;
+	char *end;
+	int class;
+
+	while (1) {
+		colon = strchr(p, ':');
+		if (!colon)
+			goto inval;
+		for (class = 0; class < CAN_ERROR_CLASSES; class++)
+			if (strlen(class_names[class]) == (size_t)(colon - p) &&
+			    !strncmp(class_names[class], p, colon - p))
+				break;
+		if (class == CAN_ERROR_CLASSES)
+			goto inval;
+
+		limit = strtoul(colon + 1, &end, 0);
+		if (end == colon + 1 || (*end != ',' && *end != '\0'))
+			goto inval;
+		r->c[class].limit = limit;
+		r->c[class].alarm = 1;
+
+		if (!*end)
+			return 0;
+		p = end + 1;
+	}
+
+ inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static void advance(struct can_error_rate *r, int64_t ns)
+{
+	int64_t now = ns / SLOT_NS, k;
+	struct class_rate *c;
+	unsigned int i;
+
+	/* time going backwards stays in the current slot */
+	if (now <= r->now)
+		return;
+
+	for (k = r->now + 1; k <= now && k <= r->now + SLOTS; k++) {
+		i = k % SLOTS;
+		for (c = r->c; c < r->c + CAN_ERROR_CLASSES; c++) {
+			c->sum -= c->slot[i];
+			c->slot[i] = 0;
+		}
+	}
+	r->now = now;
+}
+
+int can_error_rate_add(struct can_error_rate *r,
+		       const struct canfd_frame *frame, int64_t ns,
+		       struct can_error_alarm *alarms)
+{
+	struct class_rate *c;
+	int class, n = 0;
+
+	advance(r, ns);
+
+	for (class = 0; class < CAN_ERROR_CLASSES; class++) {
+		c = &r->c[class];
+		if (frame && frame->can_id & CAN_ERR_FLAG &&
+		    frame->can_id & (1u << class)) {
+			c->slot[r->now % SLOTS]++;
+			c->sum++;
+		}
+
+		if (!c->alarm || c->raised == (c->sum > c->limit))
+			continue;
+		c->raised = !c->raised;
+		alarms[n].class = class;
+		alarms[n].raised = c->raised;
+		alarms[n].rate = c->sum;
+		alarms[n].limit = c->limit;
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,155 @@
+/*
+ * canutils/canframe.c - parsing and formatting of frames and filters
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+static const char hex[] = "0123456789abcdef";
+
+/* no snprintf(3) per byte, this is called for every dumped frame */
+int can_frame_format(char *buf, size_t size, const struct canfd_frame *frame)
+{
+	char tmp[CAN_FRAME_FORMAT_SIZE];
+	int n, i;
+
+	/* error frames keep their flag, no id has bit 29 set */
+	if (frame->can_id & CAN_ERR_FLAG)
+		n = sprintf(tmp, "<0x%08x> ",
+			    frame->can_id & (CAN_ERR_FLAG | CAN_ERR_MASK));
+	else if (frame->can_id & CAN_EFF_FLAG)
+		n = sprintf(tmp, "<0x%08x> ", frame->can_id & CAN_EFF_MASK);
+	else
+		n = sprintf(tmp, "<0x%03x> ", frame->can_id & CAN_SFF_MASK);
+
+	n += sprintf(tmp + n, "[%d] ", frame->len);
+	for (i = 0; i < frame->len && i < CANFD_MAX_DLEN; i++) {
+		tmp[n++] = hex[frame->data[i] >> 4];
+		tmp[n++] = hex[frame->data[i] & 0xf];
+		tmp[n++] = ' ';
+	}
+	if (frame->can_id & CAN_RTR_FLAG)
+		n += sprintf(tmp + n, "remote request");
+	tmp[n] = '\0';
+
+	if (size) {
+		memcpy(buf, tmp, (size_t)n < size ? n + 1 : size);
+		buf[size - 1] = '\0';
+	}
+
+	return n;
+}
+
+int can_frame_parse(const char *s, struct canfd_frame *frame)
+{
+	const char *p;
+	char *end;
+	unsigned long v;
+	int i;
+
+	memset(frame, 0, sizeof(*frame));
+
+	p = strchr(s, '<');
+	if (!p)
+		return -1;
+	p++;
+	v = strtoul(p, &end, 16);
+	if (end == p || *end != '>')
+		return -1;
+
+	/* extended ids are always printed with 8 digits */
+	if (v & CAN_ERR_FLAG)
+		frame->can_id = v & (CAN_ERR_FLAG | CAN_ERR_MASK);
+	else if (end - p > 5 || v > CAN_SFF_MASK)
+		frame->can_id = (v & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	else
+		frame->can_id = v;
+
+	p = strchr(end, '[');
+	if (!p)
+		return -1;
+	p++;
+	v = strtoul(p, &end, 10);
+	if (end == p || *end != ']' || v > CANFD_MAX_DLEN)
+		return -1;
+	frame->len = v;
+	if (v > CAN_MAX_DLEN)
+		frame->flags = CANFD_FDF;
+	p = end + 1;
+
+	if (strstr(p, "remote request")) {
+		frame->can_id |= CAN_RTR_FLAG;
+		return 0;
+	}
+
+	for (i = 0; i < frame->len; i++) {
+		v = strtoul(p, &end, 16);
+		if (end == p || v > 0xff)
+			return -1;
+		frame->data[i] = v;
+		p = end;
+	}
+
+	return 0;
+}
+
+int can_filter_match(const struct can_filter *filter,
+		     const struct canfd_frame *frame)
+{
+	canid_t id = filter->can_id & ~CAN_INV_FILTER;
+	int match;
+
+	match = (frame->can_id & filter->can_mask) == (id & filter->can_mask);
+
+	return filter->can_id & CAN_INV_FILTER ? !match : match;
+}
+
+int can_filter_parse(const char *s, struct can_filter **filter)
+{
+	struct can_filter *f = NULL, *tmp;
+	const char *p = s;
+	char *end;
+	int count = 0;
+
+	while (1) {
+		tmp = realloc(f, sizeof(*f) * (count + 1));
+		if (!tmp)
+			goto err;
+		f = tmp;
+
+		f[count].can_id = strtoul(p, &end, 0);
+		if (end == p || *end != ':')
+			goto err;
+		p = end + 1;
+
+		f[count].can_mask = strtoul(p, &end, 0);
+		if (end == p || (*end != ':' && *end != '\0'))
+			goto err;
+		count++;
+
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+
+	*filter = f;
+	return count;
+
+ err:
+	free(f);
+	return -1;
+}
@@ -0,0 +1,145 @@
+/*
+ * canutils/canindex.c - time and id index of candump logs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+struct can_index {
+	int fd;
+	uint64_t offset;		/* of the next line */
+	struct can_index_block block;	/* being filled */
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+struct can_index *can_index_open(const char *path, uint64_t offset)
+{
+	struct can_index_header hdr;
+	struct can_index *idx;
+	struct stat st;
+	int err;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		return NULL;
+	idx->offset = offset;
+
+	idx->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (idx->fd < 0)
+		goto err;
+	if (fstat(idx->fd, &st))
+		goto err_close;
+
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CAN_INDEX_MAGIC, sizeof(hdr.magic));
+		hdr.block_frames = CAN_INDEX_BLOCK_FRAMES;
+		hdr.id_bits = CAN_INDEX_ID_BITS;
+		if (write_all(idx->fd, &hdr, sizeof(hdr)))
+			goto err_close;
+	} else if (pread(idx->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		   memcmp(hdr.magic, CAN_INDEX_MAGIC, sizeof(hdr.magic)) ||
+		   hdr.id_bits != CAN_INDEX_ID_BITS ||
+		   (st.st_size - sizeof(hdr)) % sizeof(struct can_index_block)) {
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	return idx;
+
+ err_close:
+	err = errno;
+	close(idx->fd);
+	errno = err;
+ err:
+	free(idx);
+	return NULL;
+}
+
+static int flush_block(struct can_index *idx)
+{
+	int ret;
+
+	if (!idx->block.frames)
+		return 0;
+
+	ret = write_all(idx->fd, &idx->block, sizeof(idx->block));
+	memset(&idx->block, 0, sizeof(idx->block));
+
+	return ret;
+}
+
+int can_index_add(struct can_index *idx, const struct canfd_frame *frame,
+		  const struct timespec *ts, size_t len)
+{
+	struct can_index_block *b = &idx->block;
+	int64_t ns = ts->tv_sec * 1000000000LL + ts->tv_nsec;
+	unsigned int bit = can_index_id_bit(frame->can_id);
+
+	if (!b->frames) {
+		b->offset = idx->offset;
+		b->first_ns = ns;
+		b->last_ns = ns;
+	} else if (ns < b->first_ns) {
+		b->first_ns = ns;
+	} else if (ns > b->last_ns) {
+		b->last_ns = ns;
+	}
+
+	b->ids[bit / 64] |= 1ULL << (bit % 64);
+	b->length += len;
+	idx->offset += len;
+
+	if (++b->frames == CAN_INDEX_BLOCK_FRAMES)
+		return flush_block(idx);
+
+	return 0;
+}
+
+int can_index_close(struct can_index *idx)
+{
+	int ret;
+
+	ret = flush_block(idx);
+	if (close(idx->fd))
+		ret = -1;
+	free(idx);
+
+	return ret;
+}
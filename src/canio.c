@@ -0,0 +1,748 @@
+/*
+ * canutils/canio.c - frame I/O backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "canio.h"
+
+/*
+ * The rx ring holds 4096 frames of 256 bytes, enough for the tpacket
+ * header, the sockaddr_ll and a struct canfd_frame.
+ */
+#define CAN_IO_RING_FRAME_SIZE	256
+#define CAN_IO_RING_BLOCK_SIZE	4096
+#define CAN_IO_RING_BLOCKS	256
+
+/* transmitted frames are marked to tell them apart from the rx ring */
+#define CAN_IO_MARK_BASE	0xca400000
+
+static const char *backend_names[] = {
+	[CAN_IO_DEFAULT] = "default",
+	[CAN_IO_RW] = "rw",
+	[CAN_IO_MMSG] = "mmsg",
+	[CAN_IO_MMAP] = "mmap",
+	[CAN_IO_URING] = "uring",
+	[CAN_IO_SIM] = "sim",
+	[CAN_IO_SHM] = "shm",
+};
+
+int can_io_backend_parse(const char *name)
+{
+	int i;
+
+	for (i = CAN_IO_RW; i <= CAN_IO_SHM; i++)
+		if (!strcmp(name, backend_names[i]))
+			return i;
+
+	return -1;
+}
+
+const char *can_io_backend_name(enum can_io_backend backend)
+{
+	if (backend > CAN_IO_SHM)
+		return "unknown";
+
+	return backend_names[backend];
+}
+
+size_t can_io_frame_mtu(const struct can_io *io,
+			const struct canfd_frame *frame)
+{
+	if (io->fd_frames && (frame->flags & CANFD_FDF || frame->len > CAN_MAX_DLEN))
+		return CANFD_MTU;
+
+	return CAN_MTU;
+}
+
+/* returns 0 if "len" bytes are not a valid frame */
+int can_io_frame_fixup(const struct can_io *io, struct canfd_frame *frame,
+		       size_t len)
+{
+	if (len == CANFD_MTU && io->fd_frames) {
+		frame->flags |= CANFD_FDF;
+		return 1;
+	}
+	if (len == CAN_MTU) {
+		frame->flags = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void can_io_get_timestamp(struct msghdr *msg, struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	ts->tv_sec = 0;
+	ts->tv_nsec = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+}
+
+/* CAN_RAW's CAN_RAW_FILTER and CAN_RAW_ERR_FILTER */
+int can_io_match(const struct can_io *io, const struct canfd_frame *frame)
+{
+	int i;
+
+	if (frame->can_id & CAN_ERR_FLAG)
+		return !!(frame->can_id & io->err_mask & CAN_ERR_MASK);
+
+	for (i = 0; i < io->filter_count; i++)
+		if (can_filter_match(&io->filter[i], frame))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * The rx ring sees everything on the interface, so CAN_RAW's filtering
+ * is done with a classic BPF program: drop outgoing packets and our own
+ * (marked) frames echoed back, then check the error mask or the filters
+ * like CAN_RAW does. The can_id is loaded in network byte order, the
+ * constants it is compared to are converted accordingly.
+ */
+#define BPF_MAX_FILTER	1000
+#define BPF_MAX_PROG	(16 + 4 * BPF_MAX_FILTER + 1)
+
+static int ring_attach_filter(struct can_io *io)
+{
+	struct sock_filter *prog, *p;
+	struct sock_fprog fprog;
+	const struct can_filter *f;
+	canid_t id, mask;
+	int i, ret;
+
+	if (io->filter_count > BPF_MAX_FILTER) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	prog = malloc(BPF_MAX_PROG * sizeof(*prog));
+	if (!prog)
+		return -1;
+	p = prog;
+
+	*p++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 1);
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	if (io->mark) {
+		*p++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_MARK);
+		*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, io->mark, 0, 1);
+		*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	}
+
+	*p++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+	*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_CAN, 2, 0);
+	*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_CANFD,
+					    io->fd_frames ? 1 : 0, 0);
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	/* error frames only pass the error mask, never the filters */
+	*p++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0);
+	*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htonl(CAN_ERR_FLAG), 0, 3);
+	*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,
+					    htonl(io->err_mask & CAN_ERR_MASK), 0, 1);
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	for (i = 0; i < io->filter_count; i++) {
+		f = &io->filter[i];
+		mask = f->can_mask;
+		id = f->can_id & ~CAN_INV_FILTER & mask;
+
+		*p++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0);
+		*p++ = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, htonl(mask));
+		if (f->can_id & CAN_INV_FILTER)
+			*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(id), 1, 0);
+		else
+			*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(id), 0, 1);
+		*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	}
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	fprog.len = p - prog;
+	fprog.filter = prog;
+	ret = setsockopt(io->pfd, SOL_SOCKET, SO_ATTACH_FILTER,
+			 &fprog, sizeof(fprog));
+	free(prog);
+
+	return ret;
+}
+
+static int ring_open(struct can_io *io, int ifindex)
+{
+	struct tpacket_req req = {
+		.tp_block_size = CAN_IO_RING_BLOCK_SIZE,
+		.tp_block_nr = CAN_IO_RING_BLOCKS,
+		.tp_frame_size = CAN_IO_RING_FRAME_SIZE,
+		.tp_frame_nr = CAN_IO_RING_BLOCKS *
+			(CAN_IO_RING_BLOCK_SIZE / CAN_IO_RING_FRAME_SIZE),
+	};
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ALL),
+		.sll_ifindex = ifindex,
+	};
+	int version = TPACKET_V2;
+
+	/* best effort, without CAP_NET_ADMIN our own frames are seen */
+	io->mark = CAN_IO_MARK_BASE | (getpid() & 0xffff);
+	if (setsockopt(io->fd, SOL_SOCKET, SO_MARK, &io->mark,
+		       sizeof(io->mark)))
+		io->mark = 0;
+
+	/* the CAN_RAW socket is only used for sending */
+	if (setsockopt(io->fd, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0))
+		return -1;
+
+	io->pfd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (io->pfd < 0)
+		return -1;
+
+	if (setsockopt(io->pfd, SOL_PACKET, PACKET_VERSION,
+		       &version, sizeof(version)))
+		return -1;
+
+	/* attach before bind, nothing unfiltered gets into the ring */
+	if (ring_attach_filter(io))
+		return -1;
+
+	if (setsockopt(io->pfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+		return -1;
+
+	io->ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+	io->ring = mmap(NULL, io->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, io->pfd, 0);
+	if (io->ring == MAP_FAILED) {
+		io->ring = NULL;
+		return -1;
+	}
+
+	return bind(io->pfd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static int ring_recv(struct can_io *io, struct canfd_frame *frames,
+		     struct timespec *ts, int n)
+{
+	unsigned int ring_frames = io->ring_size / CAN_IO_RING_FRAME_SIZE;
+	struct pollfd pfd = {
+		.fd = io->pfd,
+		.events = POLLIN,
+	};
+	struct tpacket2_hdr *h;
+	int count = 0;
+
+	while (!count) {
+		while (count < n) {
+			h = (struct tpacket2_hdr *)(io->ring +
+				io->ring_pos * CAN_IO_RING_FRAME_SIZE);
+			if (!(h->tp_status & TP_STATUS_USER))
+				break;
+			__sync_synchronize();
+
+			memset(&frames[count], 0, sizeof(frames[count]));
+			memcpy(&frames[count], (unsigned char *)h + h->tp_mac,
+			       h->tp_snaplen < CANFD_MTU ? h->tp_snaplen : CANFD_MTU);
+			if (can_io_frame_fixup(io, &frames[count], h->tp_snaplen)) {
+				if (ts) {
+					ts[count].tv_sec = h->tp_sec;
+					ts[count].tv_nsec = h->tp_nsec;
+				}
+				count++;
+			} else {
+				can_metric_add(CAN_METRIC_RX_DROPS, 1);
+			}
+
+			__sync_synchronize();
+			h->tp_status = TP_STATUS_KERNEL;
+			if (++io->ring_pos == ring_frames)
+				io->ring_pos = 0;
+		}
+
+		if (count)
+			break;
+		if (io->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		can_metric_add(CAN_METRIC_RX_SYSCALLS, 1);
+		if (poll(&pfd, 1, -1) < 0)
+			return -1;
+	}
+
+	return count;
+}
+
+static int alloc_msgs(struct mmsghdr **msgs, struct iovec **iov, int n)
+{
+	*msgs = calloc(n, sizeof(**msgs));
+	*iov = calloc(n, sizeof(**iov));
+
+	return *msgs && *iov ? 0 : -1;
+}
+
+static int raw_open(struct can_io *io, int ifindex)
+{
+	struct sockaddr_can addr;
+	int on = 1;
+
+	io->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (io->fd < 0)
+		return -1;
+
+	if (io->fd_frames &&
+	    setsockopt(io->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on)))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifindex;
+
+	return bind(io->fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+struct can_io *can_io_open(const char *ifname, const struct can_io_opts *opts)
+{
+	static const struct can_io_opts defaults;
+	struct can_io *io;
+	const char *env;
+	int ifindex = 0, on = 1, err;
+
+	if (!opts)
+		opts = &defaults;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return NULL;
+
+	io->fd = -1;
+	io->pfd = -1;
+	strncpy(io->name, ifname, sizeof(io->name) - 1);
+	io->backend = opts->backend;
+	io->fd_frames = opts->fd_frames;
+	io->wait = opts->wait;
+	io->nonblock = opts->nonblock;
+	io->timestamp = opts->timestamp;
+	io->batch = opts->batch > 0 ? opts->batch : CAN_IO_BATCH_DEFAULT;
+	if (io->batch > CAN_IO_BATCH_MAX)
+		io->batch = CAN_IO_BATCH_MAX;
+
+	if (io->backend == CAN_IO_DEFAULT) {
+		env = getenv("CANUTILS_IO");
+		if (env && can_io_backend_parse(env) > 0)
+			io->backend = can_io_backend_parse(env);
+		else
+			io->backend = CAN_IO_MMSG;
+	}
+
+	/* a simulated bus and a ring are just names */
+	if (io->backend != CAN_IO_SIM && io->backend != CAN_IO_SHM &&
+	    strcmp(ifname, "any")) {
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex)
+			goto err;
+	}
+
+	/* CAN_RAW's default is to receive everything but error frames */
+	io->filter = calloc(1, sizeof(*io->filter));
+	if (!io->filter)
+		goto err;
+	io->filter_count = 1;
+
+	if (io->backend == CAN_IO_SIM) {
+		if (can_sim_open(io, ifname))
+			goto err;
+	} else if (io->backend == CAN_IO_SHM) {
+		io->shm = can_shm_attach(ifname);
+		if (!io->shm)
+			goto err;
+	} else if (raw_open(io, ifindex)) {
+		goto err;
+	}
+
+	/* the ring has the stamps of the writer */
+	if (io->timestamp && io->backend != CAN_IO_MMAP &&
+	    io->backend != CAN_IO_SHM &&
+	    setsockopt(io->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+		goto err;
+
+	if (alloc_msgs(&io->rx_msgs, &io->rx_iov, io->batch) ||
+	    alloc_msgs(&io->tx_msgs, &io->tx_iov, io->batch))
+		goto err;
+	io->cmsg = calloc(io->batch, CAN_IO_CMSG_SIZE);
+	if (!io->cmsg)
+		goto err;
+
+	if (io->backend == CAN_IO_MMAP && ring_open(io, ifindex))
+		goto err;
+
+	if (io->backend == CAN_IO_URING && can_uring_open(io))
+		goto err;
+
+	if (io->nonblock) {
+		fcntl(io->fd, F_SETFL, O_NONBLOCK);
+		if (io->pfd >= 0)
+			fcntl(io->pfd, F_SETFL, O_NONBLOCK);
+	}
+
+	can_metrics_register(io);
+
+	return io;
+
+ err:
+	err = errno;
+	can_io_close(io);
+	errno = err;
+
+	return NULL;
+}
+
+void can_io_close(struct can_io *io)
+{
+	if (!io)
+		return;
+
+	can_metrics_unregister(io);
+	if (io->uring)
+		can_uring_close(io);
+	if (io->sim)
+		can_sim_close(io);
+	can_shm_close(io->shm);
+	if (io->ring)
+		munmap(io->ring, io->ring_size);
+	if (io->pfd >= 0)
+		close(io->pfd);
+	if (io->fd >= 0)
+		close(io->fd);
+
+	free(io->rx_msgs);
+	free(io->rx_iov);
+	free(io->tx_msgs);
+	free(io->tx_iov);
+	free(io->cmsg);
+	free(io->filter);
+	free(io->filter_hits);
+	free(io);
+}
+
+int can_io_fd(const struct can_io *io)
+{
+	if (io->backend == CAN_IO_URING)
+		return can_uring_fd(io);
+	if (io->backend == CAN_IO_SHM)
+		return can_shm_fd(io->shm);
+
+	return io->backend == CAN_IO_MMAP ? io->pfd : io->fd;
+}
+
+enum can_io_backend can_io_backend(const struct can_io *io)
+{
+	return io->backend;
+}
+
+static void setup_rx_msg(struct can_io *io, int i, struct canfd_frame *frame)
+{
+	struct msghdr *msg = &io->rx_msgs[i].msg_hdr;
+
+	io->rx_iov[i].iov_base = frame;
+	io->rx_iov[i].iov_len = sizeof(*frame);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_iov = &io->rx_iov[i];
+	msg->msg_iovlen = 1;
+	if (io->timestamp) {
+		msg->msg_control = io->cmsg + i * CAN_IO_CMSG_SIZE;
+		msg->msg_controllen = CAN_IO_CMSG_SIZE;
+	}
+}
+
+/* the frames the writer published, filtered like by CAN_RAW */
+static int shm_recv(struct can_io *io, struct canfd_frame *frames,
+		    struct timespec *ts, int n)
+{
+	uint64_t lost;
+	int ret, count, i;
+
+	can_metric_add(CAN_METRIC_RX_SYSCALLS, 1);
+	ret = can_shm_read(io->shm, frames, io->timestamp ? ts : NULL, n,
+			   io->nonblock, &lost);
+	if (lost)
+		can_metric_add(CAN_METRIC_RX_DROPS, lost);
+	if (ret < 0)
+		return -1;
+
+	for (i = 0, count = 0; i < ret; i++) {
+		if (!can_io_match(io, &frames[i]))
+			continue;
+		if (count != i) {
+			frames[count] = frames[i];
+			if (ts && io->timestamp)
+				ts[count] = ts[i];
+		}
+		count++;
+	}
+
+	return count;
+}
+
+static int recv_frames(struct can_io *io, struct canfd_frame *frames,
+		       struct timespec *ts, int n)
+{
+	ssize_t len;
+	int ret, count, i;
+
+	if (n > io->batch)
+		n = io->batch;
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	switch (io->backend) {
+	case CAN_IO_MMAP:
+		return ring_recv(io, frames, ts, n);
+
+	case CAN_IO_URING:
+		return can_uring_recv(io, frames, ts, n);
+
+	case CAN_IO_SHM:
+		return shm_recv(io, frames, ts, n);
+
+	case CAN_IO_RW:
+		can_metric_add(CAN_METRIC_RX_SYSCALLS, 1);
+		if (!io->timestamp) {
+			len = read(io->fd, frames, sizeof(*frames));
+		} else {
+			setup_rx_msg(io, 0, frames);
+			len = recvmsg(io->fd, &io->rx_msgs[0].msg_hdr, 0);
+		}
+		if (len < 0)
+			return -1;
+		if (!can_io_frame_fixup(io, frames, len)) {
+			can_metric_add(CAN_METRIC_RX_DROPS, 1);
+			return 0;
+		}
+		if (ts && io->timestamp)
+			can_io_get_timestamp(&io->rx_msgs[0].msg_hdr, ts);
+
+		return 1;
+
+	default:
+		if (io->backend == CAN_IO_SIM)
+			can_sim_receiving(io);
+
+		for (i = 0; i < n; i++)
+			setup_rx_msg(io, i, &frames[i]);
+
+		can_metric_add(CAN_METRIC_RX_SYSCALLS, 1);
+		ret = recvmmsg(io->fd, io->rx_msgs, n, MSG_WAITFORONE, NULL);
+		if (ret < 0)
+			return -1;
+
+		/* drop invalid frames, keep the rest in order */
+		for (i = 0, count = 0; i < ret; i++) {
+			if (!can_io_frame_fixup(io, &frames[i], io->rx_msgs[i].msg_len)) {
+				can_metric_add(CAN_METRIC_RX_DROPS, 1);
+				continue;
+			}
+			if (io->backend == CAN_IO_SIM && !can_io_match(io, &frames[i]))
+				continue;
+			if (ts && io->timestamp)
+				can_io_get_timestamp(&io->rx_msgs[i].msg_hdr, &ts[count]);
+			if (count != i)
+				frames[count] = frames[i];
+			count++;
+		}
+
+		return count;
+	}
+}
+
+int can_io_recv(struct can_io *io, struct canfd_frame *frames,
+		struct timespec *ts, int n)
+{
+	int ret;
+
+	ret = recv_frames(io, frames, ts, n);
+	if (ret > 0 && can_metrics_enabled())
+		can_metrics_rx(io, frames, ret);
+
+	return ret;
+}
+
+int can_io_wait_for_space(struct can_io *io)
+{
+	struct pollfd pfd = {
+		.fd = io->fd,
+		.events = POLLOUT,
+	};
+
+	return poll(&pfd, 1, 1000) < 0 ? -1 : 0;
+}
+
+static int send_frames(struct can_io *io, const struct canfd_frame *frames,
+		       int n)
+{
+	struct msghdr *msg;
+	ssize_t len;
+	int sent = 0, ret, i, chunk;
+
+	if (io->backend == CAN_IO_URING)
+		return can_uring_send(io, frames, n);
+	if (io->backend == CAN_IO_SIM)
+		return can_sim_send(io, frames, n);
+	if (io->backend == CAN_IO_SHM) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	while (sent < n) {
+		can_metric_add(CAN_METRIC_TX_SYSCALLS, 1);
+		if (io->backend == CAN_IO_RW) {
+			len = write(io->fd, &frames[sent],
+				    can_io_frame_mtu(io, &frames[sent]));
+			ret = len < 0 ? -1 : 1;
+		} else {
+			chunk = n - sent < io->batch ? n - sent : io->batch;
+			for (i = 0; i < chunk; i++) {
+				io->tx_iov[i].iov_base = (void *)&frames[sent + i];
+				io->tx_iov[i].iov_len = can_io_frame_mtu(io, &frames[sent + i]);
+
+				msg = &io->tx_msgs[i].msg_hdr;
+				memset(msg, 0, sizeof(*msg));
+				msg->msg_iov = &io->tx_iov[i];
+				msg->msg_iovlen = 1;
+			}
+			ret = sendmmsg(io->fd, io->tx_msgs, chunk, 0);
+		}
+
+		if (ret < 0) {
+			if ((errno == ENOBUFS || errno == EAGAIN) && io->wait &&
+			    !can_io_wait_for_space(io))
+				continue;
+
+			return sent ? sent : -1;
+		}
+		sent += ret;
+	}
+
+	return sent;
+}
+
+int can_io_send(struct can_io *io, const struct canfd_frame *frames, int n)
+{
+	int ret;
+
+	ret = send_frames(io, frames, n);
+	if (can_metrics_enabled())
+		can_metrics_tx(io, frames, n, ret < 0 ? 0 : ret);
+
+	return ret;
+}
+
+int can_io_write(struct can_io *io, int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	can_metric_add(CAN_METRIC_OUT_BYTES, len);
+	if (io->backend == CAN_IO_URING)
+		return can_uring_write(io, fd, buf, len);
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int can_io_flush(struct can_io *io)
+{
+	if (io->backend == CAN_IO_URING)
+		return can_uring_flush(io);
+
+	return 0;
+}
+
+int can_io_set_filter(struct can_io *io, const struct can_filter *filter,
+		      int count)
+{
+	struct can_filter *copy = NULL;
+
+	if (count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (count) {
+		copy = malloc(count * sizeof(*copy));
+		if (!copy)
+			return -1;
+		memcpy(copy, filter, count * sizeof(*copy));
+	}
+
+	can_metrics_set_filter(io, copy, count);
+
+	if (io->backend == CAN_IO_MMAP)
+		return ring_attach_filter(io);
+	if (io->backend == CAN_IO_SIM || io->backend == CAN_IO_SHM)
+		return 0;
+
+	return setsockopt(io->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+			  count * sizeof(*filter));
+}
+
+int can_io_set_err_mask(struct can_io *io, can_err_mask_t err_mask)
+{
+	io->err_mask = err_mask;
+
+	if (io->backend == CAN_IO_MMAP)
+		return ring_attach_filter(io);
+	if (io->backend == CAN_IO_SIM || io->backend == CAN_IO_SHM)
+		return 0;
+
+	return setsockopt(io->fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+			  &err_mask, sizeof(err_mask));
+}
@@ -0,0 +1,104 @@
+/*
+ * canutils/canio.h - internals of the frame I/O backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef CANIO_H
+#define CANIO_H
+
+#include <net/if.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "canutils.h"
+
+#define CAN_IO_BATCH_MAX	1024
+#define CAN_IO_CMSG_SIZE	CMSG_SPACE(sizeof(struct timespec))
+
+struct can_uring;
+struct can_sim;
+
+struct can_io {
+	char name[IFNAMSIZ];
+	enum can_io_backend backend;
+	int fd;			/* CAN_RAW, tx and rx of rw and mmsg */
+	int fd_frames;
+	int batch;
+	int wait;
+	int nonblock;
+	int timestamp;
+
+	struct mmsghdr *rx_msgs, *tx_msgs;
+	struct iovec *rx_iov, *tx_iov;
+	char *cmsg;
+
+	/* mmap */
+	int pfd;		/* PF_PACKET */
+	unsigned char *ring;
+	size_t ring_size;
+	unsigned int ring_pos;
+	unsigned int mark;
+
+	/* uring */
+	struct can_uring *uring;
+
+	/* sim */
+	struct can_sim *sim;
+
+	/* shm */
+	struct can_shm *shm;
+
+	struct can_filter *filter;
+	int filter_count;
+	can_err_mask_t err_mask;
+
+	/* metrics */
+	uint64_t *filter_hits;
+	uint64_t error_frames[CAN_ERROR_CLASSES];
+	struct can_io *metrics_next;
+	int metrics_registered;
+};
+
+/* shared by the backends, in canio.c */
+size_t can_io_frame_mtu(const struct can_io *io,
+			const struct canfd_frame *frame);
+int can_io_frame_fixup(const struct can_io *io, struct canfd_frame *frame,
+		       size_t len);
+void can_io_get_timestamp(struct msghdr *msg, struct timespec *ts);
+int can_io_match(const struct can_io *io, const struct canfd_frame *frame);
+int can_io_wait_for_space(struct can_io *io);
+
+/* canio_uring.c, all return -1 with errno set on errors */
+int can_uring_open(struct can_io *io);
+void can_uring_close(struct can_io *io);
+int can_uring_fd(const struct can_io *io);
+int can_uring_recv(struct can_io *io, struct canfd_frame *frames,
+		   struct timespec *ts, int n);
+int can_uring_send(struct can_io *io, const struct canfd_frame *frames, int n);
+int can_uring_write(struct can_io *io, int fd, const void *buf, size_t len);
+int can_uring_flush(struct can_io *io);
+
+/* canmetrics.c */
+void can_metrics_register(struct can_io *io);
+void can_metrics_unregister(struct can_io *io);
+void can_metrics_set_filter(struct can_io *io, struct can_filter *filter,
+			    int count);
+void can_metrics_rx(struct can_io *io, const struct canfd_frame *frames, int n);
+void can_metrics_tx(struct can_io *io, const struct canfd_frame *frames,
+		    int n, int sent);
+
+/* canio_sim.c */
+int can_sim_open(struct can_io *io, const char *name);
+void can_sim_close(struct can_io *io);
+int can_sim_send(struct can_io *io, const struct canfd_frame *frames, int n);
+void can_sim_receiving(struct can_io *io);
+
+#endif /* CANIO_H */
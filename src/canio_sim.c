@@ -0,0 +1,433 @@
+/*
+ * canutils/canio_sim.c - simulated CAN bus backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* sendmmsg */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+#include "canio.h"
+
+/*
+ * A simulated bus needs no kernel module: the interface name given to
+ * can_io_open() names the bus, every process opening it becomes a
+ * member with a datagram socket in the abstract unix namespace. The
+ * members are listed in a small shared file in CAN_SIM_DIR. Sending
+ * means one sendmmsg(2) per other member, a member whose queue is full
+ * loses the frames, like a CAN_RAW socket whose receive buffer
+ * overflows. With "wait" the sender blocks instead for members that
+ * receive at all, so tests can run lossless, pure senders never read
+ * their queue. Own frames are not received, as with CAN_RAW's default.
+ *
+ * The filters are applied by the receiver in can_io_recv(). The frames
+ * are transferred as CAN_MTU or CANFD_MTU bytes, so the mmsg receive
+ * path, timestamps included, is used unchanged.
+ *
+ * Optionally, configured by environment variables:
+ *
+ *   CANUTILS_SIM_BITRATE=BPS	each frame occupies the bus for its
+ *				duration and is delivered at its end
+ *   CANUTILS_SIM_DBITRATE=BPS	data phase of CAN-FD frames with BRS
+ *   CANUTILS_SIM_ERRORS=PPM	rate of frames hit by a bus error, an
+ *				error frame is sent to every member and
+ *				the frame is retransmitted
+ *
+ * The bus time is shared by all members, arbitration is first come,
+ * first served, not by priority.
+ */
+#define CAN_SIM_DIR		"/dev/shm"
+#define CAN_SIM_MAGIC		0x63616e73	/* "cans" */
+#define CAN_SIM_MEMBERS		64
+
+struct can_sim_bus {
+	uint32_t magic;
+	uint32_t generation;		/* changed on join and leave */
+	uint64_t bus_free_ns;		/* CLOCK_MONOTONIC */
+	uint32_t next_id;
+	struct {
+		int32_t pid;
+		uint32_t id;		/* 0: free */
+		uint32_t receiving;	/* has called can_io_recv() */
+	} member[CAN_SIM_MEMBERS];
+};
+
+struct can_sim {
+	char name[IFNAMSIZ];
+	int lock_fd;
+	struct can_sim_bus *bus;
+	int slot;
+	uint32_t id;
+	int receiving;
+
+	/* other members, refreshed when the generation changes */
+	uint32_t generation;
+	int peer_count;
+	uint32_t peer_id[CAN_SIM_MEMBERS];
+	int peer_receiving[CAN_SIM_MEMBERS];
+	struct sockaddr_un peer[CAN_SIM_MEMBERS];
+	socklen_t peer_len[CAN_SIM_MEMBERS];
+	struct sockaddr_un self;
+	socklen_t self_len;
+
+	unsigned long bitrate;
+	unsigned long dbitrate;
+	unsigned long error_ppm;
+	unsigned int seed;
+};
+
+static socklen_t sim_addr(struct sockaddr_un *addr, const char *name,
+			  uint32_t id)
+{
+	char path[sizeof(addr->sun_path) - 1];
+	int len;
+
+	/* "name" may live in the same struct as "addr" */
+	len = snprintf(path, sizeof(path), "canutils-sim/%s/%u", name, id);
+	if (len >= (int)sizeof(path))
+		len = sizeof(path) - 1;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/* abstract namespace, sun_path[0] stays 0 */
+	memcpy(addr->sun_path + 1, path, len);
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static unsigned long env_ulong(const char *name)
+{
+	const char *s = getenv(name);
+
+	return s ? strtoul(s, NULL, 0) : 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void refresh_peers(struct can_sim *sim)
+{
+	struct can_sim_bus *bus = sim->bus;
+	int i;
+
+	flock(sim->lock_fd, LOCK_SH);
+	sim->generation = bus->generation;
+	sim->peer_count = 0;
+	for (i = 0; i < CAN_SIM_MEMBERS; i++) {
+		if (!bus->member[i].id || i == sim->slot)
+			continue;
+		sim->peer_id[sim->peer_count] = bus->member[i].id;
+		sim->peer_receiving[sim->peer_count] = bus->member[i].receiving;
+		sim->peer_len[sim->peer_count] =
+			sim_addr(&sim->peer[sim->peer_count], sim->name,
+				 bus->member[i].id);
+		sim->peer_count++;
+	}
+	flock(sim->lock_fd, LOCK_UN);
+}
+
+/* a member that died without leaving */
+static void remove_peer(struct can_sim *sim, uint32_t id)
+{
+	struct can_sim_bus *bus = sim->bus;
+	int i;
+
+	flock(sim->lock_fd, LOCK_EX);
+	for (i = 0; i < CAN_SIM_MEMBERS; i++) {
+		if (bus->member[i].id == id) {
+			bus->member[i].id = 0;
+			bus->member[i].pid = 0;
+			bus->generation++;
+		}
+	}
+	flock(sim->lock_fd, LOCK_UN);
+}
+
+/* stuff bits included, see can_frame_bits() */
+static uint64_t frame_ns(const struct can_sim *sim,
+			 const struct canfd_frame *frame)
+{
+	return can_frame_ns(frame, sim->bitrate, sim->dbitrate);
+}
+
+/* reserve "ns" of bus time, returns when it has passed */
+static void occupy_bus(struct can_sim *sim, uint64_t ns)
+{
+	uint64_t start, end, old, now = now_ns();
+	struct timespec ts;
+
+	old = __atomic_load_n(&sim->bus->bus_free_ns, __ATOMIC_RELAXED);
+	do {
+		start = old > now ? old : now;
+		end = start + ns;
+	} while (!__atomic_compare_exchange_n(&sim->bus->bus_free_ns, &old, end,
+					      0, __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+
+	ts.tv_sec = end / 1000000000ULL;
+	ts.tv_nsec = end % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* send "n" frames to every other member and optionally to ourself */
+static void deliver(struct can_io *io, const struct canfd_frame *frames,
+		    int n, int self)
+{
+	struct can_sim *sim = io->sim;
+	struct msghdr *msg;
+	int i, p;
+
+	if (__atomic_load_n(&sim->bus->generation, __ATOMIC_ACQUIRE) !=
+	    sim->generation)
+		refresh_peers(sim);
+
+	for (i = 0; i < n; i++) {
+		io->tx_iov[i].iov_base = (void *)&frames[i];
+		io->tx_iov[i].iov_len = can_io_frame_mtu(io, &frames[i]);
+	}
+
+	for (p = self ? -1 : 0; p < sim->peer_count; p++) {
+		for (i = 0; i < n; i++) {
+			msg = &io->tx_msgs[i].msg_hdr;
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_iov = &io->tx_iov[i];
+			msg->msg_iovlen = 1;
+			msg->msg_name = p < 0 ? &sim->self : &sim->peer[p];
+			msg->msg_namelen = p < 0 ? sim->self_len : sim->peer_len[p];
+		}
+
+		/*
+		 * A full queue loses the frames, like on a real bus, unless
+		 * the sender asked to wait for buffer space. Never wait for
+		 * ourself, we're not receiving right now.
+		 */
+		can_metric_add(CAN_METRIC_TX_SYSCALLS, 1);
+		if (sendmmsg(io->fd, io->tx_msgs, n,
+			     io->wait && p >= 0 && sim->peer_receiving[p] ?
+			     0 : MSG_DONTWAIT) < 0 &&
+		    p >= 0 && (errno == ECONNREFUSED || errno == ENOENT))
+			remove_peer(sim, sim->peer_id[p]);
+	}
+}
+
+static void bus_error(struct can_io *io, const struct canfd_frame *frame)
+{
+	struct can_sim *sim = io->sim;
+	struct canfd_frame err;
+
+	/* some bits of the frame, error flag, delimiter and IFS */
+	if (sim->bitrate)
+		occupy_bus(sim, frame_ns(sim, frame) / 2 +
+			   (6 + 8 + 3) * 1000000000ULL / sim->bitrate);
+
+	memset(&err, 0, sizeof(err));
+	err.can_id = CAN_ERR_FLAG | CAN_ERR_PROT | CAN_ERR_BUSERROR;
+	err.len = CAN_ERR_DLC;
+	err.data[2] = CAN_ERR_PROT_BIT;
+	err.data[3] = CAN_ERR_PROT_LOC_DATA;
+
+	deliver(io, &err, 1, 1);
+}
+
+int can_sim_send(struct can_io *io, const struct canfd_frame *frames, int n)
+{
+	struct can_sim *sim = io->sim;
+	int sent, chunk, i;
+
+	if (!sim->bitrate && !sim->error_ppm) {
+		for (sent = 0; sent < n; sent += chunk) {
+			chunk = n - sent < io->batch ? n - sent : io->batch;
+			deliver(io, frames + sent, chunk, 0);
+		}
+		return n;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (sim->error_ppm &&
+		    (unsigned long)rand_r(&sim->seed) % 1000000 < sim->error_ppm)
+			bus_error(io, &frames[i]);
+		if (sim->bitrate)
+			occupy_bus(sim, frame_ns(sim, &frames[i]));
+		deliver(io, &frames[i], 1, 0);
+	}
+
+	return n;
+}
+
+/* senders only wait for members that read their queue */
+void can_sim_receiving(struct can_io *io)
+{
+	struct can_sim *sim = io->sim;
+
+	if (sim->receiving)
+		return;
+	sim->receiving = 1;
+
+	flock(sim->lock_fd, LOCK_EX);
+	sim->bus->member[sim->slot].receiving = 1;
+	sim->bus->generation++;
+	flock(sim->lock_fd, LOCK_UN);
+}
+
+/* bind to a new id and become visible to the others */
+static int join(struct can_io *io)
+{
+	struct can_sim *sim = io->sim;
+	struct can_sim_bus *bus = sim->bus;
+	int i, ret = -1;
+
+	flock(sim->lock_fd, LOCK_EX);
+
+	if (bus->magic != CAN_SIM_MAGIC) {
+		memset(bus, 0, sizeof(*bus));
+		bus->magic = CAN_SIM_MAGIC;
+	}
+
+	sim->slot = -1;
+	for (i = 0; i < CAN_SIM_MEMBERS; i++) {
+		/* reuse the slots of members that died without leaving */
+		if (bus->member[i].id && kill(bus->member[i].pid, 0) &&
+		    errno == ESRCH)
+			bus->member[i].id = 0;
+		if (!bus->member[i].id && sim->slot < 0)
+			sim->slot = i;
+	}
+
+	if (sim->slot < 0) {
+		errno = EUSERS;
+		goto out;
+	}
+
+	if (!++bus->next_id)
+		bus->next_id++;
+	sim->id = bus->next_id;
+
+	sim->self_len = sim_addr(&sim->self, sim->name, sim->id);
+	if (bind(io->fd, (struct sockaddr *)&sim->self, sim->self_len))
+		goto out;
+
+	bus->member[sim->slot].pid = getpid();
+	bus->member[sim->slot].id = sim->id;
+	bus->member[sim->slot].receiving = 0;
+	bus->generation++;
+	ret = 0;
+
+ out:
+	flock(sim->lock_fd, LOCK_UN);
+
+	return ret;
+}
+
+int can_sim_open(struct can_io *io, const char *name)
+{
+	struct can_sim *sim;
+	char path[sizeof(CAN_SIM_DIR) + IFNAMSIZ + 16];
+
+	if (strlen(name) >= IFNAMSIZ || strchr(name, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return -1;
+	io->sim = sim;
+	sim->lock_fd = -1;
+	sim->slot = -1;
+	strcpy(sim->name, name);
+
+	sim->bitrate = env_ulong("CANUTILS_SIM_BITRATE");
+	sim->dbitrate = env_ulong("CANUTILS_SIM_DBITRATE");
+	sim->error_ppm = env_ulong("CANUTILS_SIM_ERRORS");
+	sim->seed = getpid() ^ now_ns();
+
+	snprintf(path, sizeof(path), CAN_SIM_DIR "/canutils-sim-%s", name);
+	sim->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (sim->lock_fd < 0)
+		return -1;
+	/* the bus is shared by all users */
+	fchmod(sim->lock_fd, 0666);
+
+	flock(sim->lock_fd, LOCK_EX);
+	if (ftruncate(sim->lock_fd, sizeof(*sim->bus))) {
+		flock(sim->lock_fd, LOCK_UN);
+		return -1;
+	}
+	flock(sim->lock_fd, LOCK_UN);
+
+	sim->bus = mmap(NULL, sizeof(*sim->bus), PROT_READ | PROT_WRITE,
+			MAP_SHARED, sim->lock_fd, 0);
+	if (sim->bus == MAP_FAILED) {
+		sim->bus = NULL;
+		return -1;
+	}
+
+	io->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (io->fd < 0)
+		return -1;
+
+	if (join(io))
+		return -1;
+	refresh_peers(sim);
+
+	return 0;
+}
+
+void can_sim_close(struct can_io *io)
+{
+	struct can_sim *sim = io->sim;
+
+	if (sim->bus && sim->id) {
+		flock(sim->lock_fd, LOCK_EX);
+		if (sim->bus->member[sim->slot].id == sim->id) {
+			sim->bus->member[sim->slot].id = 0;
+			sim->bus->member[sim->slot].pid = 0;
+			sim->bus->generation++;
+		}
+		flock(sim->lock_fd, LOCK_UN);
+	}
+
+	if (sim->bus)
+		munmap(sim->bus, sizeof(*sim->bus));
+	if (sim->lock_fd >= 0)
+		close(sim->lock_fd);
+
+	free(sim);
+	io->sim = NULL;
+}
@@ -0,0 +1,738 @@
+/*
+ * canutils/canio_uring.c - io_uring frame I/O backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <can_config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/can.h>
+
+#include "canio.h"
+
+#ifdef HAVE_STRUCT_IO_URING_RECVMSG_OUT
+
+#include <linux/io_uring.h>
+
+/*
+ * Reception is a single multishot recvmsg on the CAN_RAW socket, which
+ * picks its buffers from a ring of provided buffers. Each completion
+ * carries one frame, the buffer is given back right after the frame
+ * has been copied out. Sends are submitted as a chain of linked
+ * sendmsg requests, so they hit the socket in order and everything
+ * after a failed send is cancelled. Log file writes go through the same
+ * ring, with one write in flight while the next buffer is filled.
+ *
+ * No liburing, the three system calls are used directly.
+ */
+#define URING_ENTRIES		256
+#define URING_CQ_ENTRIES	4096
+#define URING_SEND_MAX		128	/* linked sends per submission */
+#define URING_BUFS		1024	/* power of two */
+#define URING_BUF_SIZE		256
+#define URING_BGID		0
+#define URING_RXQ		4096
+#define URING_WBUF_SIZE		(64 * 1024)
+
+enum {
+	URING_TAG_RECV = 1,
+	URING_TAG_SEND,
+	URING_TAG_WRITE,
+};
+
+struct wbuf {
+	char *data;
+	size_t len;
+	size_t done;
+};
+
+struct can_uring {
+	int fd;
+
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_local;		/* our tail, published on enter */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* provided buffers of the multishot recvmsg */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned char *bufs;
+	unsigned short br_tail;
+	struct msghdr rx_msg;
+	int rx_armed;
+	int rx_err;
+
+	/* frames that arrived while waiting for sends or writes */
+	struct canfd_frame rxq[URING_RXQ];
+	struct timespec rxq_ts[URING_RXQ];
+	unsigned int rxq_head, rxq_count;
+	unsigned long long rx_dropped;
+
+	struct msghdr tx_msgs[URING_SEND_MAX];
+	struct iovec tx_iov[URING_SEND_MAX];
+	int tx_pending;
+	int tx_failed;			/* index of the first failed send */
+	int tx_err;
+
+	struct wbuf wbuf[2];
+	int wcur;			/* being filled */
+	int winflight;			/* wbuf[!wcur] is being written */
+	int wfd;
+	int werr;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* submit what's queued, wait for "min_complete" completions */
+static int uring_enter(struct can_uring *u, unsigned int min_complete)
+{
+	unsigned int to_submit;
+
+	__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+	to_submit = u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !min_complete)
+		return 0;
+
+	can_metric_add(min_complete ? CAN_METRIC_RX_SYSCALLS :
+		       CAN_METRIC_TX_SYSCALLS, 1);
+	return sys_io_uring_enter(u->fd, to_submit, min_complete,
+				  min_complete ? IORING_ENTER_GETEVENTS : 0) < 0 ?
+		-1 : 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct can_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	    u->sq_entries) {
+		if (uring_enter(u, 0))
+			return NULL;
+		if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+		    u->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	idx = u->sq_local & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local++;
+
+	return sqe;
+}
+
+static void buf_recycle(struct can_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+	buf->addr = (uintptr_t)(u->bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int arm_recv(struct can_io *io)
+{
+	struct can_uring *u = io->uring;
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(u);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = io->fd;
+	sqe->addr = (uintptr_t)&u->rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_TAG_RECV;
+	u->rx_armed = 1;
+
+	return 0;
+}
+
+/* returns 1 if "frame" has been filled */
+static int handle_recv(struct can_io *io, const struct io_uring_cqe *cqe,
+		       struct canfd_frame *frame, struct timespec *ts)
+{
+	struct can_uring *u = io->uring;
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msg;
+	unsigned char *buf, *payload;
+	unsigned short bid;
+	int ok;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		u->rx_armed = 0;
+
+	/* out of buffers ends the multishot, it is simply rearmed */
+	if (cqe->res < 0) {
+		if (cqe->res != -ENOBUFS)
+			u->rx_err = -cqe->res;
+		return 0;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = u->bufs + bid * URING_BUF_SIZE;
+	out = (struct io_uring_recvmsg_out *)buf;
+	payload = buf + sizeof(*out) + u->rx_msg.msg_namelen +
+		u->rx_msg.msg_controllen;
+
+	memset(frame, 0, sizeof(*frame));
+	memcpy(frame, payload, out->payloadlen < CANFD_MTU ?
+	       out->payloadlen : CANFD_MTU);
+	ok = !(out->flags & MSG_TRUNC) &&
+		can_io_frame_fixup(io, frame, out->payloadlen);
+
+	if (ok && ts) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = buf + sizeof(*out) + u->rx_msg.msg_namelen;
+		msg.msg_controllen = out->controllen;
+		can_io_get_timestamp(&msg, ts);
+	}
+
+	buf_recycle(u, bid);
+
+	return ok;
+}
+
+static void submit_write(struct can_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct wbuf *w;
+
+	sqe = get_sqe(u);
+	if (!sqe) {
+		u->werr = errno;
+		return;
+	}
+
+	if (!u->winflight) {
+		u->wcur ^= 1;
+		u->winflight = 1;
+	}
+	w = &u->wbuf[!u->wcur];
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = u->wfd;
+	sqe->addr = (uintptr_t)(w->data + w->done);
+	sqe->len = w->len - w->done;
+	sqe->off = -1;			/* current position, also for pipes */
+	sqe->user_data = URING_TAG_WRITE;
+}
+
+static void handle_write(struct can_uring *u, const struct io_uring_cqe *cqe)
+{
+	struct wbuf *w = &u->wbuf[!u->wcur];
+
+	if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+		u->werr = -cqe->res;
+		w->len = 0;
+		w->done = 0;
+		u->winflight = 0;
+		return;
+	}
+
+	if (cqe->res > 0)
+		w->done += cqe->res;
+	if (w->done < w->len) {
+		submit_write(u);
+		return;
+	}
+
+	w->len = 0;
+	w->done = 0;
+	u->winflight = 0;
+
+	/* keep the data flowing, entered along with the next request */
+	if (u->wbuf[u->wcur].len)
+		submit_write(u);
+}
+
+/*
+ * Process completions. Received frames are stored in "frames", up to
+ * "n", the reaping stops there, so the ring's fd stays readable. Without
+ * "frames" they are queued for the next can_uring_recv(). Returns the
+ * number of frames stored in "frames".
+ */
+static int reap(struct can_io *io, struct canfd_frame *frames,
+		struct timespec *ts, int n)
+{
+	struct can_uring *u = io->uring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, slot;
+	int count = 0, i;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & *u->cq_mask];
+
+		switch (cqe->user_data & 0xff) {
+		case URING_TAG_RECV:
+			if (frames) {
+				if (count == n)
+					goto out;
+				if (handle_recv(io, cqe, &frames[count],
+						ts ? &ts[count] : NULL))
+					count++;
+			} else if (u->rxq_count < URING_RXQ) {
+				slot = (u->rxq_head + u->rxq_count) % URING_RXQ;
+				if (handle_recv(io, cqe, &u->rxq[slot],
+						&u->rxq_ts[slot]))
+					u->rxq_count++;
+			} else {
+				struct canfd_frame dropped;
+
+				if (handle_recv(io, cqe, &dropped, NULL)) {
+					u->rx_dropped++;
+					can_metric_add(CAN_METRIC_RX_DROPS, 1);
+				}
+			}
+			break;
+
+		case URING_TAG_SEND:
+			i = cqe->user_data >> 8;
+			u->tx_pending--;
+			if (cqe->res < 0 && cqe->res != -ECANCELED &&
+			    (u->tx_failed < 0 || i < u->tx_failed)) {
+				u->tx_failed = i;
+				u->tx_err = -cqe->res;
+			}
+			break;
+
+		case URING_TAG_WRITE:
+			handle_write(u, cqe);
+			break;
+		}
+	}
+
+ out:
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static int rxq_get(struct can_uring *u, struct canfd_frame *frames,
+		   struct timespec *ts, int n)
+{
+	int count = 0;
+
+	while (u->rxq_count && count < n) {
+		frames[count] = u->rxq[u->rxq_head];
+		if (ts)
+			ts[count] = u->rxq_ts[u->rxq_head];
+		u->rxq_head = (u->rxq_head + 1) % URING_RXQ;
+		u->rxq_count--;
+		count++;
+	}
+
+	return count;
+}
+
+int can_uring_recv(struct can_io *io, struct canfd_frame *frames,
+		   struct timespec *ts, int n)
+{
+	struct can_uring *u = io->uring;
+	int count;
+
+	count = rxq_get(u, frames, ts, n);
+	if (count)
+		return count + reap(io, frames + count, ts ? ts + count : NULL,
+				    n - count);
+
+	while (1) {
+		if (u->rx_err) {
+			errno = u->rx_err;
+			u->rx_err = 0;
+			return -1;
+		}
+		if (!u->rx_armed && arm_recv(io))
+			return -1;
+
+		count = reap(io, frames, ts, n);
+		if (count)
+			return count;
+
+		if (io->nonblock) {
+			if (uring_enter(u, 0))
+				return -1;
+			count = reap(io, frames, ts, n);
+			if (!count)
+				errno = EAGAIN;
+			return count ? count : -1;
+		}
+
+		if (uring_enter(u, 1))
+			return -1;
+	}
+}
+
+int can_uring_send(struct can_io *io, const struct canfd_frame *frames, int n)
+{
+	struct can_uring *u = io->uring;
+	struct io_uring_sqe *sqe;
+	int sent = 0, chunk, i;
+
+	while (sent < n) {
+		chunk = n - sent;
+		if (chunk > URING_SEND_MAX)
+			chunk = URING_SEND_MAX;
+
+		for (i = 0; i < chunk; i++) {
+			u->tx_iov[i].iov_base = (void *)&frames[sent + i];
+			u->tx_iov[i].iov_len = can_io_frame_mtu(io, &frames[sent + i]);
+			memset(&u->tx_msgs[i], 0, sizeof(u->tx_msgs[i]));
+			u->tx_msgs[i].msg_iov = &u->tx_iov[i];
+			u->tx_msgs[i].msg_iovlen = 1;
+
+			sqe = get_sqe(u);
+			if (!sqe)
+				return sent ? sent : -1;
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = io->fd;
+			sqe->addr = (uintptr_t)&u->tx_msgs[i];
+			sqe->len = 1;
+			sqe->user_data = URING_TAG_SEND | (i << 8);
+			if (i < chunk - 1)
+				sqe->flags = IOSQE_IO_LINK;
+		}
+		u->tx_pending += chunk;
+		u->tx_failed = -1;
+
+		/* the requests reference "frames", wait for all of them */
+		while (1) {
+			if (uring_enter(u, 0) && errno != EINTR)
+				return sent ? sent : -1;
+			reap(io, NULL, NULL, 0);
+			if (!u->tx_pending)
+				break;
+			if (uring_enter(u, 1) && errno != EINTR)
+				return sent ? sent : -1;
+		}
+
+		if (u->tx_failed < 0) {
+			sent += chunk;
+			continue;
+		}
+
+		sent += u->tx_failed;
+		if ((u->tx_err == ENOBUFS || u->tx_err == EAGAIN) && io->wait &&
+		    !can_io_wait_for_space(io))
+			continue;
+
+		errno = u->tx_err;
+		return sent ? sent : -1;
+	}
+
+	return sent;
+}
+
+int can_uring_write(struct can_io *io, int fd, const void *buf, size_t len)
+{
+	struct can_uring *u = io->uring;
+	const char *p = buf;
+	struct wbuf *w;
+	size_t space;
+
+	if (u->wfd >= 0 && fd != u->wfd && can_uring_flush(io))
+		return -1;
+	u->wfd = fd;
+
+	while (len) {
+		if (u->werr) {
+			errno = u->werr;
+			u->werr = 0;
+			return -1;
+		}
+
+		w = &u->wbuf[u->wcur];
+		space = URING_WBUF_SIZE - w->len;
+		if (!space) {
+			/* both buffers are full, wait for the one in flight */
+			if (uring_enter(u, 1) && errno != EINTR)
+				return -1;
+			reap(io, NULL, NULL, 0);
+			if (!u->winflight)
+				submit_write(u);
+			continue;
+		}
+
+		if (space > len)
+			space = len;
+		memcpy(w->data + w->len, p, space);
+		w->len += space;
+		p += space;
+		len -= space;
+	}
+
+	if (!u->winflight)
+		submit_write(u);
+
+	return 0;
+}
+
+int can_uring_flush(struct can_io *io)
+{
+	struct can_uring *u = io->uring;
+	int err;
+
+	while (u->winflight || u->wbuf[u->wcur].len) {
+		if (u->werr)
+			break;
+		if (!u->winflight)
+			submit_write(u);
+		if (uring_enter(u, 1) && errno != EINTR)
+			return -1;
+		reap(io, NULL, NULL, 0);
+	}
+
+	if (u->werr) {
+		err = u->werr;
+		u->werr = 0;
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int can_uring_fd(const struct can_io *io)
+{
+	return io->uring->fd;
+}
+
+static int uring_map(struct can_uring *u, struct io_uring_params *p)
+{
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			return -1;
+		}
+	}
+
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	u->sq_entries = p->sq_entries;
+	u->sq_head = (unsigned int *)((char *)u->sq_ring + p->sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p->sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p->sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p->sq_off.array);
+	u->sq_local = *u->sq_tail;
+
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p->cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p->cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p->cq_off.cqes);
+
+	return 0;
+}
+
+static int uring_setup_bufs(struct can_uring *u)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	u->br_size = URING_BUFS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+
+	u->bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+	if (!u->bufs)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	for (i = 0; i < URING_BUFS; i++)
+		buf_recycle(u, i);
+
+	return 0;
+}
+
+int can_uring_open(struct can_io *io)
+{
+	struct io_uring_params p;
+	struct can_uring *u;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -1;
+	io->uring = u;
+	u->fd = -1;
+	u->wfd = -1;
+
+	u->wbuf[0].data = malloc(URING_WBUF_SIZE);
+	u->wbuf[1].data = malloc(URING_WBUF_SIZE);
+	if (!u->wbuf[0].data || !u->wbuf[1].data)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0)
+		return -1;
+
+	if (uring_map(u, &p) || uring_setup_bufs(u))
+		return -1;
+
+	u->rx_msg.msg_namelen = sizeof(struct sockaddr_can);
+	u->rx_msg.msg_controllen = io->timestamp ? CAN_IO_CMSG_SIZE : 0;
+
+	/* submitted right away, the ring's fd may be polled first */
+	return arm_recv(io) || uring_enter(u, 0) ? -1 : 0;
+}
+
+void can_uring_close(struct can_io *io)
+{
+	struct can_uring *u = io->uring;
+
+	if (u->fd >= 0 && u->sqes && u->bufs)
+		can_uring_flush(io);
+
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	if (u->br)
+		munmap(u->br, u->br_size);
+
+	free(u->bufs);
+	free(u->wbuf[0].data);
+	free(u->wbuf[1].data);
+	free(u);
+	io->uring = NULL;
+}
+
+#else /* HAVE_STRUCT_IO_URING_RECVMSG_OUT */
+
+int can_uring_open(struct can_io *io)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+void can_uring_close(struct can_io *io)
+{
+}
+
+int can_uring_fd(const struct can_io *io)
+{
+	return -1;
+}
+
+int can_uring_recv(struct can_io *io, struct canfd_frame *frames,
+		   struct timespec *ts, int n)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int can_uring_send(struct can_io *io, const struct canfd_frame *frames, int n)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int can_uring_write(struct can_io *io, int fd, const void *buf, size_t len)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int can_uring_flush(struct can_io *io)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+#endif /* HAVE_STRUCT_IO_URING_RECVMSG_OUT */
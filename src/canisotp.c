@@ -0,0 +1,407 @@
+/*
+ * canutils/canisotp.c - ISO-TP (ISO 15765-2) reassembly
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+#define PCI_SF		0
+#define PCI_FF		1
+#define PCI_CF		2
+#define PCI_FC		3
+
+#define FC_OVERFLOW	2
+
+/* N_Bs and N_Cr, the longest wait for a flow control or consecutive frame */
+#define TIMEOUT_NS	1000000000LL
+
+#define NO_ID		0xffffffffu
+
+/*
+ * Sessions are slots of a pool allocated up front, found by the id of
+ * their data in a hash table of twice the pool size. The ids of the
+ * pairs are in another hash table, built before receiving.
+ */
+struct session {
+	canid_t id;
+	int active;
+	size_t len, received;
+	unsigned int sn;		/* the next sequence number */
+	int64_t last_ns;
+	unsigned char *data;
+};
+
+struct pair {
+	canid_t id, fc_id;
+};
+
+struct can_isotp {
+	struct session *sessions;
+	int count;
+	unsigned char *pool;
+	int *free;			/* stack of unused sessions */
+	int free_count;
+	int *map;			/* session index, -1 if empty */
+	unsigned int map_size;
+
+	struct pair *pairs;		/* NO_ID if empty */
+	unsigned int pair_size;
+	unsigned int pair_count;
+};
+
+static unsigned int hash_id(canid_t id, unsigned int size)
+{
+	return (id * 0x9e3779b1u) & (size - 1);
+}
+
+struct can_isotp *can_isotp_new(int sessions)
+{
+	struct can_isotp *tp;
+	int i;
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return NULL;
+
+	tp->count = sessions;
+	for (tp->map_size = 16; tp->map_size < 2u * sessions;)
+		tp->map_size *= 2;
+	tp->sessions = calloc(sessions, sizeof(*tp->sessions));
+	tp->pool = malloc((size_t)sessions * CAN_ISOTP_MAX_SIZE);
+	tp->map = malloc(tp->map_size * sizeof(*tp->map));
+	tp->free = malloc(sessions * sizeof(*tp->free));
+	if (!tp->sessions || !tp->pool || !tp->map || !tp->free) {
+		can_isotp_free(tp);
+		return NULL;
+	}
+
+	for (i = 0; i < sessions; i++) {
+		tp->sessions[i].data = tp->pool + (size_t)i * CAN_ISOTP_MAX_SIZE;
+		tp->free[tp->free_count++] = sessions - 1 - i;
+	}
+	memset(tp->map, 0xff, tp->map_size * sizeof(*tp->map));
+
+	return tp;
+}
+
+void can_isotp_free(struct can_isotp *tp)
+{
+	if (!tp)
+		return;
+
+	free(tp->sessions);
+	free(tp->pool);
+	free(tp->map);
+	free(tp->free);
+	free(tp->pairs);
+	free(tp);
+}
+
+static struct pair *find_pair(const struct can_isotp *tp, canid_t id)
+{
+	unsigned int h = hash_id(id, tp->pair_size);
+
+	while (tp->pairs[h].id != NO_ID) {
+		if (tp->pairs[h].id == id)
+			return &tp->pairs[h];
+		h = (h + 1) & (tp->pair_size - 1);
+	}
+
+	return NULL;
+}
+
+static int insert_pair(struct can_isotp *tp, canid_t id, canid_t fc_id)
+{
+	struct pair *pairs;
+	unsigned int size, h, i;
+
+	/* at most half full */
+	if (2 * (tp->pair_count + 1) > tp->pair_size) {
+		size = tp->pair_size ? 2 * tp->pair_size : 16;
+		pairs = malloc(size * sizeof(*pairs));
+		if (!pairs)
+			return -1;
+		memset(pairs, 0xff, size * sizeof(*pairs));
+		for (i = 0; i < tp->pair_size; i++) {
+			if (tp->pairs[i].id == NO_ID)
+				continue;
+			h = hash_id(tp->pairs[i].id, size);
+			while (pairs[h].id != NO_ID)
+				h = (h + 1) & (size - 1);
+			pairs[h] = tp->pairs[i];
+		}
+		free(tp->pairs);
+		tp->pairs = pairs;
+		tp->pair_size = size;
+	}
+
+	h = hash_id(id, tp->pair_size);
+	while (tp->pairs[h].id != NO_ID && tp->pairs[h].id != id)
+		h = (h + 1) & (tp->pair_size - 1);
+	if (tp->pairs[h].id == NO_ID)
+		tp->pair_count++;
+	tp->pairs[h].id = id;
+	tp->pairs[h].fc_id = fc_id;
+
+	return 0;
+}
+
+int can_isotp_add_pair(struct can_isotp *tp, canid_t id, canid_t fc_id)
+{
+	id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+	fc_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+	if (id == fc_id) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (insert_pair(tp, id, fc_id) || insert_pair(tp, fc_id, id))
+		return -1;
+
+	return 0;
+}
+
+/* the flow control id of "id", NO_ID if it isn't an ISO-TP id */
+static canid_t fc_id(const struct can_isotp *tp, canid_t id)
+{
+	const struct pair *p;
+
+	if (tp->pair_count) {
+		p = find_pair(tp, id);
+		return p ? p->fc_id : NO_ID;
+	}
+
+	/* ISO 15765-4, functional requests are single frames */
+	if (id == 0x7df)
+		return 0x7e8;
+	if (id >= 0x7e0 && id <= 0x7ef)
+		return id ^ 0x8;
+	/* 0x18da<target><source> and functional 0x18db<target><source> */
+	if ((id & 0xfffe0000) == (CAN_EFF_FLAG | 0x18da0000))
+		return (id & 0xffff0000) | (id & 0xff) << 8 | (id >> 8 & 0xff);
+
+	return NO_ID;
+}
+
+int can_isotp_match(const struct can_isotp *tp, canid_t can_id)
+{
+	if (can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return 0;
+
+	return fc_id(tp, can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)) != NO_ID;
+}
+
+static struct session *find_session(struct can_isotp *tp, canid_t id)
+{
+	unsigned int h = hash_id(id, tp->map_size);
+	int k;
+
+	while ((k = tp->map[h]) >= 0) {
+		if (tp->sessions[k].id == id)
+			return &tp->sessions[k];
+		h = (h + 1) & (tp->map_size - 1);
+	}
+
+	return NULL;
+}
+
+static struct session *new_session(struct can_isotp *tp, canid_t id)
+{
+	unsigned int h;
+	int k;
+
+	if (!tp->free_count)
+		return NULL;
+	k = tp->free[--tp->free_count];
+
+	h = hash_id(id, tp->map_size);
+	while (tp->map[h] >= 0)
+		h = (h + 1) & (tp->map_size - 1);
+	tp->map[h] = k;
+	tp->sessions[k].id = id;
+	tp->sessions[k].active = 1;
+
+	return &tp->sessions[k];
+}
+
+/* the data stays untouched until the slot is taken again */
+static void end_session(struct can_isotp *tp, struct session *s)
+{
+	unsigned int h = hash_id(s->id, tp->map_size), i, want;
+
+	while (&tp->sessions[tp->map[h]] != s)
+		h = (h + 1) & (tp->map_size - 1);
+	s->active = 0;
+	tp->free[tp->free_count++] = s - tp->sessions;
+
+	/* shift back the entries that probed past the hole */
+	for (i = (h + 1) & (tp->map_size - 1); tp->map[i] >= 0;
+	     i = (i + 1) & (tp->map_size - 1)) {
+		want = hash_id(tp->sessions[tp->map[i]].id, tp->map_size);
+		if (((i - want) & (tp->map_size - 1)) >=
+		    ((i - h) & (tp->map_size - 1))) {
+			tp->map[h] = tp->map[i];
+			h = i;
+		}
+	}
+	tp->map[h] = -1;
+}
+
+static void session_event(struct can_isotp_event *ev, int type,
+			  const struct session *s)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->id = s->id;
+	ev->len = s->len;
+	ev->received = s->received;
+	if (type == CAN_ISOTP_PDU)
+		ev->data = s->data;
+}
+
+static size_t copy_data(struct session *s, const unsigned char *data,
+			size_t len)
+{
+	if (len > s->len - s->received)
+		len = s->len - s->received;
+	memcpy(s->data + s->received, data, len);
+	s->received += len;
+
+	return len;
+}
+
+int can_isotp_add(struct can_isotp *tp, const struct canfd_frame *frame,
+		  int64_t ns, struct can_isotp_event *ev)
+{
+	canid_t id = frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	const unsigned char *d = frame->data;
+	struct session *s;
+	size_t len, off;
+	int n = 0;
+
+	if (!frame->len || !can_isotp_match(tp, frame->can_id))
+		return 0;
+
+	switch (d[0] >> 4) {
+	case PCI_SF:
+		len = d[0] & 0xf;
+		off = 1;
+		/* CAN-FD frames have the length in the second byte */
+		if (!len && frame->len > CAN_MAX_DLEN) {
+			len = d[1];
+			off = 2;
+		}
+		if (!len || off + len > frame->len)
+			return 0;
+
+		s = find_session(tp, id);
+		if (s) {
+			session_event(&ev[n++], CAN_ISOTP_ABORT, s);
+			end_session(tp, s);
+		}
+		memset(&ev[n], 0, sizeof(ev[n]));
+		ev[n].type = CAN_ISOTP_PDU;
+		ev[n].id = id;
+		ev[n].len = ev[n].received = len;
+		ev[n].data = d + off;
+		return n + 1;
+
+	case PCI_FF:
+		len = (d[0] & 0xf) << 8 | d[1];
+		/* lengths beyond 4095 are escaped with 0, not supported */
+		if (frame->len < CAN_MAX_DLEN || len < frame->len - 1)
+			return 0;
+
+		s = find_session(tp, id);
+		if (s) {
+			session_event(&ev[n++], CAN_ISOTP_ABORT, s);
+		} else if (!(s = new_session(tp, id))) {
+			memset(&ev[n], 0, sizeof(ev[n]));
+			ev[n].type = CAN_ISOTP_BUSY;
+			ev[n].id = id;
+			ev[n].len = len;
+			return n + 1;
+		}
+
+		s->len = len;
+		s->received = 0;
+		s->sn = 1;
+		s->last_ns = ns;
+		copy_data(s, d + 2, frame->len - 2);
+		return n;
+
+	case PCI_CF:
+		s = find_session(tp, id);
+		if (!s)
+			return 0;
+
+		if (ns - s->last_ns > TIMEOUT_NS) {
+			session_event(&ev[n++], CAN_ISOTP_TIMEOUT, s);
+			end_session(tp, s);
+			return n;
+		}
+		if ((d[0] & 0xf) != s->sn) {
+			session_event(&ev[n], CAN_ISOTP_SEQUENCE, s);
+			ev[n].expected_sn = s->sn;
+			ev[n++].sn = d[0] & 0xf;
+			end_session(tp, s);
+			return n;
+		}
+
+		copy_data(s, d + 1, frame->len - 1);
+		s->sn = (s->sn + 1) & 0xf;
+		s->last_ns = ns;
+		if (s->received < s->len)
+			return 0;
+
+		session_event(&ev[n++], CAN_ISOTP_PDU, s);
+		end_session(tp, s);
+		return n;
+
+	case PCI_FC:
+		/* flow control for the data on the other id of the pair */
+		s = find_session(tp, fc_id(tp, id));
+		if (!s)
+			return 0;
+
+		if ((d[0] & 0xf) == FC_OVERFLOW) {
+			session_event(&ev[n++], CAN_ISOTP_ABORT, s);
+			end_session(tp, s);
+			return n;
+		}
+		s->last_ns = ns;
+		return 0;
+	}
+
+	return 0;
+}
+
+int can_isotp_expire(struct can_isotp *tp, int64_t ns,
+		     struct can_isotp_event *ev, int max)
+{
+	struct session *s;
+	int n = 0;
+
+	for (s = tp->sessions; s < tp->sessions + tp->count && n < max; s++) {
+		if (!s->active || ns - s->last_ns <= TIMEOUT_NS)
+			continue;
+		session_event(&ev[n++], CAN_ISOTP_TIMEOUT, s);
+		end_session(tp, s);
+	}
+
+	return n;
+}
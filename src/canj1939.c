@@ -0,0 +1,511 @@
+/*
+ * canutils/canj1939.c - J1939 filtering and transport protocol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+/* sorted by PGN */
+static const struct {
+	unsigned int pgn;
+	const char *name;
+} pgn_names[] = {
+	{ 0x0e800, "ACKM" },
+	{ 0x0ea00, "RQST" },
+	{ 0x0eb00, "TP.DT" },
+	{ 0x0ec00, "TP.CM" },
+	{ 0x0ee00, "AC" },
+	{ 0x0f001, "EBC1" },
+	{ 0x0f002, "ETC1" },
+	{ 0x0f003, "EEC2" },
+	{ 0x0f004, "EEC1" },
+	{ 0x0f005, "ETC2" },
+	{ 0x0fdc5, "ECUID" },
+	{ 0x0fe6c, "TCO1" },
+	{ 0x0feca, "DM1" },
+	{ 0x0fecb, "DM2" },
+	{ 0x0feda, "SOFT" },
+	{ 0x0fee5, "HOURS" },
+	{ 0x0fee6, "TD" },
+	{ 0x0fee9, "LFC" },
+	{ 0x0feec, "VI" },
+	{ 0x0feee, "ET1" },
+	{ 0x0feef, "EFL/P1" },
+	{ 0x0fef1, "CCVS" },
+	{ 0x0fef2, "LFE" },
+	{ 0x0fef5, "AMB" },
+	{ 0x0fef6, "IC1" },
+	{ 0x0fef7, "VEP1" },
+	{ 0x0fefc, "DD" },
+};
+
+#define PGN_NAMES	(sizeof(pgn_names) / sizeof(pgn_names[0]))
+
+const char *can_j1939_pgn_name(unsigned int pgn)
+{
+	unsigned int lo = 0, hi = PGN_NAMES, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pgn_names[mid].pgn == pgn)
+			return pgn_names[mid].name;
+		if (pgn_names[mid].pgn < pgn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/*
+ * The PGNs are kept in an open addressing hash table, addresses and
+ * priorities in bitmaps, a match is a lookup in each.
+ */
+struct can_j1939_filter {
+	unsigned int *pgns;	/* CAN_J1939_PGN_ANY if empty */
+	unsigned int pgn_size;	/* a power of 2 */
+	unsigned int pgn_count;
+	uint64_t sa[4];
+	int sa_count;
+	unsigned int prio;	/* bit per priority */
+};
+
+static unsigned int hash_pgn(unsigned int pgn, unsigned int size)
+{
+	return (pgn * 0x9e3779b1u) & (size - 1);
+}
+
+static int pgn_insert(unsigned int *pgns, unsigned int size, unsigned int pgn)
+{
+	unsigned int h = hash_pgn(pgn, size);
+
+	while (pgns[h] != CAN_J1939_PGN_ANY) {
+		if (pgns[h] == pgn)
+			return 0;
+		h = (h + 1) & (size - 1);
+	}
+	pgns[h] = pgn;
+
+	return 1;
+}
+
+static int pgn_lookup(const struct can_j1939_filter *f, unsigned int pgn)
+{
+	unsigned int h = hash_pgn(pgn, f->pgn_size);
+
+	while (f->pgns[h] != CAN_J1939_PGN_ANY) {
+		if (f->pgns[h] == pgn)
+			return 1;
+		h = (h + 1) & (f->pgn_size - 1);
+	}
+
+	return 0;
+}
+
+static int add_pgn(struct can_j1939_filter *f, unsigned int pgn)
+{
+	unsigned int *pgns, size, i;
+
+	/* at most half full */
+	if (2 * (f->pgn_count + 1) > f->pgn_size) {
+		size = f->pgn_size ? 2 * f->pgn_size : 16;
+		pgns = malloc(size * sizeof(*pgns));
+		if (!pgns)
+			return -1;
+		memset(pgns, 0xff, size * sizeof(*pgns));
+		for (i = 0; i < f->pgn_size; i++)
+			if (f->pgns[i] != CAN_J1939_PGN_ANY)
+				pgn_insert(pgns, size, f->pgns[i]);
+		free(f->pgns);
+		f->pgns = pgns;
+		f->pgn_size = size;
+	}
+
+	f->pgn_count += pgn_insert(f->pgns, f->pgn_size, pgn);
+
+	return 0;
+}
+
+struct can_j1939_filter *can_j1939_filter_new(void)
+{
+	return calloc(1, sizeof(struct can_j1939_filter));
+}
+
+void can_j1939_filter_free(struct can_j1939_filter *f)
+{
+	if (!f)
+		return;
+
+	free(f->pgns);
+	free(f);
+}
+
+static int parse_pgn(const char *s, size_t len, unsigned int *pgn)
+{
+	unsigned int i;
+	char *end;
+
+	*pgn = strtoul(s, &end, 0);
+	if (end == s + len && len)
+		return *pgn <= 0x3ffff ? 0 : -1;
+
+	for (i = 0; i < PGN_NAMES; i++) {
+		if (strlen(pgn_names[i].name) == len &&
+		    !strncasecmp(pgn_names[i].name, s, len)) {
+			*pgn = pgn_names[i].pgn;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int can_j1939_filter_add(struct can_j1939_filter *f, const char *field,
+			 const char *list)
+{
+	const char *p = list, *e;
+	unsigned long v;
+	unsigned int pgn;
+	char *end;
+
+	while (1) {
+		e = strchr(p, ',');
+		if (!e)
+			e = p + strlen(p);
+
+		if (!strcmp(field, "pgn")) {
+			if (parse_pgn(p, e - p, &pgn))
+				goto inval;
+			if (add_pgn(f, pgn))
+				return -1;
+		} else {
+			v = strtoul(p, &end, 0);
+			if (end != e || end == p)
+				goto inval;
+
+			if (!strcmp(field, "sa") && v <= 0xff) {
+				if (!(f->sa[v / 64] & (1ULL << (v % 64))))
+					f->sa_count++;
+				f->sa[v / 64] |= 1ULL << (v % 64);
+			} else if (!strcmp(field, "prio") && v <= 7) {
+				f->prio |= 1 << v;
+			} else {
+				goto inval;
+			}
+		}
+
+		if (!*e)
+			return 0;
+		p = e + 1;
+	}
+
+ inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int can_j1939_filter_match(const struct can_j1939_filter *f, unsigned int pgn,
+			   unsigned int sa, unsigned int prio)
+{
+	if (f->sa_count && !(f->sa[sa / 64] & (1ULL << (sa % 64))))
+		return 0;
+	if (pgn == CAN_J1939_PGN_ANY)
+		return 1;
+	if (f->prio && !(f->prio & (1 << prio)))
+		return 0;
+
+	return !f->pgn_count || pgn_lookup(f, pgn);
+}
+
+static void set_filter(struct can_filter *filter, unsigned int pgn, int sa,
+		       int prio)
+{
+	filter->can_id = CAN_EFF_FLAG;
+	filter->can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+
+	if (pgn != CAN_J1939_PGN_ANY) {
+		filter->can_id |= pgn << 8;
+		/* the low byte of a PDU1 PGN is the destination */
+		filter->can_mask |= ((pgn & 0xff00) < 0xf000 ?
+				     0x3ff00 : 0x3ffff) << 8;
+	}
+	if (sa >= 0) {
+		filter->can_id |= sa;
+		filter->can_mask |= 0xff;
+	}
+	if (prio >= 0) {
+		filter->can_id |= prio << 26;
+		filter->can_mask |= 0x7 << 26;
+	}
+}
+
+int can_j1939_filter_compile(const struct can_j1939_filter *f, int max,
+			     struct can_filter **filter)
+{
+	static const unsigned int tp_pgns[] = {
+		CAN_J1939_PGN_TP_CM, CAN_J1939_PGN_TP_DT,
+	};
+	unsigned int i, k, n_pgn, n_sa, n_prio;
+	int sa, prio, tp, count = 0;
+	struct can_filter *fl;
+
+	n_pgn = f->pgn_count ? f->pgn_count : 1;
+	n_sa = f->sa_count ? f->sa_count : 1;
+	n_prio = f->prio ? __builtin_popcount(f->prio) : 1;
+
+	/* without PGNs or priorities the TP frames match anyway */
+	tp = f->pgn_count || f->prio;
+	if ((uint64_t)n_pgn * n_sa * n_prio + (tp ? 2 * n_sa : 0) >
+	    (uint64_t)max) {
+		fl = malloc(sizeof(*fl));
+		if (!fl)
+			return -1;
+		set_filter(fl, CAN_J1939_PGN_ANY, -1, -1);
+		*filter = fl;
+		return 1;
+	}
+
+	fl = malloc(sizeof(*fl) * max);
+	if (!fl)
+		return -1;
+
+	for (sa = f->sa_count ? 0 : -1; sa < 256; sa++) {
+		if (sa >= 0 && !(f->sa[sa / 64] & (1ULL << (sa % 64))))
+			continue;
+
+		for (prio = f->prio ? 0 : -1; prio < 8; prio++) {
+			if (prio >= 0 && !(f->prio & (1 << prio)))
+				continue;
+
+			for (i = 0; i < (f->pgn_count ? f->pgn_size : 1); i++) {
+				if (!f->pgn_count)
+					set_filter(&fl[count++],
+						   CAN_J1939_PGN_ANY, sa, prio);
+				else if (f->pgns[i] != CAN_J1939_PGN_ANY)
+					set_filter(&fl[count++], f->pgns[i],
+						   sa, prio);
+			}
+			if (prio < 0)
+				break;
+		}
+
+		/* the TP frames of messages, whatever their priority */
+		for (k = 0; tp && k < 2; k++)
+			set_filter(&fl[count++], tp_pgns[k], sa, -1);
+
+		if (sa < 0)
+			break;
+	}
+
+	*filter = fl;
+	return count;
+}
+
+/* transport protocol */
+#define TP_RTS		16
+#define TP_CTS		17
+#define TP_EOMA		19
+#define TP_BAM		32
+#define TP_ABORT	255
+
+#define TP_T1_NS	750000000LL
+
+struct tp_session {
+	int active;
+	unsigned int sa, da, prio;
+	unsigned int pgn;
+	unsigned int size;
+	unsigned int packets;
+	unsigned int next;	/* sequence number */
+	int64_t last_ns;
+	unsigned char *data;	/* CAN_J1939_MAX_TP_SIZE bytes of the pool */
+};
+
+struct can_j1939_tp {
+	struct tp_session *sessions;
+	int count;
+	unsigned char *pool;
+};
+
+struct can_j1939_tp *can_j1939_tp_new(int sessions)
+{
+	struct can_j1939_tp *tp;
+	int i;
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return NULL;
+
+	tp->count = sessions;
+	tp->sessions = calloc(sessions, sizeof(*tp->sessions));
+	/* the last packet may carry up to 6 bytes past the message */
+	tp->pool = malloc((size_t)sessions * (CAN_J1939_MAX_TP_SIZE + 7));
+	if (!tp->sessions || !tp->pool) {
+		can_j1939_tp_free(tp);
+		return NULL;
+	}
+
+	for (i = 0; i < sessions; i++)
+		tp->sessions[i].data = tp->pool +
+			(size_t)i * (CAN_J1939_MAX_TP_SIZE + 7);
+
+	return tp;
+}
+
+void can_j1939_tp_free(struct can_j1939_tp *tp)
+{
+	if (!tp)
+		return;
+
+	free(tp->sessions);
+	free(tp->pool);
+	free(tp);
+}
+
+static struct tp_session *find_session(struct can_j1939_tp *tp,
+				       unsigned int sa, unsigned int da,
+				       int64_t ns)
+{
+	struct tp_session *s;
+
+	for (s = tp->sessions; s < tp->sessions + tp->count; s++) {
+		if (!s->active || s->sa != sa || s->da != da)
+			continue;
+		if (ns - s->last_ns > TP_T1_NS) {
+			s->active = 0;
+			return NULL;
+		}
+		return s;
+	}
+
+	return NULL;
+}
+
+/* a free session, or the one idle the longest */
+static struct tp_session *new_session(struct can_j1939_tp *tp)
+{
+	struct tp_session *s, *oldest = tp->sessions;
+
+	for (s = tp->sessions; s < tp->sessions + tp->count; s++) {
+		if (!s->active)
+			return s;
+		if (s->last_ns < oldest->last_ns)
+			oldest = s;
+	}
+
+	return oldest;
+}
+
+static void tp_cm(struct can_j1939_tp *tp, const struct canfd_frame *frame,
+		  int64_t ns)
+{
+	unsigned int sa = can_j1939_sa(frame->can_id);
+	unsigned int da = can_j1939_da(frame->can_id);
+	const unsigned char *d = frame->data;
+	struct tp_session *s;
+	unsigned int size;
+
+	switch (d[0]) {
+	case TP_RTS:
+	case TP_BAM:
+		if (d[0] == TP_BAM && da != CAN_J1939_NO_ADDR)
+			return;
+		size = d[1] | d[2] << 8;
+		if (size < 9 || size > CAN_J1939_MAX_TP_SIZE ||
+		    d[3] != (size + 6) / 7)
+			return;
+
+		/* a new announcement replaces the session */
+		s = find_session(tp, sa, da, ns);
+		if (!s)
+			s = new_session(tp);
+		s->active = 1;
+		s->sa = sa;
+		s->da = da;
+		s->prio = can_j1939_prio(frame->can_id);
+		s->pgn = (d[5] | d[6] << 8 | d[7] << 16) & 0x3ffff;
+		s->size = size;
+		s->packets = d[3];
+		s->next = 1;
+		s->last_ns = ns;
+		break;
+
+	case TP_ABORT:
+		/* either side may abort */
+		s = find_session(tp, sa, da, ns);
+		if (!s)
+			s = find_session(tp, da, sa, ns);
+		if (s)
+			s->active = 0;
+		break;
+
+	default:
+		/* CTS and EOMA are flow control, the data is in TP.DT */
+		break;
+	}
+}
+
+int can_j1939_tp_add(struct can_j1939_tp *tp, const struct canfd_frame *frame,
+		     int64_t ns, struct can_j1939_msg *msg)
+{
+	struct tp_session *s;
+	unsigned int pgn, seq;
+
+	if ((frame->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) !=
+	    CAN_EFF_FLAG || frame->len < 8)
+		return 0;
+
+	pgn = can_j1939_pgn(frame->can_id);
+	if (pgn == CAN_J1939_PGN_TP_CM) {
+		tp_cm(tp, frame, ns);
+		return 0;
+	}
+	if (pgn != CAN_J1939_PGN_TP_DT)
+		return 0;
+
+	s = find_session(tp, can_j1939_sa(frame->can_id),
+			 can_j1939_da(frame->can_id), ns);
+	if (!s)
+		return 0;
+
+	/* a retransmission repeats packets, a gap loses the message */
+	seq = frame->data[0];
+	if (seq < s->next)
+		return 0;
+	if (seq > s->next) {
+		s->active = 0;
+		return 0;
+	}
+
+	memcpy(s->data + (seq - 1) * 7, frame->data + 1, 7);
+	s->last_ns = ns;
+	if (s->next++ < s->packets)
+		return 0;
+
+	/* the buffer stays untouched until the next call */
+	s->active = 0;
+	msg->pgn = s->pgn;
+	msg->sa = s->sa;
+	msg->da = s->da;
+	msg->prio = s->prio;
+	msg->len = s->size;
+	msg->data = s->data;
+
+	return 1;
+}
@@ -0,0 +1,550 @@
+/*
+ * canutils/canlink.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <net/if_arp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/can/netlink.h>
+
+#include <can_config.h>
+
+#include "canlink.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* large enough for a couple of RTM_NEWLINK messages incl. stats */
+#define NL_BUF_SIZE	(32 * 1024)
+
+static void parse_rtattr(struct rtattr *tb[], int max,
+			 struct rtattr *rta, int len)
+{
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type <= max)
+			tb[rta->rta_type] = rta;
+	}
+}
+
+/* copy an attribute, tolerate older and newer kernels' struct sizes */
+static void copy_rtattr(void *dst, size_t size, const struct rtattr *rta)
+{
+	memset(dst, 0, size);
+	memcpy(dst, RTA_DATA(rta), MIN(size, RTA_PAYLOAD(rta)));
+}
+
+static void parse_can_data(struct can_link *link, struct rtattr *data)
+{
+	struct rtattr *tb[IFLA_CAN_MAX + 1];
+
+	parse_rtattr(tb, IFLA_CAN_MAX, RTA_DATA(data), RTA_PAYLOAD(data));
+
+	if (tb[IFLA_CAN_BITTIMING]) {
+		copy_rtattr(&link->bt, sizeof(link->bt), tb[IFLA_CAN_BITTIMING]);
+		link->valid |= CAN_LINK_BITTIMING;
+	}
+	if (tb[IFLA_CAN_BITTIMING_CONST]) {
+		copy_rtattr(&link->btc, sizeof(link->btc),
+			    tb[IFLA_CAN_BITTIMING_CONST]);
+		link->valid |= CAN_LINK_BITTIMING_CONST;
+	}
+	if (tb[IFLA_CAN_DATA_BITTIMING]) {
+		copy_rtattr(&link->dbt, sizeof(link->dbt),
+			    tb[IFLA_CAN_DATA_BITTIMING]);
+		link->valid |= CAN_LINK_DATA_BITTIMING;
+	}
+	if (tb[IFLA_CAN_DATA_BITTIMING_CONST]) {
+		copy_rtattr(&link->dbtc, sizeof(link->dbtc),
+			    tb[IFLA_CAN_DATA_BITTIMING_CONST]);
+		link->valid |= CAN_LINK_DATA_BITTIMING_CONST;
+	}
+	if (tb[IFLA_CAN_CLOCK]) {
+		copy_rtattr(&link->clock, sizeof(link->clock), tb[IFLA_CAN_CLOCK]);
+		link->valid |= CAN_LINK_CLOCK;
+	}
+	if (tb[IFLA_CAN_STATE]) {
+		copy_rtattr(&link->state, sizeof(link->state), tb[IFLA_CAN_STATE]);
+		link->valid |= CAN_LINK_STATE;
+	}
+	if (tb[IFLA_CAN_CTRLMODE]) {
+		copy_rtattr(&link->ctrlmode, sizeof(link->ctrlmode),
+			    tb[IFLA_CAN_CTRLMODE]);
+		link->valid |= CAN_LINK_CTRLMODE;
+	}
+	if (tb[IFLA_CAN_RESTART_MS]) {
+		copy_rtattr(&link->restart_ms, sizeof(link->restart_ms),
+			    tb[IFLA_CAN_RESTART_MS]);
+		link->valid |= CAN_LINK_RESTART_MS;
+	}
+	if (tb[IFLA_CAN_BERR_COUNTER]) {
+		copy_rtattr(&link->berr, sizeof(link->berr),
+			    tb[IFLA_CAN_BERR_COUNTER]);
+		link->valid |= CAN_LINK_BERR_COUNTER;
+	}
+}
+
+/*
+ * returns 0 if "nlh" describes a CAN interface, -1 otherwise
+ */
+static int can_link_parse(struct nlmsghdr *nlh, struct can_link *link)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *tb[IFLA_MAX + 1];
+	struct rtattr *linkinfo[IFLA_INFO_MAX + 1];
+	int len;
+
+	if (nlh->nlmsg_type != RTM_NEWLINK)
+		return -1;
+
+	len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	if (len < 0 || ifi->ifi_type != ARPHRD_CAN)
+		return -1;
+
+	memset(link, 0, sizeof(*link));
+	link->ifindex = ifi->ifi_index;
+	link->flags = ifi->ifi_flags;
+
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
+
+	if (tb[IFLA_IFNAME])
+		strncpy(link->name, RTA_DATA(tb[IFLA_IFNAME]),
+			sizeof(link->name) - 1);
+
+	if (tb[IFLA_STATS64]) {
+		copy_rtattr(&link->stats64, sizeof(link->stats64),
+			    tb[IFLA_STATS64]);
+		link->valid |= CAN_LINK_STATS64;
+	}
+
+	if (!tb[IFLA_LINKINFO])
+		return 0;
+
+	parse_rtattr(linkinfo, IFLA_INFO_MAX, RTA_DATA(tb[IFLA_LINKINFO]),
+		     RTA_PAYLOAD(tb[IFLA_LINKINFO]));
+
+	if (linkinfo[IFLA_INFO_KIND])
+		strncpy(link->kind, RTA_DATA(linkinfo[IFLA_INFO_KIND]),
+			sizeof(link->kind) - 1);
+
+	if (linkinfo[IFLA_INFO_DATA])
+		parse_can_data(link, linkinfo[IFLA_INFO_DATA]);
+
+	if (linkinfo[IFLA_INFO_XSTATS]) {
+		copy_rtattr(&link->xstats, sizeof(link->xstats),
+			    linkinfo[IFLA_INFO_XSTATS]);
+		link->valid |= CAN_LINK_XSTATS;
+	}
+
+	return 0;
+}
+
+static int nl_open(unsigned int groups)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = groups;
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int nl_send_getlink(int fd, const char *name)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char buf[RTA_SPACE(IFNAMSIZ)];
+	} req;
+	struct rtattr *rta;
+	size_t len;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.i));
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = 1;
+	req.i.ifi_family = AF_UNSPEC;
+
+	if (name) {
+		len = strlen(name) + 1;
+		if (len > IFNAMSIZ) {
+			errno = ENODEV;
+			return -1;
+		}
+		rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.n.nlmsg_len));
+		rta->rta_type = IFLA_IFNAME;
+		rta->rta_len = RTA_LENGTH(len);
+		memcpy(RTA_DATA(rta), name, len);
+		req.n.nlmsg_len = NLMSG_ALIGN(req.n.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	} else {
+		req.n.nlmsg_flags |= NLM_F_DUMP;
+	}
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+int can_link_dump(const char *name, can_link_cb_t cb, void *priv)
+{
+	struct can_link link;
+	struct nlmsghdr *nlh;
+	char *buf;
+	ssize_t len;
+	int fd, done = 0, err = -1;
+
+	buf = malloc(NL_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	fd = nl_open(0);
+	if (fd < 0)
+		goto out_free;
+
+	if (nl_send_getlink(fd, name))
+		goto out_close;
+
+	while (!done) {
+		len = recv(fd, buf, NL_BUF_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out_close;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+				errno = -e->error;
+				goto out_close;
+			}
+
+			/* a non dump request is answered with a single message */
+			if (name)
+				done = 1;
+
+			if (can_link_parse(nlh, &link)) {
+				if (name) {
+					errno = EOPNOTSUPP;
+					goto out_close;
+				}
+				continue;
+			}
+
+			if (cb(&link, priv)) {
+				done = 1;
+				break;
+			}
+		}
+	}
+	err = 0;
+
+ out_close:
+	close(fd);
+ out_free:
+	free(buf);
+
+	return err;
+}
+
+/*
+ * The dump is requested on the subscribed socket, so no change between
+ * the two is missed. Dump replies and notifications are queued in the
+ * order they're generated, each one is the state at its time. A dump
+ * isn't dropped when the socket buffer overflows, notifications are,
+ * they're replaced by another dump once the running one is done.
+ */
+int can_link_monitor(can_link_cb_t cb, void *priv)
+{
+	struct can_link link;
+	struct nlmsghdr *nlh;
+	char *buf;
+	ssize_t len;
+	int fd, dumping, redump = 0, err = -1;
+
+	buf = malloc(NL_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	fd = nl_open(RTMGRP_LINK);
+	if (fd < 0)
+		goto out_free;
+
+	if (nl_send_getlink(fd, NULL))
+		goto out_close;
+	dumping = 1;
+
+	while (1) {
+		len = recv(fd, buf, NL_BUF_SIZE, 0);
+		if (len < 0) {
+			if (errno != ENOBUFS)
+				goto out_close;
+
+			/* notifications have been lost, resync with a dump */
+			if (dumping) {
+				redump = 1;
+			} else {
+				if (nl_send_getlink(fd, NULL))
+					goto out_close;
+				dumping = 1;
+			}
+			continue;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				dumping = redump;
+				if (redump && nl_send_getlink(fd, NULL))
+					goto out_close;
+				redump = 0;
+				continue;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+				errno = -e->error;
+				goto out_close;
+			}
+
+			if (can_link_parse(nlh, &link))
+				continue;
+
+			if (cb(&link, priv)) {
+				err = 0;
+				goto out_close;
+			}
+		}
+	}
+
+ out_close:
+	close(fd);
+ out_free:
+	free(buf);
+
+	return err;
+}
+
+struct nl_batch {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static struct nlmsghdr *nl_batch_msg(struct nl_batch *b, __u32 seq,
+				     int ifindex, unsigned int flags,
+				     unsigned int change)
+{
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
+
+	nlh = (struct nlmsghdr *)(b->buf + b->len);
+	memset(nlh, 0, NLMSG_SPACE(sizeof(*ifi)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+	nlh->nlmsg_type = RTM_NEWLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_seq = seq;
+
+	ifi = NLMSG_DATA(nlh);
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = ifindex;
+	ifi->ifi_flags = flags;
+	ifi->ifi_change = change;
+
+	return nlh;
+}
+
+static struct rtattr *nl_addattr(struct nlmsghdr *nlh, int type,
+				 const void *data, size_t len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len)
+		memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+	return rta;
+}
+
+static void nl_nest_end(struct nlmsghdr *nlh, struct rtattr *nest)
+{
+	nest->rta_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+static void nl_batch_end(struct nl_batch *b, struct nlmsghdr *nlh)
+{
+	b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* worst case size of a single request */
+#define NL_APPLY_MSG_SIZE \
+	(NLMSG_SPACE(sizeof(struct ifinfomsg)) + 256 + \
+	 2 * RTA_SPACE(sizeof(struct can_bittiming)) + \
+	 RTA_SPACE(sizeof(struct can_ctrlmode)) + \
+	 RTA_SPACE(sizeof(__u32)))
+
+static void nl_add_config(struct nl_batch *b, __u32 seq,
+			  const struct can_link_config *cfg)
+{
+	struct nlmsghdr *nlh;
+	struct rtattr *linkinfo, *data;
+	unsigned int change = 0, flags = 0;
+
+	if (cfg->up >= 0) {
+		change = IFF_UP;
+		flags = cfg->up ? IFF_UP : 0;
+	}
+
+	nlh = nl_batch_msg(b, seq, cfg->ifindex, flags, change);
+
+	if (cfg->set & (CAN_LINK_BITTIMING | CAN_LINK_DATA_BITTIMING |
+			CAN_LINK_CTRLMODE | CAN_LINK_RESTART_MS)) {
+		linkinfo = nl_addattr(nlh, IFLA_LINKINFO, NULL, 0);
+		nl_addattr(nlh, IFLA_INFO_KIND, "can", strlen("can"));
+		data = nl_addattr(nlh, IFLA_INFO_DATA, NULL, 0);
+
+		if (cfg->set & CAN_LINK_BITTIMING)
+			nl_addattr(nlh, IFLA_CAN_BITTIMING, &cfg->bt,
+				   sizeof(cfg->bt));
+		if (cfg->set & CAN_LINK_DATA_BITTIMING)
+			nl_addattr(nlh, IFLA_CAN_DATA_BITTIMING, &cfg->dbt,
+				   sizeof(cfg->dbt));
+		if (cfg->set & CAN_LINK_CTRLMODE)
+			nl_addattr(nlh, IFLA_CAN_CTRLMODE, &cfg->ctrlmode,
+				   sizeof(cfg->ctrlmode));
+		if (cfg->set & CAN_LINK_RESTART_MS)
+			nl_addattr(nlh, IFLA_CAN_RESTART_MS, &cfg->restart_ms,
+				   sizeof(cfg->restart_ms));
+
+		nl_nest_end(nlh, data);
+		nl_nest_end(nlh, linkinfo);
+	}
+
+	nl_batch_end(b, nlh);
+}
+
+/*
+ * Sequence numbers: 1...n for the down requests, n + 1...2n for the
+ * config requests of cfg[0...n - 1].
+ */
+int can_link_apply(struct can_link_config *cfg, int n)
+{
+	struct nl_batch b;
+	struct nlmsghdr *nlh;
+	char *buf;
+	ssize_t len;
+	int fd, i, pending = 0, failed = 0, err = -1;
+
+	memset(&b, 0, sizeof(b));
+	b.size = 2 * n * NL_APPLY_MSG_SIZE;
+	b.buf = calloc(1, b.size);
+	buf = malloc(NL_BUF_SIZE);
+	if (!b.buf || !buf)
+		goto out_free;
+
+	for (i = 0; i < n; i++) {
+		cfg[i].err = 0;
+		if (!cfg[i].down_first)
+			continue;
+		nlh = nl_batch_msg(&b, i + 1, cfg[i].ifindex, 0, IFF_UP);
+		nl_batch_end(&b, nlh);
+		pending++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!cfg[i].set && cfg[i].up < 0)
+			continue;
+		nl_add_config(&b, n + i + 1, &cfg[i]);
+		pending++;
+	}
+
+	if (!pending) {
+		err = 0;
+		goto out_free;
+	}
+
+	fd = nl_open(0);
+	if (fd < 0)
+		goto out_free;
+
+	/* the kernel processes the requests in order */
+	if (send(fd, b.buf, b.len, 0) < 0)
+		goto out_close;
+
+	while (pending) {
+		len = recv(fd, buf, NL_BUF_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out_close;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type != NLMSG_ERROR ||
+			    nlh->nlmsg_seq < 1 || nlh->nlmsg_seq > 2 * n)
+				continue;
+
+			pending--;
+			i = (nlh->nlmsg_seq - 1) % n;
+			if (e->error && !cfg[i].err) {
+				cfg[i].err = e->error;
+				failed++;
+			}
+		}
+	}
+	err = failed;
+
+ out_close:
+	close(fd);
+ out_free:
+	free(buf);
+	free(b.buf);
+
+	return err;
+}
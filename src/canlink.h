@@ -0,0 +1,109 @@
+/*
+ * canutils/canlink.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef CANLINK_H
+#define CANLINK_H
+
+/*
+ * The CAN netlink structures are taken from whatever the includer uses,
+ * i.e. <libsocketcan.h> or <linux/can/netlink.h> has to be included
+ * before this file. Both define them in the same way.
+ */
+#include <net/if.h>
+#include <linux/if_link.h>
+
+/* which members of struct can_link are valid */
+#define CAN_LINK_BITTIMING		(1 << 0)
+#define CAN_LINK_BITTIMING_CONST	(1 << 1)
+#define CAN_LINK_CLOCK			(1 << 2)
+#define CAN_LINK_STATE			(1 << 3)
+#define CAN_LINK_CTRLMODE		(1 << 4)
+#define CAN_LINK_RESTART_MS		(1 << 5)
+#define CAN_LINK_BERR_COUNTER		(1 << 6)
+#define CAN_LINK_XSTATS			(1 << 7)
+#define CAN_LINK_STATS64		(1 << 8)
+#define CAN_LINK_DATA_BITTIMING		(1 << 9)
+#define CAN_LINK_DATA_BITTIMING_CONST	(1 << 10)
+
+/*
+ * Everything RTM_GETLINK reports about a CAN interface, parsed from a
+ * single RTM_NEWLINK message.
+ */
+struct can_link {
+	int ifindex;
+	char name[IFNAMSIZ];
+	char kind[16];
+	unsigned int flags;		/* IFF_* */
+	unsigned int valid;		/* CAN_LINK_* */
+
+	struct can_bittiming bt;
+	struct can_bittiming_const btc;
+	struct can_bittiming dbt;		/* CAN-FD data phase */
+	struct can_bittiming_const dbtc;
+	struct can_clock clock;
+	__u32 state;
+	struct can_ctrlmode ctrlmode;
+	__u32 restart_ms;
+	struct can_berr_counter berr;
+	struct can_device_stats xstats;
+	struct rtnl_link_stats64 stats64;
+};
+
+/* return != 0 to stop the dump */
+typedef int (*can_link_cb_t)(const struct can_link *link, void *priv);
+
+/*
+ * Query all attributes of the interface "name", or of all CAN interfaces
+ * if "name" is NULL, with a single RTM_GETLINK request. "cb" is called
+ * for each interface. Returns 0 on success, -1 on error with errno set.
+ */
+int can_link_dump(const char *name, can_link_cb_t cb, void *priv);
+
+/*
+ * Call "cb" for each CAN interface, then wait for link notifications
+ * (RTNLGRP_LINK) and call "cb" for each CAN interface that changed. The
+ * interfaces are dumped after subscribing, so no change is missed in
+ * between. Blocks until "cb" returns != 0 (returns 0) or an error,
+ * including a signal, occurs (returns -1 with errno set).
+ */
+int can_link_monitor(can_link_cb_t cb, void *priv);
+
+/*
+ * Desired changes of an interface for can_link_apply(), "set" tells
+ * which of bt, dbt (bitrate and sample_point, or the individual
+ * segments), ctrlmode and restart_ms are to be changed.
+ */
+struct can_link_config {
+	int ifindex;
+	const char *name;
+	unsigned int set;		/* CAN_LINK_* */
+	struct can_bittiming bt;
+	struct can_bittiming dbt;
+	struct can_ctrlmode ctrlmode;
+	__u32 restart_ms;
+
+	int down_first;			/* bring down before changing */
+	int up;				/* -1: keep, 0: down, 1: up */
+
+	int err;			/* result, 0 or -errno */
+};
+
+/*
+ * Apply "n" configs with a single batch of RTM_NEWLINK requests. First
+ * all interfaces with "down_first" are brought down, then each one is
+ * changed and brought up or down with one request. Returns the number
+ * of failed configs, see their "err", or -1 on error with errno set.
+ */
+int can_link_apply(struct can_link_config *cfg, int n);
+
+#endif /* CANLINK_H */
@@ -0,0 +1,711 @@
+/*
+ * canutils/canlog.c - compressed capture format
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <can_config.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include <linux/can.h>
+
+#include "canutils.h"
+
+/*
+ * Block header, little endian:
+ *
+ *   u32 magic "CBLK", u8 codec, u8 pad[3], u32 frames,
+ *   u32 raw length, u32 data length, u32 CRC-32 of the data,
+ *   s64 timestamp of the first frame, s64 min. and s64 max. timestamp
+ *
+ * followed by the data, the deflated or stored encoded frames. A frame
+ * is a tag byte, the zigzag varint of its timestamp's delta to the
+ * previous frame (the first frame's to the header's), then as told by
+ * the tag: a dictionary index or literal can_id as varint, the flags,
+ * and the payload as length and bytes, nothing for a repeat, or the
+ * bytes XORed with the id's previous payload of the same length. Ids
+ * not in the block's dictionary are added while it has room.
+ */
+#define BLOCK_MAGIC		0x4b4c4243
+#define BLOCK_HDR_SIZE		48
+#define BLOCK_NS		1000000000LL
+
+/* tag, timestamp, id, flags, length, payload */
+#define FRAME_MAX		(1 + 10 + 5 + 1 + 1 + CANFD_MAX_DLEN)
+
+#define DICT_SIZE		256
+#define HASH_SIZE		512
+
+enum {
+	CODEC_STORE,
+	CODEC_DEFLATE,
+};
+
+#define TAG_ID_SAME		0x00
+#define TAG_ID_DICT		0x01
+#define TAG_ID_LITERAL		0x02
+#define TAG_ID_MASK		0x03
+#define TAG_DATA_LITERAL	0x00
+#define TAG_DATA_REPEAT		0x04
+#define TAG_DATA_XOR		0x08
+#define TAG_DATA_MASK		0x0c
+#define TAG_FLAGS		0x10
+
+struct dict {
+	int count;
+	canid_t id[DICT_SIZE];
+	unsigned char len[DICT_SIZE];
+	unsigned char data[DICT_SIZE][CANFD_MAX_DLEN];
+};
+
+struct can_log {
+	int fd;
+	struct dict dict;
+	short hash[HASH_SIZE];		/* dictionary index + 1, 0 if empty */
+	canid_t prev_id;
+	int prev;			/* dictionary index of prev_id or -1 */
+	uint32_t frames;
+	int64_t base_ns, min_ns, max_ns, prev_ns;
+	size_t len;
+	unsigned char raw[CAN_LOG_BLOCK_SIZE];
+	unsigned char out[BLOCK_HDR_SIZE + CAN_LOG_BLOCK_SIZE];
+#ifdef HAVE_ZLIB_H
+	z_stream z;
+#endif
+};
+
+struct can_log_reader {
+	FILE *f;
+	int own_f;			/* of can_log_reader_open_mem() */
+	int64_t from_ns, to_ns;
+	struct dict dict;
+	canid_t prev_id;
+	int prev;
+	uint32_t frames;		/* left in the block */
+	int64_t prev_ns;
+	size_t pos, len;
+	unsigned char raw[CAN_LOG_BLOCK_SIZE];
+	unsigned char data[CAN_LOG_BLOCK_SIZE];
+#ifdef HAVE_ZLIB_H
+	z_stream z;
+#endif
+};
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	if (crc_table[1])
+		return;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_le(const unsigned char *p, size_t len)
+{
+	uint32_t c = 0xffffffff;
+
+	while (len--)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put_le64(unsigned char *p, int64_t v)
+{
+	uint64_t u = htole64(v);
+
+	memcpy(p, &u, sizeof(u));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static int64_t get_le64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static int get_varint(struct can_log_reader *r, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (r->pos == r->len)
+			return -1;
+		*v |= (uint64_t)(r->raw[r->pos] & 0x7f) << shift;
+		if (!(r->raw[r->pos++] & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static unsigned int hash_id(canid_t id)
+{
+	return (id * 0x9e3779b1u) >> (32 - 9);
+}
+
+static int dict_find(struct can_log *log, canid_t id)
+{
+	unsigned int h = hash_id(id);
+	int k;
+
+	while ((k = log->hash[h]) != 0) {
+		if (log->dict.id[k - 1] == id)
+			return k - 1;
+		h = (h + 1) % HASH_SIZE;
+	}
+
+	return -1;
+}
+
+/* returns the new index or -1 if the dictionary is full, like the reader */
+static int dict_add(struct dict *dict, canid_t id)
+{
+	if (dict->count == DICT_SIZE)
+		return -1;
+
+	dict->id[dict->count] = id;
+	return dict->count++;
+}
+
+static void reset_block(struct can_log *log)
+{
+	memset(log->hash, 0, sizeof(log->hash));
+	log->dict.count = 0;
+	log->frames = 0;
+	log->len = 0;
+}
+
+struct can_log *can_log_open(int fd)
+{
+	struct can_log *log;
+	struct stat st;
+	char magic[8];
+
+	crc_init();
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return NULL;
+	log->fd = fd;
+
+#ifdef HAVE_ZLIB_H
+	/* the fastest level, most of the redundancy is gone already */
+	if (deflateInit(&log->z, Z_BEST_SPEED) != Z_OK) {
+		free(log);
+		errno = ENOMEM;
+		return NULL;
+	}
+#endif
+
+	/* blocks are appended to an existing log */
+	if (fstat(fd, &st))
+		goto err;
+	if (S_ISREG(st.st_mode) && st.st_size) {
+		if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+		    memcmp(magic, CAN_LOG_MAGIC, sizeof(magic))) {
+			errno = EINVAL;
+			goto err;
+		}
+	} else if (write_all(fd, CAN_LOG_MAGIC, sizeof(magic))) {
+		goto err;
+	}
+
+	return log;
+
+ err:
+#ifdef HAVE_ZLIB_H
+	deflateEnd(&log->z);
+#endif
+	free(log);
+	return NULL;
+}
+
+int can_log_add(struct can_log *log, const struct canfd_frame *frame,
+		const struct timespec *ts)
+{
+	int64_t ns = ts->tv_sec * 1000000000LL + ts->tv_nsec, delta;
+	unsigned char *p, *tag;
+	unsigned int len, i;
+	int k = -1, fresh = 0;
+
+	if (log->frames && (log->len + FRAME_MAX > CAN_LOG_BLOCK_SIZE ||
+			    ns - log->base_ns >= BLOCK_NS) &&
+	    can_log_flush(log))
+		return -1;
+
+	if (!log->frames) {
+		log->base_ns = log->min_ns = log->max_ns = ns;
+		log->prev_ns = ns;
+	} else if (ns < log->min_ns) {
+		log->min_ns = ns;
+	} else if (ns > log->max_ns) {
+		log->max_ns = ns;
+	}
+
+	p = log->raw + log->len;
+	tag = p++;
+	*tag = 0;
+
+	delta = ns - log->prev_ns;
+	p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	log->prev_ns = ns;
+
+	if (log->frames && frame->can_id == log->prev_id) {
+		*tag |= TAG_ID_SAME;
+		k = log->prev;
+	} else if ((k = dict_find(log, frame->can_id)) >= 0) {
+		*tag |= TAG_ID_DICT;
+		p = put_varint(p, k);
+	} else {
+		*tag |= TAG_ID_LITERAL;
+		p = put_varint(p, frame->can_id);
+		k = dict_add(&log->dict, frame->can_id);
+		if (k >= 0) {
+			i = hash_id(frame->can_id);
+			while (log->hash[i])
+				i = (i + 1) % HASH_SIZE;
+			log->hash[i] = k + 1;
+			fresh = 1;
+		}
+	}
+
+	if (frame->flags) {
+		*tag |= TAG_FLAGS;
+		*p++ = frame->flags;
+	}
+
+	len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+	if (k >= 0 && !fresh && log->dict.len[k] == len) {
+		if (!memcmp(log->dict.data[k], frame->data, len)) {
+			*tag |= TAG_DATA_REPEAT;
+		} else {
+			*tag |= TAG_DATA_XOR;
+			for (i = 0; i < len; i++)
+				*p++ = frame->data[i] ^ log->dict.data[k][i];
+		}
+	} else {
+		*p++ = len;
+		memcpy(p, frame->data, len);
+		p += len;
+	}
+
+	if (k >= 0) {
+		log->dict.len[k] = len;
+		memcpy(log->dict.data[k], frame->data, len);
+	}
+
+	log->prev_id = frame->can_id;
+	log->prev = k;
+	log->len = p - log->raw;
+	log->frames++;
+
+	return 0;
+}
+
+int can_log_expire(struct can_log *log, const struct timespec *now)
+{
+	int64_t ns = now->tv_sec * 1000000000LL + now->tv_nsec;
+
+	if (!log->frames || ns - log->base_ns < BLOCK_NS)
+		return 0;
+
+	return can_log_flush(log);
+}
+
+int can_log_flush(struct can_log *log)
+{
+	unsigned char *hdr = log->out;
+	size_t len = log->len;
+	int codec = CODEC_STORE;
+
+	if (!log->frames)
+		return 0;
+
+#ifdef HAVE_ZLIB_H
+	/* stored if deflating doesn't make it smaller */
+	deflateReset(&log->z);
+	log->z.next_in = log->raw;
+	log->z.avail_in = log->len;
+	log->z.next_out = log->out + BLOCK_HDR_SIZE;
+	log->z.avail_out = log->len;
+	if (deflate(&log->z, Z_FINISH) == Z_STREAM_END) {
+		codec = CODEC_DEFLATE;
+		len = log->z.total_out;
+	}
+#endif
+	if (codec == CODEC_STORE)
+		memcpy(log->out + BLOCK_HDR_SIZE, log->raw, len);
+
+	memset(hdr, 0, BLOCK_HDR_SIZE);
+	put_le32(hdr, BLOCK_MAGIC);
+	hdr[4] = codec;
+	put_le32(hdr + 8, log->frames);
+	put_le32(hdr + 12, log->len);
+	put_le32(hdr + 16, len);
+	put_le32(hdr + 20, crc32_le(log->out + BLOCK_HDR_SIZE, len));
+	put_le64(hdr + 24, log->base_ns);
+	put_le64(hdr + 32, log->min_ns);
+	put_le64(hdr + 40, log->max_ns);
+
+	reset_block(log);
+	can_metric_add(CAN_METRIC_OUT_BYTES, BLOCK_HDR_SIZE + len);
+
+	return write_all(log->fd, log->out, BLOCK_HDR_SIZE + len);
+}
+
+int can_log_close(struct can_log *log)
+{
+	int ret;
+
+	ret = can_log_flush(log);
+#ifdef HAVE_ZLIB_H
+	deflateEnd(&log->z);
+#endif
+	free(log);
+
+	return ret;
+}
+
+static struct can_log_reader *reader_alloc(FILE *f)
+{
+	struct can_log_reader *r;
+
+	crc_init();
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->f = f;
+	r->from_ns = INT64_MIN;
+	r->to_ns = INT64_MAX;
+
+#ifdef HAVE_ZLIB_H
+	if (inflateInit(&r->z) != Z_OK) {
+		free(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+#endif
+
+	return r;
+}
+
+struct can_log_reader *can_log_reader_open(FILE *f)
+{
+	char magic[8];
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, CAN_LOG_MAGIC, sizeof(magic))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return reader_alloc(f);
+}
+
+struct can_log_reader *can_log_reader_open_mem(const void *buf, size_t size)
+{
+	struct can_log_reader *r;
+	FILE *f;
+
+	/* read only, the cast is fine */
+	f = fmemopen((void *)buf, size, "r");
+	if (!f)
+		return NULL;
+
+	r = reader_alloc(f);
+	if (!r) {
+		fclose(f);
+		return NULL;
+	}
+	r->own_f = 1;
+
+	return r;
+}
+
+void can_log_reader_close(struct can_log_reader *r)
+{
+#ifdef HAVE_ZLIB_H
+	inflateEnd(&r->z);
+#endif
+	if (r->own_f)
+		fclose(r->f);
+	free(r);
+}
+
+ssize_t can_log_block_size(const void *buf, size_t size)
+{
+	const unsigned char *hdr = buf;
+	uint32_t data_len;
+
+	if (size < BLOCK_HDR_SIZE)
+		return 0;
+
+	data_len = get_le32(hdr + 16);
+	if (get_le32(hdr) != BLOCK_MAGIC || data_len > CAN_LOG_BLOCK_SIZE)
+		return -1;
+	if (size - BLOCK_HDR_SIZE < data_len)
+		return 0;
+
+	return BLOCK_HDR_SIZE + data_len;
+}
+
+void can_log_reader_window(struct can_log_reader *r, int64_t from_ns,
+			   int64_t to_ns)
+{
+	r->from_ns = from_ns;
+	r->to_ns = to_ns;
+}
+
+/* returns 1 for a block, 0 at the end or -1 */
+static int next_block(struct can_log_reader *r)
+{
+	unsigned char hdr[BLOCK_HDR_SIZE];
+	uint32_t frames, raw_len, data_len;
+	int codec;
+
+	while (1) {
+		if (fread(hdr, sizeof(hdr), 1, r->f) != 1)
+			return 0;
+
+		codec = hdr[4];
+		frames = get_le32(hdr + 8);
+		raw_len = get_le32(hdr + 12);
+		data_len = get_le32(hdr + 16);
+		if (get_le32(hdr) != BLOCK_MAGIC ||
+		    raw_len > CAN_LOG_BLOCK_SIZE ||
+		    data_len > CAN_LOG_BLOCK_SIZE ||
+		    (codec == CODEC_STORE && data_len != raw_len) ||
+		    (codec != CODEC_STORE && codec != CODEC_DEFLATE))
+			goto bad;
+
+		if (fread(r->data, 1, data_len, r->f) != data_len)
+			return 0;
+
+		/* outside of the window, not worth a CRC or inflating */
+		if (get_le64(hdr + 40) < r->from_ns ||
+		    get_le64(hdr + 32) >= r->to_ns)
+			continue;
+
+		if (crc32_le(r->data, data_len) != get_le32(hdr + 20))
+			goto bad;
+
+		if (codec == CODEC_STORE) {
+			memcpy(r->raw, r->data, data_len);
+		} else {
+#ifdef HAVE_ZLIB_H
+			inflateReset(&r->z);
+			r->z.next_in = r->data;
+			r->z.avail_in = data_len;
+			r->z.next_out = r->raw;
+			r->z.avail_out = raw_len;
+			if (inflate(&r->z, Z_FINISH) != Z_STREAM_END ||
+			    r->z.total_out != raw_len)
+				goto bad;
+#else
+			errno = ENOTSUP;
+			return -1;
+#endif
+		}
+
+		r->dict.count = 0;
+		r->prev = -1;
+		r->frames = frames;
+		r->prev_ns = get_le64(hdr + 24);
+		r->pos = 0;
+		r->len = raw_len;
+
+		return 1;
+	}
+
+ bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+int can_log_read(struct can_log_reader *r, struct canfd_frame *frame,
+		 struct timespec *ts)
+{
+	uint64_t v;
+	unsigned int len, i;
+	int first, tag, k, fresh = 0, ret;
+	int64_t ns;
+
+	while (!r->frames) {
+		ret = next_block(r);
+		if (ret <= 0)
+			return ret;
+	}
+	first = r->pos == 0;
+
+	memset(frame, 0, sizeof(*frame));
+	if (r->pos == r->len)
+		goto bad;
+	tag = r->raw[r->pos++];
+
+	if (get_varint(r, &v))
+		goto bad;
+	r->prev_ns += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+
+	switch (tag & TAG_ID_MASK) {
+	case TAG_ID_SAME:
+		if (first)
+			goto bad;
+		frame->can_id = r->prev_id;
+		k = r->prev;
+		break;
+
+	case TAG_ID_DICT:
+		if (get_varint(r, &v) || v >= (uint64_t)r->dict.count)
+			goto bad;
+		k = v;
+		frame->can_id = r->dict.id[k];
+		break;
+
+	case TAG_ID_LITERAL:
+		if (get_varint(r, &v) || v > UINT32_MAX)
+			goto bad;
+		frame->can_id = v;
+		k = dict_add(&r->dict, v);
+		fresh = 1;
+		break;
+
+	default:
+		goto bad;
+	}
+
+	if (tag & TAG_FLAGS) {
+		if (r->pos == r->len)
+			goto bad;
+		frame->flags = r->raw[r->pos++];
+	}
+
+	switch (tag & TAG_DATA_MASK) {
+	case TAG_DATA_REPEAT:
+	case TAG_DATA_XOR:
+		if (k < 0 || fresh)
+			goto bad;
+		len = r->dict.len[k];
+		if (r->len - r->pos < ((tag & TAG_DATA_XOR) ? len : 0))
+			goto bad;
+		for (i = 0; i < len; i++) {
+			frame->data[i] = r->dict.data[k][i];
+			if (tag & TAG_DATA_XOR)
+				frame->data[i] ^= r->raw[r->pos++];
+		}
+		break;
+
+	case TAG_DATA_LITERAL:
+		if (r->pos == r->len)
+			goto bad;
+		len = r->raw[r->pos++];
+		if (len > CANFD_MAX_DLEN || r->len - r->pos < len)
+			goto bad;
+		memcpy(frame->data, r->raw + r->pos, len);
+		r->pos += len;
+		break;
+
+	default:
+		goto bad;
+	}
+	frame->len = len;
+
+	if (k >= 0) {
+		r->dict.len[k] = len;
+		memcpy(r->dict.data[k], frame->data, len);
+	}
+	r->prev_id = frame->can_id;
+	r->prev = k;
+	r->frames--;
+
+	ns = r->prev_ns;
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+
+	return 1;
+
+ bad:
+	r->frames = 0;
+	errno = EBADMSG;
+	return -1;
+}
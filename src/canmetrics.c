@@ -0,0 +1,481 @@
+/*
+ * canutils/canmetrics.c - counters and histograms of the frame I/O
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* open_memstream */
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <linux/can.h>
+
+#include "canio.h"
+
+/*
+ * Every thread updates its own block of counters, with plain stores, no
+ * locked instructions or shared cache lines. The blocks are pushed onto
+ * a list once and never freed, readers sum them up with relaxed loads,
+ * which may be a few updates behind.
+ *
+ * Histogram bucket i counts the values in (2^(i-1), 2^i].
+ */
+#define HIST_BUCKETS	64
+
+struct metrics_block {
+	uint64_t counter[CAN_METRIC_MAX];
+	uint64_t hist[CAN_HIST_MAX][HIST_BUCKETS];
+	uint64_t hist_sum[CAN_HIST_MAX];
+	struct metrics_block *next;
+} __attribute__((aligned(64)));
+
+static const struct {
+	const char *name;
+	const char *help;
+} counters[CAN_METRIC_MAX] = {
+	[CAN_METRIC_RX_FRAMES] = { "rx_frames", "Received frames" },
+	[CAN_METRIC_RX_BYTES] = { "rx_bytes", "Received payload bytes" },
+	[CAN_METRIC_RX_SYSCALLS] = { "rx_syscalls", "System calls to receive" },
+	[CAN_METRIC_RX_DROPS] = { "rx_drops", "Invalid or overflowed frames" },
+	[CAN_METRIC_TX_FRAMES] = { "tx_frames", "Sent frames" },
+	[CAN_METRIC_TX_BYTES] = { "tx_bytes", "Sent payload bytes" },
+	[CAN_METRIC_TX_SYSCALLS] = { "tx_syscalls", "System calls to send" },
+	[CAN_METRIC_TX_DROPS] = { "tx_drops", "Frames not sent due to errors" },
+	[CAN_METRIC_OUT_BYTES] = { "output_bytes", "Bytes written to log files" },
+};
+
+/* exposed buckets: 2^lo ... 2^hi, "scale" converts to the base unit */
+static const struct {
+	const char *name;
+	const char *help;
+	int lo, hi;
+	double scale;
+} hists[CAN_HIST_MAX] = {
+	[CAN_HIST_RX_BATCH] = {
+		"rx_batch_frames", "Frames per receive call, i.e. queue depth",
+		0, 10, 1,
+	},
+	[CAN_HIST_FRAME_NS] = {
+		"frame_processing_seconds", "Processing time per frame",
+		6, 24, 1e-9,
+	},
+};
+
+static int enabled;
+static __thread struct metrics_block *local;
+static struct metrics_block *blocks;
+
+/* protects the list of open can_io and their filters, never the hot path */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct can_io *ios;
+
+static const char *serve_path;
+static dev_t serve_dev;
+static ino_t serve_ino;
+
+void can_metrics_enable(void)
+{
+	enabled = 1;
+}
+
+int can_metrics_enabled(void)
+{
+	return enabled;
+}
+
+static struct metrics_block *get_block(void)
+{
+	struct metrics_block *b;
+
+	if (local)
+		return local;
+
+	b = aligned_alloc(64, sizeof(*b));
+	if (!b)
+		return NULL;
+	memset(b, 0, sizeof(*b));
+
+	b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&blocks, &b->next, b, 0,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return local = b;
+}
+
+static inline void inc(uint64_t *p, uint64_t v)
+{
+	/* single writer, no read-modify-write needed */
+	__atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+void can_metric_add(enum can_metric metric, uint64_t v)
+{
+	struct metrics_block *b;
+
+	if (!enabled || !(b = get_block()))
+		return;
+
+	inc(&b->counter[metric], v);
+}
+
+void can_metric_observe(enum can_metric_hist hist, uint64_t v, uint64_t count)
+{
+	struct metrics_block *b;
+	int i;
+
+	if (!enabled || !count || !(b = get_block()))
+		return;
+
+	i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+	if (i >= HIST_BUCKETS)
+		i = HIST_BUCKETS - 1;
+
+	inc(&b->hist[hist][i], count);
+	inc(&b->hist_sum[hist], v * count);
+}
+
+void can_metrics_register(struct can_io *io)
+{
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&io_lock);
+	io->metrics_next = ios;
+	ios = io;
+	io->metrics_registered = 1;
+	pthread_mutex_unlock(&io_lock);
+}
+
+void can_metrics_unregister(struct can_io *io)
+{
+	struct can_io **p;
+
+	if (!io->metrics_registered)
+		return;
+
+	pthread_mutex_lock(&io_lock);
+	for (p = &ios; *p; p = &(*p)->metrics_next) {
+		if (*p == io) {
+			*p = io->metrics_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+/* swap the filters, a reader may be printing the old ones */
+void can_metrics_set_filter(struct can_io *io, struct can_filter *filter,
+			    int count)
+{
+	struct can_filter *old_filter;
+	uint64_t *old_hits, *hits = NULL;
+
+	if (enabled && count)
+		hits = calloc(count, sizeof(*hits));
+
+	pthread_mutex_lock(&io_lock);
+	old_filter = io->filter;
+	old_hits = io->filter_hits;
+	io->filter = filter;
+	io->filter_count = count;
+	io->filter_hits = hits;
+	pthread_mutex_unlock(&io_lock);
+
+	free(old_filter);
+	free(old_hits);
+}
+
+void can_metrics_rx(struct can_io *io, const struct canfd_frame *frames, int n)
+{
+	uint64_t bytes = 0;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		bytes += frames[i].len;
+
+		if (frames[i].can_id & CAN_ERR_FLAG) {
+			for (j = 0; j < CAN_ERROR_CLASSES; j++)
+				if (frames[i].can_id & (1u << j))
+					inc(&io->error_frames[j], 1);
+			continue;
+		}
+
+		/* the first filter that lets the frame pass */
+		if (!io->filter_hits)
+			continue;
+		for (j = 0; j < io->filter_count; j++) {
+			if (can_filter_match(&io->filter[j], &frames[i])) {
+				inc(&io->filter_hits[j], 1);
+				break;
+			}
+		}
+	}
+
+	can_metric_add(CAN_METRIC_RX_FRAMES, n);
+	can_metric_add(CAN_METRIC_RX_BYTES, bytes);
+	can_metric_observe(CAN_HIST_RX_BATCH, n, 1);
+}
+
+void can_metrics_tx(struct can_io *io, const struct canfd_frame *frames,
+		    int n, int sent)
+{
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < sent; i++)
+		bytes += frames[i].len;
+
+	can_metric_add(CAN_METRIC_TX_FRAMES, sent);
+	can_metric_add(CAN_METRIC_TX_BYTES, bytes);
+	if (sent < n)
+		can_metric_add(CAN_METRIC_TX_DROPS, n - sent);
+}
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void print_bound(FILE *f, double v)
+{
+	fprintf(f, "%.9g", v);
+}
+
+int can_metrics_print(FILE *f)
+{
+	struct metrics_block *b, *head;
+	struct can_io *io;
+	uint64_t v, cum, sum, bucket[HIST_BUCKETS];
+	int m, i;
+
+	head = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+
+	for (m = 0; m < CAN_METRIC_MAX; m++) {
+		v = 0;
+		for (b = head; b; b = b->next)
+			v += load(&b->counter[m]);
+		fprintf(f, "# HELP canutils_%s_total %s.\n"
+			"# TYPE canutils_%s_total counter\n"
+			"canutils_%s_total %llu\n",
+			counters[m].name, counters[m].help, counters[m].name,
+			counters[m].name, (unsigned long long)v);
+	}
+
+	for (m = 0; m < CAN_HIST_MAX; m++) {
+		memset(bucket, 0, sizeof(bucket));
+		sum = 0;
+		for (b = head; b; b = b->next) {
+			for (i = 0; i < HIST_BUCKETS; i++)
+				bucket[i] += load(&b->hist[m][i]);
+			sum += load(&b->hist_sum[m]);
+		}
+
+		fprintf(f, "# HELP canutils_%s %s.\n"
+			"# TYPE canutils_%s histogram\n",
+			hists[m].name, hists[m].help, hists[m].name);
+		for (i = 0, cum = 0; i < HIST_BUCKETS; i++) {
+			cum += bucket[i];
+			if (i < hists[m].lo || i > hists[m].hi)
+				continue;
+			fprintf(f, "canutils_%s_bucket{le=\"", hists[m].name);
+			print_bound(f, (double)(1ULL << i) * hists[m].scale);
+			fprintf(f, "\"} %llu\n", (unsigned long long)cum);
+		}
+		fprintf(f, "canutils_%s_bucket{le=\"+Inf\"} %llu\n"
+			"canutils_%s_sum ",
+			hists[m].name, (unsigned long long)cum, hists[m].name);
+		print_bound(f, sum * hists[m].scale);
+		fprintf(f, "\ncanutils_%s_count %llu\n",
+			hists[m].name, (unsigned long long)cum);
+	}
+
+	pthread_mutex_lock(&io_lock);
+	fprintf(f, "# HELP canutils_filter_hits_total Frames passed per filter.\n"
+		"# TYPE canutils_filter_hits_total counter\n");
+	for (io = ios; io; io = io->metrics_next) {
+		if (!io->filter_hits)
+			continue;
+		for (i = 0; i < io->filter_count; i++)
+			fprintf(f, "canutils_filter_hits_total{interface=\"%s\","
+				"filter=\"%x:%x\"} %llu\n", io->name,
+				io->filter[i].can_id, io->filter[i].can_mask,
+				(unsigned long long)load(&io->filter_hits[i]));
+	}
+
+	fprintf(f, "# HELP canutils_error_frames_total Error frames per class.\n"
+		"# TYPE canutils_error_frames_total counter\n");
+	for (io = ios; io; io = io->metrics_next)
+		for (i = 0; i < CAN_ERROR_CLASSES; i++)
+			fprintf(f, "canutils_error_frames_total{interface=\"%s\","
+				"class=\"%s\"} %llu\n", io->name,
+				can_error_class_name(i),
+				(unsigned long long)load(&io->error_frames[i]));
+	pthread_mutex_unlock(&io_lock);
+
+	return ferror(f) ? -1 : 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Plain clients (socat, nc -U) get the text right away, HTTP clients
+ * (curl --unix-socket, a scraping proxy) send a request first and get
+ * a minimal HTTP/1.0 response.
+ */
+static void serve_client(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	char req[1024], hdr[128];
+	char *buf = NULL;
+	size_t len = 0;
+	ssize_t n = 0;
+	FILE *f;
+
+	if (poll(&pfd, 1, 100) > 0)
+		n = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return;
+	can_metrics_print(f);
+	fclose(f);
+
+	if (n > 4 && !strncmp(req, "GET ", 4)) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %zu\r\n\r\n", len);
+		send_all(fd, hdr, strlen(hdr));
+	}
+	send_all(fd, buf, len);
+	free(buf);
+}
+
+static void *serve_thread(void *arg)
+{
+	int sfd = (intptr_t)arg, fd;
+
+	while (1) {
+		fd = accept(sfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return NULL;
+		}
+		serve_client(fd);
+		close(fd);
+	}
+}
+
+/* only our own socket is removed, not what has taken its place */
+static void serve_cleanup(void)
+{
+	struct stat st;
+
+	if (!lstat(serve_path, &st) && S_ISSOCK(st.st_mode) &&
+	    st.st_dev == serve_dev && st.st_ino == serve_ino)
+		unlink(serve_path);
+}
+
+int can_metrics_serve(const char *path)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	struct stat st;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* a stale socket of an earlier run, but nothing else */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			errno = EEXIST;
+			goto err;
+		}
+		unlink(path);
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 8) || lstat(path, &st))
+		goto err;
+	serve_dev = st.st_dev;
+	serve_ino = st.st_ino;
+
+	/* signals are for the main thread, e.g. to interrupt a receive */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, serve_thread, (void *)(intptr_t)fd);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		goto err;
+	}
+
+	enabled = 1;
+	serve_path = path;
+	atexit(serve_cleanup);
+
+	return 0;
+
+ err:
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return -1;
+}
@@ -0,0 +1,550 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* strptime */
+#endif
+
+#include <can_config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/can.h>
+
+#include <canutils.h>
+
+extern int optind, opterr, optopt;
+
+/*
+ * Only the blocks of the index whose time range overlaps the query and
+ * whose id bitmap has one of the queried ids are read from the log, the
+ * parts of the log that aren't indexed are scanned. A bitmap can only
+ * be used if every filter matches exactly one id, anything else, e.g.
+ * a mask, has to look at all blocks of the time range.
+ */
+struct query {
+	struct can_filter *filter;
+	int filter_count;
+	uint64_t ids[CAN_INDEX_ID_BITS / 64];
+	int use_ids;
+	int64_t from_ns, to_ns;
+	int count_only;
+	unsigned long long matches;
+	unsigned long long bytes;
+};
+
+/*
+ * The timestamp and the frame, at the start of a line of candump. The
+ * decoded signals or errors that may follow aren't needed.
+ */
+#define PREFIX_SIZE	(CAN_FRAME_FORMAT_SIZE + 96)
+
+enum {
+	VERSION_OPTION = CHAR_MAX + 1,
+	FILTER_OPTION,
+	INDEX_OPTION,
+	FROM_OPTION,
+	TO_OPTION,
+};
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr,
+		"Usage: %s [Options] <logfile>\n"
+		"Print the frames of a candump log that match all options,\n"
+		"using the index written by candump --index, or of a compressed\n"
+		"log written by candump --compress\n"
+		"Options:\n"
+		" -i, --identifier=ID	frames with this id, may be repeated\n"
+		"     --filter=id:mask[:id:mask]...\n"
+		"			frames passing these filters\n"
+		"     --from=TIME	frames received at or after TIME\n"
+		"     --to=TIME		frames received before TIME\n"
+		"     --index=FILE	the index (default <logfile>.idx)\n"
+		" -c, --count		print the number of frames only\n"
+		" -v, --verbose		print how much of the log was read\n"
+		" -h, --help		this help\n"
+		"     --version		print version information and exit\n"
+		"\n"
+		"TIME is \"YYYY-MM-DD HH:MM[:SS[.frac]]\", \"HH:MM[:SS[.frac]]\" on the\n"
+		"day the log starts, both local time, or \"@SECONDS[.frac]\" since the epoch\n",
+		prg);
+}
+
+static int add_id(struct can_filter **filter, int *count, const char *s)
+{
+	struct can_filter *tmp;
+	unsigned long v;
+	char *end;
+
+	v = strtoul(s, &end, 0);
+	if (end == s || *end || v > CAN_EFF_MASK)
+		return -1;
+
+	tmp = realloc(*filter, sizeof(**filter) * (*count + 1));
+	if (!tmp)
+		return -1;
+	*filter = tmp;
+
+	/* like candump prints them, ids above 0x7ff are extended */
+	if (v > CAN_SFF_MASK) {
+		tmp[*count].can_id = v | CAN_EFF_FLAG;
+		tmp[*count].can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+	} else {
+		tmp[*count].can_id = v;
+		tmp[*count].can_mask = CAN_EFF_FLAG | CAN_SFF_MASK;
+	}
+	(*count)++;
+
+	return 0;
+}
+
+/* a filter that passes a single id, which can be looked up in the bitmaps */
+static int filter_exact(const struct can_filter *f)
+{
+	canid_t bits = f->can_id & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+	return !(f->can_id & CAN_INV_FILTER) &&
+		(f->can_mask & CAN_EFF_FLAG) &&
+		(f->can_mask & bits) == bits;
+}
+
+static void query_ids(struct query *q)
+{
+	unsigned int bit;
+	int i;
+
+	q->use_ids = q->filter_count > 0;
+	for (i = 0; i < q->filter_count; i++) {
+		if (!filter_exact(&q->filter[i])) {
+			q->use_ids = 0;
+			return;
+		}
+		bit = can_index_id_bit(q->filter[i].can_id);
+		q->ids[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+/* "day" gives the date of times without one */
+static int parse_time(const char *s, time_t day, int64_t *ns)
+{
+	static const char *formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+		"%H:%M:%S", "%H:%M",
+	};
+	struct tm tm;
+	const char *p = NULL;
+	char *end;
+	long long sec;
+	long frac = 0, scale = 1000000000;
+	unsigned int i;
+	time_t t;
+
+	if (*s == '@') {
+		sec = strtoll(s + 1, &end, 10);
+		if (end == s + 1)
+			return -1;
+		p = end;
+	} else {
+		for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			localtime_r(&day, &tm);
+			tm.tm_sec = 0;
+			p = strptime(s, formats[i], &tm);
+			if (p && (!*p || *p == '.'))
+				break;
+			p = NULL;
+		}
+		if (!p)
+			return -1;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		if (t == (time_t)-1)
+			return -1;
+		sec = t;
+	}
+
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9' && scale > 1; p++) {
+			scale /= 10;
+			frac += (*p - '0') * scale;
+		}
+	}
+	if (*p)
+		return -1;
+
+	*ns = sec * 1000000000LL + frac;
+
+	return 0;
+}
+
+static void parse_window(struct query *q, const char *from, const char *to,
+			 time_t day)
+{
+	if (from && parse_time(from, day, &q->from_ns)) {
+		fprintf(stderr, "invalid time %s\n", from);
+		exit(1);
+	}
+	if (to && parse_time(to, day, &q->to_ns)) {
+		fprintf(stderr, "invalid time %s\n", to);
+		exit(1);
+	}
+}
+
+static int match_filter(const struct query *q, const struct canfd_frame *frame)
+{
+	int i;
+
+	if (!q->filter_count)
+		return 1;
+	for (i = 0; i < q->filter_count; i++)
+		if (can_filter_match(&q->filter[i], frame))
+			return 1;
+
+	return 0;
+}
+
+static int match_line(struct query *q, const char *line, size_t len)
+{
+	struct canfd_frame frame;
+	char buf[PREFIX_SIZE];
+	long long sec;
+	long usec;
+	int64_t ns;
+	char *end;
+
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+
+	if (q->from_ns != INT64_MIN || q->to_ns != INT64_MAX) {
+		/* "(seconds.usecs) " of candump --timestamp */
+		if (buf[0] != '(')
+			return 0;
+		sec = strtoll(buf + 1, &end, 10);
+		if (*end != '.')
+			return 0;
+		usec = strtol(end + 1, &end, 10);
+		if (*end != ')')
+			return 0;
+		ns = sec * 1000000000LL + usec * 1000;
+		if (ns < q->from_ns || ns >= q->to_ns)
+			return 0;
+	}
+
+	if (!q->filter_count)
+		return 1;
+	if (can_frame_parse(buf, &frame))
+		return 0;
+
+	return match_filter(q, &frame);
+}
+
+static int scan(struct query *q, const char *log, uint64_t start, uint64_t end)
+{
+	const char *p = log + start, *e = log + end, *nl;
+
+	q->bytes += end - start;
+	while (p < e) {
+		nl = memchr(p, '\n', e - p);
+		if (!nl)
+			nl = e;
+		if (match_line(q, p, nl - p)) {
+			q->matches++;
+			if (!q->count_only &&
+			    (fwrite(p, 1, nl - p, stdout) != (size_t)(nl - p) ||
+			     putchar('\n') == EOF))
+				return -1;
+		}
+		p = nl + 1;
+	}
+
+	return 0;
+}
+
+static int block_match(const struct query *q, const struct can_index_block *b)
+{
+	int i;
+
+	if (b->last_ns < q->from_ns || b->first_ns >= q->to_ns)
+		return 0;
+	if (!q->use_ids)
+		return 1;
+	for (i = 0; i < CAN_INDEX_ID_BITS / 64; i++)
+		if (b->ids[i] & q->ids[i])
+			return 1;
+
+	return 0;
+}
+
+/*
+ * A log of candump --compress is decoded, only blocks outside of the
+ * time range are skipped. It has no id bitmaps, the dictionaries of its
+ * blocks are compressed along with the frames.
+ */
+static int query_log(struct query *q, FILE *f, const char *from,
+		     const char *to)
+{
+	struct can_log_reader *r;
+	struct canfd_frame frame;
+	struct timespec ts;
+	char buf[PREFIX_SIZE];
+	int64_t ns;
+	int ret, len;
+
+	r = can_log_reader_open(f);
+	if (!r)
+		return -1;
+
+	/* the first frame gives the day of times without a date */
+	ret = can_log_read(r, &frame, &ts);
+	parse_window(q, from, to, ret > 0 ? ts.tv_sec : time(NULL));
+	can_log_reader_window(r, q->from_ns, q->to_ns);
+
+	for (; ret > 0; ret = can_log_read(r, &frame, &ts)) {
+		ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		if (ns < q->from_ns || ns >= q->to_ns || !match_filter(q, &frame))
+			continue;
+
+		q->matches++;
+		if (q->count_only)
+			continue;
+		len = sprintf(buf, "(%lld.%06ld) ", (long long)ts.tv_sec,
+			      ts.tv_nsec / 1000);
+		can_frame_format(buf + len, CAN_FRAME_FORMAT_SIZE, &frame);
+		if (puts(buf) == EOF) {
+			ret = -1;
+			break;
+		}
+	}
+	can_log_reader_close(r);
+
+	return ret;
+}
+
+static void *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	if (!*size) {
+		close(fd);
+		return "";
+	}
+
+	p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int main(int argc, char **argv)
+{
+	struct query q = {
+		.from_ns = INT64_MIN,
+		.to_ns = INT64_MAX,
+	};
+	const struct can_index_header *hdr = NULL;
+	const struct can_index_block *blocks = NULL;
+	char *logname, *idxname = NULL;
+	char *from = NULL, *to = NULL;
+	const char *log, *idx = NULL;
+	char magic[sizeof(CAN_LOG_MAGIC) - 1];
+	FILE *f_log;
+	size_t log_size, idx_size = 0, count = 0, read_blocks = 0, i;
+	uint64_t pos = 0, end;
+	time_t day;
+	int opt, verbose = 0, n;
+	struct can_filter *f;
+
+	struct option long_options[] = {
+		{ "help",	no_argument,		0, 'h' },
+		{ "identifier",	required_argument,	0, 'i' },
+		{ "filter",	required_argument,	0, FILTER_OPTION },
+		{ "from",	required_argument,	0, FROM_OPTION },
+		{ "to",		required_argument,	0, TO_OPTION },
+		{ "index",	required_argument,	0, INDEX_OPTION },
+		{ "count",	no_argument,		0, 'c' },
+		{ "verbose",	no_argument,		0, 'v' },
+		{ "version",	no_argument,		0, VERSION_OPTION },
+		{ 0,		0,			0, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "hi:cv", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(basename(argv[0]));
+			exit(0);
+
+		case 'i':
+			if (add_id(&q.filter, &q.filter_count, optarg)) {
+				fprintf(stderr, "invalid id %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case FILTER_OPTION:
+			n = can_filter_parse(optarg, &f);
+			if (n < 0) {
+				fprintf(stderr, "filter must be applied in the form id:mask[:id:mask]...\n");
+				exit(1);
+			}
+			q.filter = realloc(q.filter,
+					   sizeof(*f) * (q.filter_count + n));
+			if (!q.filter)
+				exit(1);
+			memcpy(q.filter + q.filter_count, f, sizeof(*f) * n);
+			q.filter_count += n;
+			free(f);
+			break;
+
+		case FROM_OPTION:
+			from = optarg;
+			break;
+
+		case TO_OPTION:
+			to = optarg;
+			break;
+
+		case INDEX_OPTION:
+			idxname = optarg;
+			break;
+
+		case 'c':
+			q.count_only = 1;
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case VERSION_OPTION:
+			printf("canquery %s\n", VERSION);
+			exit(0);
+
+		default:
+			print_usage(basename(argv[0]));
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+	logname = argv[optind];
+
+	f_log = fopen(logname, "r");
+	if (!f_log) {
+		perror(logname);
+		exit(1);
+	}
+	if (fread(magic, sizeof(magic), 1, f_log) == 1 &&
+	    !memcmp(magic, CAN_LOG_MAGIC, sizeof(magic))) {
+		rewind(f_log);
+		if (query_log(&q, f_log, from, to)) {
+			perror(logname);
+			return 1;
+		}
+		if (q.count_only)
+			printf("%llu\n", q.matches);
+		if (verbose)
+			fprintf(stderr, "%llu frames\n", q.matches);
+		if (fflush(stdout))
+			goto err;
+		return 0;
+	}
+	fclose(f_log);
+
+	log = map_file(logname, &log_size);
+	if (!log) {
+		perror(logname);
+		exit(1);
+	}
+
+	if (!idxname) {
+		idxname = malloc(strlen(logname) + sizeof(".idx"));
+		if (!idxname)
+			exit(1);
+		sprintf(idxname, "%s.idx", logname);
+	}
+
+	/* without an index the whole log is scanned */
+	idx = map_file(idxname, &idx_size);
+	if (!idx) {
+		if (errno != ENOENT) {
+			perror(idxname);
+			exit(1);
+		}
+		fprintf(stderr, "%s: no index, scanning the log\n", idxname);
+	} else if (idx_size < sizeof(*hdr) ||
+		   memcmp(idx, CAN_INDEX_MAGIC, sizeof(hdr->magic)) ||
+		   ((const struct can_index_header *)idx)->id_bits !=
+		   CAN_INDEX_ID_BITS) {
+		fprintf(stderr, "%s: not an index\n", idxname);
+		exit(1);
+	} else {
+		hdr = (const struct can_index_header *)idx;
+		blocks = (const struct can_index_block *)(hdr + 1);
+		count = (idx_size - sizeof(*hdr)) / sizeof(*blocks);
+	}
+
+	day = count ? blocks[0].first_ns / 1000000000 : time(NULL);
+	parse_window(&q, from, to, day);
+	query_ids(&q);
+
+	for (i = 0; i < count; i++) {
+		end = blocks[i].offset + blocks[i].length;
+
+		/* an index that is ahead of its log, e.g. truncated */
+		if (end > log_size || blocks[i].offset < pos)
+			break;
+
+		if (blocks[i].offset > pos && scan(&q, log, pos, blocks[i].offset))
+			goto err;
+		if (block_match(&q, &blocks[i])) {
+			read_blocks++;
+			if (scan(&q, log, blocks[i].offset, end))
+				goto err;
+		}
+		pos = end;
+	}
+	if (scan(&q, log, pos, log_size))
+		goto err;
+
+	if (q.count_only)
+		printf("%llu\n", q.matches);
+	if (verbose)
+		fprintf(stderr, "%llu frames, read %zu of %zu blocks, "
+			"%llu of %zu bytes\n", q.matches, read_blocks, count,
+			q.bytes, log_size);
+
+	if (fflush(stdout))
+		goto err;
+
+	return 0;
+
+ err:
+	perror("write");
+	return 1;
+}
@@ -0,0 +1,398 @@
+/*
+ * canutils/canrecorder.c - flight recorder, frames around a trigger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+#include "canutils.h"
+
+#define TRIGGER_ERROR	1	/* any error frame */
+#define TRIGGER_BUSOFF	2
+#define TRIGGER_ID	3	/* an id, optionally with a payload */
+
+struct trigger {
+	int type;
+	canid_t id;
+	unsigned int len;		/* bytes of the payload to compare */
+	unsigned char data[CANFD_MAX_DLEN];
+	unsigned char mask[CANFD_MAX_DLEN];
+};
+
+/* a window before or after the trigger, in frames or nsecs */
+struct window {
+	uint64_t frames;
+	int64_t ns;
+	int time;
+};
+
+/*
+ * All frames go into one ring, "head" counts them. Frames before
+ * "release" may be taken, from "out" on. Until a trigger, nothing is
+ * released and the oldest frames are overwritten. A trigger releases
+ * the frames of the pre window and, while the post window lasts, every
+ * frame added. The ring has room for the pre window and a batch, so the
+ * frames a batch releases are never overwritten by the same batch.
+ */
+struct can_recorder {
+	struct canfd_frame *frames;
+	int64_t *ns;
+	uint64_t size;			/* a power of 2 */
+	uint64_t head, out, release;
+	uint64_t lost;
+
+	struct window pre, post;
+	int in_post;
+	uint64_t post_left;
+	int64_t post_end;
+
+	struct trigger *triggers;
+	int trigger_count;
+};
+
+static int parse_window(const char *s, struct window *w)
+{
+	char *end;
+	double v;
+
+	memset(w, 0, sizeof(*w));
+	v = strtod(s, &end);
+	if (end == s || v < 0)
+		return -1;
+
+	if (!strcmp(end, "s") || !strcmp(end, "ms")) {
+		w->time = 1;
+		w->ns = v * (*end == 'm' ? 1000000.0 : 1000000000.0);
+	} else if (!*end && v == (uint64_t)v) {
+		w->frames = v;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+struct can_recorder *can_recorder_new(const char *spec, int batch)
+{
+	struct can_recorder *rec;
+	const char *colon;
+	char pre[32];
+	uint64_t frames;
+
+	colon = strchr(spec, ':');
+	if (!colon)
+		colon = spec + strlen(spec);
+	if (colon - spec >= (int)sizeof(pre) || batch < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	memcpy(pre, spec, colon - spec);
+	pre[colon - spec] = '\0';
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+
+	if (parse_window(pre, &rec->pre) ||
+	    parse_window(*colon ? colon + 1 : pre, &rec->post)) {
+		free(rec);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	frames = rec->pre.time ?
+		rec->pre.ns / 1000000000.0 * CAN_RECORDER_RATE + 1 :
+		rec->pre.frames;
+	if (frames > CAN_RECORDER_MAX_FRAMES) {
+		free(rec);
+		errno = EINVAL;
+		return NULL;
+	}
+	for (rec->size = 64; rec->size < frames + batch;)
+		rec->size *= 2;
+
+	rec->frames = malloc(rec->size * sizeof(*rec->frames));
+	rec->ns = malloc(rec->size * sizeof(*rec->ns));
+	if (!rec->frames || !rec->ns) {
+		can_recorder_free(rec);
+		return NULL;
+	}
+
+	return rec;
+}
+
+void can_recorder_free(struct can_recorder *rec)
+{
+	if (!rec)
+		return;
+
+	free(rec->frames);
+	free(rec->ns);
+	free(rec->triggers);
+	free(rec);
+}
+
+static int hex(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/* "error", "bus-off" or "id[:data]", up to "end" */
+static int parse_trigger(struct trigger *t, const char *s, const char *end)
+{
+	unsigned long id;
+	char *p;
+	int hi, lo;
+
+	memset(t, 0, sizeof(*t));
+	if (end - s == 5 && !strncmp(s, "error", 5)) {
+		t->type = TRIGGER_ERROR;
+		return 0;
+	}
+	if (end - s == 7 && !strncmp(s, "bus-off", 7)) {
+		t->type = TRIGGER_BUSOFF;
+		return 0;
+	}
+
+	t->type = TRIGGER_ID;
+	id = strtoul(s, &p, 0);
+	if (p == s || id > CAN_EFF_MASK || (p != end && *p != ':'))
+		return -1;
+	t->id = id > CAN_SFF_MASK ? id | CAN_EFF_FLAG : id;
+	if (p == end)
+		return 0;
+
+	/* hex bytes, "xx" for any value */
+	for (p++; p < end; p += 2) {
+		if (p + 1 >= end || t->len == CANFD_MAX_DLEN)
+			return -1;
+		if ((p[0] == 'x' || p[0] == 'X') && (p[1] == 'x' || p[1] == 'X')) {
+			t->len++;
+			continue;
+		}
+		hi = hex(p[0]);
+		lo = hex(p[1]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		t->data[t->len] = hi << 4 | lo;
+		t->mask[t->len++] = 0xff;
+	}
+
+	return t->len ? 0 : -1;
+}
+
+int can_recorder_add_triggers(struct can_recorder *rec, const char *spec)
+{
+	struct trigger *triggers;
+	const char *p = spec, *end;
+
+	while (1) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+
+		triggers = realloc(rec->triggers, (rec->trigger_count + 1) *
+				   sizeof(*triggers));
+		if (!triggers)
+			return -1;
+		rec->triggers = triggers;
+		if (parse_trigger(&triggers[rec->trigger_count], p, end)) {
+			errno = EINVAL;
+			return -1;
+		}
+		rec->trigger_count++;
+
+		if (!*end)
+			return 0;
+		p = end + 1;
+	}
+}
+
+can_err_mask_t can_recorder_err_mask(const struct can_recorder *rec)
+{
+	can_err_mask_t mask = 0;
+	int i;
+
+	for (i = 0; i < rec->trigger_count; i++) {
+		if (rec->triggers[i].type == TRIGGER_ERROR)
+			mask |= CAN_ERR_MASK;
+		else if (rec->triggers[i].type == TRIGGER_BUSOFF)
+			mask |= CAN_ERR_BUSOFF;
+	}
+
+	return mask;
+}
+
+static int match(const struct can_recorder *rec,
+		 const struct canfd_frame *frame)
+{
+	const struct trigger *t;
+	canid_t id = frame->can_id;
+	unsigned int i;
+
+	for (t = rec->triggers; t < rec->triggers + rec->trigger_count; t++) {
+		switch (t->type) {
+		case TRIGGER_ERROR:
+			if (id & CAN_ERR_FLAG)
+				return 1;
+			break;
+
+		case TRIGGER_BUSOFF:
+			if (id & CAN_ERR_FLAG && id & CAN_ERR_BUSOFF)
+				return 1;
+			break;
+
+		case TRIGGER_ID:
+			if (id & (CAN_ERR_FLAG | CAN_RTR_FLAG) ||
+			    (id & (CAN_EFF_FLAG | CAN_EFF_MASK)) != t->id ||
+			    frame->len < t->len)
+				break;
+			for (i = 0; i < t->len; i++)
+				if ((frame->data[i] ^ t->data[i]) & t->mask[i])
+					break;
+			if (i == t->len)
+				return 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Release the pre window of a trigger at "ns", and the triggering frame,
+ * the last one added, if "frame". Frames that are neither released nor
+ * in the window are dropped.
+ */
+static void fire(struct can_recorder *rec, int64_t ns, int frame)
+{
+	uint64_t start, last, i;
+
+	start = rec->out > rec->release ? rec->out : rec->release;
+	last = rec->head - frame;
+	if (!rec->pre.time) {
+		if (last > start && last - start > rec->pre.frames)
+			start = last - rec->pre.frames;
+	} else {
+		while (start < last &&
+		       rec->ns[start & (rec->size - 1)] < ns - rec->pre.ns)
+			start++;
+	}
+
+	/*
+	 * Released frames are still to be taken, "out" stays on them. Only
+	 * the frames in front of the window are dropped, by moving the
+	 * window behind the released ones.
+	 */
+	if (rec->out < rec->release) {
+		if (start > rec->release) {
+			for (i = 0; i < rec->head - start; i++) {
+				rec->frames[(rec->release + i) & (rec->size - 1)] =
+					rec->frames[(start + i) & (rec->size - 1)];
+				rec->ns[(rec->release + i) & (rec->size - 1)] =
+					rec->ns[(start + i) & (rec->size - 1)];
+			}
+			rec->head -= start - rec->release;
+		}
+	} else if (rec->out < start) {
+		rec->out = start;
+	}
+	rec->release = rec->head;
+
+	rec->in_post = 1;
+	rec->post_left = rec->post.frames;
+	rec->post_end = ns + rec->post.ns;
+}
+
+void can_recorder_trigger(struct can_recorder *rec, const struct timespec *ts)
+{
+	fire(rec, ts->tv_sec * 1000000000LL + ts->tv_nsec, 0);
+}
+
+int can_recorder_add(struct can_recorder *rec,
+		     const struct canfd_frame *frames,
+		     const struct timespec *ts, int n)
+{
+	uint64_t slot;
+	int64_t ns;
+	int i, fired = 0;
+
+	for (i = 0; i < n; i++) {
+		ns = ts[i].tv_sec * 1000000000LL + ts[i].tv_nsec;
+
+		/* overwrite the oldest, released ones only if not taken */
+		if (rec->head - rec->out == rec->size) {
+			if (rec->out < rec->release)
+				rec->lost++;
+			rec->out++;
+			if (rec->release < rec->out)
+				rec->release = rec->out;
+		}
+		slot = rec->head++ & (rec->size - 1);
+		rec->frames[slot] = frames[i];
+		rec->ns[slot] = ns;
+
+		if (rec->in_post) {
+			if (rec->post.time ? ns <= rec->post_end :
+			    rec->post_left > 0) {
+				rec->post_left--;
+				rec->release = rec->head;
+			} else {
+				rec->in_post = 0;
+			}
+		}
+
+		if (rec->trigger_count && match(rec, &frames[i])) {
+			fire(rec, ns, 1);
+			fired++;
+		}
+	}
+
+	return fired;
+}
+
+int can_recorder_pending(const struct can_recorder *rec)
+{
+	return rec->release > rec->out;
+}
+
+int can_recorder_take(struct can_recorder *rec, struct canfd_frame *frames,
+		      struct timespec *ts, int n)
+{
+	uint64_t slot;
+	int i;
+
+	for (i = 0; i < n && rec->out < rec->release; i++, rec->out++) {
+		slot = rec->out & (rec->size - 1);
+		frames[i] = rec->frames[slot];
+		ts[i].tv_sec = rec->ns[slot] / 1000000000LL;
+		ts[i].tv_nsec = rec->ns[slot] % 1000000000LL;
+	}
+
+	return i;
+}
+
+uint64_t can_recorder_lost(const struct can_recorder *rec)
+{
+	return rec->lost;
+}
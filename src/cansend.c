@@ -10,17 +10,14 @@
 #include <string.h>
 #include <unistd.h>
 
-#include <net/if.h>
-
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/uio.h>
-#include <poll.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
+#include <canutils.h>
+
 extern int optind, opterr, optopt;
 
 static void print_usage(char *prg)
@@ -35,6 +32,7 @@ static void print_usage(char *prg)
 		" -l			send message infinite times\n"
 		"     --loop=COUNT	send message COUNT times\n"
 		" -p  --poll		use poll(2) to wait for buffer space while sending\n"
+		"     --io=BACKEND	frame I/O: rw, mmsg, mmap, uring or sim (default $CANUTILS_IO or mmsg)\n"
 		" -v, --verbose		be verbose\n"
 		" -h, --help		this help\n"
 		"     --version		print version information and exit\n",
@@ -43,20 +41,26 @@ static void print_usage(char *prg)
 
 enum {
 		VERSION_OPTION = CHAR_MAX + 1,
+		IO_OPTION,
 };
 
+#define BATCH	(32)
+
 int main(int argc, char **argv)
 {
-	struct can_frame frame = {
+	struct canfd_frame frame = {
 		.can_id = 1,
 	};
-	struct ifreq ifr;
-	struct sockaddr_can addr;
+	struct canfd_frame frames[BATCH];
+	struct can_io *io;
+	struct can_io_opts io_opts = {
+		.batch = BATCH,
+	};
 	char *interface;
 	int family = PF_CAN, type = SOCK_RAW, proto = CAN_RAW;
 	int loopcount = 1, infinite = 0;
-	int s, opt, ret, i, dlc = 0, rtr = 0, extended = 0;
-	ssize_t len;
+	int opt, ret, i, dlc = 0, rtr = 0, extended = 0;
+	int n, backend;
 	int use_poll = 0;
 	int verbose = 0;
 
@@ -69,6 +73,7 @@ int main(int argc, char **argv)
 		{ "version",	no_argument,		0, VERSION_OPTION},
 		{ "verbose",	no_argument,		0, 'v'},
 		{ "loop",	required_argument,	0, 'l'},
+		{ "io",		required_argument,	0, IO_OPTION},
 		{ 0,		0,			0, 0 },
 	};
 
@@ -104,6 +109,15 @@ int main(int argc, char **argv)
 			extended = 1;
 			break;
 
+		case IO_OPTION:
+			backend = can_io_backend_parse(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "unknown I/O backend %s\n", optarg);
+				exit(1);
+			}
+			io_opts.backend = backend;
+			break;
+
 		case VERSION_OPTION:
 			printf("cansend %s\n", VERSION);
 			exit(0);
@@ -127,22 +141,10 @@ int main(int argc, char **argv)
 	printf("interface = %s, family = %d, type = %d, proto = %d\n",
 	       interface, family, type, proto);
 
-	s = socket(family, type, proto);
-	if (s < 0) {
-		perror("socket");
-		return 1;
-	}
-
-	addr.can_family = family;
-	strcpy(ifr.ifr_name, interface);
-	if (ioctl(s, SIOCGIFINDEX, &ifr)) {
-		perror("ioctl");
-		return 1;
-	}
-	addr.can_ifindex = ifr.ifr_ifindex;
-
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
+	io_opts.wait = use_poll;
+	io = can_io_open(interface, &io_opts);
+	if (!io) {
+		perror(interface);
 		return 1;
 	}
 
@@ -152,7 +154,7 @@ int main(int argc, char **argv)
 		if (dlc == 8)
 			break;
 	}
-	frame.can_dlc = dlc;
+	frame.len = dlc;
 
 
 	if (extended) {
@@ -167,43 +169,32 @@ int main(int argc, char **argv)
 
 	if (verbose) {
 		printf("id: %d ", frame.can_id);
-		printf("dlc: %d\n", frame.can_dlc);
-		for (i = 0; i < frame.can_dlc; i++)
+		printf("dlc: %d\n", frame.len);
+		for (i = 0; i < frame.len; i++)
 			printf("0x%02x ", frame.data[i]);
 		printf("\n");
 	}
 
-	while (infinite || loopcount--) {
-	again:
-		len = write(s, &frame, sizeof(frame));
-		if (len == -1) {
-			switch (errno) {
-			case ENOBUFS: {
-				struct pollfd fds = {
-					.fd = s,
-					.events = POLLOUT,
-				};
-
-				if (!use_poll) {
-					perror("write");
-					exit(EXIT_FAILURE);
-				}
-
-				ret = poll(&fds, 1, 1000);
-				if (ret == -1 && errno != -EINTR) {
-					perror("poll()");
-					exit(EXIT_FAILURE);
-				}
-			}
-			case EINTR:	/* fallthrough */
-				goto again;
-			default:
-				perror("write");
-				exit(EXIT_FAILURE);
-			}
+	for (i = 0; i < BATCH; i++)
+		frames[i] = frame;
+
+	/* the same frame over and over, in batches */
+	while (infinite || loopcount > 0) {
+		n = BATCH;
+		if (!infinite && loopcount < n)
+			n = loopcount;
+
+		ret = can_io_send(io, frames, n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(EXIT_FAILURE);
 		}
+		if (!infinite)
+			loopcount -= ret;
 	}
 
-	close(s);
+	can_io_close(io);
 	return 0;
 }
@@ -4,33 +4,117 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
-#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <net/if.h>
-
-#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
+#include <canutils.h>
+
 extern int optind, opterr, optopt;
 
-static int s = -1;
-static int running = 1;
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t stats_pending;
 
 enum {
 	VERSION_OPTION = CHAR_MAX + 1,
+	IO_OPTION,
+	GAP_OPTION,
 };
 
+#define BATCH		(32)
 #define CAN_ID_DEFAULT	(2)
+#define STREAMS_MAX	(256)
+#define WINDOW_SIZE	(64)
+
+/*
+ * One stream per CAN id, the ids of all streams are consecutive.
+ *
+ * The sequence counter is transmitted little endian in the first
+ * width / 8 bytes of the payload. On reception it is extended to 64 bit
+ * relative to the expected value, so that with wide counters large
+ * losses don't alias. "window" remembers which of the last WINDOW_SIZE
+ * sequence numbers before "next" have been received, this is used to
+ * tell duplicated from reordered frames. A frame older than the window
+ * can't be told apart, it's taken as a restart of the sender and the
+ * stream is synced to it.
+ */
+struct stream {
+	canid_t id;
+	uint64_t next;
+	uint64_t window;
+	int init;
+
+	unsigned long long received;
+	unsigned long long lost;
+	unsigned long long duplicated;
+	unsigned long long reordered;
+	unsigned long long restarts;
+	unsigned long long wraps;
+	uint64_t max_gap;
+};
+
+static struct stream *streams;
+static int stream_count = 1;
+static int width = 8;
+
+/*
+ * With --latency the send time (CLOCK_REALTIME) follows the sequence
+ * counter in the payload. CAN-FD frames carry the full 64 bit nsec
+ * timestamp, classic frames only its lower 32 bits. This is enough for
+ * latencies up to 4.29s, the difference is calculated modulo 2^32.
+ */
+static int latency;
+static int canfd;
+
+/*
+ * Log bucketed latency histogram in nsecs, HDR style: values below
+ * HIST_SUB are counted exactly, above that each power of two is split
+ * into HIST_SUB / 2 linear buckets, i.e. the relative error is < 1/16.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_HALF	(HIST_SUB / 2)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+struct histogram {
+	unsigned long long count[HIST_BUCKETS];
+	unsigned long long total;
+	uint64_t min;
+	uint64_t max;
+	long double sum;
+};
+
+static struct histogram hist = {
+	.min = UINT64_MAX,
+};
+
+/* throughput, as seen by the receiver or the sender */
+static struct {
+	uint64_t first_ns;
+	uint64_t last_ns;
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long negative;
+} xfer;
+
+/* state of the previous --stats line */
+static struct {
+	int interval;
+	uint64_t ns;
+	unsigned long long frames;
+	unsigned long long bytes;
+} stats;
 
 void print_usage(char *prg)
 {
@@ -45,13 +129,20 @@ void print_usage(char *prg)
 		" -e  --extended		send extended frame\n"
 		" -i, --identifier=ID	CAN Identifier (default = %u)\n"
 		" -r, --receive		work as receiver\n"
+		" -L, --latency		embed the send time, the receiver measures one-way latency\n"
+		" -f, --fd		send CAN-FD frames\n"
+		" -S, --stats=SECONDS	print statistics as JSON line every SECONDS\n"
+		" -s, --streams=COUNT	use COUNT streams on consecutive IDs (default = 1, max = %u)\n"
+		" -w, --width=BITS	width of the sequence counter: 8, 16, 32 or 64 (default = 8)\n"
 		"     --loop=COUNT	send message COUNT times\n"
+		"     --gap=USEC	pause USEC between sent frames, e.g. to measure latency\n"
 		" -p  --poll		use poll(2) to wait for buffer space while sending\n"
+		"     --io=BACKEND	frame I/O: rw, mmsg, mmap, uring or sim (default $CANUTILS_IO or mmsg)\n"
 		" -q  --quit		quit if a wrong sequence is encountered\n"
 		" -v, --verbose		be verbose (twice to be even more verbose\n"
 		" -h  --help		this help\n"
 		"     --version		print version information and exit\n",
-		prg, CAN_ID_DEFAULT);
+		prg, CAN_ID_DEFAULT, STREAMS_MAX);
 }
 
 void sigterm(int signo)
@@ -59,34 +150,390 @@ void sigterm(int signo)
 	running = 0;
 }
 
+static void sigalrm(int signo)
+{
+	stats_pending = 1;
+}
+
+/* no SA_RESTART, a blocking read() or write() returns with EINTR */
+static void set_signal(int signo, void (*handler)(int))
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signo, &sa, NULL);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+	return shift * HIST_HALF + (v >> shift);
+}
+
+/* highest value that ends up in bucket "idx" */
+static uint64_t hist_value(int idx)
+{
+	int shift;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_HALF - 1;
+	return (((uint64_t)(idx % HIST_HALF + HIST_HALF) + 1) << shift) - 1;
+}
+
+static void hist_add(struct histogram *h, uint64_t v)
+{
+	h->count[hist_index(v)]++;
+	h->total++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+	unsigned long long rank, seen = 0;
+	int i;
+
+	rank = (unsigned long long)(p / 100 * h->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+static int frame_len(void)
+{
+	static const int fd_len[] = { 12, 16, 20, 24, 32, 48, 64 };
+	int len = width / 8, i;
+
+	if (latency)
+		len += canfd ? 8 : 4;
+
+	if (len > 8)
+		for (i = 0; len > fd_len[i]; i++)
+			;
+	else
+		return len;
+
+	return fd_len[i];
+}
+
+static void put_timestamp(struct canfd_frame *frame, uint64_t ts)
+{
+	int i;
+
+	for (i = width / 8; i < width / 8 + (canfd ? 8 : 4); i++) {
+		frame->data[i] = ts & 0xff;
+		ts >>= 8;
+	}
+}
+
+static uint64_t get_timestamp(const struct canfd_frame *frame)
+{
+	uint64_t ts = 0;
+	int i;
+
+	for (i = width / 8 + (canfd ? 8 : 4) - 1; i >= width / 8; i--)
+		ts = (ts << 8) | frame->data[i];
+
+	return ts;
+}
+
+static void latency_add(const struct canfd_frame *frame, uint64_t now)
+{
+	uint64_t sent = get_timestamp(frame);
+
+	if (!canfd) {
+		hist_add(&hist, (uint32_t)((uint32_t)now - (uint32_t)sent));
+	} else if (now >= sent) {
+		hist_add(&hist, now - sent);
+	} else {
+		/* the clocks of sender and receiver aren't in sync */
+		xfer.negative++;
+	}
+}
+
+static void xfer_add(const struct canfd_frame *frame, uint64_t now)
+{
+	if (!xfer.frames)
+		xfer.first_ns = now;
+	xfer.last_ns = now;
+	xfer.frames++;
+	xfer.bytes += frame->len;
+}
+
+static void print_xfer(const char *what)
+{
+	double duration = (xfer.last_ns - xfer.first_ns) / 1e9;
+
+	if (xfer.frames < 2 || duration <= 0)
+		return;
+
+	printf("%s: %llu frames, %llu bytes in %.3fs, %.0f frames/s, %.0f bytes/s\n",
+	       what, xfer.frames, xfer.bytes, duration,
+	       (xfer.frames - 1) / duration, xfer.bytes / duration);
+}
+
+static void print_latency(void)
+{
+	if (!hist.total) {
+		if (xfer.negative)
+			printf("latency: no valid samples, %llu negative\n",
+			       xfer.negative);
+		return;
+	}
+
+	printf("latency [us]: samples: %llu, min: %.1f, mean: %.1f, "
+	       "p50: %.1f, p99: %.1f, p99.9: %.1f, max: %.1f\n",
+	       hist.total, hist.min / 1e3,
+	       (double)(hist.sum / hist.total) / 1e3,
+	       hist_percentile(&hist, 50) / 1e3,
+	       hist_percentile(&hist, 99) / 1e3,
+	       hist_percentile(&hist, 99.9) / 1e3,
+	       hist.max / 1e3);
+
+	if (xfer.negative)
+		printf("latency: %llu samples with negative latency, "
+		       "clocks not in sync?\n", xfer.negative);
+}
+
+static void print_stats(int receive, int final)
+{
+	unsigned long long lost = 0, duplicated = 0, reordered = 0;
+	unsigned long long restarts = 0, wraps = 0;
+	uint64_t max_gap = 0, now = now_ns();
+	double duration, ppm = 0;
+	int i;
+
+	stats_pending = 0;
+
+	for (i = 0; i < stream_count; i++) {
+		lost += streams[i].lost;
+		duplicated += streams[i].duplicated;
+		reordered += streams[i].reordered;
+		restarts += streams[i].restarts;
+		wraps += streams[i].wraps;
+		if (streams[i].max_gap > max_gap)
+			max_gap = streams[i].max_gap;
+	}
+
+	if (!stats.ns)
+		stats.ns = xfer.first_ns ? xfer.first_ns : now;
+	duration = (now - stats.ns) / 1e9;
+	if (duration <= 0)
+		duration = 1;
+
+	if (xfer.frames + lost)
+		ppm = lost * 1e6 / (xfer.frames + lost);
+
+	printf("{\"time\": %.3f, \"final\": %s, \"%s\": %llu, \"bytes\": %llu, "
+	       "\"rate\": %.1f, \"byte_rate\": %.1f, "
+	       "\"lost\": %llu, \"loss_ppm\": %.1f, "
+	       "\"duplicated\": %llu, \"reordered\": %llu, "
+	       "\"restarts\": %llu, \"wraps\": %llu, \"max_gap\": %llu}\n",
+	       now / 1e9, final ? "true" : "false",
+	       receive ? "received" : "sent", xfer.frames, xfer.bytes,
+	       (xfer.frames - stats.frames) / duration,
+	       (xfer.bytes - stats.bytes) / duration,
+	       lost, ppm, duplicated, reordered, restarts, wraps,
+	       (unsigned long long)max_gap);
+	fflush(stdout);
+
+	stats.ns = now;
+	stats.frames = xfer.frames;
+	stats.bytes = xfer.bytes;
+}
+
+static void put_sequence(struct canfd_frame *frame, uint64_t sequence)
+{
+	int i;
+
+	for (i = 0; i < width / 8; i++) {
+		frame->data[i] = sequence & 0xff;
+		sequence >>= 8;
+	}
+}
+
+static uint64_t get_sequence(const struct canfd_frame *frame)
+{
+	uint64_t sequence = 0;
+	int i;
+
+	for (i = width / 8 - 1; i >= 0; i--)
+		sequence = (sequence << 8) | frame->data[i];
+
+	return sequence;
+}
+
+/* extend a width bit sequence number to 64 bit, relative to "next" */
+static uint64_t extend_sequence(uint64_t next, uint64_t sequence)
+{
+	uint64_t delta;
+
+	if (width == 64)
+		return sequence;
+
+	delta = (sequence - next) & ((1ULL << width) - 1);
+	if (delta & (1ULL << (width - 1)))
+		delta |= ~0ULL << width;
+
+	return next + delta;
+}
+
+static void window_shift(struct stream *st, uint64_t n)
+{
+	st->window = n >= WINDOW_SIZE ? 0 : st->window << n;
+}
+
+/*
+ * returns 0 if the frame is the expected one, 1 otherwise
+ */
+static int stream_check(struct stream *st, const struct canfd_frame *frame,
+			int verbose)
+{
+	uint64_t sequence, gap, age;
+
+	sequence = get_sequence(frame);
+	st->received++;
+
+	if (verbose > 1)
+		printf("stream 0x%x: received frame. sequence number: %llu\n",
+		       st->id, (unsigned long long)sequence);
+
+	if (!st->init) {
+		st->init = 1;
+		st->next = sequence + 1;
+		st->window = 1;
+		return 0;
+	}
+
+	sequence = extend_sequence(st->next, sequence);
+
+	if (sequence >= st->next) {
+		if (width < 64 && (sequence >> width) != ((st->next - 1) >> width)) {
+			if (verbose)
+				printf("stream 0x%x: sequence wrap around (%llu)\n",
+				       st->id, st->wraps);
+			st->wraps++;
+		}
+
+		gap = sequence - st->next;
+		window_shift(st, gap + 1);
+		st->window |= 1;
+		st->next = sequence + 1;
+
+		if (!gap)
+			return 0;
+
+		st->lost += gap;
+		if (gap > st->max_gap)
+			st->max_gap = gap;
+		printf("stream 0x%x: lost %llu frame(s). expected: %llu, got: %llu\n",
+		       st->id, (unsigned long long)gap,
+		       (unsigned long long)(sequence - gap),
+		       (unsigned long long)sequence);
+
+		return 1;
+	}
+
+	/* sequence is behind "next", see if we've seen it already */
+	age = st->next - 1 - sequence;
+	if (age >= WINDOW_SIZE) {
+		/* too old to have been counted as lost, the sender restarted */
+		st->restarts++;
+		printf("stream 0x%x: sender restarted. expected: %llu, got: %llu\n",
+		       st->id, (unsigned long long)st->next,
+		       (unsigned long long)sequence);
+		st->next = sequence + 1;
+		st->window = 1;
+	} else if (st->window & (1ULL << age)) {
+		st->duplicated++;
+		printf("stream 0x%x: duplicated frame. expected: %llu, got: %llu\n",
+		       st->id, (unsigned long long)st->next,
+		       (unsigned long long)sequence);
+	} else {
+		st->window |= 1ULL << age;
+		/* it has been counted as lost before */
+		st->reordered++;
+		if (st->lost)
+			st->lost--;
+		printf("stream 0x%x: reordered frame. expected: %llu, got: %llu\n",
+		       st->id, (unsigned long long)st->next,
+		       (unsigned long long)sequence);
+	}
+
+	return 1;
+}
+
+static void print_summary(void)
+{
+	int i;
+
+	for (i = 0; i < stream_count; i++) {
+		struct stream *st = &streams[i];
+
+		printf("stream 0x%x: received: %llu, lost: %llu, duplicated: %llu, "
+		       "reordered: %llu, restarts: %llu, max. gap: %llu, "
+		       "wraps: %llu\n",
+		       st->id, st->received, st->lost, st->duplicated,
+		       st->reordered, st->restarts,
+		       (unsigned long long)st->max_gap, st->wraps);
+	}
+}
+
 int main(int argc, char **argv)
 {
-	struct ifreq ifr;
-	struct sockaddr_can addr;
-	struct can_frame frame = {
-		.can_dlc = 1,
-	};
-	struct can_filter filter[] = {
-		{
-			.can_id = CAN_ID_DEFAULT,
-		},
+	struct canfd_frame frames[BATCH], *frame;
+	struct can_io *io;
+	struct can_io_opts io_opts = {
+		.batch = BATCH,
 	};
+	uint64_t now;
+	struct can_filter *filter;
+	canid_t can_id = CAN_ID_DEFAULT, can_mask;
 	char *interface = "can0";
-	unsigned char sequence = 0;
+	struct stream *st;
 	int seq_wrap = 0;
+	int i, j, n, sent, ret, backend;
 	int family = PF_CAN, type = SOCK_RAW, proto = CAN_RAW;
 	int loopcount = 1, infinite = 1;
+	unsigned long gap = 0;
 	int use_poll = 0;
 	int extended = 0;
 	int nbytes;
 	int opt;
 	int receive = 0;
-	int sequence_init = 1;
 	int verbose = 0, quit = 0;
 	int exit_value = EXIT_SUCCESS;
 
-	signal(SIGTERM, sigterm);
-	signal(SIGHUP, sigterm);
+	set_signal(SIGTERM, sigterm);
+	set_signal(SIGHUP, sigterm);
+	set_signal(SIGINT, sigterm);
 
 	struct option long_options[] = {
 		{ "extended",	no_argument,		0, 'e' },
@@ -94,19 +541,42 @@ int main(int argc, char **argv)
 		{ "poll",	no_argument,		0, 'p' },
 		{ "quit",	no_argument,		0, 'q' },
 		{ "receive",	no_argument,		0, 'r' },
+		{ "latency",	no_argument,		0, 'L' },
+		{ "fd",		no_argument,		0, 'f' },
+		{ "stats",	required_argument,	0, 'S' },
+		{ "streams",	required_argument,	0, 's' },
+		{ "width",	required_argument,	0, 'w' },
 		{ "verbose",	no_argument,		0, 'v' },
 		{ "version",	no_argument,		0, VERSION_OPTION},
 		{ "identifier",	required_argument,	0, 'i' },
 		{ "loop",	required_argument,	0, 'l' },
+		{ "io",		required_argument,	0, IO_OPTION },
+		{ "gap",	required_argument,	0, GAP_OPTION },
 		{ 0,		0,			0, 0},
 	};
 
-	while ((opt = getopt_long(argc, argv, "ehpqrvi:l:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "efhLpqrvi:l:s:S:w:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'e':
 			extended = 1;
 			break;
 
+		case 'f':
+			canfd = 1;
+			break;
+
+		case 'L':
+			latency = 1;
+			break;
+
+		case 'S':
+			stats.interval = strtoul(optarg, NULL, 0);
+			break;
+
+		case GAP_OPTION:
+			gap = strtoul(optarg, NULL, 0);
+			break;
+
 		case 'h':
 			print_usage(basename(argv[0]));
 			exit(EXIT_SUCCESS);
@@ -124,6 +594,23 @@ int main(int argc, char **argv)
 			receive = 1;
 			break;
 
+		case 's':
+			stream_count = strtoul(optarg, NULL, 0);
+			if (stream_count < 1 || stream_count > STREAMS_MAX) {
+				fprintf(stderr, "streams must be within 1...%u\n",
+					STREAMS_MAX);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'w':
+			width = strtoul(optarg, NULL, 0);
+			if (width != 8 && width != 16 && width != 32 && width != 64) {
+				fprintf(stderr, "width must be 8, 16, 32 or 64\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'v':
 			verbose++;
 			break;
@@ -142,7 +629,16 @@ int main(int argc, char **argv)
 			break;
 
 		case 'i':
-			filter->can_id = strtoul(optarg, NULL, 0);
+			can_id = strtoul(optarg, NULL, 0);
+			break;
+
+		case IO_OPTION:
+			backend = can_io_backend_parse(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "unknown I/O backend %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			io_opts.backend = backend;
 			break;
 
 
@@ -156,126 +652,197 @@ int main(int argc, char **argv)
 		interface = argv[optind];
 
 	if (extended) {
-		filter->can_mask = CAN_EFF_MASK;
-		filter->can_id  &= CAN_EFF_MASK;
-		filter->can_id  |= CAN_EFF_FLAG;
+		can_mask = CAN_EFF_MASK;
+		can_id  &= CAN_EFF_MASK;
 	} else {
-		filter->can_mask = CAN_SFF_MASK;
-		filter->can_id  &= CAN_SFF_MASK;
+		can_mask = CAN_SFF_MASK;
+		can_id  &= CAN_SFF_MASK;
 	}
-	frame.can_id = filter->can_id;
 
-	printf("interface = %s, family = %d, type = %d, proto = %d\n",
-	       interface, family, type, proto);
+	if (frame_len() > 8 && !canfd) {
+		fprintf(stderr, "%d bit sequence counters with --latency need --fd\n",
+			width);
+		exit(EXIT_FAILURE);
+	}
 
-	s = socket(family, type, proto);
-	if (s < 0) {
-		perror("socket");
-		return 1;
+	if (can_id + stream_count - 1 > can_mask) {
+		fprintf(stderr, "stream IDs exceed the identifier range\n");
+		exit(EXIT_FAILURE);
+	}
+
+	streams = calloc(stream_count, sizeof(*streams));
+	filter = calloc(stream_count, sizeof(*filter));
+	if (!streams || !filter) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < stream_count; i++) {
+		streams[i].id = can_id + i;
+		filter[i].can_id = can_id + i;
+		filter[i].can_mask = can_mask | CAN_EFF_FLAG | CAN_RTR_FLAG;
+		if (extended)
+			filter[i].can_id |= CAN_EFF_FLAG;
+	}
+
+	memset(frames, 0, sizeof(frames));
+	for (j = 0; j < BATCH; j++) {
+		frames[j].len = frame_len();
+		if (canfd)
+			frames[j].flags = CANFD_FDF;
 	}
 
-	addr.can_family = family;
-	strncpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
-	if (ioctl(s, SIOCGIFINDEX, &ifr)) {
-		perror("ioctl");
+	printf("interface = %s, family = %d, type = %d, proto = %d\n",
+	       interface, family, type, proto);
+
+	io_opts.fd_frames = canfd;
+	io_opts.wait = use_poll;
+	io = can_io_open(interface, &io_opts);
+	if (!io) {
+		perror(interface);
 		return 1;
 	}
-	addr.can_ifindex = ifr.ifr_ifindex;
 
 	/* first don't recv. any msgs */
-	if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0)) {
+	if (can_io_set_filter(io, NULL, 0)) {
 		perror("setsockopt");
 		exit(EXIT_FAILURE);
 	}
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+	if (stats.interval) {
+		struct itimerval it = {
+			.it_interval.tv_sec = stats.interval,
+			.it_value.tv_sec = stats.interval,
+		};
+
+		set_signal(SIGALRM, sigalrm);
+		setitimer(ITIMER_REAL, &it, NULL);
 	}
 
 	if (receive) {
 		/* enable recv. now */
-		if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filter, sizeof(filter))) {
+		if (can_io_set_filter(io, filter, stream_count)) {
 			perror("setsockopt");
 			exit(EXIT_FAILURE);
 		}
 
-		while ((infinite || loopcount--) && running) {
-			nbytes = read(s, &frame, sizeof(struct can_frame));
+		while ((infinite || loopcount > 0) && running &&
+		       exit_value == EXIT_SUCCESS) {
+			do {
+				if (stats_pending)
+					print_stats(receive, 0);
+				nbytes = can_io_recv(io, frames, NULL, BATCH);
+			} while (nbytes < 0 && errno == EINTR && running);
+
 			if (nbytes < 0) {
+				if (errno == EINTR)
+					break;
 				perror("read");
 				return 1;
 			}
+			now = now_ns();
 
-			if (sequence_init) {
-				sequence_init = 0;
-				sequence = frame.data[0];
-			}
+			for (j = 0; j < nbytes && (infinite || loopcount > 0); j++) {
+				frame = &frames[j];
+				if (!infinite)
+					loopcount--;
 
-			if (verbose > 1)
-				printf("received frame. sequence number: %d\n", frame.data[0]);
+				if (frame->len < frame_len()) {
+					printf("received short frame. id: 0x%x, len: %d\n",
+					       frame->can_id, frame->len);
+					continue;
+				}
 
-			if (frame.data[0] != sequence) {
-				printf("received wrong sequence count. expected: %d, got: %d\n",
-				       sequence, frame.data[0]);
-				if (quit) {
+				xfer_add(frame, now);
+				if (latency)
+					latency_add(frame, now);
+
+				st = &streams[(frame->can_id & can_mask) - can_id];
+				if (stream_check(st, frame, verbose) && quit) {
 					exit_value = EXIT_FAILURE;
 					break;
 				}
-				sequence = frame.data[0];
 			}
-
-			sequence++;
-			if (verbose && !sequence)
-				printf("sequence wrap around (%d)\n", seq_wrap++);
-
 		}
+
+		print_summary();
+		print_xfer("received");
+		if (latency)
+			print_latency();
 	} else {
-		while ((infinite || loopcount--) && running) {
-			ssize_t len;
-
-			if (verbose > 1)
-				printf("sending frame. sequence number: %d\n", sequence);
-
-		again:
-			len = write(s, &frame, sizeof(frame));
-			if (len == -1) {
-				switch (errno) {
-				case ENOBUFS: {
-					int err;
-					struct pollfd fds[] = {
-						{
-							.fd	= s,
-							.events	= POLLOUT,
-						},
-					};
-
-					if (!use_poll) {
-						perror("write");
-						exit(EXIT_FAILURE);
-					}
+		/* with --latency each frame is timestamped right before sending */
+		i = 0;
+		while ((infinite || loopcount > 0) && running) {
+			if (stats_pending)
+				print_stats(receive, 0);
+
+			n = latency || gap ? 1 : BATCH;
+			if (!infinite && loopcount < n)
+				n = loopcount;
+
+			for (j = 0; j < n; j++) {
+				st = &streams[i];
+				frame = &frames[j];
+				frame->can_id = st->id;
+				if (extended)
+					frame->can_id |= CAN_EFF_FLAG;
+				put_sequence(frame, st->next);
+
+				if (verbose > 1)
+					printf("stream 0x%x: sending frame. sequence number: %llu\n",
+					       st->id, (unsigned long long)st->next);
+
+				st->next++;
+				if (verbose && width < 64 &&
+				    !(st->next & ((1ULL << width) - 1)) && !i)
+					printf("sequence wrap around (%d)\n", seq_wrap++);
+
+				if (++i == stream_count)
+					i = 0;
+			}
+
+			for (sent = 0; sent < n; sent += ret) {
+				now = now_ns();
+				if (latency)
+					put_timestamp(&frames[sent], now);
 
-					err = poll(fds, 1, 1000);
-					if (err == -1 && errno != -EINTR) {
-						perror("poll()");
-						exit(EXIT_FAILURE);
+				ret = can_io_send(io, frames + sent, n - sent);
+				if (ret < 0) {
+					if (errno == EINTR && running) {
+						ret = 0;
+						continue;
 					}
-				}
-				case EINTR:	/* fallthrough */
-					goto again;
-				default:
+					if (errno == EINTR)	/* terminated by a signal */
+						break;
 					perror("write");
 					exit(EXIT_FAILURE);
 				}
+
+				for (j = sent; j < sent + ret; j++)
+					xfer_add(&frames[j], now);
 			}
+			if (sent < n)
+				break;
+
+			if (!infinite)
+				loopcount -= n;
 
-			(unsigned char)frame.data[0]++;
-			sequence++;
+			if (gap) {
+				struct timespec ts = {
+					.tv_sec = gap / 1000000,
+					.tv_nsec = (gap % 1000000) * 1000,
+				};
 
-			if (verbose && !sequence)
-				printf("sequence wrap around (%d)\n", seq_wrap++);
+				nanosleep(&ts, NULL);
+			}
 		}
+
+		print_xfer("sent");
 	}
 
+	if (stats.interval)
+		print_stats(receive, 1);
+
+	can_io_close(io);
 	exit(exit_value);
 }
@@ -0,0 +1,351 @@
+/*
+ * canutils/canshm.c - shared memory ring of captured frames
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/can.h>
+#include <linux/futex.h>
+
+#include "canutils.h"
+
+/*
+ * One writer, any number of readers, no locks. Frame p of the stream is
+ * in slot p % slots, guarded by a sequence number: 2p + 1 while it's
+ * written, 2p + 2 once it's complete. "head" counts the frames written.
+ * A reader copies a slot and checks its sequence number before and
+ * after, a change means the writer overtook it, so it skips ahead and
+ * counts the frames as lost. Readers map the ring read-only, nothing
+ * they do is seen by the writer. They sleep on a futex bumped and woken
+ * by the writer after every batch. Everything a reader needs of the
+ * header is taken and checked once, when it attaches.
+ *
+ * The ring stays when the writer exits, a new writer continues the
+ * stream, readers attached to it don't notice. The writer holds an
+ * exclusive flock(2), so there's only one at a time.
+ */
+#define CAN_SHM_DIR		"/dev/shm"
+#define CAN_SHM_MAGIC		0x63616e72	/* "canr" */
+
+/* a reader overtaken skips this fraction of the ring ahead of the writer */
+#define CAN_SHM_SLACK(slots)	((slots) / 8)
+
+struct can_shm_slot {
+	uint64_t seq;
+	int64_t ns;			/* CLOCK_REALTIME, 0 if unknown */
+	struct canfd_frame frame;
+};
+
+struct can_shm_ring {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t pad[13];
+
+	/* written by the writer for every batch, a cache line of its own */
+	uint64_t head;
+	uint32_t futex;
+	uint32_t pad2[13];
+
+	struct can_shm_slot slot[];
+};
+
+struct can_shm {
+	int fd;
+	int writer;
+	struct can_shm_ring *ring;
+	size_t size;
+	uint32_t slots;			/* as the ring was attached or created */
+	uint64_t pos;			/* reader: the next frame to read */
+};
+
+static size_t ring_size(unsigned int slots)
+{
+	return sizeof(struct can_shm_ring) +
+		(size_t)slots * sizeof(struct can_shm_slot);
+}
+
+static int shm_path(char *path, size_t size, const char *name)
+{
+	if (!*name || strlen(name) >= IFNAMSIZ || strchr(name, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(path, size, CAN_SHM_DIR "/canutils-shm-%s", name);
+
+	return 0;
+}
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+struct can_shm *can_shm_create(const char *name, unsigned int slots)
+{
+	char path[sizeof(CAN_SHM_DIR) + IFNAMSIZ + 16];
+	struct can_shm *shm;
+	struct stat st;
+	int err;
+
+	if (!slots)
+		slots = CAN_SHM_SLOTS_DEFAULT;
+	if (shm_path(path, sizeof(path), name) || slots & (slots - 1) ||
+	    slots > 1u << 24) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+	shm->writer = 1;
+	shm->slots = slots;
+	shm->size = ring_size(slots);
+
+	shm->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (shm->fd < 0)
+		goto err;
+	if (flock(shm->fd, LOCK_EX | LOCK_NB)) {
+		if (errno == EWOULDBLOCK)
+			errno = EBUSY;
+		goto err;
+	}
+
+	/* a ring of another size would pull the pages from under its readers */
+	if (fstat(shm->fd, &st))
+		goto err;
+	if (st.st_size && (size_t)st.st_size != shm->size) {
+		close(shm->fd);
+		if (unlink(path))
+			goto err_nofd;
+		shm->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (shm->fd < 0 || flock(shm->fd, LOCK_EX | LOCK_NB))
+			goto err;
+	}
+	if (ftruncate(shm->fd, shm->size))
+		goto err;
+
+	shm->ring = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 shm->fd, 0);
+	if (shm->ring == MAP_FAILED)
+		goto err;
+
+	if (shm->ring->magic != CAN_SHM_MAGIC ||
+	    shm->ring->slots != slots ||
+	    shm->ring->slot_size != sizeof(struct can_shm_slot)) {
+		memset(shm->ring, 0, sizeof(*shm->ring));
+		shm->ring->slots = slots;
+		shm->ring->slot_size = sizeof(struct can_shm_slot);
+		__atomic_store_n(&shm->ring->magic, CAN_SHM_MAGIC,
+				 __ATOMIC_RELEASE);
+	}
+
+	return shm;
+
+ err:
+	err = errno;
+	if (shm->fd >= 0)
+		close(shm->fd);
+	errno = err;
+ err_nofd:
+	free(shm);
+
+	return NULL;
+}
+
+struct can_shm *can_shm_attach(const char *name)
+{
+	char path[sizeof(CAN_SHM_DIR) + IFNAMSIZ + 16];
+	struct can_shm_ring hdr;
+	struct can_shm *shm;
+	int err;
+
+	if (shm_path(path, sizeof(path), name))
+		return NULL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	shm->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (shm->fd < 0)
+		goto err;
+
+	/* no writer has set it up yet */
+	if (pread(shm->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != CAN_SHM_MAGIC ||
+	    hdr.slot_size != sizeof(struct can_shm_slot) ||
+	    !hdr.slots || hdr.slots & (hdr.slots - 1)) {
+		errno = ENODATA;
+		goto err;
+	}
+	shm->slots = hdr.slots;
+	shm->size = ring_size(hdr.slots);
+
+	shm->ring = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, shm->fd, 0);
+	if (shm->ring == MAP_FAILED)
+		goto err;
+
+	/* from now on, like a socket bound to the interface */
+	shm->pos = __atomic_load_n(&shm->ring->head, __ATOMIC_ACQUIRE);
+
+	return shm;
+
+ err:
+	err = errno;
+	if (shm->fd >= 0)
+		close(shm->fd);
+	free(shm);
+	errno = err;
+
+	return NULL;
+}
+
+void can_shm_close(struct can_shm *shm)
+{
+	if (!shm)
+		return;
+
+	if (shm->ring && shm->ring != MAP_FAILED)
+		munmap(shm->ring, shm->size);
+	close(shm->fd);
+	free(shm);
+}
+
+int can_shm_fd(const struct can_shm *shm)
+{
+	return shm->fd;
+}
+
+int can_shm_publish(struct can_shm *shm, const struct canfd_frame *frames,
+		    const struct timespec *ts, int n)
+{
+	struct can_shm_ring *ring = shm->ring;
+	uint64_t head = ring->head, p;
+	struct can_shm_slot *s;
+	int i;
+
+	if (!shm->writer) {
+		errno = EPERM;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		p = head + i;
+		s = &ring->slot[p & (shm->slots - 1)];
+
+		__atomic_store_n(&s->seq, 2 * p + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		s->ns = ts ? ts[i].tv_sec * 1000000000LL + ts[i].tv_nsec : 0;
+		s->frame = frames[i];
+		__atomic_store_n(&s->seq, 2 * p + 2, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+	futex(&ring->futex, FUTEX_WAKE, INT_MAX);
+
+	return n;
+}
+
+/* sleeps until "head" moves past "pos", or a signal */
+static int wait_for_frames(struct can_shm *shm)
+{
+	struct can_shm_ring *ring = shm->ring;
+	uint32_t seq;
+
+	seq = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == shm->pos &&
+	    futex(&ring->futex, FUTEX_WAIT, seq) && errno == EINTR)
+		return -1;
+
+	return 0;
+}
+
+int can_shm_read(struct can_shm *shm, struct canfd_frame *frames,
+		 struct timespec *ts, int n, int nonblock, uint64_t *lost)
+{
+	struct can_shm_ring *ring = shm->ring;
+	uint64_t head, seq, skip;
+	struct can_shm_slot *s;
+	int64_t ns;
+	int count = 0;
+
+	*lost = 0;
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (1) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head != shm->pos)
+			break;
+		if (nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (wait_for_frames(shm))
+			return -1;
+	}
+
+	while (count < n && shm->pos != head) {
+		/* overtaken, or the writer started over */
+		if (head - shm->pos > shm->slots || head < shm->pos)
+			goto overrun;
+
+		s = &ring->slot[shm->pos & (shm->slots - 1)];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq != 2 * shm->pos + 2)
+			goto overrun;
+		frames[count] = s->frame;
+		ns = s->ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+			goto overrun;
+
+		if (ts) {
+			ts[count].tv_sec = ns / 1000000000LL;
+			ts[count].tv_nsec = ns % 1000000000LL;
+		}
+		count++;
+		shm->pos++;
+		continue;
+
+ overrun:
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head < shm->pos) {
+			shm->pos = head;
+			break;
+		}
+		skip = head - shm->slots + CAN_SHM_SLACK(shm->slots);
+		if (head < shm->slots || skip <= shm->pos)
+			skip = shm->pos + 1;
+		*lost += skip - shm->pos;
+		shm->pos = skip;
+	}
+
+	return count;
+}